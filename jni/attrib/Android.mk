@@ -5,9 +5,11 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := gatttool-btle
 LOCAL_SRC_FILES := gatttool.c \
 	gatt.c \
+	gatt-poll.c \
 	gattrib.c \
 	att.c \
 	utils.c \
+	hcicmd.c \
 	interactive.c \
 	../src/log.c \
 	../btio/btio.c
@@ -27,3 +29,20 @@ LOCAL_CFLAGS:= \
 		-D__ANDROID__
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := attcodec
+LOCAL_SRC_FILES := attcodec.c \
+	att.c
+
+LOCAL_STATIC_LIBRARIES := bluetooth glib
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../glib/ \
+	$(LOCAL_PATH)/../
+
+LOCAL_CFLAGS:= \
+		-DNEED_PPOLL \
+		-D__ANDROID__
+
+include $(BUILD_EXECUTABLE)
@@ -85,12 +85,7 @@ void att_data_list_free(struct att_data_list *list)
 	if (list == NULL)
 		return;
 
-	if (list->data) {
-		int i;
-		for (i = 0; i < list->num; i++)
-			g_free(list->data[i]);
-	}
-
+	/* Elements live in the same block as the pointer array */
 	g_free(list->data);
 	g_free(list);
 }
@@ -98,16 +93,23 @@ void att_data_list_free(struct att_data_list *list)
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len)
 {
 	struct att_data_list *list;
+	uint8_t *ptr;
 	int i;
 
 	list = g_new0(struct att_data_list, 1);
 	list->len = len;
 	list->num = num;
 
-	list->data = g_malloc0(sizeof(uint8_t *) * num);
+	/*
+	 * Decoders run once per received PDU, so allocate the pointer array
+	 * and all elements in a single block instead of num + 1 chunks.
+	 */
+	list->data = g_malloc0(sizeof(uint8_t *) * num +
+						sizeof(uint8_t) * len * num);
 
-	for (i = 0; i < num; i++)
-		list->data[i] = g_malloc0(sizeof(uint8_t) * len);
+	ptr = (uint8_t *) &list->data[num];
+	for (i = 0; i < num; i++, ptr += len)
+		list->data[i] = ptr;
 
 	return list;
 }
@@ -151,10 +153,10 @@ uint16_t dec_read_by_grp_req(const uint8_t *pdu, size_t len, uint16_t *start,
 	if (start == NULL || end == NULL || uuid == NULL)
 		return 0;
 
-	if (pdu[0] != ATT_OP_READ_BY_GROUP_REQ)
+	if (len != min_len + 2 && len != min_len + 16)
 		return 0;
 
-	if (len < min_len + 2)
+	if (pdu[0] != ATT_OP_READ_BY_GROUP_REQ)
 		return 0;
 
 	*start = att_get_u16(&pdu[1]);
@@ -201,10 +203,16 @@ struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len)
 	uint16_t elen, num;
 	int i;
 
+	if (pdu == NULL || len < 2)
+		return NULL;
+
 	if (pdu[0] != ATT_OP_READ_BY_GROUP_RESP)
 		return NULL;
 
 	elen = pdu[1];
+	if (elen == 0)
+		return NULL;
+
 	num = (len - 2) / elen;
 	list = att_data_list_alloc(num, elen);
 
@@ -341,6 +349,36 @@ GSList *dec_find_by_type_resp(const uint8_t *pdu, size_t len)
 	return matches;
 }
 
+uint16_t dec_find_by_type_resp_ranges(const uint8_t *pdu, size_t len,
+							GArray *ranges)
+{
+	struct att_range *range;
+	guint first;
+	uint16_t num, i;
+
+	if (pdu == NULL || len < 5 || ranges == NULL)
+		return 0;
+
+	if (pdu[0] != ATT_OP_FIND_BY_TYPE_RESP)
+		return 0;
+
+	num = (len - 1) / (sizeof(uint16_t) * 2);
+
+	/* Grow the caller's array once and decode in place */
+	first = ranges->len;
+	g_array_set_size(ranges, first + num);
+
+	for (i = 0; i < num; i++) {
+		const uint8_t *ptr = &pdu[1 + i * sizeof(uint16_t) * 2];
+
+		range = &g_array_index(ranges, struct att_range, first + i);
+		range->start = att_get_u16(&ptr[0]);
+		range->end = att_get_u16(&ptr[2]);
+	}
+
+	return num;
+}
+
 uint16_t enc_read_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, size_t len)
 {
@@ -380,7 +418,7 @@ uint16_t dec_read_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
 	if (start == NULL || end == NULL || uuid == NULL)
 		return 0;
 
-	if (len < min_len + 2)
+	if (len != min_len + 2 && len != min_len + 16)
 		return 0;
 
 	if (pdu[0] != ATT_OP_READ_BY_TYPE_REQ)
@@ -431,10 +469,16 @@ struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len)
 	uint16_t elen, num;
 	int i;
 
+	if (pdu == NULL || len < 2)
+		return NULL;
+
 	if (pdu[0] != ATT_OP_READ_BY_TYPE_RESP)
 		return NULL;
 
 	elen = pdu[1];
+	if (elen == 0)
+		return NULL;
+
 	num = (len - 2) / elen;
 	list = att_data_list_alloc(num, elen);
 
@@ -562,6 +606,9 @@ uint16_t dec_write_resp(const uint8_t *pdu, size_t len)
 	if (pdu == NULL)
 		return 0;
 
+	if (len < 1)
+		return 0;
+
 	if (pdu[0] != ATT_OP_WRITE_RESP)
 		return 0;
 
@@ -603,6 +650,26 @@ uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 	return min_len;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, uint16_t num,
+						uint8_t *pdu, size_t len)
+{
+	uint16_t i, w;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* Read Multiple needs at least two handles */
+	if (num < 2 || len < sizeof(pdu[0]) + sizeof(uint16_t) * num)
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+
+	for (i = 0, w = 1; i < num; i++, w += sizeof(uint16_t))
+		att_put_u16(handles[i], &pdu[w]);
+
+	return w;
+}
+
 uint16_t dec_read_req(const uint8_t *pdu, size_t len, uint16_t *handle)
 {
 	const uint16_t min_len = sizeof(pdu[0]) + sizeof(*handle);
@@ -694,6 +761,9 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value, size_t vle
 	if (value == NULL)
 		return -EINVAL;
 
+	if (len < 1)
+		return -EINVAL;
+
 	if (pdu[0] != ATT_OP_READ_RESP)
 		return -EINVAL;
 
@@ -806,6 +876,9 @@ struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
 	if (format == NULL)
 		return 0;
 
+	if (len < 2)
+		return 0;
+
 	if (pdu[0] != ATT_OP_FIND_INFO_RESP)
 		return 0;
 
@@ -875,10 +948,10 @@ uint16_t dec_indication(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (pdu == NULL)
 		return 0;
 
-	if (pdu[0] != ATT_OP_HANDLE_IND)
+	if (len < min_len)
 		return 0;
 
-	if (len < min_len)
+	if (pdu[0] != ATT_OP_HANDLE_IND)
 		return 0;
 
 	dlen = MIN(len - min_len, vlen);
@@ -1022,7 +1095,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = att_get_u16(&pdu[1]);
@@ -217,6 +217,8 @@ uint16_t dec_find_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
 		uint16_t *end, bt_uuid_t *uuid, uint8_t *value, size_t *vlen);
 uint16_t enc_find_by_type_resp(GSList *ranges, uint8_t *pdu, size_t len);
 GSList *dec_find_by_type_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_find_by_type_resp_ranges(const uint8_t *pdu, size_t len,
+							GArray *ranges);
 struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len);
 uint16_t enc_read_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, size_t len);
@@ -238,6 +240,8 @@ uint16_t dec_write_resp(const uint8_t *pdu, size_t len);
 uint16_t enc_read_req(uint16_t handle, uint8_t *pdu, size_t len);
 uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 								size_t len);
+uint16_t enc_read_multi_req(const uint16_t *handles, uint16_t num,
+						uint8_t *pdu, size_t len);
 uint16_t dec_read_req(const uint8_t *pdu, size_t len, uint16_t *handle);
 uint16_t dec_read_blob_req(const uint8_t *pdu, size_t len, uint16_t *handle,
 							uint16_t *offset);
@@ -0,0 +1,1064 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Checks of the ATT PDU codec in att.c, which needs nothing but glib and
+ * so builds and runs on the host as well as on the device:
+ *
+ *	attcodec			encode and decode every PDU type
+ *	attcodec -z count [-s seed]	random PDUs through every decoder
+ *	attcodec -t target file...	replay PDUs saved as files
+ *	attcodec -b [-n count] [-m mtu]	time the decoders on the hot paths
+ *
+ * Each decoder also has a fuzz target. Built with -DATT_FUZZER and
+ * -fsanitize=fuzzer this file is a libFuzzer binary instead: the target
+ * named in ATT_FUZZ_TARGET gets every input, or without it the first
+ * byte of the input picks the target.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/uuid.h>
+
+#include <glib.h>
+
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+
+#define BENCH_COUNT	1000000
+
+/* Fuzz targets abort, so that the fuzzer keeps the input */
+#define ASSERT(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__,	\
+								#cond);	\
+		abort();						\
+	}								\
+} while (0)
+
+/*
+ * Callers parse notifications inline; this mirrors dec_indication() so
+ * there is a notification decoder to fuzz and time.
+ */
+static uint16_t dec_notification(const uint8_t *pdu, size_t len,
+				uint16_t *handle, uint8_t *value, size_t vlen)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + sizeof(uint16_t);
+	uint16_t dlen;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (len < min_len)
+		return 0;
+
+	if (pdu[0] != ATT_OP_HANDLE_NOTIFY)
+		return 0;
+
+	dlen = MIN(len - min_len, vlen);
+
+	if (handle)
+		*handle = att_get_u16(&pdu[1]);
+
+	memcpy(value, &pdu[3], dlen);
+
+	return dlen;
+}
+
+/*
+ * Fuzz targets. GAttrib never hands out a PDU longer than its buffer, so
+ * inputs are cut at ATT_MAX_MTU, and the decoders that copy out a value
+ * without a bound get a buffer of that size, as all callers pass. All a
+ * decoder returns is read back, so that the sanitizers see any overrun.
+ */
+
+static uint8_t fuzz_sink;
+
+static void touch(const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fuzz_sink ^= p[i];
+}
+
+/* Decoded lists encode back to the PDU they came from */
+static void check_list(struct att_data_list *list, const uint8_t *pdu,
+				size_t len, uint16_t (*enc) (struct att_data_list *,
+							uint8_t *, size_t))
+{
+	uint8_t out[ATT_MAX_MTU];
+	uint16_t olen;
+	int i;
+
+	if (list == NULL)
+		return;
+
+	for (i = 0; i < list->num; i++)
+		touch(list->data[i], list->len);
+
+	ASSERT(2 + (size_t) list->num * list->len <= len);
+
+	if (list->num > 0) {
+		olen = enc(list, out, sizeof(out));
+		ASSERT(olen == 2 + list->num * list->len);
+		ASSERT(memcmp(out, pdu, olen) == 0);
+	}
+
+	att_data_list_free(list);
+}
+
+static void fuzz_read_by_grp_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t start, end;
+	bt_uuid_t uuid;
+
+	if (dec_read_by_grp_req(pdu, len, &start, &end, &uuid))
+		ASSERT(uuid.type == BT_UUID16 || uuid.type == BT_UUID128);
+}
+
+static void fuzz_read_by_grp_resp(const uint8_t *pdu, size_t len)
+{
+	check_list(dec_read_by_grp_resp(pdu, len), pdu, len,
+							enc_read_by_grp_resp);
+}
+
+static void fuzz_find_by_type_req(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_MAX_MTU];
+	uint16_t start, end;
+	bt_uuid_t uuid;
+	size_t vlen;
+
+	if (dec_find_by_type_req(pdu, len, &start, &end, &uuid, value,
+								&vlen)) {
+		ASSERT(vlen <= sizeof(value));
+		touch(value, vlen);
+	}
+}
+
+static void fuzz_find_by_type_resp(const uint8_t *pdu, size_t len)
+{
+	GSList *l, *ranges;
+	GArray *arr;
+	guint n = 0;
+
+	ranges = dec_find_by_type_resp(pdu, len);
+	for (l = ranges; l; l = l->next)
+		n++;
+
+	arr = g_array_new(FALSE, FALSE, sizeof(struct att_range));
+	ASSERT(dec_find_by_type_resp_ranges(pdu, len, arr) == n);
+	ASSERT(arr->len == n);
+
+	for (l = ranges, n = 0; l; l = l->next, n++)
+		ASSERT(memcmp(l->data, &g_array_index(arr, struct att_range, n),
+					sizeof(struct att_range)) == 0);
+
+	g_array_free(arr, TRUE);
+	g_slist_free_full(ranges, g_free);
+}
+
+static void fuzz_read_by_type_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t start, end;
+	bt_uuid_t uuid;
+
+	if (dec_read_by_type_req(pdu, len, &start, &end, &uuid))
+		ASSERT(uuid.type == BT_UUID16 || uuid.type == BT_UUID128);
+}
+
+static void fuzz_read_by_type_resp(const uint8_t *pdu, size_t len)
+{
+	check_list(dec_read_by_type_resp(pdu, len), pdu, len,
+							enc_read_by_type_resp);
+}
+
+static void fuzz_write_cmd(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_MAX_MTU];
+	uint16_t handle;
+	size_t vlen;
+
+	if (dec_write_cmd(pdu, len, &handle, value, &vlen)) {
+		ASSERT(vlen == len - 3);
+		touch(value, vlen);
+	}
+}
+
+static void fuzz_write_req(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_MAX_MTU];
+	uint16_t handle;
+	size_t vlen;
+
+	if (dec_write_req(pdu, len, &handle, value, &vlen)) {
+		ASSERT(vlen == len - 3);
+		touch(value, vlen);
+	}
+}
+
+static void fuzz_write_resp(const uint8_t *pdu, size_t len)
+{
+	ASSERT(dec_write_resp(pdu, len) <= len);
+}
+
+static void fuzz_read_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t handle;
+
+	ASSERT(dec_read_req(pdu, len, &handle) <= len);
+}
+
+static void fuzz_read_blob_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t handle, offset;
+
+	ASSERT(dec_read_blob_req(pdu, len, &handle, &offset) <= len);
+}
+
+static void fuzz_read_resp(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_DEFAULT_LE_MTU];
+	ssize_t vlen;
+
+	vlen = dec_read_resp(pdu, len, value, sizeof(value));
+	if (vlen < 0)
+		return;
+
+	ASSERT((size_t) vlen == len - 1 && (size_t) vlen <= sizeof(value));
+	touch(value, vlen);
+}
+
+static void fuzz_find_info_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t start, end;
+
+	ASSERT(dec_find_info_req(pdu, len, &start, &end) <= len);
+}
+
+static uint8_t find_info_format;
+
+static uint16_t enc_find_info_list(struct att_data_list *list, uint8_t *pdu,
+								size_t len)
+{
+	return enc_find_info_resp(find_info_format, list, pdu, len);
+}
+
+static void fuzz_find_info_resp(const uint8_t *pdu, size_t len)
+{
+	struct att_data_list *list;
+
+	list = dec_find_info_resp(pdu, len, &find_info_format);
+	check_list(list, pdu, len, enc_find_info_list);
+}
+
+static void fuzz_notification(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_DEFAULT_LE_MTU];
+	uint16_t handle, vlen;
+
+	vlen = dec_notification(pdu, len, &handle, value, sizeof(value));
+	ASSERT(vlen <= sizeof(value));
+	touch(value, vlen);
+}
+
+static void fuzz_indication(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_DEFAULT_LE_MTU];
+	uint16_t handle, vlen;
+
+	vlen = dec_indication(pdu, len, &handle, value, sizeof(value));
+	ASSERT(vlen <= sizeof(value));
+	touch(value, vlen);
+}
+
+static void fuzz_mtu_req(const uint8_t *pdu, size_t len)
+{
+	uint16_t mtu;
+
+	ASSERT(dec_mtu_req(pdu, len, &mtu) <= len);
+}
+
+static void fuzz_mtu_resp(const uint8_t *pdu, size_t len)
+{
+	uint16_t mtu;
+
+	ASSERT(dec_mtu_resp(pdu, len, &mtu) <= len);
+}
+
+static void fuzz_prep_write_resp(const uint8_t *pdu, size_t len)
+{
+	uint8_t value[ATT_MAX_MTU];
+	uint16_t handle, offset;
+	size_t vlen;
+
+	if (dec_prep_write_resp(pdu, len, &handle, &offset, value, &vlen)) {
+		ASSERT(vlen == len - 5);
+		touch(value, vlen);
+	}
+}
+
+static void fuzz_exec_write_resp(const uint8_t *pdu, size_t len)
+{
+	ASSERT(dec_exec_write_resp(pdu, len) <= len);
+}
+
+static const struct fuzz_target {
+	const char *name;
+	uint8_t opcode;
+	void (*func) (const uint8_t *pdu, size_t len);
+} targets[] = {
+	{ "read_by_grp_req",	ATT_OP_READ_BY_GROUP_REQ,
+						fuzz_read_by_grp_req },
+	{ "read_by_grp_resp",	ATT_OP_READ_BY_GROUP_RESP,
+						fuzz_read_by_grp_resp },
+	{ "find_by_type_req",	ATT_OP_FIND_BY_TYPE_REQ,
+						fuzz_find_by_type_req },
+	{ "find_by_type_resp",	ATT_OP_FIND_BY_TYPE_RESP,
+						fuzz_find_by_type_resp },
+	{ "read_by_type_req",	ATT_OP_READ_BY_TYPE_REQ,
+						fuzz_read_by_type_req },
+	{ "read_by_type_resp",	ATT_OP_READ_BY_TYPE_RESP,
+						fuzz_read_by_type_resp },
+	{ "write_cmd",		ATT_OP_WRITE_CMD,	fuzz_write_cmd },
+	{ "write_req",		ATT_OP_WRITE_REQ,	fuzz_write_req },
+	{ "write_resp",		ATT_OP_WRITE_RESP,	fuzz_write_resp },
+	{ "read_req",		ATT_OP_READ_REQ,	fuzz_read_req },
+	{ "read_blob_req",	ATT_OP_READ_BLOB_REQ,	fuzz_read_blob_req },
+	{ "read_resp",		ATT_OP_READ_RESP,	fuzz_read_resp },
+	{ "find_info_req",	ATT_OP_FIND_INFO_REQ,	fuzz_find_info_req },
+	{ "find_info_resp",	ATT_OP_FIND_INFO_RESP,	fuzz_find_info_resp },
+	{ "notification",	ATT_OP_HANDLE_NOTIFY,	fuzz_notification },
+	{ "indication",		ATT_OP_HANDLE_IND,	fuzz_indication },
+	{ "mtu_req",		ATT_OP_MTU_REQ,		fuzz_mtu_req },
+	{ "mtu_resp",		ATT_OP_MTU_RESP,	fuzz_mtu_resp },
+	{ "prep_write_resp",	ATT_OP_PREP_WRITE_RESP,
+						fuzz_prep_write_resp },
+	{ "exec_write_resp",	ATT_OP_EXEC_WRITE_RESP,
+						fuzz_exec_write_resp },
+	{ NULL, 0, NULL }
+};
+
+static const struct fuzz_target *find_target(const char *name)
+{
+	int i;
+
+	for (i = 0; targets[i].name; i++)
+		if (!strcmp(targets[i].name, name))
+			return &targets[i];
+
+	return NULL;
+}
+
+static void fuzz_one(const struct fuzz_target *t, const uint8_t *data,
+								size_t size)
+{
+	t->func(data, MIN(size, ATT_MAX_MTU));
+}
+
+#ifdef ATT_FUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static const struct fuzz_target *target;
+	static int init;
+	int n;
+
+	if (!init) {
+		const char *name = getenv("ATT_FUZZ_TARGET");
+
+		if (name) {
+			target = find_target(name);
+			if (!target) {
+				fprintf(stderr, "Unknown target %s\n", name);
+				abort();
+			}
+		}
+
+		init = 1;
+	}
+
+	if (target) {
+		fuzz_one(target, data, size);
+		return 0;
+	}
+
+	if (size < 1)
+		return 0;
+
+	n = G_N_ELEMENTS(targets) - 1;
+	fuzz_one(&targets[data[0] % n], data + 1, size - 1);
+
+	return 0;
+}
+#else
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__,	\
+								#cond);	\
+		failed++;						\
+		return;							\
+	}								\
+} while (0)
+
+static const uint8_t value_in[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+	0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,
+	0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+};
+
+static const uint128_t uuid128_val = {
+	.data = { 0x00, 0x00, 0x18, 0x0d, 0x00, 0x00, 0x10, 0x00,
+			0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb },
+};
+
+static struct att_data_list *make_list(uint16_t num, uint16_t len)
+{
+	struct att_data_list *list = att_data_list_alloc(num, len);
+	int i, j;
+
+	for (i = 0; i < num; i++)
+		for (j = 0; j < len; j++)
+			list->data[i][j] = i * len + j;
+
+	return list;
+}
+
+static int list_equal(struct att_data_list *a, struct att_data_list *b)
+{
+	int i;
+
+	if (a->num != b->num || a->len != b->len)
+		return 0;
+
+	for (i = 0; i < a->num; i++)
+		if (memcmp(a->data[i], b->data[i], a->len))
+			return 0;
+
+	return 1;
+}
+
+static void test_read_by_grp_req(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t start, end, plen;
+	bt_uuid_t in, out;
+
+	bt_uuid16_create(&in, GATT_PRIM_SVC_UUID);
+	plen = enc_read_by_grp_req(0x0001, 0xffff, &in, pdu, sizeof(pdu));
+	CHECK(plen == 7);
+	CHECK(dec_read_by_grp_req(pdu, plen, &start, &end, &out) == plen);
+	CHECK(start == 0x0001 && end == 0xffff);
+	CHECK(bt_uuid_cmp(&in, &out) == 0);
+
+	bt_uuid128_create(&in, uuid128_val);
+	plen = enc_read_by_grp_req(0x0010, 0x0020, &in, pdu, sizeof(pdu));
+	CHECK(plen == 21);
+	CHECK(dec_read_by_grp_req(pdu, plen, &start, &end, &out) == plen);
+	CHECK(start == 0x0010 && end == 0x0020);
+	CHECK(bt_uuid_cmp(&in, &out) == 0);
+
+	/* A truncated 128-bit UUID */
+	CHECK(dec_read_by_grp_req(pdu, plen - 1, &start, &end, &out) == 0);
+}
+
+static void test_read_by_grp_resp(void)
+{
+	struct att_data_list *in, *out;
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t plen;
+
+	in = make_list(3, 6);
+	plen = enc_read_by_grp_resp(in, pdu, sizeof(pdu));
+	out = dec_read_by_grp_resp(pdu, plen);
+	att_data_list_free(in);
+
+	CHECK(plen == 2 + 3 * 6);
+	CHECK(out != NULL);
+	in = make_list(3, 6);
+	CHECK(list_equal(in, out));
+	att_data_list_free(in);
+	att_data_list_free(out);
+
+	pdu[1] = 0;
+	CHECK(dec_read_by_grp_resp(pdu, plen) == NULL);
+}
+
+static void test_find_by_type_req(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU], value[ATT_MAX_MTU];
+	uint16_t start, end, plen;
+	bt_uuid_t in, out;
+	size_t vlen;
+
+	bt_uuid16_create(&in, GATT_PRIM_SVC_UUID);
+	plen = enc_find_by_type_req(0x0001, 0xffff, &in, value_in, 2,
+							pdu, sizeof(pdu));
+	CHECK(plen == 9);
+	CHECK(dec_find_by_type_req(pdu, plen, &start, &end, &out, value,
+							&vlen) == plen);
+	CHECK(start == 0x0001 && end == 0xffff);
+	CHECK(bt_uuid_cmp(&in, &out) == 0);
+	CHECK(vlen == 2 && memcmp(value, value_in, vlen) == 0);
+
+	/* The value is cut to what fits */
+	plen = enc_find_by_type_req(0x0001, 0xffff, &in, value_in,
+					sizeof(value_in), pdu, sizeof(pdu));
+	CHECK(plen == sizeof(pdu));
+	CHECK(dec_find_by_type_req(pdu, plen, NULL, NULL, NULL, value,
+							&vlen) == plen);
+	CHECK(vlen == sizeof(pdu) - 7);
+	CHECK(memcmp(value, value_in, vlen) == 0);
+}
+
+static void test_find_by_type_resp(void)
+{
+	struct att_range ranges[] = {
+		{ 0x0001, 0x0005 }, { 0x0010, 0x0020 }, { 0x0030, 0xffff },
+	};
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	GSList *in = NULL, *out, *l;
+	GArray *arr;
+	uint16_t plen;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(ranges); i++)
+		in = g_slist_append(in, &ranges[i]);
+
+	plen = enc_find_by_type_resp(in, pdu, sizeof(pdu));
+	g_slist_free(in);
+	CHECK(plen == 1 + 4 * G_N_ELEMENTS(ranges));
+
+	out = dec_find_by_type_resp(pdu, plen);
+	for (i = 0, l = out; l; i++, l = l->next) {
+		struct att_range *r = l->data;
+
+		if (i >= G_N_ELEMENTS(ranges) || r->start != ranges[i].start ||
+						r->end != ranges[i].end)
+			break;
+	}
+	g_slist_free_full(out, g_free);
+	CHECK(i == G_N_ELEMENTS(ranges) && l == NULL);
+
+	arr = g_array_new(FALSE, FALSE, sizeof(struct att_range));
+	i = dec_find_by_type_resp_ranges(pdu, plen, arr);
+	CHECK(i == G_N_ELEMENTS(ranges) && arr->len == i);
+	CHECK(memcmp(arr->data, ranges, sizeof(ranges)) == 0);
+	g_array_free(arr, TRUE);
+}
+
+static void test_read_by_type_req(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t start, end, plen;
+	bt_uuid_t in, out;
+
+	bt_uuid16_create(&in, GATT_CHARAC_UUID);
+	plen = enc_read_by_type_req(0x0001, 0xffff, &in, pdu, sizeof(pdu));
+	CHECK(plen == 7);
+	CHECK(dec_read_by_type_req(pdu, plen, &start, &end, &out) == plen);
+	CHECK(start == 0x0001 && end == 0xffff);
+	CHECK(bt_uuid_cmp(&in, &out) == 0);
+
+	bt_uuid128_create(&in, uuid128_val);
+	plen = enc_read_by_type_req(0x0002, 0x0003, &in, pdu, sizeof(pdu));
+	CHECK(plen == 21);
+	CHECK(dec_read_by_type_req(pdu, plen, &start, &end, &out) == plen);
+	CHECK(start == 0x0002 && end == 0x0003);
+	CHECK(bt_uuid_cmp(&in, &out) == 0);
+
+	CHECK(dec_read_by_type_req(pdu, plen - 1, &start, &end, &out) == 0);
+}
+
+static void test_read_by_type_resp(void)
+{
+	struct att_data_list *in, *out;
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t plen;
+
+	/* Characteristic declarations: handle, properties, handle, UUID16 */
+	in = make_list(3, 7);
+	plen = enc_read_by_type_resp(in, pdu, sizeof(pdu));
+	out = dec_read_by_type_resp(pdu, plen);
+
+	CHECK(plen == 2 + 3 * 7);
+	CHECK(out != NULL);
+	CHECK(list_equal(in, out));
+	att_data_list_free(in);
+	att_data_list_free(out);
+
+	/* Elements that don't fit are left out */
+	in = make_list(4, 7);
+	plen = enc_read_by_type_resp(in, pdu, sizeof(pdu));
+	att_data_list_free(in);
+	out = dec_read_by_type_resp(pdu, plen);
+	CHECK(out != NULL && out->num == 3);
+	att_data_list_free(out);
+
+	pdu[1] = 0;
+	CHECK(dec_read_by_type_resp(pdu, plen) == NULL);
+}
+
+static void test_write(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU], value[ATT_MAX_MTU];
+	uint16_t handle, plen;
+	size_t vlen;
+
+	plen = enc_write_cmd(0x0025, value_in, 4, pdu, sizeof(pdu));
+	CHECK(plen == 7);
+	CHECK(dec_write_cmd(pdu, plen, &handle, value, &vlen) == plen);
+	CHECK(handle == 0x0025);
+	CHECK(vlen == 4 && memcmp(value, value_in, vlen) == 0);
+	CHECK(dec_write_req(pdu, plen, &handle, value, &vlen) == 0);
+
+	plen = enc_write_req(0x0026, value_in, sizeof(value_in), pdu,
+								sizeof(pdu));
+	CHECK(plen == sizeof(pdu));
+	CHECK(dec_write_req(pdu, plen, &handle, value, &vlen) == plen);
+	CHECK(handle == 0x0026);
+	CHECK(vlen == sizeof(pdu) - 3);
+	CHECK(memcmp(value, value_in, vlen) == 0);
+
+	plen = enc_write_req(0x0027, NULL, 0, pdu, sizeof(pdu));
+	CHECK(plen == 3);
+	CHECK(dec_write_req(pdu, plen, &handle, value, &vlen) == plen);
+	CHECK(handle == 0x0027 && vlen == 0);
+
+	plen = enc_write_resp(pdu, sizeof(pdu));
+	CHECK(plen == 1);
+	CHECK(dec_write_resp(pdu, plen) == plen);
+}
+
+static void test_read(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU], value[ATT_MAX_MTU];
+	uint16_t handle, offset, plen;
+	uint16_t handles[] = { 0x0003, 0x0005, 0x0007 };
+	ssize_t vlen;
+	unsigned int i;
+
+	plen = enc_read_req(0x0003, pdu, sizeof(pdu));
+	CHECK(plen == 3);
+	CHECK(dec_read_req(pdu, plen, &handle) == plen);
+	CHECK(handle == 0x0003);
+
+	plen = enc_read_blob_req(0x0004, 0x0016, pdu, sizeof(pdu));
+	CHECK(plen == 5);
+	CHECK(dec_read_blob_req(pdu, plen, &handle, &offset) == plen);
+	CHECK(handle == 0x0004 && offset == 0x0016);
+
+	plen = enc_read_multi_req(handles, G_N_ELEMENTS(handles), pdu,
+								sizeof(pdu));
+	CHECK(plen == 1 + 2 * G_N_ELEMENTS(handles));
+	CHECK(pdu[0] == ATT_OP_READ_MULTI_REQ);
+	for (i = 0; i < G_N_ELEMENTS(handles); i++)
+		CHECK(att_get_u16(&pdu[1 + 2 * i]) == handles[i]);
+	CHECK(enc_read_multi_req(handles, 1, pdu, sizeof(pdu)) == 0);
+
+	plen = enc_read_resp((uint8_t *) value_in, 5, pdu, sizeof(pdu));
+	CHECK(plen == 6);
+	vlen = dec_read_resp(pdu, plen, value, sizeof(value));
+	CHECK(vlen == 5 && memcmp(value, value_in, vlen) == 0);
+	CHECK(dec_read_resp(pdu, plen, value, 4) == -ENOBUFS);
+
+	/* Long values are cut to the MTU and read on with Read Blob */
+	plen = enc_read_resp((uint8_t *) value_in, sizeof(value_in), pdu,
+								sizeof(pdu));
+	CHECK(plen == sizeof(pdu));
+	vlen = dec_read_resp(pdu, plen, value, sizeof(value));
+	CHECK(vlen == (ssize_t) sizeof(pdu) - 1);
+
+	plen = enc_read_blob_resp((uint8_t *) value_in, sizeof(value_in), vlen,
+							pdu, sizeof(pdu));
+	CHECK(plen == 1 + sizeof(value_in) - vlen);
+	CHECK(pdu[0] == ATT_OP_READ_BLOB_RESP);
+	CHECK(memcmp(&pdu[1], &value_in[vlen], plen - 1) == 0);
+}
+
+static void test_find_info(void)
+{
+	struct att_data_list *in, *out;
+	uint8_t pdu[ATT_MAX_MTU];
+	uint16_t start, end, plen;
+	uint8_t format;
+
+	plen = enc_find_info_req(0x0001, 0x0010, pdu, sizeof(pdu));
+	CHECK(plen == 5);
+	CHECK(dec_find_info_req(pdu, plen, &start, &end) == plen);
+	CHECK(start == 0x0001 && end == 0x0010);
+
+	/* Handles with 16-bit UUIDs */
+	in = make_list(5, 4);
+	plen = enc_find_info_resp(0x01, in, pdu, ATT_DEFAULT_LE_MTU);
+	out = dec_find_info_resp(pdu, plen, &format);
+	CHECK(plen == 2 + 5 * 4);
+	CHECK(out != NULL && format == 0x01);
+	CHECK(list_equal(in, out));
+	att_data_list_free(in);
+	att_data_list_free(out);
+
+	/* Handles with 128-bit UUIDs */
+	in = make_list(2, 18);
+	plen = enc_find_info_resp(0x02, in, pdu, sizeof(pdu));
+	out = dec_find_info_resp(pdu, plen, &format);
+	CHECK(plen == 2 + 2 * 18);
+	CHECK(out != NULL && format == 0x02);
+	CHECK(list_equal(in, out));
+	att_data_list_free(in);
+	att_data_list_free(out);
+}
+
+static void test_handle_value(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU], value[ATT_MAX_MTU];
+	uint16_t handle, plen;
+
+	plen = enc_notification(0x0012, (uint8_t *) value_in, 8, pdu,
+								sizeof(pdu));
+	CHECK(plen == 11);
+	CHECK(dec_notification(pdu, plen, &handle, value,
+						sizeof(value)) == 8);
+	CHECK(handle == 0x0012 && memcmp(value, value_in, 8) == 0);
+	CHECK(dec_notification(pdu, plen, &handle, value, 4) == 4);
+	CHECK(dec_indication(pdu, plen, &handle, value, sizeof(value)) == 0);
+
+	plen = enc_indication(0x0013, (uint8_t *) value_in, 8, pdu,
+								sizeof(pdu));
+	CHECK(plen == 11);
+	CHECK(dec_indication(pdu, plen, &handle, value, sizeof(value)) == 8);
+	CHECK(handle == 0x0013 && memcmp(value, value_in, 8) == 0);
+	CHECK(dec_notification(pdu, plen, &handle, value,
+						sizeof(value)) == 0);
+
+	CHECK(enc_notification(0x0012, (uint8_t *) value_in,
+			sizeof(value_in), pdu, sizeof(pdu)) == 0);
+
+	plen = enc_confirmation(pdu, sizeof(pdu));
+	CHECK(plen == 1 && pdu[0] == ATT_OP_HANDLE_CNF);
+}
+
+static void test_mtu(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t mtu, plen;
+
+	plen = enc_mtu_req(ATT_MAX_MTU, pdu, sizeof(pdu));
+	CHECK(plen == 3);
+	CHECK(dec_mtu_req(pdu, plen, &mtu) == plen);
+	CHECK(mtu == ATT_MAX_MTU);
+	CHECK(dec_mtu_resp(pdu, plen, &mtu) == 0);
+
+	plen = enc_mtu_resp(ATT_DEFAULT_LE_MTU, pdu, sizeof(pdu));
+	CHECK(plen == 3);
+	CHECK(dec_mtu_resp(pdu, plen, &mtu) == plen);
+	CHECK(mtu == ATT_DEFAULT_LE_MTU);
+}
+
+static void test_prep_write(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU], value[ATT_MAX_MTU];
+	uint16_t handle, offset, plen;
+	size_t vlen;
+
+	plen = enc_prep_write_req(0x0030, 0x0012, value_in, sizeof(value_in),
+							pdu, sizeof(pdu));
+	CHECK(plen == sizeof(pdu));
+
+	/* The response echoes the request */
+	CHECK(dec_prep_write_resp(pdu, plen, &handle, &offset, value,
+							&vlen) == 0);
+	pdu[0] = ATT_OP_PREP_WRITE_RESP;
+	CHECK(dec_prep_write_resp(pdu, plen, &handle, &offset, value,
+							&vlen) == plen);
+	CHECK(handle == 0x0030 && offset == 0x0012);
+	CHECK(vlen == sizeof(pdu) - 5);
+	CHECK(memcmp(value, value_in, vlen) == 0);
+
+	plen = enc_exec_write_req(0x01, pdu, sizeof(pdu));
+	CHECK(plen == 2 && pdu[0] == ATT_OP_EXEC_WRITE_REQ && pdu[1] == 0x01);
+	CHECK(enc_exec_write_req(0x02, pdu, sizeof(pdu)) == 0);
+
+	pdu[0] = ATT_OP_EXEC_WRITE_RESP;
+	CHECK(dec_exec_write_resp(pdu, 1) == 1);
+}
+
+static void test_error_resp(void)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t plen;
+
+	plen = enc_error_resp(ATT_OP_READ_REQ, 0x0040,
+				ATT_ECODE_READ_NOT_PERM, pdu, sizeof(pdu));
+	CHECK(plen == 5);
+	CHECK(pdu[0] == ATT_OP_ERROR && pdu[1] == ATT_OP_READ_REQ);
+	CHECK(att_get_u16(&pdu[2]) == 0x0040);
+	CHECK(pdu[4] == ATT_ECODE_READ_NOT_PERM);
+}
+
+static const struct {
+	const char *name;
+	void (*func) (void);
+} tests[] = {
+	{ "read_by_grp_req",	test_read_by_grp_req },
+	{ "read_by_grp_resp",	test_read_by_grp_resp },
+	{ "find_by_type_req",	test_find_by_type_req },
+	{ "find_by_type_resp",	test_find_by_type_resp },
+	{ "read_by_type_req",	test_read_by_type_req },
+	{ "read_by_type_resp",	test_read_by_type_resp },
+	{ "write",		test_write },
+	{ "read",		test_read },
+	{ "find_info",		test_find_info },
+	{ "handle_value",	test_handle_value },
+	{ "mtu",		test_mtu },
+	{ "prep_write",		test_prep_write },
+	{ "error_resp",		test_error_resp },
+	{ NULL, NULL }
+};
+
+static int run_tests(void)
+{
+	int i, before;
+
+	for (i = 0; tests[i].name; i++) {
+		before = failed;
+		tests[i].func();
+		printf("%-20s %s\n", tests[i].name,
+					failed > before ? "FAILED" : "ok");
+	}
+
+	return failed ? 1 : 0;
+}
+
+static void fuzz_random(unsigned long count, unsigned int seed)
+{
+	uint8_t pdu[ATT_MAX_MTU + 1];
+	unsigned long n;
+	size_t len, j;
+	int i;
+
+	srand(seed);
+
+	for (i = 0; targets[i].name; i++) {
+		for (n = 0; n < count; n++) {
+			len = rand() % sizeof(pdu);
+			for (j = 0; j < len; j++)
+				pdu[j] = rand();
+
+			/* Most inputs should get past the opcode check */
+			if (len > 0 && n % 8)
+				pdu[0] = targets[i].opcode;
+
+			/* Short element lengths exercise the lists more */
+			if (len > 1 && n % 2)
+				pdu[1] %= 24;
+
+			fuzz_one(&targets[i], pdu, len);
+		}
+
+		printf("%-20s %lu PDUs\n", targets[i].name, count);
+	}
+}
+
+static int fuzz_files(const struct fuzz_target *t, int argc, char *argv[])
+{
+	uint8_t buf[4096];
+	FILE *f;
+	size_t len;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+
+		len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+
+		fuzz_one(t, buf, len);
+	}
+
+	printf("%s: %d inputs\n", t->name, argc);
+
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long count, double elapsed,
+							size_t len)
+{
+	printf("%-24s %4zu bytes %8.1f ns/PDU\n", name, len,
+						elapsed * 1e9 / count);
+}
+
+static void bench(unsigned long count, size_t mtu)
+{
+	uint8_t pdu[ATT_MAX_MTU], value[ATT_MAX_MTU];
+	struct att_data_list *list;
+	unsigned long i;
+	uint16_t handle, plen;
+	double start;
+	size_t sum = 0;
+
+	/* Characteristic discovery, 7 bytes per declaration */
+	list = make_list((mtu - 2) / 7, 7);
+	plen = enc_read_by_type_resp(list, pdu, mtu);
+	att_data_list_free(list);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		list = dec_read_by_type_resp(pdu, plen);
+		sum += list->num;
+		att_data_list_free(list);
+	}
+	report("dec_read_by_type_resp", count, now() - start, plen);
+
+	memset(value, 0xa5, sizeof(value));
+	plen = enc_indication(0x0012, value, mtu - 3, pdu, mtu);
+	start = now();
+	for (i = 0; i < count; i++)
+		sum += dec_indication(pdu, plen, &handle, value, sizeof(value));
+	report("dec_indication", count, now() - start, plen);
+
+	pdu[0] = ATT_OP_HANDLE_NOTIFY;
+	start = now();
+	for (i = 0; i < count; i++)
+		sum += dec_notification(pdu, plen, &handle, value,
+								sizeof(value));
+	report("dec_notification", count, now() - start, plen);
+
+	plen = enc_read_resp(value, mtu - 1, pdu, mtu);
+	start = now();
+	for (i = 0; i < count; i++)
+		sum += dec_read_resp(pdu, plen, value, sizeof(value));
+	report("dec_read_resp", count, now() - start, plen);
+
+	if (sum == 0)
+		printf("Nothing decoded\n");
+}
+
+static void usage(void)
+{
+	int i;
+
+	printf("attcodec - ATT PDU encoder and decoder checks\n"
+		"Usage:\n"
+		"\tattcodec\t\t\tencode and decode every PDU type\n"
+		"\tattcodec -z count [-s seed]\trandom PDUs to every decoder\n"
+		"\tattcodec -t target file...\treplay PDUs from files\n"
+		"\tattcodec -b [-n count] [-m mtu]\ttime the decoders\n"
+		"Targets:\n");
+
+	for (i = 0; targets[i].name; i++)
+		printf("\t%s\n", targets[i].name);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct fuzz_target *target = NULL;
+	unsigned long count = BENCH_COUNT, fuzz = 0;
+	unsigned int seed = 1;
+	size_t mtu = ATT_DEFAULT_LE_MTU;
+	int opt, do_bench = 0;
+
+	while ((opt = getopt(argc, argv, "bn:m:z:s:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			do_bench = 1;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mtu = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			fuzz = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			target = find_target(optarg);
+			if (!target) {
+				fprintf(stderr, "Unknown target %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (target)
+		return fuzz_files(target, argc - optind, argv + optind);
+
+	if (fuzz) {
+		fuzz_random(fuzz, seed);
+		return 0;
+	}
+
+	if (do_bench) {
+		if (count == 0) {
+			fprintf(stderr, "Nothing to time\n");
+			exit(1);
+		}
+
+		if (mtu < ATT_DEFAULT_LE_MTU || mtu > ATT_MAX_MTU) {
+			fprintf(stderr, "MTU must be %d to %d\n",
+					ATT_DEFAULT_LE_MTU, ATT_MAX_MTU);
+			exit(1);
+		}
+
+		bench(count, mtu);
+		return 0;
+	}
+
+	return run_tests();
+}
+#endif
@@ -0,0 +1,438 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Periodic characteristic polling.
+ *
+ * Every registration may be served anywhere within +/- jitter of its
+ * nominal due time. The scheduler sleeps until the earliest window
+ * closes and then reads every characteristic whose window is already
+ * open, so reads with compatible periods end up sharing one wake-up.
+ * Characteristics with a known fixed value length are grouped into Read
+ * Multiple Requests, the rest are queued back to back.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <bluetooth/uuid.h>
+
+#include "att.h"
+#include "gattrib.h"
+#include "gatt-poll.h"
+
+struct poll_entry {
+	guint id;
+	uint16_t handle;
+	size_t vlen;
+	gdouble period;
+	gdouble jitter;
+	gdouble due;
+	gdouble deadline;
+	gdouble sent;
+	gboolean pending;
+	gatt_poll_func_t func;
+	gpointer user_data;
+	struct gatt_poll_stats stats;
+	gdouble latency_sum;
+};
+
+struct poll_request {
+	struct gatt_poll *poll;
+	guint id;
+	guint num;
+	guint *entries;
+};
+
+struct gatt_poll {
+	GAttrib *attrib;
+	GTimer *timer;
+	GSList *entries;
+	GSList *requests;
+	guint timeout;
+	guint next_id;
+	guint wakeups;
+};
+
+static void poll_schedule(struct gatt_poll *poll);
+
+static gdouble poll_now(struct gatt_poll *poll)
+{
+	return g_timer_elapsed(poll->timer, NULL) * 1000;
+}
+
+static gint entry_cmp_by_id(gconstpointer a, gconstpointer b)
+{
+	const struct poll_entry *entry = a;
+	guint id = GPOINTER_TO_UINT(b);
+
+	return entry->id - id;
+}
+
+static struct poll_entry *poll_find(struct gatt_poll *poll, guint id)
+{
+	GSList *l;
+
+	l = g_slist_find_custom(poll->entries, GUINT_TO_POINTER(id),
+							entry_cmp_by_id);
+
+	return l ? l->data : NULL;
+}
+
+static void request_free(gpointer user_data)
+{
+	struct poll_request *req = user_data;
+
+	g_free(req->entries);
+	g_free(req);
+}
+
+static void entry_done(struct gatt_poll *poll, struct poll_entry *entry,
+				guint8 status, const uint8_t *value,
+				size_t vlen, gdouble now)
+{
+	guint latency = now - entry->sent;
+
+	entry->pending = FALSE;
+
+	entry->stats.reads++;
+	entry->latency_sum += latency;
+	entry->stats.latency_avg = entry->latency_sum / entry->stats.reads;
+
+	if (entry->stats.reads == 1 || latency < entry->stats.latency_min)
+		entry->stats.latency_min = latency;
+
+	if (latency > entry->stats.latency_max)
+		entry->stats.latency_max = latency;
+
+	if (now > entry->deadline)
+		entry->stats.missed++;
+
+	/* Skip, and account for, periods that passed while we waited */
+	while (entry->due + entry->jitter < now) {
+		entry->due += entry->period;
+		entry->stats.missed++;
+	}
+
+	if (entry->func)
+		entry->func(entry->handle, status, value, vlen,
+							entry->user_data);
+}
+
+static void poll_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct poll_request *req = user_data;
+	struct gatt_poll *poll = req->poll;
+	gdouble now = poll_now(poll);
+	guint16 offset = 1;
+	guint i;
+
+	poll->requests = g_slist_remove(poll->requests, req);
+
+	if (status == 0 && (plen < 1 || (pdu[0] != ATT_OP_READ_RESP &&
+					pdu[0] != ATT_OP_READ_MULTI_RESP)))
+		status = ATT_ECODE_INVALID_PDU;
+
+	for (i = 0; i < req->num; i++) {
+		struct poll_entry *entry = poll_find(poll, req->entries[i]);
+		const uint8_t *value = NULL;
+		size_t vlen = 0;
+		guint8 estatus = status;
+
+		/* Removed while the read was in flight */
+		if (entry == NULL)
+			continue;
+
+		if (estatus == 0 && req->num == 1) {
+			value = &pdu[1];
+			vlen = plen - 1;
+		} else if (estatus == 0) {
+			if (offset + entry->vlen > plen)
+				estatus = ATT_ECODE_INVALID_PDU;
+			else {
+				value = &pdu[offset];
+				vlen = entry->vlen;
+				offset += entry->vlen;
+			}
+		}
+
+		entry_done(poll, entry, estatus, value, vlen, now);
+	}
+
+	poll_schedule(poll);
+}
+
+/* Returns how many entries from the head of batch were sent */
+static guint poll_send(struct gatt_poll *poll, GSList *batch)
+{
+	struct poll_request *req;
+	uint16_t handles[ATT_MAX_MTU / 2];
+	uint8_t *buf;
+	size_t buflen, rlen;
+	guint16 plen;
+	GSList *l;
+	guint n;
+
+	buf = g_attrib_get_buffer(poll->attrib, &buflen);
+
+	req = g_new0(struct poll_request, 1);
+	req->poll = poll;
+	req->entries = g_new0(guint, g_slist_length(batch));
+
+	/* Fill a Read Multiple Request while the values fit the response */
+	for (l = batch, n = 0, rlen = 1; l; l = l->next) {
+		struct poll_entry *entry = l->data;
+
+		if (entry->vlen == 0 || n == G_N_ELEMENTS(handles) ||
+				1 + (n + 1) * sizeof(uint16_t) > buflen ||
+				rlen + entry->vlen > buflen)
+			break;
+
+		handles[n] = entry->handle;
+		req->entries[n++] = entry->id;
+		rlen += entry->vlen;
+	}
+
+	if (n > 1)
+		plen = enc_read_multi_req(handles, n, buf, buflen);
+	else {
+		n = 1;
+		req->entries[0] = ((struct poll_entry *) batch->data)->id;
+		plen = enc_read_req(((struct poll_entry *) batch->data)->handle,
+								buf, buflen);
+	}
+
+	req->num = n;
+	req->id = g_attrib_send(poll->attrib, 0, buf[0], buf, plen,
+					poll_read_cb, req, request_free);
+	if (req->id == 0) {
+		gdouble now = poll_now(poll);
+
+		for (n = 0; n < req->num; n++) {
+			struct poll_entry *entry;
+
+			entry = poll_find(poll, req->entries[n]);
+			if (entry)
+				entry_done(poll, entry, ATT_ECODE_IO, NULL, 0,
+									now);
+		}
+
+		request_free(req);
+		return n;
+	}
+
+	poll->requests = g_slist_append(poll->requests, req);
+
+	return n;
+}
+
+static gboolean poll_timeout(gpointer user_data)
+{
+	struct gatt_poll *poll = user_data;
+	GSList *l, *multi = NULL, *single = NULL;
+	gdouble now = poll_now(poll);
+
+	poll->timeout = 0;
+	poll->wakeups++;
+
+	for (l = poll->entries; l; l = l->next) {
+		struct poll_entry *entry = l->data;
+
+		if (entry->pending || entry->due - entry->jitter > now)
+			continue;
+
+		entry->pending = TRUE;
+		entry->sent = now;
+		entry->deadline = entry->due + entry->jitter;
+		entry->due += entry->period;
+
+		if (entry->vlen > 0)
+			multi = g_slist_append(multi, entry);
+		else
+			single = g_slist_append(single, entry);
+	}
+
+	/* Each send consumes the entries it managed to pack */
+	while (multi) {
+		guint n = poll_send(poll, multi);
+
+		while (n-- > 0)
+			multi = g_slist_delete_link(multi, multi);
+	}
+
+	for (l = single; l; l = l->next)
+		poll_send(poll, l);
+
+	g_slist_free(single);
+
+	poll_schedule(poll);
+
+	return FALSE;
+}
+
+static void poll_schedule(struct gatt_poll *poll)
+{
+	gdouble next = -1, now;
+	GSList *l;
+
+	if (poll->timeout > 0) {
+		g_source_remove(poll->timeout);
+		poll->timeout = 0;
+	}
+
+	for (l = poll->entries; l; l = l->next) {
+		struct poll_entry *entry = l->data;
+
+		if (entry->pending)
+			continue;
+
+		if (next < 0 || entry->due + entry->jitter < next)
+			next = entry->due + entry->jitter;
+	}
+
+	if (next < 0)
+		return;
+
+	now = poll_now(poll);
+
+	poll->timeout = g_timeout_add(next > now ? next - now : 0,
+							poll_timeout, poll);
+}
+
+struct gatt_poll *gatt_poll_new(GAttrib *attrib)
+{
+	struct gatt_poll *poll;
+
+	poll = g_try_new0(struct gatt_poll, 1);
+	if (poll == NULL)
+		return NULL;
+
+	poll->attrib = g_attrib_ref(attrib);
+	poll->timer = g_timer_new();
+
+	return poll;
+}
+
+void gatt_poll_free(struct gatt_poll *poll)
+{
+	GSList *l, *next;
+
+	if (poll == NULL)
+		return;
+
+	if (poll->timeout > 0)
+		g_source_remove(poll->timeout);
+
+	/* Cancelling destroys the request, so walk a step ahead */
+	for (l = poll->requests; l; l = next) {
+		struct poll_request *req = l->data;
+
+		next = l->next;
+		g_attrib_cancel(poll->attrib, req->id);
+	}
+
+	g_slist_free(poll->requests);
+	g_slist_free_full(poll->entries, g_free);
+	g_timer_destroy(poll->timer);
+	g_attrib_unref(poll->attrib);
+	g_free(poll);
+}
+
+/*
+ * Poll handle every period milliseconds, allowing each read to move up
+ * to jitter milliseconds either way so it can share a wake-up with other
+ * reads. When vlen is non-zero the value is known to be exactly vlen
+ * bytes long and the handle may be read through Read Multiple.
+ */
+guint gatt_poll_add(struct gatt_poll *poll, uint16_t handle, size_t vlen,
+				guint period, guint jitter,
+				gatt_poll_func_t func, gpointer user_data)
+{
+	struct poll_entry *entry;
+
+	if (poll == NULL || period == 0 || vlen > ATT_MAX_MTU)
+		return 0;
+
+	entry = g_try_new0(struct poll_entry, 1);
+	if (entry == NULL)
+		return 0;
+
+	entry->id = ++poll->next_id;
+	entry->handle = handle;
+	entry->vlen = vlen;
+	entry->period = period;
+	entry->jitter = MIN(jitter, period / 2);
+	entry->due = poll_now(poll);
+	entry->func = func;
+	entry->user_data = user_data;
+
+	poll->entries = g_slist_append(poll->entries, entry);
+
+	poll_schedule(poll);
+
+	return entry->id;
+}
+
+gboolean gatt_poll_remove(struct gatt_poll *poll, guint id)
+{
+	struct poll_entry *entry;
+
+	if (poll == NULL)
+		return FALSE;
+
+	entry = poll_find(poll, id);
+	if (entry == NULL)
+		return FALSE;
+
+	poll->entries = g_slist_remove(poll->entries, entry);
+	g_free(entry);
+
+	poll_schedule(poll);
+
+	return TRUE;
+}
+
+gboolean gatt_poll_get_stats(struct gatt_poll *poll, guint id,
+					struct gatt_poll_stats *stats)
+{
+	struct poll_entry *entry;
+
+	if (poll == NULL || stats == NULL)
+		return FALSE;
+
+	entry = poll_find(poll, id);
+	if (entry == NULL)
+		return FALSE;
+
+	*stats = entry->stats;
+
+	return TRUE;
+}
+
+guint gatt_poll_get_wakeups(struct gatt_poll *poll)
+{
+	return poll ? poll->wakeups : 0;
+}
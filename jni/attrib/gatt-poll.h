@@ -0,0 +1,47 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct gatt_poll;
+
+typedef void (*gatt_poll_func_t) (uint16_t handle, guint8 status,
+					const uint8_t *value, size_t vlen,
+					gpointer user_data);
+
+/* Latencies are in milliseconds, measured from request to response */
+struct gatt_poll_stats {
+	guint reads;
+	guint missed;
+	guint latency_min;
+	guint latency_max;
+	guint latency_avg;
+};
+
+struct gatt_poll *gatt_poll_new(GAttrib *attrib);
+void gatt_poll_free(struct gatt_poll *poll);
+
+guint gatt_poll_add(struct gatt_poll *poll, uint16_t handle, size_t vlen,
+				guint period, guint jitter,
+				gatt_poll_func_t func, gpointer user_data);
+gboolean gatt_poll_remove(struct gatt_poll *poll, guint id);
+
+gboolean gatt_poll_get_stats(struct gatt_poll *poll, guint id,
+					struct gatt_poll_stats *stats);
+guint gatt_poll_get_wakeups(struct gatt_poll *poll);
@@ -33,6 +33,7 @@
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 
+#include "log.h"
 #include "att.h"
 #include "gattrib.h"
 #include "gatt.h"
@@ -41,6 +42,7 @@ struct discover_primary {
 	GAttrib *attrib;
 	bt_uuid_t uuid;
 	GSList *primaries;
+	GArray *ranges;
 	gatt_cb_t cb;
 	void *user_data;
 };
@@ -57,6 +59,8 @@ struct discover_char {
 static void discover_primary_free(struct discover_primary *dp)
 {
 	g_slist_free(dp->primaries);
+	if (dp->ranges)
+		g_array_free(dp->ranges, TRUE);
 	g_attrib_unref(dp->attrib);
 	g_free(dp);
 }
@@ -110,26 +114,23 @@ static void primary_by_uuid_cb(guint8 status, const guint8 *ipdu,
 
 {
 	struct discover_primary *dp = user_data;
-	GSList *ranges, *last;
 	struct att_range *range;
 	uint8_t *buf;
 	guint16 oplen;
 	int err = 0;
 	size_t buflen;
+	guint i;
 
 	if (status) {
 		err = status == ATT_ECODE_ATTR_NOT_FOUND ? 0 : status;
 		goto done;
 	}
 
-	ranges = dec_find_by_type_resp(ipdu, iplen);
-	if (ranges == NULL)
+	if (dec_find_by_type_resp_ranges(ipdu, iplen, dp->ranges) == 0)
 		goto done;
 
-	dp->primaries = g_slist_concat(dp->primaries, ranges);
-
-	last = g_slist_last(ranges);
-	range = last->data;
+	range = &g_array_index(dp->ranges, struct att_range,
+							dp->ranges->len - 1);
 
 	if (range->end == 0xffff)
 		goto done;
@@ -146,6 +147,11 @@ static void primary_by_uuid_cb(guint8 status, const guint8 *ipdu,
 	return;
 
 done:
+	/* The list only borrows the ranges stored in dp->ranges */
+	for (i = dp->ranges->len; i > 0; i--)
+		dp->primaries = g_slist_prepend(dp->primaries,
+			&g_array_index(dp->ranges, struct att_range, i - 1));
+
 	dp->cb(dp->primaries, err, dp->user_data);
 	discover_primary_free(dp);
 }
@@ -241,6 +247,8 @@ guint gatt_discover_primary(GAttrib *attrib, bt_uuid_t *uuid, gatt_cb_t func,
 
 	if (uuid) {
 		dp->uuid = *uuid;
+		dp->ranges = g_array_new(FALSE, FALSE,
+						sizeof(struct att_range));
 		cb = primary_by_uuid_cb;
 	} else
 		cb = primary_all_cb;
@@ -526,12 +534,26 @@ struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
-	guint16 handle;
-	uint16_t offset;
-	uint8_t *value;
+	gboolean reliable;
+	uint8_t *pdus;
+	size_t stride;
+	guint16 last_len;
+	guint num;
+	guint next;
 	size_t vlen;
+	GTimer *timer;
+	guint id;
 };
 
+static void write_long_free(struct write_long_data *long_write)
+{
+	if (long_write->timer)
+		g_timer_destroy(long_write->timer);
+
+	g_free(long_write->pdus);
+	g_free(long_write);
+}
+
 static guint execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data)
 {
@@ -548,54 +570,151 @@ static guint execute_write(GAttrib *attrib, uint8_t flags,
 									NULL);
 }
 
-static guint prepare_write(GAttrib *attrib, uint16_t handle, uint16_t offset,
-			uint8_t *value, size_t vlen, GAttribResultFunc func,
-			gpointer user_data);
+static void execute_write_cb(guint8 status, const guint8 *rpdu,
+					guint16 rlen, gpointer user_data)
+{
+	struct write_long_data *long_write = user_data;
+	gdouble elapsed;
+
+	elapsed = g_timer_elapsed(long_write->timer, NULL);
+	if (status == 0 && elapsed > 0)
+		DBG("%zu bytes in %u prepare writes: %.0f bytes/s",
+				long_write->vlen, long_write->num,
+				long_write->vlen / elapsed);
+
+	if (long_write->func)
+		long_write->func(status, rpdu, rlen, long_write->user_data);
+
+	write_long_free(long_write);
+}
+
+static guint16 prepare_write_len(struct write_long_data *long_write,
+								guint index)
+{
+	if (index == long_write->num - 1)
+		return long_write->last_len;
+
+	return long_write->stride;
+}
+
+static void long_write_abort(struct write_long_data *long_write,
+				guint8 status, const guint8 *rpdu,
+				guint16 rlen)
+{
+	/* Drop whatever the server has queued so far */
+	execute_write(long_write->attrib, ATT_CANCEL_ALL_PREP_WRITES,
+								NULL, NULL);
+
+	if (long_write->func)
+		long_write->func(status, rpdu, rlen, long_write->user_data);
+
+	write_long_free(long_write);
+}
 
 static void prepare_write_cb(guint8 status, const guint8 *rpdu,
 					guint16 rlen, gpointer user_data)
 {
 	struct write_long_data *long_write = user_data;
+	const uint8_t *pdu;
+	guint16 plen;
 
 	if (status != 0) {
-		long_write->func(status, rpdu, rlen, long_write->user_data);
+		long_write_abort(long_write, status, rpdu, rlen);
 		return;
 	}
 
-	/* Skip Prepare Write Response PDU header (5 bytes) */
-	long_write->offset += rlen - 5;
+	/*
+	 * Reliable Write: the response echoes handle, offset and value of
+	 * the request, only the opcode differs.
+	 */
+	if (long_write->reliable) {
+		pdu = &long_write->pdus[long_write->next * long_write->stride];
+		plen = prepare_write_len(long_write, long_write->next);
 
-	if (long_write->offset == long_write->vlen){
-		execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
-				long_write->func, long_write->user_data);
-		g_free(long_write->value);
-		g_free(long_write);
+		if (rlen != plen || memcmp(&rpdu[1], &pdu[1], plen - 1) != 0) {
+			long_write_abort(long_write, ATT_ECODE_IO, rpdu, rlen);
+			return;
+		}
+	}
+
+	long_write->next++;
+
+	if (long_write->next == long_write->num) {
+		if (execute_write(long_write->attrib,
+					ATT_WRITE_ALL_PREP_WRITES,
+					execute_write_cb, long_write) == 0)
+			long_write_abort(long_write, ATT_ECODE_IO, NULL, 0);
 
 		return;
 	}
 
-	prepare_write(long_write->attrib, long_write->handle,
-		long_write->offset, long_write->value, long_write->vlen,
-		long_write->func, long_write);
+	/*
+	 * The PDU is already encoded, reuse the request ID so the next
+	 * chunk goes out ahead of anything queued meanwhile.
+	 */
+	pdu = &long_write->pdus[long_write->next * long_write->stride];
+	plen = prepare_write_len(long_write, long_write->next);
+
+	if (g_attrib_send(long_write->attrib, long_write->id,
+				ATT_OP_PREP_WRITE_REQ, pdu, plen,
+				prepare_write_cb, long_write, NULL) == 0)
+		long_write_abort(long_write, ATT_ECODE_IO, NULL, 0);
 }
 
-static guint prepare_write(GAttrib *attrib, uint16_t handle, uint16_t offset,
-			uint8_t *value, size_t vlen, GAttribResultFunc func,
-			gpointer user_data)
+static guint prepare_write(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				gboolean reliable, GAttribResultFunc func,
+				gpointer user_data)
 {
-	guint16 plen;
-	size_t buflen;
-	uint8_t *buf;
+	struct write_long_data *long_write;
+	size_t buflen, chunk, offset;
+	guint i;
 
-	buf = g_attrib_get_buffer(attrib, &buflen);
+	g_attrib_get_buffer(attrib, &buflen);
 
-	plen = enc_prep_write_req(handle, offset, &value[offset], vlen - offset,
-								buf, buflen);
-	if (plen == 0)
+	/* Prepare Write Request header is 5 bytes, offsets are 16-bit */
+	if (buflen <= 5 || vlen == 0 || vlen > 0xffff)
 		return 0;
 
-	return g_attrib_send(attrib, 0, buf[0], buf, plen, prepare_write_cb,
-							user_data, NULL);
+	long_write = g_try_new0(struct write_long_data, 1);
+	if (long_write == NULL)
+		return 0;
+
+	chunk = buflen - 5;
+
+	long_write->attrib = attrib;
+	long_write->func = func;
+	long_write->user_data = user_data;
+	long_write->reliable = reliable;
+	long_write->vlen = vlen;
+	long_write->stride = buflen;
+	long_write->num = (vlen + chunk - 1) / chunk;
+
+	/* Encode every Prepare Write Request up front, back to back */
+	long_write->pdus = g_try_malloc(long_write->num * long_write->stride);
+	if (long_write->pdus == NULL) {
+		g_free(long_write);
+		return 0;
+	}
+
+	for (i = 0, offset = 0; i < long_write->num; i++, offset += chunk)
+		long_write->last_len = enc_prep_write_req(handle, offset,
+				&value[offset], MIN(chunk, vlen - offset),
+				&long_write->pdus[i * long_write->stride],
+				long_write->stride);
+
+	long_write->timer = g_timer_new();
+
+	long_write->id = g_attrib_send(attrib, 0, ATT_OP_PREP_WRITE_REQ,
+				long_write->pdus,
+				prepare_write_len(long_write, 0),
+				prepare_write_cb, long_write, NULL);
+	if (long_write->id == 0) {
+		write_long_free(long_write);
+		return 0;
+	}
+
+	return long_write->id;
 }
 
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
@@ -604,7 +723,6 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 	uint8_t *buf;
 	size_t buflen;
 	guint16 plen;
-	struct write_long_data *long_write;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -623,19 +741,16 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 	}
 
 	/* Write Long Characteristic Values */
-	long_write = g_try_new0(struct write_long_data, 1);
-	if (long_write == NULL)
-		return 0;
-
-	long_write->attrib = attrib;
-	long_write->func = func;
-	long_write->user_data = user_data;
-	long_write->handle = handle;
-	long_write->value = g_memdup(value, vlen);
-	long_write->vlen = vlen;
+	return prepare_write(attrib, handle, value, vlen, FALSE, func,
+								user_data);
+}
 
-	return prepare_write(attrib, handle, long_write->offset, value, vlen,
-							func, long_write);
+guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data)
+{
+	return prepare_write(attrib, handle, value, vlen, TRUE, func,
+								user_data);
 }
 
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
@@ -53,6 +53,11 @@ struct _GAttrib {
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	gboolean stale;
+	guint cmd_credits;
+	guint pending_cmds;
+	gboolean cmds_blocked;
+	GAttribReadyFunc ready;
+	gpointer ready_user_data;
 };
 
 struct command {
@@ -118,6 +123,11 @@ static guint8 opcode2expected(guint8 opcode)
 	return 0;
 }
 
+static gboolean is_write_cmd(guint8 opcode)
+{
+	return opcode == ATT_OP_WRITE_CMD || opcode == ATT_OP_SIGNED_WRITE_CMD;
+}
+
 static gboolean is_response(guint8 opcode)
 {
 	switch (opcode) {
@@ -161,6 +171,27 @@ static void command_destroy(struct command *cmd)
 	g_free(cmd);
 }
 
+/*
+ * Return the credit held by a write command that left the queue, either
+ * written to the socket or cancelled. A producer that was turned away
+ * because no credits were left is told it may send again.
+ */
+static void write_cmd_done(struct _GAttrib *attrib, struct command *cmd)
+{
+	if (!is_write_cmd(cmd->opcode))
+		return;
+
+	attrib->pending_cmds--;
+
+	if (!attrib->cmds_blocked)
+		return;
+
+	attrib->cmds_blocked = FALSE;
+
+	if (attrib->ready)
+		attrib->ready(attrib->ready_user_data);
+}
+
 static void event_destroy(struct event *evt)
 {
 	if (evt->notify)
@@ -313,11 +344,28 @@ static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
 
 	iostat = g_io_channel_write_chars(io, (gchar *) cmd->pdu, cmd->len,
 								&len, &gerr);
-	if (iostat != G_IO_STATUS_NORMAL)
+
+	/* Socket buffer is full, wait until it drains */
+	if (iostat == G_IO_STATUS_AGAIN)
+		return TRUE;
+
+	if (iostat != G_IO_STATUS_NORMAL) {
+		if (gerr)
+			g_error_free(gerr);
+		return FALSE;
+	}
+
+	/*
+	 * Each write is one ATT PDU on the L2CAP channel, so a tail written
+	 * on its own would be a malformed PDU of its own. Give up as on any
+	 * other write error.
+	 */
+	if (len != cmd->len)
 		return FALSE;
 
 	if (cmd->expected == 0) {
 		g_queue_pop_head(queue);
+		write_cmd_done(attrib, cmd);
 		command_destroy(cmd);
 
 		return TRUE;
@@ -482,6 +530,12 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 	if (attrib->stale)
 		return 0;
 
+	if (is_write_cmd(opcode) && attrib->cmd_credits > 0 &&
+				attrib->pending_cmds >= attrib->cmd_credits) {
+		attrib->cmds_blocked = TRUE;
+		return 0;
+	}
+
 	c = g_try_new0(struct command, 1);
 	if (c == NULL)
 		return 0;
@@ -495,6 +549,9 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 	c->user_data = user_data;
 	c->notify = notify;
 
+	if (is_write_cmd(opcode))
+		attrib->pending_cmds++;
+
 	if (is_response(opcode))
 		queue = attrib->responses;
 	else
@@ -561,13 +618,14 @@ gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 		cmd->func = NULL;
 	else {
 		g_queue_remove(queue, cmd);
+		write_cmd_done(attrib, cmd);
 		command_destroy(cmd);
 	}
 
 	return TRUE;
 }
 
-static gboolean cancel_all_per_queue(GQueue *queue)
+static gboolean cancel_all_per_queue(struct _GAttrib *attrib, GQueue *queue)
 {
 	struct command *c, *head = NULL;
 	gboolean first = TRUE;
@@ -584,6 +642,7 @@ static gboolean cancel_all_per_queue(GQueue *queue)
 		}
 
 		first = FALSE;
+		write_cmd_done(attrib, c);
 		command_destroy(c);
 	}
 
@@ -602,8 +661,8 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 	if (attrib == NULL)
 		return FALSE;
 
-	ret = cancel_all_per_queue(attrib->requests);
-	ret = cancel_all_per_queue(attrib->responses) && ret;
+	ret = cancel_all_per_queue(attrib, attrib->requests);
+	ret = cancel_all_per_queue(attrib, attrib->responses) && ret;
 
 	return ret;
 }
@@ -614,6 +673,25 @@ gboolean g_attrib_set_debug(GAttrib *attrib,
 	return TRUE;
 }
 
+/*
+ * Limit the number of Write Commands waiting to be written to the socket.
+ * Once the limit is reached g_attrib_send() refuses further Write
+ * Commands and returns 0; func is called as soon as one of the queued
+ * commands is written or cancelled. A limit of 0 disables flow control.
+ */
+gboolean g_attrib_set_cmd_credits(GAttrib *attrib, guint credits,
+				GAttribReadyFunc func, gpointer user_data)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	attrib->cmd_credits = credits;
+	attrib->ready = func;
+	attrib->ready_user_data = user_data;
+
+	return TRUE;
+}
+
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len)
 {
 	if (len == NULL)
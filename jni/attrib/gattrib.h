@@ -40,6 +40,7 @@ typedef void (*GAttribDisconnectFunc)(gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
+typedef void (*GAttribReadyFunc)(gpointer user_data);
 
 GAttrib *g_attrib_new(GIOChannel *io);
 GAttrib *g_attrib_ref(GAttrib *attrib);
@@ -57,6 +58,9 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
+gboolean g_attrib_set_cmd_credits(GAttrib *attrib, guint credits,
+				GAttribReadyFunc func, gpointer user_data);
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data);
 
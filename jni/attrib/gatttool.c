@@ -61,9 +61,12 @@ static gboolean opt_listen = FALSE;
 static gboolean opt_char_desc = FALSE;
 static gboolean opt_char_write = FALSE;
 static gboolean opt_char_write_req = FALSE;
+static gboolean opt_reliable = FALSE;
 static gboolean opt_interactive = FALSE;
 static GMainLoop *event_loop;
 static gboolean got_error = FALSE;
+static GTimer *write_timer = NULL;
+static size_t write_len = 0;
 static GSourceFunc operation;
 
 struct characteristic_data {
@@ -378,7 +381,20 @@ static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 
 	g_print("Characteristic value was written successfully\n");
 
+	if (write_timer) {
+		gdouble elapsed = g_timer_elapsed(write_timer, NULL);
+
+		g_print("%zu bytes written in %.3f s (%.0f bytes/s)\n",
+					write_len, elapsed,
+					elapsed > 0 ? write_len / elapsed : 0);
+	}
+
 done:
+	if (write_timer) {
+		g_timer_destroy(write_timer);
+		write_timer = NULL;
+	}
+
 	if (opt_listen == FALSE)
 		g_main_loop_quit(event_loop);
 }
@@ -387,7 +403,7 @@ static gboolean characteristics_write_req(gpointer user_data)
 {
 	GAttrib *attrib = user_data;
 	uint8_t *value;
-	size_t len;
+	size_t len, buflen;
 
 	if (opt_handle <= 0) {
 		g_printerr("A valid handle is required\n");
@@ -405,8 +421,20 @@ static gboolean characteristics_write_req(gpointer user_data)
 		goto error;
 	}
 
-	gatt_write_char(attrib, opt_handle, value, len, char_write_req_cb,
-									NULL);
+	g_attrib_get_buffer(attrib, &buflen);
+
+	/* Time long writes, they take several round trips */
+	if (opt_reliable || len > buflen - 3) {
+		write_timer = g_timer_new();
+		write_len = len;
+	}
+
+	if (opt_reliable)
+		gatt_reliable_write_char(attrib, opt_handle, value, len,
+						char_write_req_cb, NULL);
+	else
+		gatt_write_char(attrib, opt_handle, value, len,
+						char_write_req_cb, NULL);
 
 	return FALSE;
 
@@ -500,6 +528,8 @@ static GOptionEntry char_rw_options[] = {
 		"0x0001" },
 	{ "offset", 'o', 0, G_OPTION_ARG_INT, &opt_offset,
 		"Offset to long read characteristic by handle", "N"},
+	{ "reliable", 'r', 0, G_OPTION_ARG_NONE, &opt_reliable,
+		"Use Reliable Write for --char-write-req", NULL },
 	{NULL},
 };
 
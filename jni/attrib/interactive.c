@@ -24,8 +24,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <glib.h>
 
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
 #include <bluetooth/uuid.h>
 
 #include <readline/readline.h>
@@ -35,7 +39,9 @@
 #include "btio.h"
 #include "gattrib.h"
 #include "gatt.h"
+#include "gatt-poll.h"
 #include "gatttool.h"
+#include "hcicmd.h"
 
 static GIOChannel *iochannel = NULL;
 static GAttrib *attrib = NULL;
@@ -51,8 +57,20 @@ static int opt_mtu = 0;
 static uint16_t conn_handle = 0;
 static int start;
 static int end;
+static struct gatt_poll *poller = NULL;
+static GHashTable *poll_ids = NULL;
+static GQueue *write_cmds = NULL;
+static struct hci_cmd_chan *hci_chan = NULL;
+static guint hci_watch = 0;
 
 
+struct write_cmd {
+    uint16_t handle;
+    uint8_t *value;
+    size_t vlen;
+    int count;
+};
+
 struct characteristic_data {
     uint16_t orig_start;
     uint16_t start;
@@ -145,6 +163,135 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
         g_attrib_send(attrib, 0, opdu[0], opdu, olen, NULL, NULL, NULL);
 }
 
+/*
+ * Write Commands get no response, so gattrib only lets WRITE_CMD_CREDITS
+ * of them wait for the socket at a time. char-write-cmd queues its writes
+ * here and hands them over until gattrib refuses one; write_cmd_ready()
+ * carries on once a queued command has gone out.
+ */
+#define WRITE_CMD_CREDITS 8
+
+static void write_cmd_free(struct write_cmd *w)
+{
+    g_free(w->value);
+    g_free(w);
+}
+
+static void write_cmds_run(void)
+{
+    struct write_cmd *w;
+
+    while ((w = g_queue_peek_head(write_cmds))) {
+        for (; w->count > 0; w->count--)
+            if (!gatt_write_char(attrib, w->handle, w->value, w->vlen,
+                            NULL, NULL))
+                return;
+
+        // let other end know we sent the request
+        printf("\nCHAR-WRITE-CMD(%04x): 0\n", conn_handle);
+        rl_forced_update_display();
+
+        g_queue_pop_head(write_cmds);
+        write_cmd_free(w);
+    }
+}
+
+static void write_cmd_ready(gpointer user_data)
+{
+    write_cmds_run();
+}
+
+static void write_cmds_clear(void)
+{
+    struct write_cmd *w;
+
+    while ((w = g_queue_pop_head(write_cmds)))
+        write_cmd_free(w);
+}
+
+/* The peer or the controller changed the parameters of our link */
+static void conn_update_event(uint8_t evt, void *data, int len,
+                            void *user_data)
+{
+    uint8_t *ptr = data;
+    evt_le_connection_update_complete *ev;
+
+    if (len < EVT_LE_META_EVENT_SIZE + EVT_LE_CONN_UPDATE_COMPLETE_SIZE)
+        return;
+
+    ev = (void *) (ptr + EVT_LE_META_EVENT_SIZE);
+    if (conn_state != STATE_CONNECTED || btohs(ev->handle) != conn_handle)
+        return;
+
+    if (ev->status)
+        printf("\nCONN-UPDATE(%04x): %i Command failed\n", conn_handle,
+               ev->status);
+    else
+        printf("\nCONN-UPDATE(%04x): 0 %u %u %u\n", conn_handle,
+               btohs(ev->interval), btohs(ev->latency),
+               btohs(ev->supervision_timeout));
+    rl_forced_update_display();
+}
+
+/*
+ * HCI commands for the link go through a command channel on the local
+ * adapter, driven from the main loop like the ATT traffic. The channel
+ * also reports LE connection updates. It is opened once connected and
+ * kept until exit.
+ */
+static struct hci_cmd_chan *hci_chan_get(void)
+{
+    int dev_id, dd;
+
+    if (hci_chan)
+        return hci_chan;
+
+    if (opt_src && !strncmp(opt_src, "hci", 3))
+        dev_id = atoi(opt_src + 3);
+    else if (opt_src)
+        dev_id = hci_devid(opt_src);
+    else
+        dev_id = hci_get_route(NULL);
+
+    if (dev_id < 0)
+        return NULL;
+
+    dd = hci_open_dev(dev_id);
+    if (dd < 0)
+        return NULL;
+
+    hci_chan = hci_cmd_chan_new(dd);
+    if (!hci_chan) {
+        hci_close_dev(dd);
+        return NULL;
+    }
+
+    hci_cmd_chan_subscribe(hci_chan, EVT_LE_META_EVENT,
+                    EVT_LE_CONN_UPDATE_COMPLETE, HCI_SUB_ANY, 0,
+                    conn_update_event, NULL);
+
+    hci_watch = hci_cmd_chan_add_watch(hci_chan);
+
+    return hci_chan;
+}
+
+static void hci_chan_close(void)
+{
+    int dd;
+
+    if (!hci_chan)
+        return;
+
+    if (hci_watch)
+        g_source_remove(hci_watch);
+    hci_watch = 0;
+
+    dd = hci_cmd_chan_fd(hci_chan);
+    hci_cmd_chan_free(hci_chan);
+    hci_close_dev(dd);
+    hci_chan = NULL;
+}
+
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
     if (err) {
@@ -156,6 +303,8 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
     }
 
     attrib = g_attrib_new(iochannel);
+    g_attrib_set_cmd_credits(attrib, WRITE_CMD_CREDITS, write_cmd_ready,
+                            NULL);
     g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, events_handler,
                             attrib, NULL);
     g_attrib_register(attrib, ATT_OP_HANDLE_IND, events_handler,
@@ -176,6 +325,9 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 
     printf("\nCONNECTED(%04x): %s 0\n", conn_handle, opt_dst);
     set_state(STATE_CONNECTED);
+
+    /* Not fatal: rssi says why when it can't open the channel */
+    hci_chan_get();
 }
 
 static void disconnect_io()
@@ -183,6 +335,15 @@ static void disconnect_io()
     if (conn_state == STATE_DISCONNECTED)
         return;
 
+    gatt_poll_free(poller);
+    poller = NULL;
+    if (poll_ids)
+        g_hash_table_remove_all(poll_ids);
+
+    /* Cancelling the queued commands must not start new ones */
+    g_attrib_set_cmd_credits(attrib, 0, NULL, NULL);
+    write_cmds_clear();
+
     g_attrib_unref(attrib);
     attrib = NULL;
     opt_mtu = 0;
@@ -728,16 +889,160 @@ static void cmd_char_write(int argcp, char **argvp)
         gatt_write_char(attrib, handle, value, plen,
                     char_write_req_cb, NULL);
     else {
-        gatt_write_char(attrib, handle, value, plen, NULL, NULL);
-        printf("\nCHAR-WRITE-CMD(%04x): 0\n", conn_handle); 
-        // let other end know we sent the request
-        rl_forced_update_display();
+        struct write_cmd *w = g_new0(struct write_cmd, 1);
+
+        w->handle = handle;
+        w->value = value;
+        w->vlen = plen;
+        w->count = argcp > 3 ? atoi(argvp[3]) : 1;
+        if (w->count < 1)
+            w->count = 1;
+
+        g_queue_push_tail(write_cmds, w);
+        write_cmds_run();
         return;
     }
 
     g_free(value);
 }
 
+static void char_poll_cb(uint16_t handle, guint8 status, const uint8_t *value,
+                            size_t vlen, gpointer user_data)
+{
+    size_t i;
+
+    if (status != 0) {
+        printf("\nCHAR-POLL(%04x): %i %04x %s\n", conn_handle, status,
+               handle, att_ecode2str(status));
+        rl_forced_update_display();
+        return;
+    }
+
+    printf("\nCHAR-POLL(%04x): 0 %04x ", conn_handle, handle);
+    for (i = 0; i < vlen; i++)
+        printf("%02x ", value[i]);
+    printf("\n");
+
+    rl_forced_update_display();
+}
+
+static void cmd_char_poll(int argcp, char **argvp)
+{
+    int handle, period, jitter = 0, len = 0;
+    guint id;
+
+    if (conn_state != STATE_CONNECTED) {
+        printf("\nCHAR-POLL(0000): 256 Command failed: disconnected\n");
+        rl_forced_update_display();
+        return;
+    }
+
+    if (argcp < 3) {
+        printf("\nCHAR-POLL(%04x): 1 Usage: char-poll <handle> <period ms> "
+               "[jitter ms] [length]\n", conn_handle);
+        rl_forced_update_display();
+        return;
+    }
+
+    handle = strtohandle(argvp[1]);
+    period = atoi(argvp[2]);
+    if (argcp > 3)
+        jitter = atoi(argvp[3]);
+    if (argcp > 4)
+        len = atoi(argvp[4]);
+
+    if (handle <= 0 || period <= 0 || jitter < 0 || len < 0) {
+        printf("\nCHAR-POLL(%04x): 1 Invalid argument\n", conn_handle);
+        rl_forced_update_display();
+        return;
+    }
+
+    if (poller == NULL)
+        poller = gatt_poll_new(attrib);
+
+    if (poll_ids == NULL)
+        poll_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    /* Re-registering a handle replaces its previous schedule */
+    id = GPOINTER_TO_UINT(g_hash_table_lookup(poll_ids,
+                                        GINT_TO_POINTER(handle)));
+    if (id)
+        gatt_poll_remove(poller, id);
+
+    id = gatt_poll_add(poller, handle, len, period, jitter, char_poll_cb,
+                                                                    NULL);
+    if (id == 0) {
+        g_hash_table_remove(poll_ids, GINT_TO_POINTER(handle));
+        printf("\nCHAR-POLL(%04x): 1 Command failed\n", conn_handle);
+        rl_forced_update_display();
+        return;
+    }
+
+    g_hash_table_insert(poll_ids, GINT_TO_POINTER(handle),
+                                        GUINT_TO_POINTER(id));
+}
+
+static void cmd_char_poll_stop(int argcp, char **argvp)
+{
+    gpointer id;
+    int handle;
+
+    if (argcp < 2) {
+        gatt_poll_free(poller);
+        poller = NULL;
+        if (poll_ids)
+            g_hash_table_remove_all(poll_ids);
+        printf("\nCHAR-POLL-STOP(%04x): 0\n", conn_handle);
+        rl_forced_update_display();
+        return;
+    }
+
+    handle = strtohandle(argvp[1]);
+    id = poll_ids ? g_hash_table_lookup(poll_ids,
+                                        GINT_TO_POINTER(handle)) : NULL;
+    if (id == NULL) {
+        printf("\nCHAR-POLL-STOP(%04x): 1 Handle not polled: %s\n",
+               conn_handle, argvp[1]);
+        rl_forced_update_display();
+        return;
+    }
+
+    gatt_poll_remove(poller, GPOINTER_TO_UINT(id));
+    g_hash_table_remove(poll_ids, GINT_TO_POINTER(handle));
+
+    printf("\nCHAR-POLL-STOP(%04x): 0\n", conn_handle);
+    rl_forced_update_display();
+}
+
+static void cmd_char_poll_stats(int argcp, char **argvp)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    printf("\nCHAR-POLL-STATS(%04x): 0 wakeups %u\n", conn_handle,
+           gatt_poll_get_wakeups(poller));
+
+    if (poll_ids == NULL) {
+        rl_forced_update_display();
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, poll_ids);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct gatt_poll_stats stats;
+
+        if (!gatt_poll_get_stats(poller, GPOINTER_TO_UINT(value), &stats))
+            continue;
+
+        printf("handle: 0x%04x reads: %u missed: %u latency "
+               "min/avg/max: %u/%u/%u ms\n", GPOINTER_TO_INT(key),
+               stats.reads, stats.missed, stats.latency_min,
+               stats.latency_avg, stats.latency_max);
+    }
+
+    rl_forced_update_display();
+}
+
 static void cmd_sec_level(int argcp, char **argvp)
 {
     GError *gerr = NULL;
@@ -863,6 +1168,64 @@ static void cmd_mtu(int argcp, char **argvp)
     gatt_exchange_mtu(attrib, opt_mtu, exchange_mtu_cb, NULL);
 }
 
+static void read_rssi_cb(int err, void *rparam, int rlen, void *user_data)
+{
+    uint16_t handle = GPOINTER_TO_UINT(user_data);
+    read_rssi_rp *rp = rparam;
+
+    if (err < 0) {
+        printf("\nRSSI(%04x): 256 Command failed: %s\n", handle,
+               strerror(-err));
+        rl_forced_update_display();
+        return;
+    }
+
+    if (rlen >= 1 && rp->status) {
+        printf("\nRSSI(%04x): %i Command failed\n", handle, rp->status);
+        rl_forced_update_display();
+        return;
+    }
+
+    if (rlen < READ_RSSI_RP_SIZE) {
+        printf("\nRSSI(%04x): %i Protocol error\n", handle,
+               ATT_ECODE_INVALID_PDU);
+        rl_forced_update_display();
+        return;
+    }
+
+    printf("\nRSSI(%04x): 0 %d\n", handle, rp->rssi);
+    rl_forced_update_display();
+}
+
+static void cmd_rssi(int argcp, char **argvp)
+{
+    struct hci_cmd_chan *chan;
+    uint16_t handle;
+
+    if (conn_state != STATE_CONNECTED) {
+        printf("\nRSSI(0000): 256 Command failed: not connected.\n");
+        rl_forced_update_display();
+        return;
+    }
+
+    chan = hci_chan_get();
+    if (!chan) {
+        printf("\nRSSI(%04x): 256 Can't open HCI device: %s\n",
+               conn_handle, strerror(errno));
+        rl_forced_update_display();
+        return;
+    }
+
+    handle = htobs(conn_handle);
+    if (!hci_cmd_chan_submit(chan, OGF_STATUS_PARAM, OCF_READ_RSSI, 0,
+                    &handle, sizeof(handle), read_rssi_cb,
+                    GUINT_TO_POINTER(conn_handle))) {
+        printf("\nRSSI(%04x): 256 Command failed: %s\n", conn_handle,
+               strerror(errno));
+        rl_forced_update_display();
+    }
+}
+
 static void cmd_psm(int argcp, char **argvp)
 {
     if (conn_state == STATE_CONNECTED) {
@@ -912,14 +1275,23 @@ static struct {
         "Characteristics Value/Descriptor Read by UUID" },
     { "char-write-req", cmd_char_write, "<handle> <new value>",
         "Characteristic Value Write (Write Request)" },
-    { "char-write-cmd", cmd_char_write, "<handle> <new value>",
+    { "char-write-cmd", cmd_char_write, "<handle> <new value> [count]",
         "Characteristic Value Write (No response)" },
+    { "char-poll",      cmd_char_poll,
+        "<handle> <period ms> [jitter ms] [length]",
+        "Read a characteristic periodically" },
+    { "char-poll-stop", cmd_char_poll_stop, "[handle]",
+        "Stop polling one or all characteristics" },
+    { "char-poll-stats", cmd_char_poll_stats, "",
+        "Show polling deadlines and latency" },
     { "sec-level",      cmd_sec_level,  "[low | medium | high]",
         "Set security level. Default: low" },
     { "mtu",        cmd_mtu,    "<value>",
         "Exchange MTU for GATT/ATT" },
     { "psm",        cmd_psm,    "<value>",
       "Set PSM for GATT/ATT over BR"},
+    { "rssi",       cmd_rssi,   "",
+        "Read the RSSI of the connection" },
     { NULL, NULL, NULL}
 };
 
@@ -1019,6 +1391,7 @@ int interactive(const gchar *src, const gchar *dst,
     opt_psm = psm;
 
     prompt = g_string_new(NULL);
+    write_cmds = g_queue_new();
 
     event_loop = g_main_loop_new(NULL, FALSE);
 
@@ -1034,9 +1407,11 @@ int interactive(const gchar *src, const gchar *dst,
 
     rl_callback_handler_remove();
     cmd_disconnect(0, NULL);
+    hci_chan_close();
     g_io_channel_unref(pchan);
     g_main_loop_unref(event_loop);
     g_string_free(prompt, TRUE);
+    g_queue_free(write_cmds);
 
     g_free(opt_src);
     g_free(opt_dst);
@@ -53,14 +53,84 @@ int hci_close_dev(int dd);
 int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
 int hci_send_req(int dd, struct hci_request *req, int timeout);
 
+struct hci_cmd_chan;
+
+struct hci_cmd_chan_stats {
+	unsigned long commands;
+	unsigned long events;
+	unsigned long ignored;
+	unsigned long stale;
+	unsigned long unexpected;
+	unsigned long timeouts;
+	unsigned long lost;
+	unsigned long max_inflight;
+};
+
+typedef void (*hci_cmd_func_t)(int err, void *rparam, int rlen, void *user_data);
+typedef void (*hci_event_func_t)(uint8_t evt, void *data, int len, void *user_data);
+
+struct hci_cmd_chan *hci_cmd_chan_new(int dd);
+void hci_cmd_chan_free(struct hci_cmd_chan *chan);
+int hci_cmd_chan_fd(struct hci_cmd_chan *chan);
+int hci_cmd_chan_send_req(struct hci_cmd_chan *chan, struct hci_request *req, int timeout);
+int hci_cmd_chan_send_batch(struct hci_cmd_chan *chan, struct hci_request *reqs, int num, int timeout);
+unsigned int hci_cmd_chan_submit(struct hci_cmd_chan *chan, uint16_t ogf, uint16_t ocf, int event, const void *param, uint8_t plen, hci_cmd_func_t func, void *user_data);
+int hci_cmd_chan_cancel(struct hci_cmd_chan *chan, unsigned int id);
+int hci_cmd_chan_process(struct hci_cmd_chan *chan);
+int hci_cmd_chan_wait(struct hci_cmd_chan *chan, unsigned int id, int timeout);
+void hci_cmd_chan_get_stats(struct hci_cmd_chan *chan, struct hci_cmd_chan_stats *stats);
+void hci_cmd_chan_set_event_func(struct hci_cmd_chan *chan, hci_event_func_t func, void *user_data);
+int hci_cmd_chan_input(struct hci_cmd_chan *chan, const void *buf, int len);
+
+#define HCI_SUB_ANY	-1
+
+struct hci_sub_stats {
+	unsigned long events;
+	unsigned long dropped;
+	unsigned int queued;
+	unsigned int max_queued;
+};
+
+unsigned int hci_cmd_chan_subscribe(struct hci_cmd_chan *chan, int evt, int subevt, int opcode, unsigned int queue_len, hci_event_func_t func, void *user_data);
+int hci_cmd_chan_unsubscribe(struct hci_cmd_chan *chan, unsigned int id);
+int hci_cmd_chan_sub_read(struct hci_cmd_chan *chan, unsigned int id, void *buf, int len);
+int hci_cmd_chan_sub_get_stats(struct hci_cmd_chan *chan, unsigned int id, struct hci_sub_stats *stats);
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype, uint16_t clkoffset, uint8_t rswitch, uint16_t *handle, int to);
 int hci_disconnect(int dd, uint16_t handle, uint8_t reason, int to);
 
 int hci_inquiry(int dev_id, int len, int num_rsp, const uint8_t *lap, inquiry_info **ii, long flags);
+
+#define HCI_INQUIRY_NO_RSSI	127
+
+struct hci_inquiry_result {
+	bdaddr_t	bdaddr;
+	uint8_t		pscan_rep_mode;
+	uint8_t		pscan_period_mode;
+	uint8_t		dev_class[3];
+	uint16_t	clock_offset;
+	int8_t		rssi;
+	const uint8_t	*eir;
+	int		eir_len;
+};
+
+typedef int (*hci_inquiry_func_t)(const struct hci_inquiry_result *res, void *user_data);
+
+int hci_inquiry_parse(const void *buf, int len, hci_inquiry_func_t func, void *user_data);
+int hci_inquiry_stream(int dd, int len, int num_rsp, const uint8_t *lap, hci_inquiry_func_t func, void *user_data);
+int hci_periodic_inquiry_stream(int dd, int max_period, int min_period, int len, int num_rsp, const uint8_t *lap, hci_inquiry_func_t func, void *user_data);
+
 int hci_devinfo(int dev_id, struct hci_dev_info *di);
 int hci_devba(int dev_id, bdaddr_t *bdaddr);
 int hci_devid(const char *str);
 
+typedef void (*hci_dev_func_t)(int dev_id, int event, void *user_data);
+
+int hci_dev_list_get(struct hci_dev_info *devs, int num);
+int hci_dev_list_fd(void);
+int hci_dev_list_process(void);
+void hci_dev_list_set_func(hci_dev_func_t func, void *user_data);
+
 int hci_read_local_name(int dd, int len, char *name, int to);
 int hci_write_local_name(int dd, const char *name, int to);
 int hci_read_remote_name(int dd, const bdaddr_t *bdaddr, int len, char *name, int to);
@@ -40,6 +40,8 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "bluetooth.h"
 #include "hci.h"
@@ -808,19 +810,128 @@ char *lmp_featurestostr(uint8_t *features, char *pref, int width)
 	return str;
 }
 
-/* HCI functions that do not require open device */
-int hci_for_each_dev(int flag, int (*func)(int dd, int dev_id, long arg),
-			long arg)
+/*
+ * Adapter registry. Route lookups used to list the devices and ask each
+ * for its info on every call. The list is now cached and a socket bound
+ * to no device listens for the stack internal device events (registered,
+ * up, down, ...), which invalidate it. Without those events, as for an
+ * unprivileged process the kernel filters them from, every lookup
+ * refreshes as before.
+ *
+ * A forked child reopens the registry, it can't share the socket with
+ * its parent, and the socket is close-on-exec so that programs started
+ * from here don't inherit it.
+ *
+ * The cache is shared by every thread of the process and guarded by a
+ * lock. Device events drained while it is held are only handed to the
+ * function once it has been released, so the function may look routes
+ * up again.
+ */
+#define HCI_DEV_EVENTS_MAX	32
+
+struct hci_dev_events {
+	int num;
+	struct {
+		uint16_t dev_id;
+		uint16_t event;
+	} evts[HCI_DEV_EVENTS_MAX];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pid_t pid;
+	int sk;
+	int valid;
+	int num;
+	struct hci_dev_info devs[HCI_MAX_DEV];
+	hci_dev_func_t func;
+	void *user_data;
+} hci_devs = { .lock = PTHREAD_MUTEX_INITIALIZER, .sk = -1 };
+
+static void hci_dev_list_lock(struct hci_dev_events *ev)
 {
-	struct hci_dev_list_req *dl;
-	struct hci_dev_req *dr;
-	int dev_id = -1;
-	int i, sk, err = 0;
+	pthread_mutex_lock(&hci_devs.lock);
+	ev->num = 0;
+}
+
+static void hci_dev_list_unlock(struct hci_dev_events *ev)
+{
+	hci_dev_func_t func = hci_devs.func;
+	void *user_data = hci_devs.user_data;
+	int i, err = errno;
+
+	pthread_mutex_unlock(&hci_devs.lock);
+
+	for (i = 0; i < ev->num && func; i++)
+		func(ev->evts[i].dev_id, ev->evts[i].event, user_data);
+
+	errno = err;
+}
+
+static int hci_dev_list_open(void)
+{
+	struct hci_filter nf, of;
+	struct sockaddr_hci a;
+	socklen_t olen;
+	int sk;
+
+	if (hci_devs.pid == getpid())
+		return hci_devs.sk;
+
+	if (hci_devs.sk >= 0)
+		close(hci_devs.sk);
+
+	hci_devs.pid = getpid();
+	hci_devs.sk = -1;
+	hci_devs.valid = 0;
 
 	sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
 	if (sk < 0)
 		return -1;
 
+	fcntl(sk, F_SETFD, FD_CLOEXEC);
+
+	memset(&a, 0, sizeof(a));
+	a.hci_family = AF_BLUETOOTH;
+	a.hci_dev = HCI_DEV_NONE;
+	if (bind(sk, (struct sockaddr *) &a, sizeof(a)) < 0)
+		goto failed;
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_STACK_INTERNAL, &nf);
+
+	if (setsockopt(sk, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
+		goto failed;
+
+	/* The kernel quietly masks what a process may not see */
+	olen = sizeof(of);
+	if (getsockopt(sk, SOL_HCI, HCI_FILTER, &of, &olen) < 0 ||
+				!hci_filter_test_event(EVT_STACK_INTERNAL, &of))
+		goto failed;
+
+	hci_devs.sk = sk;
+
+	return sk;
+
+failed:
+	close(sk);
+	return -1;
+}
+
+static int hci_dev_list_refresh(void)
+{
+	struct hci_dev_list_req *dl;
+	struct hci_dev_req *dr;
+	int i, sk, err = 0;
+
+	sk = hci_devs.sk;
+	if (sk < 0) {
+		sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+		if (sk < 0)
+			return -1;
+	}
+
 	dl = malloc(HCI_MAX_DEV * sizeof(*dr) + sizeof(*dl));
 	if (!dl) {
 		err = errno;
@@ -837,74 +948,297 @@ int hci_for_each_dev(int flag, int (*func)(int dd, int dev_id, long arg),
 		goto free;
 	}
 
-	for (i = 0; i < dl->dev_num; i++, dr++) {
-		if (hci_test_bit(flag, &dr->dev_opt))
-			if (!func || func(sk, dr->dev_id, arg)) {
-				dev_id = dr->dev_id;
-				break;
-			}
+	hci_devs.num = 0;
+
+	for (i = 0; i < dl->dev_num && i < HCI_MAX_DEV; i++, dr++) {
+		struct hci_dev_info *di = &hci_devs.devs[hci_devs.num];
+
+		memset(di, 0, sizeof(*di));
+		di->dev_id = dr->dev_id;
+
+		/* Gone since the list was taken */
+		if (ioctl(sk, HCIGETDEVINFO, (void *) di) < 0)
+			continue;
+
+		hci_devs.num++;
 	}
 
-	if (dev_id < 0)
-		err = ENODEV;
+	/* Only events can tell when it goes stale */
+	hci_devs.valid = hci_devs.sk >= 0;
 
 free:
 	free(dl);
 
 done:
-	close(sk);
+	if (sk != hci_devs.sk)
+		close(sk);
+
 	errno = err;
 
-	return dev_id;
+	return err ? -1 : 0;
 }
 
-static int __other_bdaddr(int dd, int dev_id, long arg)
+/* Drain the registry socket, keeping the events for the function */
+static int hci_dev_list_drain(struct hci_dev_events *ev)
 {
-	struct hci_dev_info di = { .dev_id = dev_id };
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	int len, count = 0;
+	int sk = hci_dev_list_open();
 
-	if (ioctl(dd, HCIGETDEVINFO, (void *) &di))
+	if (sk < 0)
 		return 0;
 
-	if (hci_test_bit(HCI_RAW, &di.flags))
-		return 0;
+	while (1) {
+		hci_event_hdr *hdr = (void *) (buf + 1);
+		evt_stack_internal *si = (void *) (hdr + 1);
+		evt_si_device *sd = (void *) si->data;
+
+		len = recv(sk, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_STACK_INTERNAL_SIZE +
+					EVT_SI_DEVICE_SIZE ||
+				hdr->evt != EVT_STACK_INTERNAL ||
+				btohs(si->type) != EVT_SI_DEVICE)
+			continue;
+
+		hci_devs.valid = 0;
+		count++;
+
+		if (ev->num < HCI_DEV_EVENTS_MAX) {
+			ev->evts[ev->num].dev_id = btohs(sd->dev_id);
+			ev->evts[ev->num].event = btohs(sd->event);
+			ev->num++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Handle the device events waiting on the registry socket without
+ * blocking, invalidating the list and calling the function set with
+ * hci_dev_list_set_func() for each. Returns the number of events.
+ */
+int hci_dev_list_process(void)
+{
+	struct hci_dev_events ev;
+	int count;
+
+	hci_dev_list_lock(&ev);
+	count = hci_dev_list_drain(&ev);
+	hci_dev_list_unlock(&ev);
 
-	return bacmp((bdaddr_t *) arg, &di.bdaddr);
+	return count;
 }
 
-static int __same_bdaddr(int dd, int dev_id, long arg)
+/* Called with the lock held */
+static int hci_dev_list_update(struct hci_dev_events *ev)
 {
-	struct hci_dev_info di = { .dev_id = dev_id };
+	if (hci_dev_list_open() >= 0 && hci_dev_list_drain(ev) < 0)
+		hci_devs.valid = 0;
 
-	if (ioctl(dd, HCIGETDEVINFO, (void *) &di))
+	if (hci_devs.valid)
 		return 0;
 
-	return !bacmp((bdaddr_t *) arg, &di.bdaddr);
+	return hci_dev_list_refresh();
+}
+
+/* Descriptor to poll for device changes, -1 if they can't be watched */
+int hci_dev_list_fd(void)
+{
+	struct hci_dev_events ev;
+	int sk;
+
+	hci_dev_list_lock(&ev);
+	sk = hci_dev_list_open();
+	hci_dev_list_unlock(&ev);
+
+	return sk;
+}
+
+void hci_dev_list_set_func(hci_dev_func_t func, void *user_data)
+{
+	pthread_mutex_lock(&hci_devs.lock);
+	hci_devs.func = func;
+	hci_devs.user_data = user_data;
+	pthread_mutex_unlock(&hci_devs.lock);
+}
+
+/*
+ * Copy the info of up to num devices, as of the last device event.
+ * Returns the number of devices.
+ */
+int hci_dev_list_get(struct hci_dev_info *devs, int num)
+{
+	struct hci_dev_events ev;
+
+	hci_dev_list_lock(&ev);
+
+	if (hci_dev_list_update(&ev) < 0) {
+		num = -1;
+		goto done;
+	}
+
+	if (num > hci_devs.num)
+		num = hci_devs.num;
+
+	memcpy(devs, hci_devs.devs, num * sizeof(*devs));
+
+done:
+	hci_dev_list_unlock(&ev);
+
+	return num;
+}
+
+static struct hci_dev_info *hci_dev_list_find(int dev_id)
+{
+	int i;
+
+	for (i = 0; i < hci_devs.num; i++)
+		if (hci_devs.devs[i].dev_id == dev_id)
+			return &hci_devs.devs[i];
+
+	return NULL;
+}
+
+/* HCI functions that do not require open device */
+int hci_for_each_dev(int flag, int (*func)(int dd, int dev_id, long arg),
+			long arg)
+{
+	struct hci_dev_events ev;
+	int ids[HCI_MAX_DEV];
+	int dev_id = -1;
+	int i, num = 0, sk, reg_sk, err = 0;
+
+	hci_dev_list_lock(&ev);
+
+	if (hci_dev_list_update(&ev) < 0) {
+		hci_dev_list_unlock(&ev);
+		return -1;
+	}
+
+	/* The function may look routes up, which can refresh the list */
+	for (i = 0; i < hci_devs.num; i++)
+		if (hci_test_bit(flag, &hci_devs.devs[i].flags))
+			ids[num++] = hci_devs.devs[i].dev_id;
+
+	/* Only closed in a forked child, never under another thread */
+	reg_sk = hci_devs.sk;
+
+	hci_dev_list_unlock(&ev);
+
+	if (!func) {
+		if (num)
+			return ids[0];
+		errno = ENODEV;
+		return -1;
+	}
+
+	/* Any HCI socket does for the device ioctls */
+	sk = reg_sk;
+	if (sk < 0) {
+		sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+		if (sk < 0)
+			return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (func(sk, ids[i], arg)) {
+			dev_id = ids[i];
+			break;
+		}
+	}
+
+	if (dev_id < 0)
+		err = ENODEV;
+
+	if (sk != reg_sk)
+		close(sk);
+
+	errno = err;
+
+	return dev_id;
 }
 
 int hci_get_route(bdaddr_t *bdaddr)
 {
-	return hci_for_each_dev(HCI_UP, __other_bdaddr,
-				(long) (bdaddr ? bdaddr : BDADDR_ANY));
+	const bdaddr_t *ba = bdaddr ? bdaddr : BDADDR_ANY;
+	struct hci_dev_events ev;
+	int i, dev_id = -1;
+
+	hci_dev_list_lock(&ev);
+
+	if (hci_dev_list_update(&ev) < 0)
+		goto done;
+
+	for (i = 0; i < hci_devs.num; i++) {
+		struct hci_dev_info *di = &hci_devs.devs[i];
+
+		if (!hci_test_bit(HCI_UP, &di->flags) ||
+				hci_test_bit(HCI_RAW, &di->flags))
+			continue;
+
+		if (bacmp(ba, &di->bdaddr)) {
+			dev_id = di->dev_id;
+			goto done;
+		}
+	}
+
+	errno = ENODEV;
+
+done:
+	hci_dev_list_unlock(&ev);
+
+	return dev_id;
 }
 
 int hci_devid(const char *str)
 {
+	struct hci_dev_events ev;
 	bdaddr_t ba;
-	int id = -1;
+	int i, id = -1;
 
 	if (!strncmp(str, "hci", 3) && strlen(str) >= 4) {
 		id = atoi(str + 3);
 		if (hci_devba(id, &ba) < 0)
 			return -1;
-	} else {
-		errno = ENODEV;
-		str2ba(str, &ba);
-		id = hci_for_each_dev(HCI_UP, __same_bdaddr, (long) &ba);
+
+		return id;
+	}
+
+	str2ba(str, &ba);
+
+	hci_dev_list_lock(&ev);
+
+	if (hci_dev_list_update(&ev) < 0)
+		goto done;
+
+	for (i = 0; i < hci_devs.num; i++) {
+		struct hci_dev_info *di = &hci_devs.devs[i];
+
+		if (hci_test_bit(HCI_UP, &di->flags) &&
+					!bacmp(&ba, &di->bdaddr)) {
+			id = di->dev_id;
+			goto done;
+		}
 	}
 
+	errno = ENODEV;
+
+done:
+	hci_dev_list_unlock(&ev);
+
 	return id;
 }
 
+/* Counters and scan flags change without events, so this stays live */
 int hci_devinfo(int dev_id, struct hci_dev_info *di)
 {
 	int dd, err, ret;
@@ -927,21 +1261,33 @@ int hci_devinfo(int dev_id, struct hci_dev_info *di)
 
 int hci_devba(int dev_id, bdaddr_t *bdaddr)
 {
-	struct hci_dev_info di;
+	struct hci_dev_events ev;
+	struct hci_dev_info *di;
+	int err = -1;
 
-	memset(&di, 0, sizeof(di));
+	hci_dev_list_lock(&ev);
 
-	if (hci_devinfo(dev_id, &di))
-		return -1;
+	if (hci_dev_list_update(&ev) < 0)
+		goto done;
+
+	di = hci_dev_list_find(dev_id);
+	if (!di) {
+		errno = ENODEV;
+		goto done;
+	}
 
-	if (!hci_test_bit(HCI_UP, &di.flags)) {
+	if (!hci_test_bit(HCI_UP, &di->flags)) {
 		errno = ENETDOWN;
-		return -1;
+		goto done;
 	}
 
-	bacpy(bdaddr, &di.bdaddr);
+	bacpy(bdaddr, &di->bdaddr);
+	err = 0;
 
-	return 0;
+done:
+	hci_dev_list_unlock(&ev);
+
+	return err;
 }
 
 int hci_inquiry(int dev_id, int len, int nrsp, const uint8_t *lap,
@@ -1013,62 +1359,422 @@ done:
 	return ret;
 }
 
-/* Open HCI device.
- * Returns device descriptor (dd). */
-int hci_open_dev(int dev_id)
+static struct hci_cmd_chan *hci_cmd_chan_lookup(int dd);
+static void hci_cmd_chan_destroy(struct hci_cmd_chan *chan);
+
+/*
+ * Streaming inquiry. hci_inquiry() only returns once the inquiry is
+ * over; these hand every response to func as its event arrives. func
+ * gets NULL when an inquiry round completes, and stops the inquiry by
+ * returning non-zero.
+ */
+static int inquiry_report(hci_inquiry_func_t func, void *user_data,
+				const bdaddr_t *bdaddr, uint8_t pscan_rep_mode,
+				uint8_t pscan_period_mode, const uint8_t *cls,
+				uint16_t clock_offset, int8_t rssi,
+				const uint8_t *eir, int eir_len)
 {
-	struct sockaddr_hci a;
-	int dd, err;
+	struct hci_inquiry_result res;
+
+	memset(&res, 0, sizeof(res));
+	bacpy(&res.bdaddr, bdaddr);
+	res.pscan_rep_mode = pscan_rep_mode;
+	res.pscan_period_mode = pscan_period_mode;
+	memcpy(res.dev_class, cls, 3);
+	res.clock_offset = clock_offset;
+	res.rssi = rssi;
+	res.eir = eir;
+	res.eir_len = eir_len;
+
+	return func(&res, user_data);
+}
 
-	/* Create HCI socket */
-	dd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
-	if (dd < 0)
-		return dd;
+/*
+ * Report the responses carried by one event packet. Returns the number
+ * of responses, 0 for other events, -1 with ECANCELED if func asked to
+ * stop.
+ */
+int hci_inquiry_parse(const void *buf, int len, hci_inquiry_func_t func,
+							void *user_data)
+{
+	const uint8_t *ptr = buf;
+	const hci_event_hdr *hdr = (const void *) (ptr + 1);
+	int i, num, size, pscan_mode;
 
-	/* Bind socket to the HCI device */
-	memset(&a, 0, sizeof(a));
-	a.hci_family = AF_BLUETOOTH;
-	a.hci_dev = dev_id;
-	if (bind(dd, (struct sockaddr *) &a, sizeof(a)) < 0)
-		goto failed;
+	if (len < 1 + HCI_EVENT_HDR_SIZE + 1 || ptr[0] != HCI_EVENT_PKT)
+		return 0;
 
-	return dd;
+	ptr += 1 + HCI_EVENT_HDR_SIZE;
+	len -= 1 + HCI_EVENT_HDR_SIZE;
 
-failed:
-	err = errno;
-	close(dd);
-	errno = err;
+	num = *ptr++;
+	len--;
 
-	return -1;
-}
+	/*
+	 * Some controllers still include the page scan mode in results with
+	 * RSSI. Tell from the size of the whole event, once for all records.
+	 */
+	pscan_mode = num && len / num ==
+				INQUIRY_INFO_WITH_RSSI_AND_PSCAN_MODE_SIZE;
 
-int hci_close_dev(int dd)
-{
-	return close(dd);
-}
+	for (i = 0; i < num; i++) {
+		int ret;
 
-/* HCI functions that require open device
- * dd - Device descriptor returned by hci_open_dev. */
+		switch (hdr->evt) {
+		case EVT_INQUIRY_RESULT: {
+			const inquiry_info *info = (const void *) ptr;
+
+			size = INQUIRY_INFO_SIZE;
+			if (len < size)
+				return i;
+
+			ret = inquiry_report(func, user_data, &info->bdaddr,
+					info->pscan_rep_mode,
+					info->pscan_period_mode,
+					info->dev_class, info->clock_offset,
+					HCI_INQUIRY_NO_RSSI, NULL, 0);
+			break;
+		}
+		case EVT_INQUIRY_RESULT_WITH_RSSI:
+			if (pscan_mode) {
+				const inquiry_info_with_rssi_and_pscan_mode *info =
+							(const void *) ptr;
+
+				size = INQUIRY_INFO_WITH_RSSI_AND_PSCAN_MODE_SIZE;
+				if (len < size)
+					return i;
+
+				ret = inquiry_report(func, user_data,
+						&info->bdaddr,
+						info->pscan_rep_mode,
+						info->pscan_period_mode,
+						info->dev_class,
+						info->clock_offset,
+						info->rssi, NULL, 0);
+			} else {
+				const inquiry_info_with_rssi *info =
+							(const void *) ptr;
+
+				size = INQUIRY_INFO_WITH_RSSI_SIZE;
+				if (len < size)
+					return i;
+
+				ret = inquiry_report(func, user_data,
+						&info->bdaddr,
+						info->pscan_rep_mode,
+						info->pscan_period_mode,
+						info->dev_class,
+						info->clock_offset,
+						info->rssi, NULL, 0);
+			}
+			break;
+		case EVT_EXTENDED_INQUIRY_RESULT: {
+			const extended_inquiry_info *info = (const void *) ptr;
+
+			size = EXTENDED_INQUIRY_INFO_SIZE;
+			if (len < size)
+				return i;
+
+			ret = inquiry_report(func, user_data, &info->bdaddr,
+					info->pscan_rep_mode,
+					info->pscan_period_mode,
+					info->dev_class, info->clock_offset,
+					info->rssi, info->data,
+					HCI_MAX_EIR_LENGTH);
+			break;
+		}
+		default:
+			return 0;
+		}
 
-int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+		if (ret) {
+			errno = ECANCELED;
+			return -1;
+		}
+
+		ptr += size;
+		len -= size;
+	}
+
+	return num;
+}
+
+static int inquiry_wait_cmd(int dd, uint16_t opcode, int to)
 {
-	uint8_t type = HCI_COMMAND_PKT;
-	hci_command_hdr hc;
-	struct iovec iv[3];
-	int ivn;
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct pollfd p;
+	int len;
 
-	hc.opcode = htobs(cmd_opcode_pack(ogf, ocf));
-	hc.plen= plen;
+	p.fd = dd;
+	p.events = POLLIN;
 
-	iv[0].iov_base = &type;
-	iv[0].iov_len  = 1;
-	iv[1].iov_base = &hc;
-	iv[1].iov_len  = HCI_COMMAND_HDR_SIZE;
-	ivn = 2;
+	while (poll(&p, 1, to) > 0) {
+		hci_event_hdr *hdr = (void *) (buf + 1);
 
-	if (plen) {
-		iv[2].iov_base = param;
-		iv[2].iov_len  = plen;
+		len = read(dd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (hdr->evt == EVT_CMD_COMPLETE) {
+			evt_cmd_complete *cc = (void *) (hdr + 1);
+
+			if (cc->opcode == opcode)
+				return 0;
+		}
+	}
+
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+static int inquiry_loop(int dd, uint16_t ocf, void *cp, uint8_t clen,
+				int to, hci_inquiry_func_t func,
+				void *user_data)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	uint16_t opcode = htobs(cmd_opcode_pack(OGF_LINK_CTL, ocf));
+	int periodic = ocf == OCF_PERIODIC_INQUIRY;
+	struct hci_filter nf, of;
+	socklen_t olen;
+	int len, err = 0, count = 0;
+
+	if (hci_cmd_chan_lookup(dd)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	olen = sizeof(of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0)
+		return -1;
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_CMD_STATUS, &nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+	hci_filter_set_event(EVT_INQUIRY_COMPLETE, &nf);
+	hci_filter_set_event(EVT_INQUIRY_RESULT, &nf);
+	hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &nf);
+	hci_filter_set_event(EVT_EXTENDED_INQUIRY_RESULT, &nf);
+
+	/* In place before the command, so no early response is lost */
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
+		return -1;
+
+	if (hci_send_cmd(dd, OGF_LINK_CTL, ocf, clen, cp) < 0)
+		goto failed;
+
+	while (1) {
+		hci_event_hdr *hdr = (void *) (buf + 1);
+		struct pollfd p;
+		int n;
+
+		p.fd = dd;
+		p.events = POLLIN;
+
+		n = poll(&p, 1, to);
+		if (n < 0) {
+			/* Interrupted: wind the inquiry down */
+			if (errno == EINTR)
+				goto stop;
+			goto failed;
+		}
+
+		if (n == 0) {
+			errno = ETIMEDOUT;
+			goto failed;
+		}
+
+		len = read(dd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			goto failed;
+		}
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + 1)
+			continue;
+
+		switch (hdr->evt) {
+		case EVT_CMD_STATUS: {
+			evt_cmd_status *cs = (void *) (hdr + 1);
+
+			if (cs->opcode == opcode && cs->status) {
+				errno = EIO;
+				goto failed;
+			}
+			continue;
+		}
+		case EVT_CMD_COMPLETE: {
+			evt_cmd_complete *cc = (void *) (hdr + 1);
+
+			/* Periodic inquiry completes, its status follows */
+			if (cc->opcode == opcode &&
+					len > 1 + HCI_EVENT_HDR_SIZE +
+						EVT_CMD_COMPLETE_SIZE &&
+					buf[1 + HCI_EVENT_HDR_SIZE +
+						EVT_CMD_COMPLETE_SIZE]) {
+				errno = EIO;
+				goto failed;
+			}
+			continue;
+		}
+		case EVT_INQUIRY_COMPLETE:
+			/* Only a periodic inquiry goes on after a round */
+			if (!func(NULL, user_data) && periodic)
+				continue;
+			if (periodic)
+				goto stop;
+			goto done;
+		}
+
+		n = hci_inquiry_parse(buf, len, func, user_data);
+		if (n < 0)
+			goto stop;
+
+		count += n;
+	}
+
+stop:
+	if (periodic) {
+		if (hci_send_cmd(dd, OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQUIRY,
+								0, NULL) == 0)
+			inquiry_wait_cmd(dd, htobs(cmd_opcode_pack(OGF_LINK_CTL,
+					OCF_EXIT_PERIODIC_INQUIRY)), 1000);
+	} else {
+		if (hci_send_cmd(dd, OGF_LINK_CTL, OCF_INQUIRY_CANCEL,
+								0, NULL) == 0)
+			inquiry_wait_cmd(dd, htobs(cmd_opcode_pack(OGF_LINK_CTL,
+					OCF_INQUIRY_CANCEL)), 1000);
+	}
+
+done:
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	return count;
+
+failed:
+	err = errno;
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	errno = err;
+	return -1;
+}
+
+/* len and the periods are in units of 1.28 seconds */
+int hci_inquiry_stream(int dd, int len, int nrsp, const uint8_t *lap,
+			hci_inquiry_func_t func, void *user_data)
+{
+	inquiry_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	if (lap)
+		memcpy(cp.lap, lap, 3);
+	else {
+		cp.lap[0] = 0x33;
+		cp.lap[1] = 0x8b;
+		cp.lap[2] = 0x9e;
+	}
+	cp.length = len;
+	cp.num_rsp = nrsp > 0 && nrsp < 256 ? nrsp : 0;
+
+	return inquiry_loop(dd, OCF_INQUIRY, &cp, INQUIRY_CP_SIZE,
+				len * 1280 + 5000, func, user_data);
+}
+
+int hci_periodic_inquiry_stream(int dd, int max_period, int min_period,
+				int len, int nrsp, const uint8_t *lap,
+				hci_inquiry_func_t func, void *user_data)
+{
+	periodic_inquiry_cp cp;
+
+	/* Required by the specification: max > min > length */
+	if (!(max_period > min_period && min_period > len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	if (lap)
+		memcpy(cp.lap, lap, 3);
+	else {
+		cp.lap[0] = 0x33;
+		cp.lap[1] = 0x8b;
+		cp.lap[2] = 0x9e;
+	}
+	cp.max_period = htobs(max_period);
+	cp.min_period = htobs(min_period);
+	cp.length = len;
+	cp.num_rsp = nrsp > 0 && nrsp < 256 ? nrsp : 0;
+
+	return inquiry_loop(dd, OCF_PERIODIC_INQUIRY, &cp,
+				PERIODIC_INQUIRY_CP_SIZE,
+				max_period * 1280 + 5000, func, user_data);
+}
+
+/* Open HCI device.
+ * Returns device descriptor (dd). */
+int hci_open_dev(int dev_id)
+{
+	struct sockaddr_hci a;
+	int dd, err;
+
+	/* Create HCI socket */
+	dd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (dd < 0)
+		return dd;
+
+	/* Bind socket to the HCI device */
+	memset(&a, 0, sizeof(a));
+	a.hci_family = AF_BLUETOOTH;
+	a.hci_dev = dev_id;
+	if (bind(dd, (struct sockaddr *) &a, sizeof(a)) < 0)
+		goto failed;
+
+	return dd;
+
+failed:
+	err = errno;
+	close(dd);
+	errno = err;
+
+	return -1;
+}
+
+int hci_close_dev(int dd)
+{
+	struct hci_cmd_chan *chan;
+
+	/* The descriptor may be reused, don't leave a channel behind */
+	chan = hci_cmd_chan_lookup(dd);
+	if (chan)
+		hci_cmd_chan_destroy(chan);
+
+	return close(dd);
+}
+
+/* HCI functions that require open device
+ * dd - Device descriptor returned by hci_open_dev. */
+
+int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+{
+	uint8_t type = HCI_COMMAND_PKT;
+	hci_command_hdr hc;
+	struct iovec iv[3];
+	int ivn;
+
+	hc.opcode = htobs(cmd_opcode_pack(ogf, ocf));
+	hc.plen= plen;
+
+	iv[0].iov_base = &type;
+	iv[0].iov_len  = 1;
+	iv[1].iov_base = &hc;
+	iv[1].iov_len  = HCI_COMMAND_HDR_SIZE;
+	ivn = 2;
+
+	if (plen) {
+		iv[2].iov_base = param;
+		iv[2].iov_len  = plen;
 		ivn = 3;
 	}
 
@@ -1080,15 +1786,106 @@ int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
 	return 0;
 }
 
+/*
+ * Check whether the event in buf completes request r. Returns 1 and
+ * fills in the request's return parameters if it does, 0 if the event is
+ * unrelated and -1 if it reports the request failed.
+ */
+static int hci_req_match(struct hci_request *r, uint16_t opcode,
+					unsigned char *buf, int len)
+{
+	evt_cmd_complete *cc;
+	evt_cmd_status *cs;
+	evt_remote_name_req_complete *rn;
+	evt_le_meta_event *me;
+	remote_name_req_cp *cp;
+	hci_event_hdr *hdr;
+	unsigned char *ptr;
+
+	hdr = (void *) (buf + 1);
+	ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+	len -= (1 + HCI_EVENT_HDR_SIZE);
+
+	switch (hdr->evt) {
+	case EVT_CMD_STATUS:
+		cs = (void *) ptr;
+
+		if (cs->opcode != opcode)
+			return 0;
+
+		if (r->event != EVT_CMD_STATUS) {
+			if (cs->status) {
+				errno = EIO;
+				return -1;
+			}
+			return 0;
+		}
+
+		r->rlen = MIN(len, r->rlen);
+		memcpy(r->rparam, ptr, r->rlen);
+		return 1;
+
+	case EVT_CMD_COMPLETE:
+		cc = (void *) ptr;
+
+		if (cc->opcode != opcode)
+			return 0;
+
+		ptr += EVT_CMD_COMPLETE_SIZE;
+		len -= EVT_CMD_COMPLETE_SIZE;
+
+		r->rlen = MIN(len, r->rlen);
+		memcpy(r->rparam, ptr, r->rlen);
+		return 1;
+
+	case EVT_REMOTE_NAME_REQ_COMPLETE:
+		if (hdr->evt != r->event)
+			return 0;
+
+		rn = (void *) ptr;
+		cp = r->cparam;
+
+		if (bacmp(&rn->bdaddr, &cp->bdaddr))
+			return 0;
+
+		r->rlen = MIN(len, r->rlen);
+		memcpy(r->rparam, ptr, r->rlen);
+		return 1;
+
+	case EVT_LE_META_EVENT:
+		me = (void *) ptr;
+
+		if (me->subevent != r->event)
+			return 0;
+
+		len -= 1;
+		r->rlen = MIN(len, r->rlen);
+		memcpy(r->rparam, me->data, r->rlen);
+		return 1;
+
+	default:
+		if (hdr->evt != r->event)
+			return 0;
+
+		r->rlen = MIN(len, r->rlen);
+		memcpy(r->rparam, ptr, r->rlen);
+		return 1;
+	}
+}
+
 int hci_send_req(int dd, struct hci_request *r, int to)
 {
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
 	uint16_t opcode = htobs(cmd_opcode_pack(r->ogf, r->ocf));
+	struct hci_cmd_chan *chan;
 	struct hci_filter nf, of;
 	socklen_t olen;
-	hci_event_hdr *hdr;
 	int err, try;
 
+	chan = hci_cmd_chan_lookup(dd);
+	if (chan)
+		return hci_cmd_chan_send_req(chan, r, to);
+
 	olen = sizeof(of);
 	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0)
 		return -1;
@@ -1108,11 +1905,6 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 
 	try = 10;
 	while (try--) {
-		evt_cmd_complete *cc;
-		evt_cmd_status *cs;
-		evt_remote_name_req_complete *rn;
-		evt_le_meta_event *me;
-		remote_name_req_cp *cp;
 		int len;
 
 		if (to) {
@@ -1143,86 +1935,1177 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 			goto failed;
 		}
 
-		hdr = (void *) (buf + 1);
-		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-		len -= (1 + HCI_EVENT_HDR_SIZE);
+		switch (hci_req_match(r, opcode, buf, len)) {
+		case 1:
+			goto done;
+		case -1:
+			goto failed;
+		}
+	}
+	errno = ETIMEDOUT;
 
-		switch (hdr->evt) {
-		case EVT_CMD_STATUS:
-			cs = (void *) ptr;
+failed:
+	err = errno;
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	errno = err;
+	return -1;
 
-			if (cs->opcode != opcode)
-				continue;
+done:
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	return 0;
+}
 
-			if (r->event != EVT_CMD_STATUS) {
-				if (cs->status) {
-					errno = EIO;
-					goto failed;
-				}
-				break;
-			}
+/*
+ * Persistent command channel.
+ *
+ * hci_send_req() swaps the socket filter around every command, which
+ * costs four system calls and loses events meant for anybody else
+ * reading the socket meanwhile. A command channel installs one filter
+ * that passes every event for as long as it is attached to a socket, and
+ * picks out completions by itself. Once attached, hci_send_req() and all
+ * the helpers built on it use the channel automatically.
+ *
+ * The channel is also an asynchronous engine. Submitted commands are
+ * queued and sent as soon as the controller has command credits
+ * (Num_HCI_Command_Packets of the last Command Complete or Command
+ * Status), so a controller that accepts several commands at once gets
+ * them back to back instead of one per round trip. Replies are matched
+ * to the oldest outstanding command with the same opcode and handed to
+ * that command's callback. The engine does no I/O on its own: feed it
+ * with hci_cmd_chan_process() whenever hci_cmd_chan_fd() is readable,
+ * or block in hci_cmd_chan_wait().
+ *
+ * Commands whose caller gave up waiting stay outstanding, so that a late
+ * reply to them is dropped instead of being taken for the answer to a
+ * newer command with the same opcode. A reply that is lost altogether,
+ * say to a receive buffer overrun, would then shift every later reply
+ * by one, so they only stay until the caller's timeout plus a grace
+ * period has passed since they were sent.
+ */
+#define HCI_CMD_CHAN_ABANDONED 8
+#define HCI_CMD_CHAN_GRACE 2000
 
-			r->rlen = MIN(len, r->rlen);
-			memcpy(r->rparam, ptr, r->rlen);
-			goto done;
+enum {
+	HCI_CMD_QUEUED,
+	HCI_CMD_SENT,
+	HCI_CMD_ACKED,
+};
 
-		case EVT_CMD_COMPLETE:
-			cc = (void *) ptr;
+struct hci_cmd {
+	unsigned int id;
+	int state;
+	int abandoned;
+	int expires;		/* ms after sent, once abandoned */
+	struct timespec sent;
+	uint16_t opcode;
+	struct hci_request req;
+	struct hci_request *user_req;
+	uint8_t param[HCI_MAX_EVENT_SIZE];
+	uint8_t rbuf[HCI_MAX_EVENT_SIZE];
+	hci_cmd_func_t func;
+	void *user_data;
+	struct hci_cmd *next;
+};
 
-			if (cc->opcode != opcode)
-				continue;
+struct hci_cmd_chan {
+	int dd;
+	struct hci_filter of;
+	struct hci_cmd *cmds;
+	unsigned int next_id;
+	int ncmd;
+	int num_sent;
+	hci_event_func_t event_func;
+	void *event_data;
+	struct hci_cmd_chan_stats stats;
+	struct hci_sub *subs;
+	struct hci_sub **evt_table[256];
+	struct hci_sub **le_table[256];
+	unsigned int next_sub_id;
+	int sub_busy;
+	int sub_dirty;
+	int sub_delivering;
+	struct hci_cmd_chan *next;
+};
 
-			ptr += EVT_CMD_COMPLETE_SIZE;
-			len -= EVT_CMD_COMPLETE_SIZE;
+/*
+ * Channels are found by socket from any thread, so the list has a lock.
+ * Using a channel itself is left to whoever owns its socket.
+ */
+static struct hci_cmd_chan *hci_cmd_chans;
+static pthread_mutex_t hci_cmd_chans_lock = PTHREAD_MUTEX_INITIALIZER;
 
-			r->rlen = MIN(len, r->rlen);
-			memcpy(r->rparam, ptr, r->rlen);
-			goto done;
+/* Called with the lock held */
+static struct hci_cmd_chan *hci_cmd_chan_find(int dd)
+{
+	struct hci_cmd_chan *chan;
 
-		case EVT_REMOTE_NAME_REQ_COMPLETE:
-			if (hdr->evt != r->event)
-				break;
+	for (chan = hci_cmd_chans; chan; chan = chan->next)
+		if (chan->dd == dd)
+			return chan;
 
-			rn = (void *) ptr;
-			cp = r->cparam;
+	return NULL;
+}
 
-			if (bacmp(&rn->bdaddr, &cp->bdaddr))
-				continue;
+static struct hci_cmd_chan *hci_cmd_chan_lookup(int dd)
+{
+	struct hci_cmd_chan *chan;
 
-			r->rlen = MIN(len, r->rlen);
-			memcpy(r->rparam, ptr, r->rlen);
-			goto done;
+	pthread_mutex_lock(&hci_cmd_chans_lock);
+	chan = hci_cmd_chan_find(dd);
+	pthread_mutex_unlock(&hci_cmd_chans_lock);
 
-		case EVT_LE_META_EVENT:
-			me = (void *) ptr;
+	return chan;
+}
 
-			if (me->subevent != r->event)
-				continue;
+struct hci_cmd_chan *hci_cmd_chan_new(int dd)
+{
+	struct hci_cmd_chan *chan;
+	struct hci_filter nf;
+	socklen_t olen;
+	int err;
 
-			len -= 1;
-			r->rlen = MIN(len, r->rlen);
-			memcpy(r->rparam, me->data, r->rlen);
-			goto done;
+	pthread_mutex_lock(&hci_cmd_chans_lock);
 
-		default:
-			if (hdr->evt != r->event)
-				break;
+	if (hci_cmd_chan_find(dd)) {
+		pthread_mutex_unlock(&hci_cmd_chans_lock);
+		errno = EALREADY;
+		return NULL;
+	}
 
-			r->rlen = MIN(len, r->rlen);
-			memcpy(r->rparam, ptr, r->rlen);
-			goto done;
-		}
+	chan = calloc(1, sizeof(*chan));
+	if (!chan) {
+		pthread_mutex_unlock(&hci_cmd_chans_lock);
+		return NULL;
 	}
-	errno = ETIMEDOUT;
+
+	chan->dd = dd;
+	chan->ncmd = 1;
+
+	olen = sizeof(chan->of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &chan->of, &olen) < 0)
+		goto failed;
+
+	/* Every event, any opcode: completions are matched in userspace */
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_all_events(&nf);
+
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
+		goto failed;
+
+	chan->next = hci_cmd_chans;
+	hci_cmd_chans = chan;
+
+	pthread_mutex_unlock(&hci_cmd_chans_lock);
+
+	return chan;
 
 failed:
 	err = errno;
-	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	pthread_mutex_unlock(&hci_cmd_chans_lock);
+	free(chan);
 	errno = err;
-	return -1;
+	return NULL;
+}
+
+static void hci_cmd_chan_unlink(struct hci_cmd_chan *chan)
+{
+	struct hci_cmd_chan **p;
+
+	pthread_mutex_lock(&hci_cmd_chans_lock);
+
+	for (p = &hci_cmd_chans; *p; p = &(*p)->next) {
+		if (*p == chan) {
+			*p = chan->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&hci_cmd_chans_lock);
+}
+
+static void hci_sub_free_all(struct hci_cmd_chan *chan);
+
+static void hci_cmd_chan_destroy(struct hci_cmd_chan *chan)
+{
+	hci_cmd_chan_unlink(chan);
+
+	while (chan->cmds) {
+		struct hci_cmd *cmd = chan->cmds;
+
+		chan->cmds = cmd->next;
+
+		if (!cmd->abandoned && cmd->func)
+			cmd->func(-ECANCELED, NULL, 0, cmd->user_data);
+
+		free(cmd);
+	}
+
+	hci_sub_free_all(chan);
+
+	free(chan);
+}
+
+void hci_cmd_chan_free(struct hci_cmd_chan *chan)
+{
+	if (!chan)
+		return;
+
+	setsockopt(chan->dd, SOL_HCI, HCI_FILTER, &chan->of, sizeof(chan->of));
+	hci_cmd_chan_destroy(chan);
+}
+
+int hci_cmd_chan_fd(struct hci_cmd_chan *chan)
+{
+	return chan->dd;
+}
+
+void hci_cmd_chan_get_stats(struct hci_cmd_chan *chan,
+					struct hci_cmd_chan_stats *stats)
+{
+	*stats = chan->stats;
+}
+
+/* Hand events that complete no command to func instead of dropping them */
+void hci_cmd_chan_set_event_func(struct hci_cmd_chan *chan,
+				hci_event_func_t func, void *user_data)
+{
+	chan->event_func = func;
+	chan->event_data = user_data;
+}
+
+/*
+ * Event subscribers. With a channel attached, the channel is the single
+ * reader of the socket and every event it dispatches also goes to each
+ * subscriber whose filter matches: an event code, an LE subevent, or the
+ * opcode of a Command Complete or Status. Filters are compiled into a
+ * table indexed by event code (and by subevent for LE meta events), so
+ * dispatching an event costs one lookup however many subscribers exist.
+ *
+ * A subscriber without a queue has its function called as the event is
+ * dispatched. Otherwise events wait in a queue of the given length and
+ * are handed to the function once everything waiting on the socket has
+ * been dispatched, or, without a function, read back one at a time with
+ * hci_cmd_chan_sub_read(). Events that find the queue full are dropped
+ * and counted, so a slow subscriber can't hold up command completions.
+ */
+struct hci_sub {
+	unsigned int id;
+	int evt;
+	int subevt;
+	int opcode;
+	hci_event_func_t func;
+	void *user_data;
+	uint8_t *buf;
+	uint16_t *len;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	int dead;
+	struct hci_sub_stats stats;
+	struct hci_sub *next;
+};
+
+static void hci_sub_free(struct hci_sub *sub)
+{
+	free(sub->buf);
+	free(sub->len);
+	free(sub);
+}
+
+static int hci_sub_match(struct hci_sub *sub, int evt, int subevt)
+{
+	if (sub->dead)
+		return 0;
+
+	if (sub->evt != HCI_SUB_ANY && sub->evt != evt)
+		return 0;
+
+	if (sub->subevt != HCI_SUB_ANY &&
+			(evt != EVT_LE_META_EVENT || sub->subevt != subevt))
+		return 0;
+
+	if (sub->opcode != HCI_SUB_ANY &&
+			evt != EVT_CMD_COMPLETE && evt != EVT_CMD_STATUS)
+		return 0;
+
+	return 1;
+}
+
+static struct hci_sub **hci_sub_table_entry(struct hci_cmd_chan *chan,
+							int evt, int subevt)
+{
+	struct hci_sub **entry, *sub;
+	int n = 0;
+
+	for (sub = chan->subs; sub; sub = sub->next)
+		if (hci_sub_match(sub, evt, subevt))
+			n++;
+
+	if (!n)
+		return NULL;
+
+	entry = malloc((n + 1) * sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	n = 0;
+	for (sub = chan->subs; sub; sub = sub->next)
+		if (hci_sub_match(sub, evt, subevt))
+			entry[n++] = sub;
+
+	entry[n] = NULL;
+
+	return entry;
+}
+
+static void hci_sub_table_free(struct hci_cmd_chan *chan)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		free(chan->evt_table[i]);
+		free(chan->le_table[i]);
+		chan->evt_table[i] = NULL;
+		chan->le_table[i] = NULL;
+	}
+}
+
+static void hci_sub_free_all(struct hci_cmd_chan *chan)
+{
+	hci_sub_table_free(chan);
+
+	while (chan->subs) {
+		struct hci_sub *sub = chan->subs;
+
+		chan->subs = sub->next;
+		hci_sub_free(sub);
+	}
+}
+
+/* Drop dead subscribers and recompile the table, never mid dispatch */
+static void hci_sub_rebuild(struct hci_cmd_chan *chan)
+{
+	struct hci_sub **p;
+	int i;
+
+	if (chan->sub_busy || !chan->sub_dirty)
+		return;
+
+	hci_sub_table_free(chan);
+
+	for (p = &chan->subs; *p;) {
+		struct hci_sub *sub = *p;
+
+		if (!sub->dead) {
+			p = &sub->next;
+			continue;
+		}
+
+		*p = sub->next;
+		hci_sub_free(sub);
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (i != EVT_LE_META_EVENT)
+			chan->evt_table[i] = hci_sub_table_entry(chan, i, 0);
+		chan->le_table[i] = hci_sub_table_entry(chan,
+						EVT_LE_META_EVENT, i);
+	}
+
+	chan->sub_dirty = 0;
+}
+
+static struct hci_sub *hci_sub_find(struct hci_cmd_chan *chan,
+							unsigned int id)
+{
+	struct hci_sub *sub;
+
+	for (sub = chan->subs; sub; sub = sub->next)
+		if (sub->id == id && !sub->dead)
+			return sub;
+
+	return NULL;
+}
+
+/*
+ * Subscribe to events. evt, subevt and opcode narrow the events down,
+ * HCI_SUB_ANY leaves them open. A subevt only matches LE meta events,
+ * an opcode only Command Complete and Command Status. Returns the
+ * subscriber id, 0 on failure.
+ */
+unsigned int hci_cmd_chan_subscribe(struct hci_cmd_chan *chan, int evt,
+					int subevt, int opcode,
+					unsigned int queue_len,
+					hci_event_func_t func, void *user_data)
+{
+	struct hci_sub *sub, **p;
+
+	if ((!func && !queue_len) || queue_len > 0xffff) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		return 0;
+
+	if (queue_len) {
+		sub->buf = malloc(queue_len * HCI_MAX_EVENT_SIZE);
+		sub->len = malloc(queue_len * sizeof(*sub->len));
+		if (!sub->buf || !sub->len) {
+			hci_sub_free(sub);
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+
+	if (++chan->next_sub_id == 0)
+		chan->next_sub_id = 1;
+
+	sub->id = chan->next_sub_id;
+	sub->evt = evt;
+	sub->subevt = subevt;
+	sub->opcode = opcode == HCI_SUB_ANY ? HCI_SUB_ANY : htobs(opcode);
+	sub->size = queue_len;
+	sub->func = func;
+	sub->user_data = user_data;
+
+	for (p = &chan->subs; *p; p = &(*p)->next);
+	*p = sub;
+
+	chan->sub_dirty = 1;
+	hci_sub_rebuild(chan);
+
+	return sub->id;
+}
+
+int hci_cmd_chan_unsubscribe(struct hci_cmd_chan *chan, unsigned int id)
+{
+	struct hci_sub *sub = hci_sub_find(chan, id);
+
+	if (!sub) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	sub->dead = 1;
+	chan->sub_dirty = 1;
+	hci_sub_rebuild(chan);
+
+	return 0;
+}
+
+static void hci_sub_push(struct hci_sub *sub, const unsigned char *buf,
+								int len)
+{
+	unsigned int slot;
+
+	if (sub->count == sub->size) {
+		sub->stats.dropped++;
+		return;
+	}
+
+	slot = (sub->head + sub->count) % sub->size;
+	memcpy(sub->buf + slot * HCI_MAX_EVENT_SIZE, buf, len);
+	sub->len[slot] = len;
+
+	if (++sub->count > sub->stats.max_queued)
+		sub->stats.max_queued = sub->count;
+}
+
+static int hci_sub_pop(struct hci_sub *sub, unsigned char *buf, int size)
+{
+	int len;
+
+	if (!sub->count)
+		return -1;
+
+	len = MIN(size, sub->len[sub->head]);
+	memcpy(buf, sub->buf + sub->head * HCI_MAX_EVENT_SIZE, len);
+
+	sub->head = (sub->head + 1) % sub->size;
+	sub->count--;
+	sub->stats.events++;
+
+	return len;
+}
+
+static void hci_sub_dispatch(struct hci_cmd_chan *chan, unsigned char *buf,
+								int len)
+{
+	hci_event_hdr *hdr = (void *) (buf + 1);
+	unsigned char *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+	int plen = len - (1 + HCI_EVENT_HDR_SIZE);
+	struct hci_sub **entry;
+	uint16_t opcode = 0;
+
+	if (hdr->evt == EVT_LE_META_EVENT) {
+		if (plen < EVT_LE_META_EVENT_SIZE)
+			return;
+		entry = chan->le_table[ptr[0]];
+	} else
+		entry = chan->evt_table[hdr->evt];
+
+	if (!entry)
+		return;
+
+	if (hdr->evt == EVT_CMD_COMPLETE && plen >= EVT_CMD_COMPLETE_SIZE)
+		opcode = ((evt_cmd_complete *) ptr)->opcode;
+	else if (hdr->evt == EVT_CMD_STATUS && plen >= EVT_CMD_STATUS_SIZE)
+		opcode = ((evt_cmd_status *) ptr)->opcode;
+
+	chan->sub_busy++;
+
+	for (; *entry; entry++) {
+		struct hci_sub *sub = *entry;
+
+		if (sub->dead)
+			continue;
+
+		if (sub->opcode != HCI_SUB_ANY && sub->opcode != opcode)
+			continue;
+
+		if (sub->size) {
+			hci_sub_push(sub, buf, len);
+			continue;
+		}
+
+		sub->stats.events++;
+		sub->func(hdr->evt, ptr, plen, sub->user_data);
+	}
+
+	chan->sub_busy--;
+	hci_sub_rebuild(chan);
+}
+
+/* Hand queued events to their functions */
+static void hci_sub_deliver(struct hci_cmd_chan *chan)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct hci_sub *sub;
+
+	/* A function waiting for a command gets back here */
+	if (chan->sub_delivering)
+		return;
+
+	chan->sub_delivering = 1;
+	chan->sub_busy++;
+
+	for (sub = chan->subs; sub; sub = sub->next) {
+		int len;
+
+		if (!sub->func)
+			continue;
+
+		while (!sub->dead && (len = hci_sub_pop(sub, buf,
+							sizeof(buf))) >= 0)
+			sub->func(buf[1], buf + 1 + HCI_EVENT_HDR_SIZE,
+				len - (1 + HCI_EVENT_HDR_SIZE), sub->user_data);
+	}
+
+	chan->sub_busy--;
+	chan->sub_delivering = 0;
+	hci_sub_rebuild(chan);
+}
+
+/*
+ * Take the oldest event queued for a subscriber without a function, as
+ * read() would return it from the socket. Returns its length, or -1 with
+ * EAGAIN when the queue is empty.
+ */
+int hci_cmd_chan_sub_read(struct hci_cmd_chan *chan, unsigned int id,
+						void *buf, int len)
+{
+	struct hci_sub *sub = hci_sub_find(chan, id);
+	int ret;
+
+	if (!sub || !sub->size) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	ret = hci_sub_pop(sub, buf, len);
+	if (ret < 0)
+		errno = EAGAIN;
+
+	return ret;
+}
+
+int hci_cmd_chan_sub_get_stats(struct hci_cmd_chan *chan, unsigned int id,
+					struct hci_sub_stats *stats)
+{
+	struct hci_sub *sub = hci_sub_find(chan, id);
+
+	if (!sub) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*stats = sub->stats;
+	stats->queued = sub->count;
+
+	return 0;
+}
+
+static struct hci_cmd *hci_cmd_find(struct hci_cmd_chan *chan,
+							unsigned int id)
+{
+	struct hci_cmd *cmd;
+
+	for (cmd = chan->cmds; cmd; cmd = cmd->next)
+		if (cmd->id == id)
+			return cmd;
+
+	return NULL;
+}
+
+static void hci_cmd_remove(struct hci_cmd_chan *chan, struct hci_cmd *cmd)
+{
+	struct hci_cmd **p;
+
+	for (p = &chan->cmds; *p; p = &(*p)->next) {
+		if (*p == cmd) {
+			*p = cmd->next;
+			break;
+		}
+	}
+
+	if (cmd->state == HCI_CMD_SENT)
+		chan->num_sent--;
+}
+
+static int hci_cmd_chan_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+				(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Send queued commands for as long as the controller takes them */
+static void hci_cmd_chan_kick(struct hci_cmd_chan *chan)
+{
+	struct hci_cmd *cmd, *next;
+
+	for (cmd = chan->cmds; cmd && chan->ncmd > 0; cmd = next) {
+		next = cmd->next;
+
+		if (cmd->state != HCI_CMD_QUEUED)
+			continue;
+
+		if (hci_send_cmd(chan->dd, cmd_opcode_ogf(btohs(cmd->opcode)),
+					cmd_opcode_ocf(btohs(cmd->opcode)),
+					cmd->req.clen, cmd->req.cparam) < 0) {
+			int err = -errno;
+
+			hci_cmd_remove(chan, cmd);
+			if (!cmd->abandoned && cmd->func)
+				cmd->func(err, NULL, 0, cmd->user_data);
+			free(cmd);
+
+			/* The callback may have changed the list */
+			next = chan->cmds;
+			continue;
+		}
+
+		cmd->state = HCI_CMD_SENT;
+		clock_gettime(CLOCK_MONOTONIC, &cmd->sent);
+		chan->ncmd--;
+		chan->num_sent++;
+		chan->stats.commands++;
+
+		if ((unsigned long) chan->num_sent > chan->stats.max_inflight)
+			chan->stats.max_inflight = chan->num_sent;
+	}
+}
+
+static void hci_cmd_complete(struct hci_cmd_chan *chan, struct hci_cmd *cmd,
+								int err)
+{
+	hci_cmd_remove(chan, cmd);
+
+	if (cmd->user_req && !err) {
+		cmd->user_req->rlen = cmd->req.rlen;
+		memcpy(cmd->user_req->rparam, cmd->req.rparam, cmd->req.rlen);
+	}
+
+	if (cmd->func)
+		cmd->func(err, err ? NULL : cmd->req.rparam,
+				err ? 0 : cmd->req.rlen, cmd->user_data);
+
+	free(cmd);
+}
+
+static unsigned int hci_cmd_chan_queue(struct hci_cmd_chan *chan,
+					uint16_t ogf, uint16_t ocf, int event,
+					const void *param, uint8_t plen,
+					struct hci_request *user_req,
+					hci_cmd_func_t func, void *user_data)
+{
+	struct hci_cmd *cmd, **p;
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return 0;
+
+	if (++chan->next_id == 0)
+		chan->next_id = 1;
+
+	cmd->id = chan->next_id;
+	cmd->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+	cmd->user_req = user_req;
+	cmd->func = func;
+	cmd->user_data = user_data;
+
+	if (plen)
+		memcpy(cmd->param, param, plen);
+
+	cmd->req.ogf = ogf;
+	cmd->req.ocf = ocf;
+	cmd->req.event = event;
+	cmd->req.cparam = cmd->param;
+	cmd->req.clen = plen;
+	cmd->req.rparam = cmd->rbuf;
+	cmd->req.rlen = user_req ? MIN(user_req->rlen, HCI_MAX_EVENT_SIZE) :
+							HCI_MAX_EVENT_SIZE;
+
+	for (p = &chan->cmds; *p; p = &(*p)->next);
+	*p = cmd;
+
+	hci_cmd_chan_kick(chan);
+
+	return cmd->id;
+}
+
+/*
+ * Queue a command. func is called with 0 and the return parameters once
+ * event arrives for it (EVT_CMD_COMPLETE for most commands), or with a
+ * negative error if the controller rejects the command or the channel
+ * goes away first. Returns the command id, 0 on failure.
+ */
+unsigned int hci_cmd_chan_submit(struct hci_cmd_chan *chan, uint16_t ogf,
+				uint16_t ocf, int event, const void *param,
+				uint8_t plen, hci_cmd_func_t func,
+				void *user_data)
+{
+	return hci_cmd_chan_queue(chan, ogf, ocf, event, param, plen, NULL,
+							func, user_data);
+}
+
+/* Drop abandoned commands whose reply is too late to still come */
+static void hci_cmd_chan_expire(struct hci_cmd_chan *chan)
+{
+	struct hci_cmd *cmd, *next;
+	int count = 0;
+
+	for (cmd = chan->cmds; cmd; cmd = next) {
+		next = cmd->next;
+
+		if (!cmd->abandoned)
+			continue;
+
+		if (hci_cmd_chan_elapsed(&cmd->sent) < cmd->expires) {
+			count++;
+			continue;
+		}
+
+		hci_cmd_remove(chan, cmd);
+		free(cmd);
+		chan->stats.lost++;
+	}
+
+	/* Don't stall waiting for a credit the reply would have returned */
+	if (chan->ncmd == 0 && chan->num_sent == count)
+		chan->ncmd = 1;
+}
+
+static void hci_cmd_abandon(struct hci_cmd_chan *chan, struct hci_cmd *cmd,
+								int to)
+{
+	struct hci_cmd *c, *oldest = NULL;
+	int count = 0;
+
+	/* Only a sent command can still get a reply worth recognizing */
+	if (cmd->state != HCI_CMD_SENT) {
+		hci_cmd_remove(chan, cmd);
+		free(cmd);
+		return;
+	}
+
+	cmd->abandoned = 1;
+	cmd->expires = MAX(to, hci_cmd_chan_elapsed(&cmd->sent)) +
+							HCI_CMD_CHAN_GRACE;
+	cmd->func = NULL;
+	cmd->user_req = NULL;
+
+	for (c = chan->cmds; c; c = c->next) {
+		if (!c->abandoned)
+			continue;
+
+		if (!oldest)
+			oldest = c;
+		count++;
+	}
+
+	if (count > HCI_CMD_CHAN_ABANDONED) {
+		hci_cmd_remove(chan, oldest);
+		free(oldest);
+		chan->stats.lost++;
+	}
+
+	/* Don't stall waiting for a credit the reply would have returned */
+	if (chan->ncmd == 0 && chan->num_sent == count)
+		chan->ncmd = 1;
+}
+
+int hci_cmd_chan_cancel(struct hci_cmd_chan *chan, unsigned int id)
+{
+	struct hci_cmd *cmd;
+
+	cmd = hci_cmd_find(chan, id);
+	if (!cmd || cmd->abandoned) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	hci_cmd_abandon(chan, cmd, 0);
+	hci_cmd_chan_kick(chan);
+
+	return 0;
+}
+
+static void hci_cmd_chan_reply(struct hci_cmd_chan *chan,
+					unsigned char *buf, int len)
+{
+	hci_event_hdr *hdr = (void *) (buf + 1);
+	struct hci_cmd *cmd;
+	uint16_t opcode;
+	int ret;
+
+	if (hdr->evt == EVT_CMD_COMPLETE) {
+		evt_cmd_complete *cc = (void *) (hdr + 1);
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE)
+			return;
+
+		chan->ncmd = cc->ncmd;
+		opcode = cc->opcode;
+	} else {
+		evt_cmd_status *cs = (void *) (hdr + 1);
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_STATUS_SIZE)
+			return;
+
+		chan->ncmd = cs->ncmd;
+		opcode = cs->opcode;
+	}
+
+	/* A NOP only hands out credits */
+	if (opcode == 0)
+		return;
+
+	hci_cmd_chan_expire(chan);
+
+	for (cmd = chan->cmds; cmd; cmd = cmd->next)
+		if (cmd->state == HCI_CMD_SENT && cmd->opcode == opcode)
+			break;
+
+	if (!cmd) {
+		chan->stats.unexpected++;
+		return;
+	}
+
+	if (cmd->abandoned) {
+		hci_cmd_remove(chan, cmd);
+		free(cmd);
+		chan->stats.stale++;
+		return;
+	}
+
+	ret = hci_req_match(&cmd->req, opcode, buf, len);
+	if (ret > 0)
+		hci_cmd_complete(chan, cmd, 0);
+	else if (ret < 0)
+		hci_cmd_complete(chan, cmd, -errno);
+	else {
+		/* Accepted, the result comes in a later event */
+		cmd->state = HCI_CMD_ACKED;
+		chan->num_sent--;
+	}
+}
+
+static void hci_cmd_chan_dispatch(struct hci_cmd_chan *chan,
+					unsigned char *buf, int len)
+{
+	hci_event_hdr *hdr;
+	struct hci_cmd *cmd;
+
+	chan->stats.events++;
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+		return;
+
+	hdr = (void *) (buf + 1);
+
+	/* Subscribers see every event, whether it completes a command or not */
+	hci_sub_dispatch(chan, buf, len);
+
+	if (hdr->evt == EVT_CMD_COMPLETE || hdr->evt == EVT_CMD_STATUS) {
+		hci_cmd_chan_reply(chan, buf, len);
+		return;
+	}
+
+	for (cmd = chan->cmds; cmd; cmd = cmd->next) {
+		if (cmd->state != HCI_CMD_ACKED)
+			continue;
+
+		if (hci_req_match(&cmd->req, cmd->opcode, buf, len) > 0) {
+			hci_cmd_complete(chan, cmd, 0);
+			return;
+		}
+	}
+
+	if (!chan->event_func) {
+		chan->stats.ignored++;
+		return;
+	}
+
+	chan->event_func(hdr->evt, buf + 1 + HCI_EVENT_HDR_SIZE,
+			len - (1 + HCI_EVENT_HDR_SIZE), chan->event_data);
+}
+
+/*
+ * Handle every event waiting on the socket without blocking. Returns the
+ * number of events handled or -1 on a socket error.
+ */
+int hci_cmd_chan_process(struct hci_cmd_chan *chan)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	int len, count = 0;
+
+	while (1) {
+		len = recv(chan->dd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		hci_cmd_chan_dispatch(chan, buf, len);
+		count++;
+	}
+
+	hci_cmd_chan_kick(chan);
+	hci_sub_deliver(chan);
+
+	return count;
+}
+
+/*
+ * Dispatch an event read from the socket by somebody else, for loops
+ * that want to do the reading themselves (in batches, say) and still
+ * share the socket with the channel.
+ */
+int hci_cmd_chan_input(struct hci_cmd_chan *chan, const void *buf, int len)
+{
+	unsigned char ev[HCI_MAX_EVENT_SIZE];
+
+	if (len < 1 || len > (int) sizeof(ev)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(ev, buf, len);
+
+	hci_cmd_chan_dispatch(chan, ev, len);
+	hci_cmd_chan_kick(chan);
+	hci_sub_deliver(chan);
+
+	return 0;
+}
+
+static int hci_cmd_chan_busy(struct hci_cmd_chan *chan, unsigned int id)
+{
+	struct hci_cmd *cmd;
+
+	if (id)
+		return hci_cmd_find(chan, id) != NULL;
+
+	for (cmd = chan->cmds; cmd; cmd = cmd->next)
+		if (!cmd->abandoned)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Process events until command id, or every command when id is 0, has
+ * completed. A timeout of 0 waits forever. Returns -1 with ETIMEDOUT if
+ * the commands are still outstanding when the time is up.
+ */
+int hci_cmd_chan_wait(struct hci_cmd_chan *chan, unsigned int id, int to)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (hci_cmd_chan_busy(chan, id)) {
+		struct pollfd p;
+		int n, left = -1;
+
+		if (to) {
+			left = to - hci_cmd_chan_elapsed(&start);
+			if (left <= 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+
+		p.fd = chan->dd; p.events = POLLIN;
+		n = poll(&p, 1, left);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (n > 0 && hci_cmd_chan_process(chan) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+struct hci_cmd_sync {
+	int done;
+	int err;
+};
+
+static void hci_cmd_sync_cb(int err, void *rparam, int rlen, void *user_data)
+{
+	struct hci_cmd_sync *sync = user_data;
+
+	sync->done = 1;
+	sync->err = err;
+}
+
+int hci_cmd_chan_send_req(struct hci_cmd_chan *chan, struct hci_request *r,
+								int to)
+{
+	struct hci_cmd_sync sync = { 0, 0 };
+	unsigned int id;
+
+	id = hci_cmd_chan_queue(chan, r->ogf, r->ocf, r->event, r->cparam,
+					r->clen, r, hci_cmd_sync_cb, &sync);
+	if (!id)
+		return -1;
+
+	if (hci_cmd_chan_wait(chan, id, to) < 0) {
+		int err = errno;
+		struct hci_cmd *cmd = hci_cmd_find(chan, id);
+
+		if (cmd)
+			hci_cmd_abandon(chan, cmd, to);
+
+		if (err == ETIMEDOUT)
+			chan->stats.timeouts++;
+
+		errno = err;
+		return -1;
+	}
+
+	if (sync.err) {
+		errno = -sync.err;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct hci_cmd_batch {
+	struct hci_request *req;
+	int *failed;
+};
+
+static void hci_cmd_batch_cb(int err, void *rparam, int rlen, void *user_data)
+{
+	struct hci_cmd_batch *b = user_data;
+
+	if (err) {
+		b->req->rlen = -1;
+		(*b->failed)++;
+	}
+}
+
+/*
+ * Send num requests pipelined and wait for all of them. Requests that
+ * fail or time out get rlen set to -1. Returns 0 if all of them
+ * completed, -1 otherwise.
+ */
+int hci_cmd_chan_send_batch(struct hci_cmd_chan *chan,
+				struct hci_request *reqs, int num, int to)
+{
+	struct hci_cmd_batch *batch;
+	unsigned int *ids;
+	int i, failed = 0, ret = 0;
+
+	batch = calloc(num, sizeof(*batch));
+	ids = calloc(num, sizeof(*ids));
+	if (!batch || !ids) {
+		free(batch);
+		free(ids);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch[i].req = &reqs[i];
+		batch[i].failed = &failed;
+
+		ids[i] = hci_cmd_chan_queue(chan, reqs[i].ogf, reqs[i].ocf,
+					reqs[i].event, reqs[i].cparam,
+					reqs[i].clen, &reqs[i],
+					hci_cmd_batch_cb, &batch[i]);
+		if (!ids[i]) {
+			reqs[i].rlen = -1;
+			failed++;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		struct hci_cmd *cmd;
+
+		if (!ids[i] || !hci_cmd_find(chan, ids[i]))
+			continue;
+
+		if (ret == 0 && hci_cmd_chan_wait(chan, ids[i], to) == 0)
+			continue;
+
+		/* Out of time: give up on the rest as well */
+		ret = -1;
+
+		cmd = hci_cmd_find(chan, ids[i]);
+		if (cmd) {
+			hci_cmd_abandon(chan, cmd, to);
+			reqs[i].rlen = -1;
+			chan->stats.timeouts++;
+			failed++;
+		}
+	}
+
+	free(batch);
+	free(ids);
+
+	if (failed) {
+		errno = ret < 0 ? ETIMEDOUT : EIO;
+		return -1;
+	}
 
-done:
-	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
 	return 0;
 }
 
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
@@ -38,51 +40,452 @@
 
 /* http://standards.ieee.org/regauth/oui/oui.txt */
 
+#ifndef OUIINDEX
+#define OUIINDEX OUIFILE ".idx"
+#endif
+
+/* Longer lines are read in pieces, by both lookups alike */
+#define OUI_LINE_MAX		512
+
+/*
+ * The index is a header, the entries sorted by OUI and the company names
+ * they point to, NUL terminated. It records the size and modification time
+ * of the text file it was built from and is ignored once that changes.
+ */
+#define OUI_INDEX_MAGIC		0x5849554f	/* "OUIX" */
+#define OUI_INDEX_VERSION	1
+
+struct oui_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t strings;
+	uint64_t text_size;
+	uint64_t text_mtime;
+};
+
+struct oui_index_entry {
+	uint32_t oui;
+	uint32_t offset;
+};
+
+static struct {
+	int state;		/* 0 not tried yet, 1 mapped, -1 unusable */
+	const struct oui_index_header *hdr;
+	const struct oui_index_entry *entries;
+	const char *strings;
+	size_t size;
+} oui_index;
+
+/* "XX-XX-XX" as printed by ba2oui() */
+static int oui_parse(const char *str, uint32_t *oui)
+{
+	uint32_t val = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		int c = str[i];
+
+		if (i == 2 || i == 5) {
+			if (c != '-' && c != ':')
+				return -1;
+			continue;
+		}
+
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			return -1;
+
+		val = val << 4 | c;
+	}
+
+	*oui = val;
+
+	return 0;
+}
+
+/* Maps the index once per process, fails when it is missing or stale */
+int oui_index_open(void)
+{
+	const struct oui_index_header *hdr;
+	struct stat st, text;
+	size_t len;
+	void *map;
+	int fd;
+
+	if (oui_index.state)
+		return oui_index.state > 0 ? 0 : -1;
+
+	oui_index.state = -1;
+
+	fd = open(OUIINDEX, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	len = sizeof(*hdr) + (size_t) hdr->count * sizeof(struct oui_index_entry);
+
+	if (hdr->magic != OUI_INDEX_MAGIC ||
+			hdr->version != OUI_INDEX_VERSION ||
+			len > (size_t) st.st_size ||
+			hdr->strings != st.st_size - len)
+		goto fail;
+
+	/* Every name ends within the file */
+	if (hdr->strings && ((const char *) map)[st.st_size - 1] != '\0')
+		goto fail;
+
+	/* Stale once the text file changed, the text is searched instead */
+	if (stat(OUIFILE, &text) == 0 &&
+			((uint64_t) text.st_size != hdr->text_size ||
+			(uint64_t) text.st_mtime != hdr->text_mtime))
+		goto fail;
+
+	oui_index.hdr = hdr;
+	oui_index.entries = (const void *) (hdr + 1);
+	oui_index.strings = (const char *) map + len;
+	oui_index.size = st.st_size;
+	oui_index.state = 1;
+
+	return 0;
+
+fail:
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/*
+ * Returns 0 and the company name, or NULL in *comp when the OUI isn't
+ * listed. Returns -1 without a usable index.
+ */
+static int oui_index_find(const char *oui, const char **comp)
+{
+	const struct oui_index_entry *e;
+	uint32_t key, lo, hi;
+
+	if (oui_index_open() < 0)
+		return -1;
+
+	*comp = NULL;
+
+	if (oui_parse(oui, &key) < 0)
+		return 0;
+
+	lo = 0;
+	hi = oui_index.hdr->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		e = &oui_index.entries[mid];
+
+		if (e->oui == key) {
+			if (e->offset < oui_index.hdr->strings)
+				*comp = oui_index.strings + e->offset;
+			return 0;
+		}
+
+		if (e->oui < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+char *oui_index_lookup(const char *oui)
+{
+	const char *comp;
+
+	if (oui_index_find(oui, &comp) < 0 || !comp)
+		return NULL;
+
+	return strdup(comp);
+}
+
 char *ouitocomp(const char *oui)
 {
+	const char *comp;
+
+	if (oui_index_find(oui, &comp) == 0)
+		return comp ? strdup(comp) : NULL;
+
+	return oui_text_lookup(oui);
+}
+
+struct oui_build_entry {
+	uint32_t oui;
+	uint32_t line;
+	uint32_t offset;
+};
+
+static int oui_build_cmp(const void *a, const void *b)
+{
+	const struct oui_build_entry *ea = a, *eb = b;
+
+	if (ea->oui != eb->oui)
+		return ea->oui < eb->oui ? -1 : 1;
+
+	/* The first entry wins, as with searching the text */
+	return ea->line < eb->line ? -1 : ea->line > eb->line;
+}
+
+/* "00-00-00   (hex)\t\tXEROX CORPORATION" */
+static int oui_parse_line(char *line, uint32_t *oui, char **comp)
+{
+	char *ptr, *end;
+
+	line += strspn(line, " \t");
+
+	if (oui_parse(line, oui) < 0 || line[2] != '-')
+		return -1;
+
+	ptr = line + 8;
+	ptr += strspn(ptr, " \t");
+
+	if (strncmp(ptr, "(hex)", 5))
+		return -1;
+
+	ptr += 5;
+	ptr += strspn(ptr, " \t");
+
+	end = ptr + strcspn(ptr, "\r\n");
+	while (end > ptr && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+
+	if (end == ptr)
+		return -1;
+
+	*end = '\0';
+	*comp = ptr;
+
+	return 0;
+}
+
+/*
+ * Search the text file itself, line by line as oui_index_build() reads
+ * it, so that both lookups return the same name.
+ */
+char *oui_text_lookup(const char *oui)
+{
+	char line[OUI_LINE_MAX], *map, *ptr, *start, *end, *next, *comp;
+	char *str = NULL;
+	uint32_t key, val;
 	struct stat st;
-	char *str, *map, *off, *end;
+	size_t len;
 	int fd;
 
+	if (oui_parse(oui, &key) < 0)
+		return NULL;
+
 	fd = open(OUIFILE, O_RDONLY);
 	if (fd < 0)
 		return NULL;
 
-	if (fstat(fd, &st) < 0) {
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
 		close(fd);
 		return NULL;
 	}
 
-	str = malloc(128);
-	if (!str) {
-		close(fd);
+	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
 		return NULL;
+
+	end = map + st.st_size;
+
+	for (ptr = map; ptr < end; ptr = next) {
+		next = memchr(ptr, '\n', end - ptr);
+		next = next ? next + 1 : end;
+
+		/* As fgets() into a buffer of the same size */
+		len = next - ptr;
+		if (len > sizeof(line) - 1) {
+			len = sizeof(line) - 1;
+			next = ptr + len;
+		}
+
+		/* Only lines starting with the OUI are worth a closer look */
+		for (start = ptr; start < ptr + len &&
+				(*start == ' ' || *start == '\t'); start++);
+
+		if (ptr + len - start < 8 || oui_parse(start, &val) < 0 ||
+								val != key)
+			continue;
+
+		memcpy(line, ptr, len);
+		line[len] = '\0';
+
+		if (oui_parse_line(line, &val, &comp) == 0 && val == key) {
+			str = strdup(comp);
+			break;
+		}
 	}
 
-	memset(str, 0, 128);
+	munmap(map, st.st_size);
 
-	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (!map || map == MAP_FAILED) {
-		free(str);
-		close(fd);
-		return NULL;
+	return str;
+}
+
+/*
+ * Compile the IEEE text file into the index. NULL picks the default
+ * paths. The index is replaced atomically, so processes that have the
+ * old one mapped carry on with it. Returns the number of OUIs indexed.
+ */
+int oui_index_build(const char *textfile, const char *indexfile)
+{
+	struct oui_index_header hdr;
+	struct oui_build_entry *build = NULL;
+	struct oui_index_entry *entries = NULL;
+	char *strings = NULL, line[OUI_LINE_MAX], tmp[PATH_MAX];
+	uint32_t count = 0, size = 0, used = 0, n = 0, lines = 0, i;
+	struct stat st;
+	FILE *in, *out;
+	int err = 0;
+
+	if (!textfile)
+		textfile = OUIFILE;
+	if (!indexfile)
+		indexfile = OUIINDEX;
+
+	in = fopen(textfile, "r");
+	if (!in)
+		return -1;
+
+	if (fstat(fileno(in), &st) < 0) {
+		err = errno;
+		goto done;
 	}
 
-	off = strstr(map, oui);
-	if (off) {
-		off += 18;
-		end = strpbrk(off, "\r\n");
-		strncpy(str, off, end - off);
-	} else {
-		free(str);
-		str = NULL;
+	while (fgets(line, sizeof(line), in)) {
+		uint32_t oui;
+		char *comp;
+		size_t len;
+
+		lines++;
+
+		if (oui_parse_line(line, &oui, &comp) < 0)
+			continue;
+
+		len = strlen(comp) + 1;
+
+		if (count == size) {
+			uint32_t grow = size ? size * 2 : 4096;
+			void *p = realloc(build, grow * sizeof(*build));
+
+			if (!p) {
+				err = ENOMEM;
+				goto done;
+			}
+
+			build = p;
+			size = grow;
+		}
+
+		if (used + len > n) {
+			uint32_t grow = n ? n * 2 : 65536;
+			void *p = realloc(strings, grow);
+
+			if (!p) {
+				err = ENOMEM;
+				goto done;
+			}
+
+			strings = p;
+			n = grow;
+		}
+
+		build[count].oui = oui;
+		build[count].line = lines;
+		build[count].offset = used;
+		count++;
+
+		memcpy(strings + used, comp, len);
+		used += len;
 	}
 
-	munmap(map, st.st_size);
+	if (ferror(in)) {
+		err = EIO;
+		goto done;
+	}
 
-	close(fd);
+	qsort(build, count, sizeof(*build), oui_build_cmp);
 
-	return str;
+	entries = malloc((count ? count : 1) * sizeof(*entries));
+	if (!entries) {
+		err = ENOMEM;
+		goto done;
+	}
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (n && entries[n - 1].oui == build[i].oui)
+			continue;
+
+		entries[n].oui = build[i].oui;
+		entries[n].offset = build[i].offset;
+		n++;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = OUI_INDEX_MAGIC;
+	hdr.version = OUI_INDEX_VERSION;
+	hdr.count = n;
+	hdr.strings = used;
+	hdr.text_size = st.st_size;
+	hdr.text_mtime = st.st_mtime;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", indexfile);
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		err = errno;
+		goto done;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+			(n && fwrite(entries, sizeof(*entries), n, out) != n) ||
+			(used && fwrite(strings, used, 1, out) != 1))
+		err = errno ? errno : EIO;
+
+	if (fclose(out) != 0 && !err)
+		err = errno;
+
+	if (!err && rename(tmp, indexfile) < 0)
+		err = errno;
+
+	if (err)
+		unlink(tmp);
+
+done:
+	fclose(in);
+	free(build);
+	free(entries);
+	free(strings);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return n;
 }
 
 int oui2comp(const char *oui, char *comp, size_t size)
@@ -23,3 +23,8 @@
 
 char *ouitocomp(const char *oui);
 int oui2comp(const char *oui, char *comp, size_t size);
+
+int oui_index_build(const char *textfile, const char *indexfile);
+int oui_index_open(void);
+char *oui_index_lookup(const char *oui);
+char *oui_text_lookup(const char *oui);
@@ -376,6 +376,123 @@ int textfile_caseput(const char *pathname, const char *key, const char *value)
 	return write_key(pathname, key, value, 1);
 }
 
+/*
+ * Put count keys at once. write_key() locks, rewrites and syncs the file
+ * once per key, this does it once for all of them. A key given twice
+ * ends up with its last value.
+ */
+int textfile_put_batch(const char *pathname, int count, const char **keys,
+							const char **values)
+{
+	struct stat st;
+	char *buf = NULL, *out = NULL, *ptr, *end;
+	size_t size, extra = 0, len = 0;
+	int fd, i, err = 0, *done;
+
+	done = calloc(count ? count : 1, sizeof(*done));
+	if (!done)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++)
+		extra += strlen(keys[i]) + strlen(values[i]) + 2;
+
+	fd = open(pathname, O_RDWR);
+	if (fd < 0) {
+		err = -errno;
+		goto free;
+	}
+
+	if (flock(fd, LOCK_EX) < 0) {
+		err = -errno;
+		goto close;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto unlock;
+	}
+
+	size = st.st_size;
+
+	buf = malloc(size + 1);
+	out = malloc(size + extra + 2);
+	if (!buf || !out) {
+		err = -ENOMEM;
+		goto unlock;
+	}
+
+	if (size && pread(fd, buf, size, 0) != (ssize_t) size) {
+		err = errno ? -errno : -EIO;
+		goto unlock;
+	}
+
+	buf[size] = '\0';
+
+	for (ptr = buf; ptr < buf + size; ptr = end) {
+		size_t klen;
+
+		end = strnpbrk(ptr, buf + size - ptr, "\r\n");
+		end = end ? end + strspn(end, "\r\n") : buf + size;
+
+		klen = strcspn(ptr, " \r\n");
+
+		for (i = count - 1; i >= 0; i--)
+			if (strlen(keys[i]) == klen &&
+					!strncmp(ptr, keys[i], klen))
+				break;
+
+		if (i < 0) {
+			memcpy(out + len, ptr, end - ptr);
+			len += end - ptr;
+			if (out[len - 1] != '\n')
+				out[len++] = '\n';
+			continue;
+		}
+
+		if (done[i])
+			continue;
+
+		len += sprintf(out + len, "%s %s\n", keys[i], values[i]);
+		done[i] = 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		int j;
+
+		if (done[i])
+			continue;
+
+		/* Later duplicates of this key were written already */
+		for (j = i + 1; j < count; j++)
+			if (!strcmp(keys[i], keys[j]))
+				break;
+
+		if (j < count)
+			continue;
+
+		len += sprintf(out + len, "%s %s\n", keys[i], values[i]);
+		done[i] = 1;
+	}
+
+	if (ftruncate(fd, 0) < 0 || pwrite(fd, out, len, 0) < 0)
+		err = -errno;
+
+unlock:
+	flock(fd, LOCK_UN);
+
+close:
+	fdatasync(fd);
+	close(fd);
+
+free:
+	free(done);
+	free(buf);
+	free(out);
+	errno = -err;
+
+	return err;
+}
+
 int textfile_del(const char *pathname, const char *key)
 {
 	return write_key(pathname, key, NULL, 0);
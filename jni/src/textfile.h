@@ -31,6 +31,8 @@ int create_name(char *buf, size_t size, const char *path,
 
 int textfile_put(const char *pathname, const char *key, const char *value);
 int textfile_caseput(const char *pathname, const char *key, const char *value);
+int textfile_put_batch(const char *pathname, int count, const char **keys,
+							const char **values);
 int textfile_del(const char *pathname, const char *key);
 int textfile_casedel(const char *pathname, const char *key);
 char *textfile_get(const char *pathname, const char *key);
@@ -3,7 +3,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := hcitool-btle
-LOCAL_SRC_FILES := hcitool.c
+LOCAL_SRC_FILES := \
+	hcitool.c \
+	lescan-ring.c \
+	rpa.c
 LOCAL_STATIC_LIBRARIES := bluetooth bluetoothd
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/../src \
@@ -16,3 +19,67 @@ LOCAL_CFLAGS:= \
 		-D__ANDROID__
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := lescan-reader
+LOCAL_SRC_FILES := \
+	lescan-reader.c \
+	lescan-ring.c
+LOCAL_STATIC_LIBRARIES := bluetooth
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/..
+
+LOCAL_CFLAGS:= \
+		-D__ANDROID__
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ouiindex
+LOCAL_SRC_FILES := \
+	ouiindex.c
+LOCAL_STATIC_LIBRARIES := bluetoothd
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../src
+
+LOCAL_CFLAGS:= \
+		-D__ANDROID__
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hcisim-bench
+LOCAL_SRC_FILES := \
+	hcisim-bench.c \
+	hcisim.c \
+	hcisim-shim.c
+LOCAL_STATIC_LIBRARIES := bluetooth
+LOCAL_LDLIBS := -ldl
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/..
+
+LOCAL_CFLAGS:= \
+		-DNEED_PPOLL \
+		-D__ANDROID__
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libhcisim
+LOCAL_SRC_FILES := \
+	hcisim.c \
+	hcisim-shim.c
+LOCAL_STATIC_LIBRARIES := bluetooth
+LOCAL_LDLIBS := -ldl
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/..
+
+LOCAL_CFLAGS:= \
+		-DNEED_PPOLL \
+		-D__ANDROID__
+
+include $(BUILD_SHARED_LIBRARY)
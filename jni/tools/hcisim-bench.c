@@ -0,0 +1,528 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmarks of the hci_* library against the simulated controller.
+ * Each test starts the simulator afresh from the same configuration, so
+ * that runs with the same options see the same traffic:
+ *
+ *	cmd		hci_send_req() round trips, filter swapped each time
+ *	chan		the same through an attached command channel
+ *	pipeline	commands submitted all at once, sent as credits allow
+ *	scan		advertising reports read straight off the socket
+ *	demux		the same fed through a channel subscriber, as lescan
+ *
+ * The scan tests run at the generator's pace, so what they measure is
+ * the reader's CPU time per event. An event dropped on the way fails
+ * the test rather than making the rate look better than it is.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hcisim.h"
+
+#define SCAN_QUEUE_LEN	256
+#define PIPELINE_DEPTH	64
+#define SCAN_CHECK	256
+#define SCAN_EVENTS	50000
+
+static struct hcisim_config config;
+
+static double clock_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double now(void)
+{
+	return clock_now(CLOCK_MONOTONIC);
+}
+
+static int open_sim(void)
+{
+	int dd;
+
+	if (hcisim_start(&config) < 0) {
+		perror("Can't start simulator");
+		return -1;
+	}
+
+	dd = hci_open_dev(0);
+	if (dd < 0) {
+		perror("Can't open simulated device");
+		hcisim_stop();
+		return -1;
+	}
+
+	return dd;
+}
+
+static void close_sim(int dd)
+{
+	struct hcisim_stats st;
+
+	hci_close_dev(dd);
+
+	hcisim_get_stats(&st);
+	hcisim_stop();
+
+	printf("\tcontroller: %lu commands, %lu events, %lu dropped\n",
+					st.commands, st.events, st.dropped);
+}
+
+static void print_rate(const char *name, unsigned long ops, double elapsed,
+							const char *unit)
+{
+	printf("%-8s %lu %s in %.3f s, %.0f %s/s, %.1f us each\n", name, ops,
+			unit, elapsed, ops / elapsed, unit,
+			ops ? elapsed * 1e6 / ops : 0);
+}
+
+static int bench_cmd(const char *name, unsigned long count, int use_chan)
+{
+	struct hci_cmd_chan *chan = NULL;
+	struct hci_version ver;
+	double start, t, min = 1e9, max = 0;
+	unsigned long i;
+	int dd, err = 0;
+
+	dd = open_sim();
+	if (dd < 0)
+		return 1;
+
+	if (use_chan) {
+		chan = hci_cmd_chan_new(dd);
+		if (!chan) {
+			perror("Can't attach command channel");
+			close_sim(dd);
+			return 1;
+		}
+	}
+
+	start = now();
+
+	for (i = 0; i < count; i++) {
+		t = now();
+
+		if (hci_read_local_version(dd, &ver, 1000) < 0) {
+			perror("Can't read local version");
+			err = 1;
+			break;
+		}
+
+		t = now() - t;
+		if (t < min)
+			min = t;
+		if (t > max)
+			max = t;
+	}
+
+	print_rate(name, i, now() - start, "commands");
+	printf("\tround trip min %.1f us, max %.1f us\n", min * 1e6,
+								max * 1e6);
+
+	if (chan)
+		hci_cmd_chan_free(chan);
+
+	close_sim(dd);
+
+	return err;
+}
+
+static void pipeline_cb(int err, void *rparam, int rlen, void *user_data)
+{
+	unsigned long *failed = user_data;
+
+	if (err || rlen < 1 || *(uint8_t *) rparam)
+		(*failed)++;
+}
+
+static int bench_pipeline(unsigned long count)
+{
+	struct hci_cmd_chan *chan;
+	struct hci_cmd_chan_stats st;
+	unsigned long i, n, failed = 0;
+	double start;
+	int dd, err = 0;
+
+	dd = open_sim();
+	if (dd < 0)
+		return 1;
+
+	chan = hci_cmd_chan_new(dd);
+	if (!chan) {
+		perror("Can't attach command channel");
+		close_sim(dd);
+		return 1;
+	}
+
+	start = now();
+
+	/* In windows, so the queue stays as short as a real caller's */
+	for (i = 0; i < count && !err; i += n) {
+		for (n = 0; n < PIPELINE_DEPTH && i + n < count; n++) {
+			if (!hci_cmd_chan_submit(chan, OGF_INFO_PARAM,
+					OCF_READ_LOCAL_VERSION, 0, NULL, 0,
+					pipeline_cb, &failed)) {
+				perror("Can't submit command");
+				err = 1;
+				break;
+			}
+		}
+
+		if (hci_cmd_chan_wait(chan, 0, 10000) < 0) {
+			perror("Commands didn't complete");
+			err = 1;
+		}
+	}
+
+	print_rate("pipeline", i, now() - start, "commands");
+
+	hci_cmd_chan_get_stats(chan, &st);
+	printf("\t%lu failed, at most %lu in flight\n", failed,
+							st.max_inflight);
+
+	hci_cmd_chan_free(chan);
+	close_sim(dd);
+
+	return err || failed;
+}
+
+struct scan_count {
+	unsigned long events;
+	unsigned long reports;
+};
+
+static void scan_event(uint8_t evt, void *data, int len, void *user_data)
+{
+	struct scan_count *c = user_data;
+	uint8_t *p = data;
+
+	if (len < 2)
+		return;
+
+	c->events++;
+	c->reports += p[1];
+}
+
+static int start_scan(int dd, struct hci_cmd_chan *chan)
+{
+	le_set_scan_enable_cp cp;
+	struct hci_request rq;
+	struct hci_filter nf;
+	uint8_t status;
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+
+	/* An attached channel has its own filter in place */
+	if (!chan && setsockopt(dd, SOL_HCI, HCI_FILTER, &nf,
+							sizeof(nf)) < 0) {
+		perror("Can't set filter");
+		return -1;
+	}
+
+	if (hci_le_set_scan_parameters(dd, 0x01, htobs(0x0010),
+					htobs(0x0010), 0x00, 0x00, 1000) < 0) {
+		perror("Can't set scan parameters");
+		return -1;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = 0x01;
+	cp.filter_dup = 0x00;
+
+	/*
+	 * Reports can arrive ahead of the enable's completion and
+	 * hci_send_req() would throw them away. The channel hands them
+	 * to the subscriber while it waits; without one, the read loop
+	 * picks up the completion along with them.
+	 */
+	if (!chan) {
+		if (hci_send_cmd(dd, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+					LE_SET_SCAN_ENABLE_CP_SIZE, &cp) < 0) {
+			perror("Can't enable scan");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = OCF_LE_SET_SCAN_ENABLE;
+	rq.cparam = &cp;
+	rq.clen = LE_SET_SCAN_ENABLE_CP_SIZE;
+	rq.rparam = &status;
+	rq.rlen = 1;
+
+	if (hci_cmd_chan_send_req(chan, &rq, 1000) < 0 || status) {
+		perror("Can't enable scan");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_scan(const char *name, int use_chan)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	struct scan_count c = { 0, 0 };
+	struct hci_cmd_chan *chan = NULL;
+	struct hci_sub_stats ss;
+	struct hcisim_stats st;
+	struct pollfd p;
+	unsigned long reads = 0, dropped;
+	unsigned int sub = 0;
+	double start, last, cpu;
+	ssize_t len;
+	int dd, done = 0, err = 0;
+
+	if (!config.adv_interval || !config.adv_count) {
+		fprintf(stderr, "%s needs adv_interval and adv_count\n", name);
+		return 1;
+	}
+
+	dd = open_sim();
+	if (dd < 0)
+		return 1;
+
+	if (use_chan) {
+		chan = hci_cmd_chan_new(dd);
+		if (chan)
+			sub = hci_cmd_chan_subscribe(chan, EVT_LE_META_EVENT,
+					EVT_LE_ADVERTISING_REPORT,
+					HCI_SUB_ANY, SCAN_QUEUE_LEN,
+					scan_event, &c);
+		if (!sub) {
+			perror("Can't subscribe to advertising reports");
+			close_sim(dd);
+			return 1;
+		}
+	}
+
+	if (start_scan(dd, chan) < 0) {
+		if (chan)
+			hci_cmd_chan_free(chan);
+		close_sim(dd);
+		return 1;
+	}
+
+	p.fd = dd;
+	p.events = POLLIN;
+
+	start = last = now();
+	cpu = clock_now(CLOCK_THREAD_CPUTIME_ID);
+
+	/* Until the storm is over and what it left in the socket is read */
+	while (1) {
+		if (done)
+			len = recv(dd, buf, sizeof(buf), MSG_DONTWAIT);
+		else if (poll(&p, 1, 100) > 0)
+			len = read(dd, buf, sizeof(buf));
+		else
+			len = 0;
+
+		if (len < 0 && done && errno == EAGAIN)
+			break;
+
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("Read failed");
+			err = 1;
+			break;
+		}
+
+		if (len == 0 || ++reads % SCAN_CHECK == 0) {
+			hcisim_get_stats(&st);
+			done = st.adv_events >= config.adv_count;
+		}
+
+		if (len == 0)
+			continue;
+
+		last = now();
+
+		if (chan) {
+			hci_cmd_chan_input(chan, buf, len);
+			continue;
+		}
+
+		if (len >= 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE + 1 &&
+				buf[1] == EVT_CMD_COMPLETE) {
+			evt_cmd_complete *cc = (void *) (buf + 1 +
+							HCI_EVENT_HDR_SIZE);
+			uint8_t status = buf[1 + HCI_EVENT_HDR_SIZE +
+							EVT_CMD_COMPLETE_SIZE];
+
+			if (cc->opcode == htobs(cmd_opcode_pack(OGF_LE_CTL,
+					OCF_LE_SET_SCAN_ENABLE)) && status) {
+				fprintf(stderr, "Can't enable scan: 0x%02x\n",
+								status);
+				err = 1;
+				break;
+			}
+			continue;
+		}
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + 2 ||
+				buf[1] != EVT_LE_META_EVENT ||
+				buf[3] != EVT_LE_ADVERTISING_REPORT)
+			continue;
+
+		scan_event(buf[1], buf + 1 + HCI_EVENT_HDR_SIZE,
+				len - 1 - HCI_EVENT_HDR_SIZE, &c);
+	}
+
+	cpu = clock_now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+	print_rate(name, c.events, last - start, "events");
+	printf("\t%lu reports, %.0f reports/s, reader CPU %.2f us/event\n",
+				c.reports, c.reports / (last - start),
+				c.events ? cpu * 1e6 / c.events : 0);
+
+	/* A rate over a stream with holes in it means nothing */
+	hcisim_get_stats(&st);
+	dropped = st.dropped;
+
+	if (chan) {
+		hci_cmd_chan_sub_get_stats(chan, sub, &ss);
+		printf("\tsubscriber: %lu events, %lu dropped, "
+				"at most %u queued\n", ss.events, ss.dropped,
+				ss.max_queued);
+		dropped += ss.dropped;
+		hci_cmd_chan_free(chan);
+	}
+
+	if (dropped) {
+		fprintf(stderr, "%s: %lu events dropped, raise adv_interval\n",
+								name, dropped);
+		err = 1;
+	}
+
+	if (c.events != st.adv_events) {
+		fprintf(stderr, "%s: read %lu of %lu events\n", name,
+						c.events, st.adv_events);
+		err = 1;
+	}
+
+	close_sim(dd);
+
+	return err;
+}
+
+static void usage(void)
+{
+	printf("hcisim-bench - benchmarks against a simulated controller\n"
+		"Usage:\n"
+		"\thcisim-bench [-c config] [-n count] [test ...]\n"
+		"Tests:\n"
+		"\tcmd chan pipeline scan demux (default all)\n"
+		"Config:\n"
+		"\tkey=value[,key=value...] with keys latency, ncmd,\n"
+		"\tconn_latency, adv_interval, adv_burst, adv_reports,\n"
+		"\tadv_devices, adv_len, adv_count, seed, script\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *all[] = { "cmd", "chan", "pipeline", "scan",
+							"demux", NULL };
+	const char **tests = all;
+	unsigned long count = 10000;
+	int opt, i, err = 0;
+
+	/* Paced so that the scan tests can read every event */
+	hcisim_config_init(&config);
+	config.ncmd = 8;
+	config.adv_interval = 100;
+	config.adv_reports = 3;
+	config.adv_count = SCAN_EVENTS;
+
+	while ((opt = getopt(argc, argv, "c:n:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (hcisim_config_parse(&config, optarg) < 0) {
+				fprintf(stderr, "Invalid config \"%s\"\n",
+								optarg);
+				exit(1);
+			}
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (optind < argc)
+		tests = (const char **) argv + optind;
+
+	printf("latency %u us, ncmd %u, adv every %u us x %u, %u reports "
+			"of %u bytes from %u devices, seed %u\n",
+			config.cmd_latency, config.ncmd, config.adv_interval,
+			config.adv_burst, config.adv_reports,
+			config.adv_data_len, config.adv_devices, config.seed);
+
+	for (i = 0; tests[i]; i++) {
+		if (!strcmp(tests[i], "cmd"))
+			err |= bench_cmd("cmd", count, 0);
+		else if (!strcmp(tests[i], "chan"))
+			err |= bench_cmd("chan", count, 1);
+		else if (!strcmp(tests[i], "pipeline"))
+			err |= bench_pipeline(count);
+		else if (!strcmp(tests[i], "scan"))
+			err |= bench_scan("scan", 0);
+		else if (!strcmp(tests[i], "demux"))
+			err |= bench_scan("demux", 1);
+		else {
+			usage();
+			exit(1);
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,182 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Stands in for the kernel's HCI sockets while the simulator runs.
+ *
+ * The socket calls the hci_* library makes are interposed: raw HCI
+ * sockets come from the simulator, and binding, socket options, ioctls
+ * and close on them are answered by it. Everything else goes on to the
+ * C library. Linked into a program, the shim takes over once that
+ * program calls hcisim_start(); preloaded into an unmodified one, as in
+ *
+ *	HCISIM=adv_interval=1000,adv_reports=3 \
+ *		LD_PRELOAD=libhcisim.so hcitool lescan
+ *
+ * it starts the simulator itself with the configuration in HCISIM.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hcisim.h"
+
+static void *real(const char *name)
+{
+	void *sym = dlsym(RTLD_NEXT, name);
+
+	if (!sym) {
+		fprintf(stderr, "hcisim: no %s to fall back on\n", name);
+		abort();
+	}
+
+	return sym;
+}
+
+int socket(int domain, int type, int protocol)
+{
+	static int (*real_socket)(int, int, int);
+
+	/* Mask SOCK_CLOEXEC and SOCK_NONBLOCK */
+	if (domain == AF_BLUETOOTH && protocol == BTPROTO_HCI &&
+				(type & 0xf) == SOCK_RAW && hcisim_active())
+		return hcisim_socket();
+
+	if (!real_socket)
+		real_socket = real("socket");
+
+	return real_socket(domain, type, protocol);
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	static int (*real_bind)(int, const struct sockaddr *, socklen_t);
+
+	if (hcisim_owns(fd)) {
+		const struct sockaddr_hci *a = (const void *) addr;
+
+		if (len < sizeof(*a) || a->hci_family != AF_BLUETOOTH) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		return hcisim_bind(fd, a->hci_dev);
+	}
+
+	if (!real_bind)
+		real_bind = real("bind");
+
+	return real_bind(fd, addr, len);
+}
+
+int getsockopt(int fd, int level, int name, void *val, socklen_t *len)
+{
+	static int (*real_getsockopt)(int, int, int, void *, socklen_t *);
+
+	if (level == SOL_HCI && hcisim_owns(fd))
+		return hcisim_getsockopt(fd, level, name, val, len);
+
+	if (!real_getsockopt)
+		real_getsockopt = real("getsockopt");
+
+	return real_getsockopt(fd, level, name, val, len);
+}
+
+int setsockopt(int fd, int level, int name, const void *val, socklen_t len)
+{
+	static int (*real_setsockopt)(int, int, int, const void *, socklen_t);
+
+	if (level == SOL_HCI && hcisim_owns(fd))
+		return hcisim_setsockopt(fd, level, name, val, len);
+
+	if (!real_setsockopt)
+		real_setsockopt = real("setsockopt");
+
+	return real_setsockopt(fd, level, name, val, len);
+}
+
+#ifdef __BIONIC__
+int ioctl(int fd, int req, ...)
+#else
+int ioctl(int fd, unsigned long req, ...)
+#endif
+{
+	static int (*real_ioctl)(int, unsigned long, void *);
+	va_list ap;
+	void *arg;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (hcisim_owns(fd))
+		return hcisim_ioctl(fd, req, arg);
+
+	if (!real_ioctl)
+		real_ioctl = real("ioctl");
+
+	return real_ioctl(fd, req, arg);
+}
+
+int close(int fd)
+{
+	static int (*real_close)(int);
+
+	if (hcisim_owns(fd))
+		hcisim_close(fd);
+
+	if (!real_close)
+		real_close = real("close");
+
+	return real_close(fd);
+}
+
+static void __attribute__ ((constructor)) hcisim_shim_init(void)
+{
+	struct hcisim_config cfg;
+	const char *env = getenv("HCISIM");
+
+	if (!env)
+		return;
+
+	hcisim_config_init(&cfg);
+
+	if (hcisim_config_parse(&cfg, env) < 0 || hcisim_start(&cfg) < 0) {
+		fprintf(stderr, "hcisim: can't start with \"%s\": %s\n", env,
+							strerror(errno));
+		return;
+	}
+}
@@ -0,0 +1,1921 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * A controller simulated in userspace, standing in for device 0.
+ *
+ * Every HCI socket the shim hands out is one end of a SOCK_SEQPACKET
+ * socketpair; the simulator thread holds the other end, so packets keep
+ * their boundaries just like on a real HCI socket. Commands written to
+ * any socket are answered after the configured latency, with command
+ * credits (Num_HCI_Command_Packets) that honour the configured queue
+ * depth. Events go to every socket bound to device 0 whose filter
+ * passes them, as the kernel would do. An event a socket has no room
+ * for is dropped and counted, again as the kernel would do.
+ *
+ * While LE scanning is enabled the simulator generates advertising
+ * reports from a seeded generator, so that a run is reproducible, and
+ * replays the script file if one is configured:
+ *
+ *	adv <bdaddr> <rssi> [<hex data>]	one advertising report
+ *	sleep <ms>
+ *	disconnect <handle> [<reason>]		drop a simulated connection
+ *	loop					start over
+ *
+ * With duplicate filtering enabled only the first report from each
+ * address gets through, until the filter's table fills up and starts
+ * over.
+ *
+ * The simulator serves a single process and its state, connections and
+ * white list included, lasts only as long as that process. A forked
+ * child can't use the sockets it inherited through it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "hcisim.h"
+
+#define SIM_MAX_CONN	16
+#define SIM_MAX_WL	16
+#define SIM_MAX_POLL	64
+#define SIM_MAX_STEPS	1024
+#define SIM_MAX_BURST	256	/* events per loop while catching up */
+#define SIM_INQ_RESULTS	4
+#define SIM_DUP_SIZE	1024
+
+#ifndef LE_LINK
+#define LE_LINK		0x80
+#endif
+
+enum {
+	SIM_TIMER_EVENT,
+	SIM_TIMER_REPLY,
+	SIM_TIMER_LE_CONN,
+};
+
+enum {
+	SIM_STEP_ADV,
+	SIM_STEP_SLEEP,
+	SIM_STEP_DISCONNECT,
+	SIM_STEP_LOOP,
+};
+
+struct sim_sock {
+	int host_fd;
+	int sim_fd;
+	int dev;
+	int dead;
+	struct hci_filter filter;
+	struct sim_sock *next;
+};
+
+struct sim_timer {
+	uint64_t due;
+	int kind;
+	int len;
+	uint8_t buf[1 + HCI_EVENT_HDR_SIZE + 255];
+	struct sim_timer *next;
+};
+
+struct sim_conn {
+	int used;
+	uint16_t handle;
+	uint8_t type;
+	bdaddr_t bdaddr;
+};
+
+struct sim_wl {
+	uint8_t type;
+	bdaddr_t bdaddr;
+};
+
+struct sim_step {
+	int type;
+	bdaddr_t bdaddr;
+	int8_t rssi;
+	uint8_t len;
+	uint8_t data[31];
+	unsigned int us;
+	uint16_t handle;
+	uint8_t reason;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int running;
+	int wake[2];
+	int timer;
+	struct hcisim_config cfg;
+	struct hcisim_stats stats;
+	struct sim_sock *socks;
+	struct sim_timer *timers;
+	unsigned int outstanding;
+
+	bdaddr_t bdaddr;
+	char name[HCI_MAX_NAME_LENGTH];
+	struct sim_conn conns[SIM_MAX_CONN];
+	uint16_t next_handle;
+	struct sim_wl wl[SIM_MAX_WL];
+	int wl_num;
+	int le_pending;
+	le_create_connection_cp le_cp;
+
+	int scanning;
+	int filter_dup;
+	bdaddr_t dup[SIM_DUP_SIZE];
+	uint8_t dup_used[SIM_DUP_SIZE];
+	int dup_num;
+	uint64_t adv_next;
+	uint32_t rand;
+	uint32_t adv_seq;
+	unsigned long adv_generated;
+
+	struct sim_step *steps;
+	int num_steps;
+	int step;
+	uint64_t step_next;
+} sim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = { -1, -1 },
+	.timer = -1,
+};
+
+/* Both ends of every link claim the same features */
+static const uint8_t sim_features[8] = {
+	0xff, 0xff, 0x8f, 0xfe, 0xdb, 0xff, 0x5b, 0x87
+};
+
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The shim interposes close(), which would come back here for the lock */
+static void sim_close_fd(int fd)
+{
+	syscall(SYS_close, fd);
+}
+
+static void sim_wake(void)
+{
+	char c = 0;
+
+	if (sim.wake[1] >= 0 && write(sim.wake[1], &c, 1) < 0 &&
+							errno != EAGAIN)
+		perror("hcisim: can't wake simulator");
+}
+
+static uint32_t sim_random(void)
+{
+	sim.rand = sim.rand * 1103515245 + 12345;
+
+	return sim.rand >> 8;
+}
+
+void hcisim_config_init(struct hcisim_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+
+	cfg->cmd_latency = 100;
+	cfg->ncmd = 1;
+	cfg->conn_latency = 5000;
+	cfg->adv_burst = 1;
+	cfg->adv_reports = 1;
+	cfg->adv_devices = 100;
+	cfg->adv_data_len = 20;
+	cfg->seed = 1;
+}
+
+static int sim_fix_config(struct hcisim_config *cfg)
+{
+	unsigned int max;
+
+	if (cfg->ncmd < 1 || cfg->ncmd > 255 || cfg->adv_burst < 1 ||
+				cfg->adv_devices < 1 || cfg->adv_reports < 1 ||
+				cfg->adv_data_len > 31)
+		return -1;
+
+	/* Each report takes 10 bytes besides its data, the event 1 more */
+	max = (255 - 1) / (10 + cfg->adv_data_len);
+	if (cfg->adv_reports > max)
+		return -1;
+
+	return 0;
+}
+
+int hcisim_config_parse(struct hcisim_config *cfg, const char *str)
+{
+	static const struct {
+		const char *key;
+		size_t off;
+	} keys[] = {
+		{ "latency",		offsetof(struct hcisim_config, cmd_latency) },
+		{ "ncmd",		offsetof(struct hcisim_config, ncmd) },
+		{ "conn_latency",	offsetof(struct hcisim_config, conn_latency) },
+		{ "adv_interval",	offsetof(struct hcisim_config, adv_interval) },
+		{ "adv_burst",		offsetof(struct hcisim_config, adv_burst) },
+		{ "adv_reports",	offsetof(struct hcisim_config, adv_reports) },
+		{ "adv_devices",	offsetof(struct hcisim_config, adv_devices) },
+		{ "adv_len",		offsetof(struct hcisim_config, adv_data_len) },
+		{ "seed",		offsetof(struct hcisim_config, seed) },
+		{ NULL }
+	};
+	char *copy, *tok, *save, *val, *end;
+	int i, err = 0;
+
+	copy = strdup(str);
+	if (!copy)
+		return -1;
+
+	for (tok = strtok_r(copy, ",", &save); tok && !err;
+					tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			err = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "script")) {
+			/* Kept for the life of the process, as is the config */
+			cfg->script = strdup(val);
+			continue;
+		}
+
+		if (!strcmp(tok, "adv_count")) {
+			cfg->adv_count = strtoul(val, &end, 0);
+			if (*end || end == val)
+				err = -1;
+			continue;
+		}
+
+		for (i = 0; keys[i].key; i++) {
+			if (!strcmp(tok, keys[i].key))
+				break;
+		}
+
+		if (!keys[i].key) {
+			err = -1;
+			break;
+		}
+
+		*(unsigned int *) ((char *) cfg + keys[i].off) =
+						strtoul(val, &end, 0);
+		if (*end || end == val)
+			err = -1;
+	}
+
+	free(copy);
+
+	if (err || sim_fix_config(cfg) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sim_parse_hex(const char *str, uint8_t *data, int max)
+{
+	int len = 0;
+	unsigned int val;
+
+	while (*str && !isspace((unsigned char) *str)) {
+		if (len == max || sscanf(str, "%2x", &val) != 1 ||
+						!isxdigit((unsigned char) str[1]))
+			return -1;
+
+		data[len++] = val;
+		str += 2;
+	}
+
+	return len;
+}
+
+static int sim_load_script(const char *path)
+{
+	char line[256], addr[18], hex[80];
+	struct sim_step *step;
+	int num = 0, lineno = 0, sleeps = 0, loops = 0;
+	unsigned int val, reason;
+	FILE *f;
+	int rssi, n;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	sim.steps = calloc(SIM_MAX_STEPS, sizeof(*sim.steps));
+	if (!sim.steps) {
+		fclose(f);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+
+		lineno++;
+
+		while (isspace((unsigned char) *p))
+			p++;
+
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (num == SIM_MAX_STEPS)
+			goto fail;
+
+		step = &sim.steps[num];
+
+		if (sscanf(p, "adv %17s %d %79s", addr, &rssi, hex) >= 2) {
+			step->type = SIM_STEP_ADV;
+			if (bachk(addr) < 0)
+				goto fail;
+			str2ba(addr, &step->bdaddr);
+			step->rssi = rssi;
+
+			n = sscanf(p, "adv %*s %*d %79s", hex) == 1 ?
+				sim_parse_hex(hex, step->data,
+						sizeof(step->data)) : 0;
+			if (n < 0)
+				goto fail;
+			step->len = n;
+		} else if (sscanf(p, "sleep %u", &val) == 1) {
+			step->type = SIM_STEP_SLEEP;
+			step->us = val * 1000;
+			sleeps++;
+		} else if ((n = sscanf(p, "disconnect %i %i", &val,
+							&reason)) >= 1) {
+			step->type = SIM_STEP_DISCONNECT;
+			step->handle = val;
+			step->reason = n == 2 ? reason : HCI_OE_USER_ENDED_CONNECTION;
+		} else if (!strncmp(p, "loop", 4)) {
+			step->type = SIM_STEP_LOOP;
+			loops++;
+		} else
+			goto fail;
+
+		num++;
+	}
+
+	fclose(f);
+
+	/* A loop without a pause would never let go of the simulator */
+	if (loops && !sleeps) {
+		lineno = 0;
+		goto fail_closed;
+	}
+
+	sim.num_steps = num;
+
+	return 0;
+
+fail:
+	fclose(f);
+fail_closed:
+	if (lineno)
+		fprintf(stderr, "hcisim: %s:%d: bad step\n", path, lineno);
+	else
+		fprintf(stderr, "hcisim: %s: loop without sleep\n", path);
+	free(sim.steps);
+	sim.steps = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+/* Hands an event to every socket that would get it from the kernel */
+static void sim_send(const uint8_t *buf, int len)
+{
+	hci_event_hdr *hdr = (void *) (buf + 1);
+	struct sim_sock *s;
+	int opcode = 0;
+
+	if (hdr->evt == EVT_CMD_COMPLETE)
+		opcode = bt_get_le16(buf + 1 + HCI_EVENT_HDR_SIZE + 1);
+	else if (hdr->evt == EVT_CMD_STATUS)
+		opcode = bt_get_le16(buf + 1 + HCI_EVENT_HDR_SIZE + 2);
+
+	sim.stats.events++;
+
+	for (s = sim.socks; s; s = s->next) {
+		if (s->dead || s->dev != 0)
+			continue;
+
+		if (!hci_filter_test_ptype(HCI_EVENT_PKT, &s->filter) ||
+				!hci_filter_test_event(hdr->evt, &s->filter))
+			continue;
+
+		if (opcode && s->filter.opcode &&
+				!hci_filter_test_opcode(opcode, &s->filter))
+			continue;
+
+		if (send(s->sim_fd, buf, len, MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+							errno == ENOBUFS)
+				sim.stats.dropped++;
+			else
+				s->dead = 1;
+		}
+	}
+}
+
+static void sim_schedule(uint64_t due, int kind, uint8_t evt,
+						const void *param, int plen)
+{
+	struct sim_timer *t, **p;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return;
+
+	t->due = due;
+	t->kind = kind;
+	t->buf[0] = HCI_EVENT_PKT;
+	t->buf[1] = evt;
+	t->buf[2] = plen;
+	memcpy(t->buf + 3, param, plen);
+	t->len = 3 + plen;
+
+	/* Keep events due at the same time in the order they were made */
+	for (p = &sim.timers; *p && (*p)->due <= due; p = &(*p)->next)
+		;
+
+	t->next = *p;
+	*p = t;
+}
+
+static void sim_event(unsigned int delay, uint8_t evt, const void *param,
+								int plen)
+{
+	sim_schedule(sim_now() + delay, SIM_TIMER_EVENT, evt, param, plen);
+}
+
+static void sim_cmd_complete(uint16_t opcode, const void *rp, int rlen)
+{
+	uint8_t buf[255];
+	evt_cmd_complete *cc = (void *) buf;
+
+	cc->ncmd = 0;
+	cc->opcode = htobs(opcode);
+	memcpy(buf + EVT_CMD_COMPLETE_SIZE, rp, rlen);
+
+	sim_schedule(sim_now() + sim.cfg.cmd_latency, SIM_TIMER_REPLY,
+			EVT_CMD_COMPLETE, buf, EVT_CMD_COMPLETE_SIZE + rlen);
+}
+
+static void sim_cmd_status(uint16_t opcode, uint8_t status)
+{
+	evt_cmd_status cs;
+
+	cs.status = status;
+	cs.ncmd = 0;
+	cs.opcode = htobs(opcode);
+
+	sim_schedule(sim_now() + sim.cfg.cmd_latency, SIM_TIMER_REPLY,
+				EVT_CMD_STATUS, &cs, EVT_CMD_STATUS_SIZE);
+}
+
+static void sim_status_complete(uint16_t opcode, uint8_t status)
+{
+	sim_cmd_complete(opcode, &status, 1);
+}
+
+static struct sim_conn *sim_conn_find(uint16_t handle)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_CONN; i++) {
+		if (sim.conns[i].used && sim.conns[i].handle == handle)
+			return &sim.conns[i];
+	}
+
+	return NULL;
+}
+
+static struct sim_conn *sim_conn_find_ba(const bdaddr_t *ba, int type)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_CONN; i++) {
+		if (sim.conns[i].used && sim.conns[i].type == type &&
+				!bacmp(&sim.conns[i].bdaddr, ba))
+			return &sim.conns[i];
+	}
+
+	return NULL;
+}
+
+static struct sim_conn *sim_conn_add(const bdaddr_t *ba, uint8_t type)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_CONN; i++) {
+		struct sim_conn *c = &sim.conns[i];
+
+		if (c->used)
+			continue;
+
+		c->used = 1;
+		c->handle = sim.next_handle++;
+		if (sim.next_handle > 0x0eff)
+			sim.next_handle = 0x0040;
+		c->type = type;
+		bacpy(&c->bdaddr, ba);
+		sim.stats.connections++;
+
+		return c;
+	}
+
+	return NULL;
+}
+
+static void sim_disconn_complete(unsigned int delay, struct sim_conn *c,
+								uint8_t reason)
+{
+	evt_disconn_complete dc;
+
+	dc.status = 0;
+	dc.handle = htobs(c->handle);
+	dc.reason = reason;
+
+	c->used = 0;
+
+	sim_event(delay, EVT_DISCONN_COMPLETE, &dc, EVT_DISCONN_COMPLETE_SIZE);
+}
+
+static void sim_le_conn_complete(unsigned int delay, uint8_t status,
+				const struct sim_conn *c, uint8_t peer_type)
+{
+	uint8_t buf[1 + EVT_LE_CONN_COMPLETE_SIZE];
+	evt_le_connection_complete *cc = (void *) (buf + 1);
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = EVT_LE_CONN_COMPLETE;
+	cc->status = status;
+
+	if (c) {
+		cc->handle = htobs(c->handle);
+		cc->peer_bdaddr_type = peer_type;
+		bacpy(&cc->peer_bdaddr, &c->bdaddr);
+		cc->interval = sim.le_cp.min_interval;
+		cc->latency = sim.le_cp.latency;
+		cc->supervision_timeout = sim.le_cp.supervision_timeout;
+	}
+
+	sim_event(delay, EVT_LE_META_EVENT, buf, sizeof(buf));
+}
+
+/* Runs when the simulated peer has answered the connection request */
+static void sim_le_connect(void)
+{
+	const bdaddr_t *peer = &sim.le_cp.peer_bdaddr;
+	uint8_t type = sim.le_cp.peer_bdaddr_type;
+	struct sim_conn *c;
+	int i;
+
+	if (!sim.le_pending)
+		return;
+
+	if (sim.le_cp.initiator_filter) {
+		for (i = 0; i < sim.wl_num; i++) {
+			if (!sim_conn_find_ba(&sim.wl[i].bdaddr, LE_LINK))
+				break;
+		}
+
+		/* Nobody on the white list is left to connect to yet */
+		if (i == sim.wl_num) {
+			sim_schedule(sim_now() + sim.cfg.conn_latency,
+					SIM_TIMER_LE_CONN, 0, NULL, 0);
+			return;
+		}
+
+		peer = &sim.wl[i].bdaddr;
+		type = sim.wl[i].type;
+	}
+
+	sim.le_pending = 0;
+
+	c = sim_conn_add(peer, LE_LINK);
+	sim_le_conn_complete(0, c ? 0 : HCI_REJECTED_LIMITED_RESOURCES, c,
+									type);
+}
+
+static void sim_remote_info(uint16_t ocf, const uint8_t *cp)
+{
+	unsigned int delay = sim.cfg.cmd_latency + sim.cfg.conn_latency;
+
+	switch (ocf) {
+	case OCF_READ_REMOTE_FEATURES: {
+		evt_read_remote_features_complete ev;
+
+		ev.status = 0;
+		memcpy(&ev.handle, cp, 2);
+		memcpy(ev.features, sim_features, sizeof(ev.features));
+		sim_event(delay, EVT_READ_REMOTE_FEATURES_COMPLETE, &ev,
+				EVT_READ_REMOTE_FEATURES_COMPLETE_SIZE);
+		break;
+	}
+
+	case OCF_READ_REMOTE_EXT_FEATURES: {
+		evt_read_remote_ext_features_complete ev;
+
+		memset(&ev, 0, sizeof(ev));
+		memcpy(&ev.handle, cp, 2);
+		ev.page_num = cp[2];
+		ev.max_page_num = 0;
+		if (cp[2] == 0)
+			memcpy(ev.features, sim_features, sizeof(ev.features));
+		else
+			ev.status = HCI_INVALID_PARAMETERS;
+		sim_event(delay, EVT_READ_REMOTE_EXT_FEATURES_COMPLETE, &ev,
+				EVT_READ_REMOTE_EXT_FEATURES_COMPLETE_SIZE);
+		break;
+	}
+
+	case OCF_READ_REMOTE_VERSION: {
+		evt_read_remote_version_complete ev;
+
+		ev.status = 0;
+		memcpy(&ev.handle, cp, 2);
+		ev.lmp_ver = 0x06;
+		ev.manufacturer = htobs(0x05f1);
+		ev.lmp_subver = htobs(0x0001);
+		sim_event(delay, EVT_READ_REMOTE_VERSION_COMPLETE, &ev,
+				EVT_READ_REMOTE_VERSION_COMPLETE_SIZE);
+		break;
+	}
+	}
+}
+
+static void sim_link_ctl(uint16_t opcode, uint16_t ocf, uint8_t *cp, int plen)
+{
+	switch (ocf) {
+	case OCF_CREATE_CONN: {
+		create_conn_cp *ccp = (void *) cp;
+		evt_conn_complete cc;
+		struct sim_conn *c;
+
+		if (plen < CREATE_CONN_CP_SIZE)
+			break;
+
+		sim_cmd_status(opcode, 0);
+
+		memset(&cc, 0, sizeof(cc));
+		bacpy(&cc.bdaddr, &ccp->bdaddr);
+		cc.link_type = ACL_LINK;
+
+		c = sim_conn_find_ba(&ccp->bdaddr, ACL_LINK);
+		if (c)
+			cc.status = HCI_ACL_CONNECTION_EXISTS;
+		else if (!(c = sim_conn_add(&ccp->bdaddr, ACL_LINK)))
+			cc.status = HCI_REJECTED_LIMITED_RESOURCES;
+		else
+			cc.handle = htobs(c->handle);
+
+		/* EVT_CONN_COMPLETE_SIZE overstates the event by two bytes */
+		sim_event(sim.cfg.cmd_latency + sim.cfg.conn_latency,
+				EVT_CONN_COMPLETE, &cc, sizeof(cc));
+		return;
+	}
+
+	case OCF_DISCONNECT: {
+		disconnect_cp *dcp = (void *) cp;
+		struct sim_conn *c;
+
+		if (plen < DISCONNECT_CP_SIZE)
+			break;
+
+		c = sim_conn_find(btohs(dcp->handle));
+		if (!c) {
+			sim_cmd_status(opcode, HCI_NO_CONNECTION);
+			return;
+		}
+
+		sim_cmd_status(opcode, 0);
+		sim_disconn_complete(sim.cfg.cmd_latency + sim.cfg.conn_latency,
+					c, HCI_CONNECTION_TERMINATED);
+		return;
+	}
+
+	case OCF_REMOTE_NAME_REQ: {
+		remote_name_req_cp *rcp = (void *) cp;
+		evt_remote_name_req_complete rn;
+
+		if (plen < REMOTE_NAME_REQ_CP_SIZE)
+			break;
+
+		sim_cmd_status(opcode, 0);
+
+		memset(&rn, 0, sizeof(rn));
+		bacpy(&rn.bdaddr, &rcp->bdaddr);
+		snprintf((char *) rn.name, sizeof(rn.name), "hcisim-%02X%02X",
+					rcp->bdaddr.b[1], rcp->bdaddr.b[0]);
+
+		sim_event(sim.cfg.cmd_latency + sim.cfg.conn_latency,
+				EVT_REMOTE_NAME_REQ_COMPLETE, &rn,
+				EVT_REMOTE_NAME_REQ_COMPLETE_SIZE);
+		return;
+	}
+
+	case OCF_INQUIRY_CANCEL:
+		sim_status_complete(opcode, 0);
+		return;
+
+	case OCF_REMOTE_NAME_REQ_CANCEL: {
+		uint8_t rp[1 + 6];
+
+		if (plen < 6)
+			break;
+
+		rp[0] = 0;
+		memcpy(rp + 1, cp, 6);
+		sim_cmd_complete(opcode, rp, sizeof(rp));
+		return;
+	}
+
+	case OCF_INQUIRY: {
+		uint8_t buf[1 + INQUIRY_INFO_SIZE];
+		inquiry_info *info = (void *) (buf + 1);
+		uint8_t status = 0;
+		int i;
+
+		sim_cmd_status(opcode, 0);
+
+		for (i = 0; i < SIM_INQ_RESULTS; i++) {
+			memset(buf, 0, sizeof(buf));
+			buf[0] = 1;
+			info->bdaddr.b[0] = i;
+			info->bdaddr.b[3] = 0x5a;
+			info->bdaddr.b[4] = 0x5a;
+			info->bdaddr.b[5] = 0x5a;
+			info->pscan_rep_mode = 0x01;
+			info->dev_class[1] = 0x01;
+			info->clock_offset = htobs(0x8000 | i);
+
+			sim_event(sim.cfg.cmd_latency +
+					(i + 1) * sim.cfg.conn_latency,
+					EVT_INQUIRY_RESULT, buf, sizeof(buf));
+		}
+
+		sim_event(sim.cfg.cmd_latency +
+				(i + 1) * sim.cfg.conn_latency,
+				EVT_INQUIRY_COMPLETE, &status, 1);
+		return;
+	}
+
+	case OCF_READ_REMOTE_FEATURES:
+	case OCF_READ_REMOTE_EXT_FEATURES:
+	case OCF_READ_REMOTE_VERSION:
+		if (plen < 2)
+			break;
+
+		if (!sim_conn_find(bt_get_le16(cp))) {
+			sim_cmd_status(opcode, HCI_NO_CONNECTION);
+			return;
+		}
+
+		sim_cmd_status(opcode, 0);
+		sim_remote_info(ocf, cp);
+		return;
+	}
+
+	/* Anything else would owe an event we can't make up */
+	sim_cmd_status(opcode, HCI_UNKNOWN_COMMAND);
+}
+
+static void sim_host_ctl(uint16_t opcode, uint16_t ocf, uint8_t *cp, int plen)
+{
+	switch (ocf) {
+	case OCF_RESET:
+		memset(sim.conns, 0, sizeof(sim.conns));
+		sim.wl_num = 0;
+		sim.le_pending = 0;
+		sim.scanning = 0;
+		break;
+
+	case OCF_READ_LOCAL_NAME: {
+		read_local_name_rp rp;
+
+		rp.status = 0;
+		memcpy(rp.name, sim.name, sizeof(rp.name));
+		sim_cmd_complete(opcode, &rp, READ_LOCAL_NAME_RP_SIZE);
+		return;
+	}
+
+	case OCF_CHANGE_LOCAL_NAME:
+		if (plen >= HCI_MAX_NAME_LENGTH)
+			memcpy(sim.name, cp, sizeof(sim.name));
+		break;
+
+	case OCF_READ_TRANSMIT_POWER_LEVEL: {
+		read_transmit_power_level_cp *tcp = (void *) cp;
+		read_transmit_power_level_rp rp;
+
+		if (plen < READ_TRANSMIT_POWER_LEVEL_CP_SIZE)
+			break;
+
+		rp.status = sim_conn_find(btohs(tcp->handle)) ? 0 :
+							HCI_NO_CONNECTION;
+		rp.handle = tcp->handle;
+		rp.level = tcp->type ? 4 : 0;
+		sim_cmd_complete(opcode, &rp, READ_TRANSMIT_POWER_LEVEL_RP_SIZE);
+		return;
+	}
+	}
+
+	sim_status_complete(opcode, 0);
+}
+
+static void sim_info_param(uint16_t opcode, uint16_t ocf)
+{
+	switch (ocf) {
+	case OCF_READ_LOCAL_VERSION: {
+		read_local_version_rp rp;
+
+		rp.status = 0;
+		rp.hci_ver = 0x06;
+		rp.hci_rev = htobs(0x1000);
+		rp.lmp_ver = 0x06;
+		rp.manufacturer = htobs(0x05f1);
+		rp.lmp_subver = htobs(0x0001);
+		sim_cmd_complete(opcode, &rp, READ_LOCAL_VERSION_RP_SIZE);
+		return;
+	}
+
+	case OCF_READ_LOCAL_FEATURES: {
+		read_local_features_rp rp;
+
+		rp.status = 0;
+		memcpy(rp.features, sim_features, sizeof(rp.features));
+		sim_cmd_complete(opcode, &rp, READ_LOCAL_FEATURES_RP_SIZE);
+		return;
+	}
+
+	case OCF_READ_BD_ADDR: {
+		read_bd_addr_rp rp;
+
+		rp.status = 0;
+		bacpy(&rp.bdaddr, &sim.bdaddr);
+		sim_cmd_complete(opcode, &rp, READ_BD_ADDR_RP_SIZE);
+		return;
+	}
+	}
+
+	sim_status_complete(opcode, 0);
+}
+
+static void sim_status_param(uint16_t opcode, uint16_t ocf, uint8_t *cp,
+								int plen)
+{
+	uint8_t rp[4];
+	uint16_t handle;
+
+	if (plen < 2 || (ocf != OCF_READ_RSSI &&
+					ocf != OCF_READ_LINK_QUALITY)) {
+		sim_status_complete(opcode, 0);
+		return;
+	}
+
+	handle = bt_get_le16(cp);
+
+	rp[0] = sim_conn_find(handle) ? 0 : HCI_NO_CONNECTION;
+	bt_put_le16(handle, rp + 1);
+
+	if (ocf == OCF_READ_RSSI)
+		rp[3] = (uint8_t) -(int8_t) (sim_random() % 20);
+	else
+		rp[3] = 0xff - sim_random() % 16;
+
+	sim_cmd_complete(opcode, rp, sizeof(rp));
+}
+
+static void sim_le_ctl(uint16_t opcode, uint16_t ocf, uint8_t *cp, int plen)
+{
+	uint8_t status = 0;
+	int i;
+
+	switch (ocf) {
+	case OCF_LE_SET_SCAN_ENABLE:
+		if (plen < 1)
+			break;
+
+		if (cp[0] && !sim.scanning) {
+			sim.adv_next = sim_now() + sim.cfg.cmd_latency;
+			sim.step = 0;
+			sim.step_next = sim.adv_next;
+			memset(sim.dup_used, 0, sizeof(sim.dup_used));
+			sim.dup_num = 0;
+		}
+		sim.scanning = cp[0];
+		sim.filter_dup = plen > 1 && cp[1];
+		break;
+
+	case OCF_LE_READ_WHITE_LIST_SIZE: {
+		uint8_t rp[2] = { 0, SIM_MAX_WL };
+
+		sim_cmd_complete(opcode, rp, sizeof(rp));
+		return;
+	}
+
+	case OCF_LE_CLEAR_WHITE_LIST:
+		sim.wl_num = 0;
+		break;
+
+	case OCF_LE_ADD_DEVICE_TO_WHITE_LIST: {
+		le_add_device_to_white_list_cp *wcp = (void *) cp;
+
+		if (plen < LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE)
+			break;
+
+		for (i = 0; i < sim.wl_num; i++) {
+			if (sim.wl[i].type == wcp->bdaddr_type &&
+					!bacmp(&sim.wl[i].bdaddr, &wcp->bdaddr))
+				break;
+		}
+
+		if (i < sim.wl_num)
+			break;
+
+		if (sim.wl_num == SIM_MAX_WL) {
+			status = HCI_MEMORY_FULL;
+			break;
+		}
+
+		sim.wl[sim.wl_num].type = wcp->bdaddr_type;
+		bacpy(&sim.wl[sim.wl_num].bdaddr, &wcp->bdaddr);
+		sim.wl_num++;
+		break;
+	}
+
+	case OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST: {
+		le_remove_device_from_white_list_cp *wcp = (void *) cp;
+
+		if (plen < LE_REMOVE_DEVICE_FROM_WHITE_LIST_CP_SIZE)
+			break;
+
+		for (i = 0; i < sim.wl_num; i++) {
+			if (sim.wl[i].type == wcp->bdaddr_type &&
+					!bacmp(&sim.wl[i].bdaddr, &wcp->bdaddr))
+				break;
+		}
+
+		if (i == sim.wl_num) {
+			status = HCI_INVALID_PARAMETERS;
+			break;
+		}
+
+		sim.wl[i] = sim.wl[--sim.wl_num];
+		break;
+	}
+
+	case OCF_LE_CREATE_CONN:
+		if (plen < LE_CREATE_CONN_CP_SIZE)
+			break;
+
+		if (sim.le_pending) {
+			sim_cmd_status(opcode, HCI_COMMAND_DISALLOWED);
+			return;
+		}
+
+		memcpy(&sim.le_cp, cp, sizeof(sim.le_cp));
+		sim.le_pending = 1;
+
+		sim_cmd_status(opcode, 0);
+		sim_schedule(sim_now() + sim.cfg.cmd_latency +
+					sim.cfg.conn_latency,
+					SIM_TIMER_LE_CONN, 0, NULL, 0);
+		return;
+
+	case OCF_LE_CREATE_CONN_CANCEL:
+		if (!sim.le_pending) {
+			status = HCI_COMMAND_DISALLOWED;
+			break;
+		}
+
+		sim.le_pending = 0;
+		sim_status_complete(opcode, 0);
+		sim_le_conn_complete(sim.cfg.cmd_latency, HCI_NO_CONNECTION,
+								NULL, 0);
+		return;
+	}
+
+	sim_status_complete(opcode, status);
+}
+
+static void sim_command(const uint8_t *buf, int len)
+{
+	hci_command_hdr *hdr = (void *) (buf + 1);
+	uint8_t cp[255];
+	uint16_t opcode, ogf, ocf;
+	int plen;
+
+	if (len < 1 + HCI_COMMAND_HDR_SIZE || buf[0] != HCI_COMMAND_PKT)
+		return;
+
+	opcode = btohs(hdr->opcode);
+	ogf = cmd_opcode_ogf(opcode);
+	ocf = cmd_opcode_ocf(opcode);
+
+	/* Short parameters read as zeroes rather than past the packet */
+	plen = MIN(hdr->plen, len - 1 - HCI_COMMAND_HDR_SIZE);
+	memset(cp, 0, sizeof(cp));
+	memcpy(cp, buf + 1 + HCI_COMMAND_HDR_SIZE, plen);
+
+	sim.stats.commands++;
+	sim.outstanding++;
+
+	switch (ogf) {
+	case OGF_LINK_CTL:
+		sim_link_ctl(opcode, ocf, cp, plen);
+		break;
+	case OGF_HOST_CTL:
+		sim_host_ctl(opcode, ocf, cp, plen);
+		break;
+	case OGF_INFO_PARAM:
+		sim_info_param(opcode, ocf);
+		break;
+	case OGF_STATUS_PARAM:
+		sim_status_param(opcode, ocf, cp, plen);
+		break;
+	case OGF_LE_CTL:
+		sim_le_ctl(opcode, ocf, cp, plen);
+		break;
+	default:
+		/* Anything else is taken without complaint */
+		sim_status_complete(opcode, 0);
+		break;
+	}
+}
+
+static void sim_fire(struct sim_timer *t)
+{
+	unsigned int ncmd;
+
+	switch (t->kind) {
+	case SIM_TIMER_LE_CONN:
+		sim_le_connect();
+		return;
+
+	case SIM_TIMER_REPLY:
+		if (sim.outstanding > 0)
+			sim.outstanding--;
+
+		ncmd = sim.cfg.ncmd > sim.outstanding ?
+				sim.cfg.ncmd - sim.outstanding : 0;
+
+		/* Num_HCI_Command_Packets leads both replies but for status */
+		if (t->buf[1] == EVT_CMD_COMPLETE)
+			t->buf[3] = ncmd;
+		else
+			t->buf[4] = ncmd;
+		break;
+	}
+
+	sim_send(t->buf, t->len);
+}
+
+static int sim_adv_done(void)
+{
+	return sim.cfg.adv_count && sim.adv_generated >= sim.cfg.adv_count;
+}
+
+/* Like a controller's, the duplicate filter forgets everyone once full */
+static int sim_dup_seen(const bdaddr_t *ba)
+{
+	unsigned int h = 0, i;
+
+	if (!sim.filter_dup)
+		return 0;
+
+	for (i = 0; i < 6; i++)
+		h = h * 31 + ba->b[i];
+	h %= SIM_DUP_SIZE;
+
+	for (i = h; sim.dup_used[i]; i = (i + 1) % SIM_DUP_SIZE) {
+		if (!bacmp(&sim.dup[i], ba))
+			return 1;
+	}
+
+	if (sim.dup_num == SIM_DUP_SIZE / 2) {
+		memset(sim.dup_used, 0, sizeof(sim.dup_used));
+		sim.dup_num = 0;
+		i = h;
+	}
+
+	bacpy(&sim.dup[i], ba);
+	sim.dup_used[i] = 1;
+	sim.dup_num++;
+
+	return 0;
+}
+
+static void sim_adv_event(void)
+{
+	uint8_t buf[1 + HCI_EVENT_HDR_SIZE + 255];
+	uint8_t *p = buf + 1 + HCI_EVENT_HDR_SIZE;
+	unsigned int i, j, idx, num = 0, len = sim.cfg.adv_data_len;
+
+	*p++ = EVT_LE_ADVERTISING_REPORT;
+	*p++ = 0;
+
+	sim.adv_generated++;
+
+	for (i = 0; i < sim.cfg.adv_reports; i++) {
+		le_advertising_info *info = (void *) p;
+
+		idx = sim.adv_seq++ % sim.cfg.adv_devices;
+
+		info->evt_type = 0x00;
+		info->bdaddr_type = LE_RANDOM_ADDRESS;
+		info->bdaddr.b[0] = idx & 0xff;
+		info->bdaddr.b[1] = idx >> 8;
+		info->bdaddr.b[2] = idx >> 16;
+		info->bdaddr.b[3] = 0x5a;
+		info->bdaddr.b[4] = 0x5a;
+		info->bdaddr.b[5] = 0xc0;	/* static random */
+		info->length = len;
+
+		/* Flags, then manufacturer data with a random payload */
+		for (j = 0; j < len; j++)
+			info->data[j] = sim_random();
+		if (len >= 3) {
+			info->data[0] = 0x02;
+			info->data[1] = 0x01;
+			info->data[2] = 0x06;
+		}
+		if (len >= 7) {
+			info->data[3] = len - 4;
+			info->data[4] = 0xff;
+			info->data[5] = 0xff;
+			info->data[6] = 0xff;
+		}
+
+		info->data[len] = (uint8_t) (-30 - (int) (sim_random() % 60));
+
+		/* Filtered reports still draw from the generator */
+		if (sim_dup_seen(&info->bdaddr))
+			continue;
+
+		p += LE_ADVERTISING_INFO_SIZE + len + 1;
+		num++;
+	}
+
+	if (!num)
+		return;
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = EVT_LE_META_EVENT;
+	buf[2] = p - buf - 1 - HCI_EVENT_HDR_SIZE;
+	buf[4] = num;
+
+	sim.stats.adv_events++;
+	sim.stats.adv_reports += num;
+
+	sim_send(buf, p - buf);
+}
+
+static void sim_adv(uint64_t now)
+{
+	unsigned int i, sent = 0;
+
+	if (!sim.scanning || !sim.cfg.adv_interval)
+		return;
+
+	while (sim.adv_next <= now && sent < SIM_MAX_BURST) {
+		for (i = 0; i < sim.cfg.adv_burst; i++) {
+			if (sim_adv_done())
+				return;
+
+			sim_adv_event();
+			sent++;
+		}
+
+		sim.adv_next += sim.cfg.adv_interval;
+	}
+}
+
+static void sim_step_adv(const struct sim_step *step)
+{
+	uint8_t buf[1 + HCI_EVENT_HDR_SIZE + 2 + LE_ADVERTISING_INFO_SIZE +
+								31 + 1];
+	le_advertising_info *info = (void *) (buf + 5);
+
+	if (sim_dup_seen(&step->bdaddr))
+		return;
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = EVT_LE_META_EVENT;
+	buf[2] = 2 + LE_ADVERTISING_INFO_SIZE + step->len + 1;
+	buf[3] = EVT_LE_ADVERTISING_REPORT;
+	buf[4] = 1;
+
+	info->evt_type = 0x00;
+	info->bdaddr_type = (step->bdaddr.b[5] & 0xc0) ? LE_RANDOM_ADDRESS :
+							LE_PUBLIC_ADDRESS;
+	bacpy(&info->bdaddr, &step->bdaddr);
+	info->length = step->len;
+	memcpy(info->data, step->data, step->len);
+	info->data[step->len] = step->rssi;
+
+	sim.stats.adv_events++;
+	sim.stats.adv_reports++;
+
+	sim_send(buf, 3 + buf[2]);
+}
+
+static void sim_script(uint64_t now)
+{
+	const struct sim_step *step;
+	struct sim_conn *c;
+
+	if (!sim.scanning)
+		return;
+
+	while (sim.step < sim.num_steps && sim.step_next <= now) {
+		step = &sim.steps[sim.step++];
+
+		switch (step->type) {
+		case SIM_STEP_ADV:
+			sim_step_adv(step);
+			break;
+		case SIM_STEP_SLEEP:
+			sim.step_next = now + step->us;
+			break;
+		case SIM_STEP_DISCONNECT:
+			c = sim_conn_find(step->handle);
+			if (c)
+				sim_disconn_complete(0, c, step->reason);
+			break;
+		case SIM_STEP_LOOP:
+			sim.step = 0;
+			break;
+		}
+	}
+}
+
+/* Microseconds until the simulator has something to do, -1 for never */
+static int64_t sim_timeout(uint64_t now)
+{
+	uint64_t due = UINT64_MAX;
+
+	if (sim.timers)
+		due = sim.timers->due;
+
+	if (sim.scanning && sim.cfg.adv_interval && !sim_adv_done())
+		due = MIN(due, sim.adv_next);
+
+	if (sim.scanning && sim.step < sim.num_steps)
+		due = MIN(due, sim.step_next);
+
+	if (due == UINT64_MAX)
+		return -1;
+
+	return due > now ? (int64_t) (due - now) : 0;
+}
+
+static void sim_read(struct sim_sock *s)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE];
+	ssize_t len;
+
+	/* Commands beyond the credits wait in the socket, as in the kernel */
+	while (sim.outstanding < sim.cfg.ncmd) {
+		len = recv(s->sim_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len > 0) {
+			sim_command(buf, len);
+			continue;
+		}
+
+		/* The host closed its end without telling the shim */
+		if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+							errno != EINTR))
+			s->dead = 1;
+		break;
+	}
+}
+
+static void sim_reap(void)
+{
+	struct sim_sock *s, **p = &sim.socks;
+
+	while ((s = *p)) {
+		if (!s->dead) {
+			p = &s->next;
+			continue;
+		}
+
+		*p = s->next;
+		sim_close_fd(s->sim_fd);
+		free(s);
+	}
+}
+
+/* pfds has room for one more entry, for the timer */
+static void sim_poll(struct pollfd *pfds, int n, int64_t us)
+{
+#ifdef NEED_PPOLL
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+
+	/* poll() alone would round every wait up to a whole millisecond */
+	if (us > 0 && sim.timer >= 0 &&
+			syscall(SYS_timerfd_settime, sim.timer, 0, &its,
+							NULL) == 0) {
+		pfds[n].fd = sim.timer;
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		poll(pfds, n + 1, -1);
+		return;
+	}
+
+	poll(pfds, n, us < 0 ? -1 : (int) ((us + 999) / 1000));
+#else
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	ppoll(pfds, n, us < 0 ? NULL : &ts, NULL);
+#endif
+}
+
+static void *sim_run(void *data)
+{
+	struct pollfd pfds[SIM_MAX_POLL + 1];
+	struct sim_sock *s;
+	struct sim_timer *t;
+	uint64_t now;
+	int i, n;
+	char c;
+
+	pthread_mutex_lock(&sim.lock);
+
+	while (sim.running) {
+		sim_reap();
+
+		pfds[0].fd = sim.wake[0];
+		pfds[0].events = POLLIN;
+
+		for (n = 1, s = sim.socks; s && n < SIM_MAX_POLL; s = s->next) {
+			pfds[n].fd = s->sim_fd;
+			pfds[n].events = sim.outstanding < sim.cfg.ncmd ?
+								POLLIN : 0;
+			n++;
+		}
+
+		now = sim_now();
+
+		pthread_mutex_unlock(&sim.lock);
+		sim_poll(pfds, n, sim_timeout(now));
+		pthread_mutex_lock(&sim.lock);
+
+		if (pfds[0].revents & POLLIN) {
+			while (read(sim.wake[0], &c, 1) == 1)
+				;
+		}
+
+		/* Sockets may have come and gone while polling */
+		for (i = 1; i < n; i++) {
+			if (!pfds[i].revents)
+				continue;
+
+			for (s = sim.socks; s; s = s->next) {
+				if (s->sim_fd == pfds[i].fd && !s->dead)
+					break;
+			}
+
+			if (!s)
+				continue;
+
+			if (pfds[i].revents & (POLLHUP | POLLERR))
+				s->dead = 1;
+			else
+				sim_read(s);
+		}
+
+		now = sim_now();
+
+		while ((t = sim.timers) && t->due <= now) {
+			sim.timers = t->next;
+			sim_fire(t);
+			free(t);
+		}
+
+		sim_adv(now);
+		sim_script(now);
+	}
+
+	pthread_mutex_unlock(&sim.lock);
+
+	return NULL;
+}
+
+int hcisim_start(const struct hcisim_config *cfg)
+{
+	struct hcisim_config conf = *cfg;
+	int err;
+
+	if (sim_fix_config(&conf) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+
+	if (sim.running) {
+		pthread_mutex_unlock(&sim.lock);
+		errno = EALREADY;
+		return -1;
+	}
+
+	sim.cfg = conf;
+	memset(&sim.stats, 0, sizeof(sim.stats));
+	memset(sim.conns, 0, sizeof(sim.conns));
+	sim.next_handle = 0x0040;
+	sim.wl_num = 0;
+	sim.le_pending = 0;
+	sim.scanning = 0;
+	sim.outstanding = 0;
+	sim.rand = conf.seed;
+	sim.adv_seq = 0;
+	sim.adv_generated = 0;
+	str2ba("00:5E:AA:00:00:01", &sim.bdaddr);
+	memset(sim.name, 0, sizeof(sim.name));
+	strcpy(sim.name, "hcisim");
+
+	if (conf.script && sim_load_script(conf.script) < 0)
+		goto fail;
+
+	if (pipe(sim.wake) < 0)
+		goto fail;
+
+	fcntl(sim.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(sim.wake[1], F_SETFL, O_NONBLOCK);
+
+#ifdef NEED_PPOLL
+	/* Without one, waits fall back to whole milliseconds */
+	sim.timer = syscall(SYS_timerfd_create, CLOCK_MONOTONIC, 0);
+#endif
+
+	sim.running = 1;
+
+	err = pthread_create(&sim.thread, NULL, sim_run, NULL);
+	if (err) {
+		sim.running = 0;
+		sim_close_fd(sim.wake[0]);
+		sim_close_fd(sim.wake[1]);
+		sim.wake[0] = sim.wake[1] = -1;
+		if (sim.timer >= 0)
+			sim_close_fd(sim.timer);
+		sim.timer = -1;
+		errno = err;
+		goto fail;
+	}
+
+	pthread_mutex_unlock(&sim.lock);
+
+	return 0;
+
+fail:
+	err = errno;
+	free(sim.steps);
+	sim.steps = NULL;
+	sim.num_steps = 0;
+	pthread_mutex_unlock(&sim.lock);
+	errno = err;
+	return -1;
+}
+
+void hcisim_stop(void)
+{
+	struct sim_sock *s;
+	struct sim_timer *t;
+
+	pthread_mutex_lock(&sim.lock);
+
+	if (!sim.running) {
+		pthread_mutex_unlock(&sim.lock);
+		return;
+	}
+
+	sim.running = 0;
+	sim_wake();
+
+	pthread_mutex_unlock(&sim.lock);
+
+	pthread_join(sim.thread, NULL);
+
+	pthread_mutex_lock(&sim.lock);
+
+	/* Host ends stay open; reads on them now see end of file */
+	for (s = sim.socks; s; s = s->next)
+		s->dead = 1;
+	sim_reap();
+
+	while ((t = sim.timers)) {
+		sim.timers = t->next;
+		free(t);
+	}
+
+	sim_close_fd(sim.wake[0]);
+	sim_close_fd(sim.wake[1]);
+	sim.wake[0] = sim.wake[1] = -1;
+
+	if (sim.timer >= 0)
+		sim_close_fd(sim.timer);
+	sim.timer = -1;
+
+	free(sim.steps);
+	sim.steps = NULL;
+	sim.num_steps = 0;
+
+	pthread_mutex_unlock(&sim.lock);
+}
+
+void hcisim_get_stats(struct hcisim_stats *stats)
+{
+	pthread_mutex_lock(&sim.lock);
+	*stats = sim.stats;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+int hcisim_active(void)
+{
+	int running;
+
+	pthread_mutex_lock(&sim.lock);
+	running = sim.running;
+	pthread_mutex_unlock(&sim.lock);
+
+	return running;
+}
+
+/* Called with the lock held */
+static struct sim_sock *sim_sock_find(int fd)
+{
+	struct sim_sock *s;
+
+	for (s = sim.socks; s; s = s->next) {
+		if (s->host_fd == fd && !s->dead)
+			return s;
+	}
+
+	return NULL;
+}
+
+int hcisim_socket(void)
+{
+	struct sim_sock *s;
+	int sv[2];
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		free(s);
+		return -1;
+	}
+
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+	s->host_fd = sv[0];
+	s->sim_fd = sv[1];
+	s->dev = -1;
+
+	pthread_mutex_lock(&sim.lock);
+	s->next = sim.socks;
+	sim.socks = s;
+	sim_wake();
+	pthread_mutex_unlock(&sim.lock);
+
+	return sv[0];
+}
+
+int hcisim_owns(int fd)
+{
+	int owns;
+
+	pthread_mutex_lock(&sim.lock);
+	owns = sim_sock_find(fd) != NULL;
+	pthread_mutex_unlock(&sim.lock);
+
+	return owns;
+}
+
+int hcisim_bind(int fd, int dev_id)
+{
+	struct sim_sock *s;
+	int err = 0;
+
+	pthread_mutex_lock(&sim.lock);
+
+	s = sim_sock_find(fd);
+	if (!s)
+		err = EBADF;
+	else if (s->dev != -1)
+		err = EALREADY;
+	else if (dev_id != 0 && dev_id != HCI_DEV_NONE)
+		err = ENODEV;
+	else
+		s->dev = dev_id;
+
+	pthread_mutex_unlock(&sim.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int hcisim_getsockopt(int fd, int level, int name, void *val, socklen_t *len)
+{
+	struct sim_sock *s;
+	int err = 0, zero = 0;
+
+	pthread_mutex_lock(&sim.lock);
+
+	s = sim_sock_find(fd);
+	if (!s)
+		err = EBADF;
+	else if (level != SOL_HCI)
+		err = ENOPROTOOPT;
+	else if (name == HCI_FILTER) {
+		*len = MIN(*len, sizeof(s->filter));
+		memcpy(val, &s->filter, *len);
+	} else if (name == HCI_DATA_DIR || name == HCI_TIME_STAMP) {
+		*len = MIN(*len, sizeof(zero));
+		memcpy(val, &zero, *len);
+	} else
+		err = ENOPROTOOPT;
+
+	pthread_mutex_unlock(&sim.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int hcisim_setsockopt(int fd, int level, int name, const void *val,
+								socklen_t len)
+{
+	struct sim_sock *s;
+	int err = 0;
+
+	pthread_mutex_lock(&sim.lock);
+
+	s = sim_sock_find(fd);
+	if (!s)
+		err = EBADF;
+	else if (level != SOL_HCI)
+		err = ENOPROTOOPT;
+	else if (name == HCI_FILTER) {
+		memset(&s->filter, 0, sizeof(s->filter));
+		memcpy(&s->filter, val, MIN(len, sizeof(s->filter)));
+	} else if (name != HCI_DATA_DIR && name != HCI_TIME_STAMP)
+		err = ENOPROTOOPT;
+
+	pthread_mutex_unlock(&sim.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sim_dev_info(struct hci_dev_info *di)
+{
+	memset(di, 0, sizeof(*di));
+
+	di->dev_id = 0;
+	strcpy(di->name, "hci0");
+	bacpy(&di->bdaddr, &sim.bdaddr);
+	di->flags = (1 << HCI_UP) | (1 << HCI_RUNNING);
+	if (sim.scanning)
+		di->flags |= 1 << HCI_INQUIRY;
+	di->type = HCI_VIRTUAL;
+	di->acl_mtu = 1021;
+	di->acl_pkts = 8;
+	di->sco_mtu = 64;
+	di->sco_pkts = 1;
+}
+
+static int sim_conn_list(struct hci_conn_list_req *cl)
+{
+	int i, n = 0;
+
+	if (cl->dev_id != 0)
+		return ENODEV;
+
+	for (i = 0; i < SIM_MAX_CONN && n < cl->conn_num; i++) {
+		struct hci_conn_info *ci = &cl->conn_info[n];
+
+		if (!sim.conns[i].used)
+			continue;
+
+		memset(ci, 0, sizeof(*ci));
+		ci->handle = sim.conns[i].handle;
+		bacpy(&ci->bdaddr, &sim.conns[i].bdaddr);
+		ci->type = sim.conns[i].type;
+		ci->out = 1;
+		ci->state = 1;	/* BT_CONNECTED */
+		n++;
+	}
+
+	cl->conn_num = n;
+
+	return 0;
+}
+
+static int sim_inquiry(struct hci_inquiry_req *ir)
+{
+	inquiry_info *info = (void *) (ir + 1);
+	int i, num = ir->num_rsp ? ir->num_rsp : 255;
+
+	if (ir->dev_id != 0)
+		return ENODEV;
+
+	num = MIN(num, SIM_INQ_RESULTS);
+
+	for (i = 0; i < num; i++) {
+		memset(&info[i], 0, sizeof(info[i]));
+		info[i].bdaddr.b[0] = i;
+		info[i].bdaddr.b[3] = 0x5a;
+		info[i].bdaddr.b[4] = 0x5a;
+		info[i].bdaddr.b[5] = 0x5a;
+		info[i].pscan_rep_mode = 0x01;
+		info[i].dev_class[1] = 0x01;
+		info[i].clock_offset = htobs(0x8000 | i);
+	}
+
+	ir->num_rsp = num;
+
+	return 0;
+}
+
+int hcisim_ioctl(int fd, unsigned long req, void *arg)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&sim.lock);
+
+	if (!sim_sock_find(fd)) {
+		err = EBADF;
+		goto done;
+	}
+
+	switch (req) {
+	case HCIGETDEVLIST: {
+		struct hci_dev_list_req *dl = arg;
+
+		if (dl->dev_num < 1) {
+			err = EINVAL;
+			break;
+		}
+
+		dl->dev_num = 1;
+		dl->dev_req[0].dev_id = 0;
+		dl->dev_req[0].dev_opt = (1 << HCI_UP) | (1 << HCI_RUNNING);
+		break;
+	}
+
+	case HCIGETDEVINFO: {
+		struct hci_dev_info *di = arg;
+
+		if (di->dev_id != 0)
+			err = ENODEV;
+		else
+			sim_dev_info(di);
+		break;
+	}
+
+	case HCIGETCONNLIST:
+		err = sim_conn_list(arg);
+		break;
+
+	case HCIGETCONNINFO: {
+		struct hci_conn_info_req *cr = arg;
+		struct sim_conn *c;
+
+		c = sim_conn_find_ba(&cr->bdaddr, cr->type);
+		if (!c) {
+			err = ENOENT;
+			break;
+		}
+
+		memset(cr->conn_info, 0, sizeof(*cr->conn_info));
+		cr->conn_info->handle = c->handle;
+		bacpy(&cr->conn_info->bdaddr, &c->bdaddr);
+		cr->conn_info->type = c->type;
+		cr->conn_info->out = 1;
+		cr->conn_info->state = 1;
+		break;
+	}
+
+	case HCIINQUIRY:
+		err = sim_inquiry(arg);
+		break;
+
+	case HCIDEVUP:
+	case HCIDEVDOWN:
+	case HCIDEVRESET:
+	case HCIDEVRESTAT:
+	case HCISETSCAN:
+	case HCISETAUTH:
+	case HCISETENCRYPT:
+	case HCISETPTYPE:
+	case HCISETLINKPOL:
+	case HCISETLINKMODE:
+	case HCISETACLMTU:
+	case HCISETSCOMTU:
+	case HCISETRAW:
+		break;
+
+	default:
+		err = EINVAL;
+		break;
+	}
+
+done:
+	pthread_mutex_unlock(&sim.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+void hcisim_close(int fd)
+{
+	struct sim_sock *s;
+
+	pthread_mutex_lock(&sim.lock);
+
+	s = sim_sock_find(fd);
+	if (s) {
+		s->dead = 1;
+		sim_wake();
+	}
+
+	pthread_mutex_unlock(&sim.lock);
+}
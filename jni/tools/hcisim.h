@@ -0,0 +1,69 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __HCISIM_H
+#define __HCISIM_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct hcisim_config {
+	unsigned int cmd_latency;	/* us from command to its reply */
+	unsigned int ncmd;		/* commands the controller takes at once */
+	unsigned int conn_latency;	/* us from connect to its completion */
+	unsigned int adv_interval;	/* us between advertising events, 0 off */
+	unsigned int adv_burst;		/* events per interval */
+	unsigned int adv_reports;	/* reports per event */
+	unsigned int adv_devices;	/* distinct advertisers */
+	unsigned int adv_data_len;	/* bytes of advertising data */
+	unsigned long adv_count;	/* events before the storm ends, 0 never */
+	unsigned int seed;
+	const char *script;
+};
+
+struct hcisim_stats {
+	unsigned long commands;
+	unsigned long events;
+	unsigned long adv_events;
+	unsigned long adv_reports;
+	unsigned long dropped;
+	unsigned long connections;
+};
+
+void hcisim_config_init(struct hcisim_config *cfg);
+int hcisim_config_parse(struct hcisim_config *cfg, const char *str);
+
+int hcisim_start(const struct hcisim_config *cfg);
+void hcisim_stop(void);
+void hcisim_get_stats(struct hcisim_stats *stats);
+
+/* Entry points for the shim standing in for the kernel's HCI sockets */
+int hcisim_active(void);
+int hcisim_socket(void);
+int hcisim_owns(int fd);
+int hcisim_bind(int fd, int dev_id);
+int hcisim_getsockopt(int fd, int level, int name, void *val, socklen_t *len);
+int hcisim_setsockopt(int fd, int level, int name, const void *val,
+							socklen_t len);
+int hcisim_ioctl(int fd, unsigned long req, void *arg);
+void hcisim_close(int fd);
+
+#endif /* __HCISIM_H */
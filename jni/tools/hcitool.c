@@ -35,10 +35,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -46,6 +53,8 @@
 
 #include "textfile.h"
 #include "oui.h"
+#include "lescan.h"
+#include "rpa.h"
 
 /* Unofficial value, might still change */
 #define LE_LINK		0x03
@@ -65,6 +74,10 @@
 #define EIR_NAME_COMPLETE           0x09  /* complete local name */
 #define EIR_TX_POWER                0x0A  /* transmit power level */
 #define EIR_DEVICE_ID               0x10  /* device ID */
+#define EIR_SVC_DATA16              0x16  /* 16-bit UUID service data */
+#define EIR_SVC_DATA32              0x20  /* 32-bit UUID service data */
+#define EIR_SVC_DATA128             0x21  /* 128-bit UUID service data */
+#define EIR_MANUFACTURER            0xFF  /* manufacturer specific data */
 
 #define for_each_opt(opt, long, short) while ((opt=getopt_long(argc, argv, short ? short:"+", long, NULL)) != -1)
 
@@ -72,6 +85,18 @@ static volatile int signal_received = 0;
 
 static void usage(void);
 
+/* In batch mode every command shares the descriptor opened up front */
+static int batch_dd = -1;
+static int batch_dev_id = -1;
+
+static int open_dev(int dev_id)
+{
+    if (batch_dd >= 0 && dev_id == batch_dev_id)
+        return batch_dd;
+
+    return hci_open_dev(dev_id);
+}
+
 static int dev_info(int s, int dev_id, long arg)
 {
     struct hci_dev_info di = { .dev_id = dev_id };
@@ -547,29 +572,568 @@ static struct option scan_options[] = {
     { "oui",	0, 0, 'O' },
     { "all",	0, 0, 'A' },
     { "ext",	0, 0, 'A' },
+    { "names",	1, 0, 'N' },
+    { "name-timeout",	1, 0, 'T' },
     { 0, 0, 0, 0 }
 };
 
 static const char *scan_help =
     "Usage:\n"
-    "\tscan [--length=N] [--numrsp=N] [--iac=lap] [--flush] [--class] [--info] [--oui] [--refresh]\n";
+    "\tscan [--length=N] [--numrsp=N] [--iac=lap] [--flush] [--class] [--info] [--oui] [--refresh]\n"
+    "\t     [--names=N] [--name-timeout=ms]\n"
+    "\n"
+    "\tWithout --class, --info or --oui up to --names remote names (4)\n"
+    "\tare requested at once as devices respond, each cancelled after\n"
+    "\t--name-timeout ms (10000), and stored in the name cache. Names\n"
+    "\tthe controller won't page for during the inquiry wait for its end.\n";
 
-static void cmd_scan(int dev_id, int argc, char **argv)
+/*
+ * Remote name resolution queue. Names are requested through a command
+ * channel so several pages run at once, each with the page scan mode and
+ * clock offset its inquiry response reported. The controller says how
+ * many it takes: a rejected request goes back to the queue and lowers the
+ * limit. Requests that overrun their deadline are cancelled.
+ *
+ * The queue starts while the inquiry is still running. Many controllers
+ * page in the gaps between inquiry trains, others refuse until the
+ * inquiry is over; after the first refusal the rest waits for its end.
+ */
+static uint64_t now_us(void);
+static void sigint_handler(int sig);
+
+enum {
+    NAME_QUEUED,
+    NAME_PENDING,
+    NAME_CANCELLING,
+    NAME_DONE,
+};
+
+struct name_req {
+    struct name_req *next;
+    struct name_queue *queue;
+    bdaddr_t bdaddr;
+    uint8_t pscan_rep_mode;
+    uint16_t clock_offset;
+    int state;
+    int tries;
+    unsigned int id;
+    uint64_t deadline;
+    uint64_t retry_at;
+    char name[249];
+};
+
+struct name_queue {
+    struct hci_cmd_chan *chan;
+    struct name_req *reqs;
+    struct name_req **tail;
+    int inflight;
+    int limit;
+    int timeout;
+    int resolved;
+    int failed;
+    int inquiring;
+    int deferred;
+};
+
+static int name_queue_add(struct name_queue *q, const bdaddr_t *bdaddr,
+                uint8_t pscan_rep_mode, uint16_t clock_offset)
+{
+    struct name_req *req;
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return -1;
+
+    req->queue = q;
+    bacpy(&req->bdaddr, bdaddr);
+    req->pscan_rep_mode = pscan_rep_mode;
+    req->clock_offset = clock_offset;
+
+    *q->tail = req;
+    q->tail = &req->next;
+
+    return 0;
+}
+
+static void name_print(struct name_req *req)
+{
+    char addr[18];
+
+    ba2str(&req->bdaddr, addr);
+    printf("\t%s\t%s\n", addr, req->name[0] ? req->name : "n/a");
+    fflush(stdout);
+}
+
+static void name_complete(int err, void *rparam, int rlen, void *user_data)
+{
+    struct name_req *req = user_data;
+    struct name_queue *q = req->queue;
+    evt_remote_name_req_complete *rn = rparam;
+    int n;
+
+    req->id = 0;
+    q->inflight--;
+
+    if (err == -EIO && req->state == NAME_PENDING) {
+        /* Rejected while inquiring: try again once the inquiry is over */
+        if (q->inquiring) {
+            q->deferred = 1;
+            req->state = NAME_QUEUED;
+            return;
+        }
+
+        /* Rejected, most likely busy paging the others */
+        if (q->inflight > 0) {
+            q->limit = q->inflight;
+            req->state = NAME_QUEUED;
+            return;
+        }
+
+        if (++req->tries < 3) {
+            req->retry_at = now_us() + req->tries * 100000;
+            req->state = NAME_QUEUED;
+            return;
+        }
+    }
+
+    req->state = NAME_DONE;
+
+    if (err || rlen < EVT_REMOTE_NAME_REQ_COMPLETE_SIZE || rn->status) {
+        q->failed++;
+        name_print(req);
+        return;
+    }
+
+    memcpy(req->name, rn->name, 248);
+    req->name[248] = '\0';
+
+    for (n = 0; n < 248 && req->name[n]; n++) {
+        if ((unsigned char) req->name[n] < 32 || req->name[n] == 127)
+            req->name[n] = '.';
+    }
+
+    q->resolved++;
+    name_print(req);
+}
+
+static void name_submit(struct name_queue *q, struct name_req *req)
+{
+    remote_name_req_cp cp;
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.bdaddr, &req->bdaddr);
+    cp.pscan_rep_mode = req->pscan_rep_mode;
+    cp.clock_offset = req->clock_offset | htobs(0x8000);
+
+    req->id = hci_cmd_chan_submit(q->chan, OGF_LINK_CTL,
+                OCF_REMOTE_NAME_REQ, EVT_REMOTE_NAME_REQ_COMPLETE,
+                &cp, REMOTE_NAME_REQ_CP_SIZE, name_complete, req);
+    if (!req->id) {
+        req->state = NAME_DONE;
+        q->failed++;
+        name_print(req);
+        return;
+    }
+
+    req->state = NAME_PENDING;
+    req->deadline = now_us() + q->timeout * 1000ULL;
+    q->inflight++;
+}
+
+static void name_cancel(struct name_queue *q, struct name_req *req, int dd)
+{
+    /* The completion, with an error status, follows the cancel */
+    req->state = NAME_CANCELLING;
+    req->deadline = now_us() + 2000000;
+
+    if (hci_read_remote_name_cancel(dd, &req->bdaddr, 1000) < 0)
+        req->deadline = 0;
+}
+
+/*
+ * Start what fits, cancel what is overdue. Returns the number of ms until
+ * something needs doing again, or -1 once every request is done.
+ */
+static int name_queue_run(struct name_queue *q, int dd, int stop)
+{
+    struct name_req *req;
+    uint64_t now = now_us(), next = now + 1000000;
+    int busy = 0;
+
+    for (req = q->reqs; req; req = req->next) {
+        switch (req->state) {
+        case NAME_QUEUED:
+            if (stop) {
+                req->state = NAME_DONE;
+                name_print(req);
+                break;
+            }
+
+            if (q->inflight >= q->limit || req->retry_at > now ||
+                        (q->inquiring && q->deferred)) {
+                if (req->retry_at > now && req->retry_at < next)
+                    next = req->retry_at;
+                busy = 1;
+                break;
+            }
+
+            name_submit(q, req);
+            if (req->state == NAME_PENDING)
+                busy = 1;
+            break;
+
+        case NAME_PENDING:
+            if (stop || now >= req->deadline)
+                name_cancel(q, req, dd);
+            /* The cancel may have completed it already */
+            if (req->state != NAME_DONE)
+                busy = 1;
+            break;
+
+        case NAME_CANCELLING:
+            if (now >= req->deadline) {
+                /* No completion ever came, give up on it */
+                hci_cmd_chan_cancel(q->chan, req->id);
+                req->id = 0;
+                req->state = NAME_DONE;
+                q->inflight--;
+                q->failed++;
+                name_print(req);
+                break;
+            }
+            busy = 1;
+            break;
+        }
+
+        if (req->state == NAME_PENDING || req->state == NAME_CANCELLING)
+            if (req->deadline < next)
+                next = req->deadline;
+    }
+
+    if (!busy)
+        return -1;
+
+    return next > now ? (next - now) / 1000 + 1 : 0;
+}
+
+/* Take the replies that came in so far and start what fits, if anything */
+static void name_queue_poll(struct name_queue *q, int dd)
+{
+    if (hci_cmd_chan_process(q->chan) < 0)
+        return;
+
+    name_queue_run(q, dd, 0);
+}
+
+static void name_queue_resolve(struct name_queue *q, int dd)
+{
+    int stopped = 0, left;
+
+    while ((left = name_queue_run(q, dd, stopped)) >= 0) {
+        struct pollfd p;
+
+        if (signal_received && !stopped) {
+            stopped = 1;
+            continue;
+        }
+
+        p.fd = dd;
+        p.events = POLLIN;
+
+        if (poll(&p, 1, left) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (hci_cmd_chan_process(q->chan) < 0) {
+            perror("Read failed");
+            break;
+        }
+    }
+}
+
+/* One locked rewrite of the cache for all names of the scan */
+static void name_queue_store(struct name_queue *q, const bdaddr_t *local)
+{
+    char filename[PATH_MAX + 1], addr[18];
+    const char **keys, **values;
+    char (*addrs)[18];
+    struct name_req *req;
+    int n = 0;
+
+    if (!q->resolved)
+        return;
+
+    keys = calloc(q->resolved, sizeof(*keys));
+    values = calloc(q->resolved, sizeof(*values));
+    addrs = calloc(q->resolved, sizeof(*addrs));
+    if (!keys || !values || !addrs)
+        goto done;
+
+    for (req = q->reqs; req && n < q->resolved; req = req->next) {
+        if (!req->name[0])
+            continue;
+
+        ba2str(&req->bdaddr, addrs[n]);
+        keys[n] = addrs[n];
+        values[n] = req->name;
+        n++;
+    }
+
+    ba2str(local, addr);
+    create_name(filename, PATH_MAX, STORAGEDIR, addr, "names");
+
+    if (create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0 ||
+            textfile_put_batch(filename, n, keys, values) < 0)
+        fprintf(stderr, "Can't update name cache %s: %s\n", filename,
+                            strerror(errno));
+
+done:
+    free(keys);
+    free(values);
+    free(addrs);
+}
+
+static void name_queue_free(struct name_queue *q)
+{
+    while (q->reqs) {
+        struct name_req *req = q->reqs;
+
+        q->reqs = req->next;
+        free(req);
+    }
+}
+
+struct scan_ctx {
+    int dd;
+    struct hci_dev_info di;
+    int refresh, extcls, extinf, extoui;
+    bdaddr_t *seen;
+    int num_seen;
+    int size_seen;
+    struct name_queue names;
+};
+
+static void scan_device(struct scan_ctx *ctx, inquiry_info *info)
 {
-    inquiry_info *info = NULL;
-    uint8_t lap[3] = { 0x33, 0x8b, 0x9e };
-    int num_rsp, length, flags;
     uint8_t cls[3], features[8];
     char addr[18], name[249], oui[9], *comp, *tmp;
     struct hci_version version;
-    struct hci_dev_info di;
     struct hci_conn_info_req *cr;
-    int refresh = 0, extcls = 0, extinf = 0, extoui = 0;
-    int i, n, l, opt, dd, cc, nc;
+    uint16_t handle = 0;
+    int n, cc, nc;
+
+
+    if (!ctx->refresh) {
+        memset(name, 0, sizeof(name));
+        tmp = get_device_name(&ctx->di.bdaddr, &info->bdaddr);
+        if (tmp) {
+            strncpy(name, tmp, 249);
+            free(tmp);
+            nc = 1;
+        } else
+            nc = 0;
+    } else
+        nc = 0;
+
+    ba2str(&info->bdaddr, addr);
+    printf("BD Address:\t%s [mode %d, clkoffset 0x%4.4x]\n", addr,
+        info->pscan_rep_mode, btohs(info->clock_offset));
+
+    if (ctx->extoui) {
+        ba2oui(&info->bdaddr, oui);
+        comp = ouitocomp(oui);
+        if (comp) {
+            printf("OUI company:\t%s (%s)\n", comp, oui);
+            free(comp);
+        }
+    }
+
+    cc = 0;
+
+    if (ctx->extinf) {
+        cr = malloc(sizeof(*cr) + sizeof(struct hci_conn_info));
+        if (cr) {
+            bacpy(&cr->bdaddr, &info->bdaddr);
+            cr->type = ACL_LINK;
+            if (ioctl(ctx->dd, HCIGETCONNINFO, (unsigned long) cr) < 0) {
+                handle = 0;
+                cc = 1;
+            } else {
+                handle = htobs(cr->conn_info->handle);
+                cc = 0;
+            }
+            free(cr);
+        }
+
+        if (cc) {
+            if (hci_create_connection(ctx->dd, &info->bdaddr,
+                    htobs(ctx->di.pkt_type & ACL_PTYPE_MASK),
+                    info->clock_offset | 0x8000,
+                    0x01, &handle, 25000) < 0) {
+                handle = 0;
+                cc = 0;
+            }
+        }
+    }
+
+    if (handle > 0 || !nc) {
+        if (hci_read_remote_name_with_clock_offset(ctx->dd,
+                &info->bdaddr,
+                info->pscan_rep_mode,
+                info->clock_offset | 0x8000,
+                sizeof(name), name, 100000) < 0) {
+            if (!nc)
+                strcpy(name, "n/a");
+        } else {
+            for (n = 0; n < 248 && name[n]; n++) {
+                if ((unsigned char) name[n] < 32 || name[n] == 127)
+                    name[n] = '.';
+            }
+
+            name[248] = '\0';
+            nc = 0;
+        }
+    }
+
+    if (strlen(name) > 0)
+        printf("Device name:\t%s%s\n", name, nc ? " [cached]" : "");
+
+    if (ctx->extcls) {
+        memcpy(cls, info->dev_class, 3);
+        printf("Device class:\t");
+        if ((cls[1] & 0x1f) > sizeof(major_classes) / sizeof(char *))
+            printf("Invalid");
+        else
+            printf("%s, %s", major_classes[cls[1] & 0x1f],
+                get_minor_device_name(cls[1] & 0x1f, cls[0] >> 2));
+        printf(" (0x%2.2x%2.2x%2.2x)\n", cls[2], cls[1], cls[0]);
+    }
+
+    if (ctx->extinf && handle > 0) {
+        if (hci_read_remote_version(ctx->dd, handle, &version, 20000) == 0) {
+            char *ver = lmp_vertostr(version.lmp_ver);
+            printf("Manufacturer:\t%s (%d)\n",
+                bt_compidtostr(version.manufacturer),
+                version.manufacturer);
+            printf("LMP version:\t%s (0x%x) [subver 0x%x]\n",
+                ver ? ver : "n/a",
+                version.lmp_ver, version.lmp_subver);
+            if (ver)
+                bt_free(ver);
+        }
+
+        if (hci_read_remote_features(ctx->dd, handle, features, 20000) == 0) {
+            char *tmp = lmp_featurestostr(features, "\t\t", 63);
+            printf("LMP features:\t0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x"
+                " 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x\n",
+                features[0], features[1],
+                features[2], features[3],
+                features[4], features[5],
+                features[6], features[7]);
+            printf("%s\n", tmp);
+            bt_free(tmp);
+        }
+
+        if (cc) {
+            usleep(10000);
+            hci_disconnect(ctx->dd, handle, HCI_OE_USER_ENDED_CONNECTION, 10000);
+        }
+    }
+
+    printf("\n");
+}
+
+/* Inquiry reports a device once per response, the kernel did the merging */
+static int scan_seen(struct scan_ctx *ctx, const bdaddr_t *bdaddr)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_seen; i++)
+        if (!bacmp(&ctx->seen[i], bdaddr))
+            return 1;
+
+    if (ctx->num_seen == ctx->size_seen) {
+        int size = ctx->size_seen ? ctx->size_seen * 2 : 32;
+        bdaddr_t *seen = realloc(ctx->seen, size * sizeof(*seen));
+
+        if (!seen)
+            return 0;
+
+        ctx->seen = seen;
+        ctx->size_seen = size;
+    }
+
+    bacpy(&ctx->seen[ctx->num_seen++], bdaddr);
+
+    return 0;
+}
+
+/* Cached names print right away, the others wait for the name queue */
+static void scan_name(struct scan_ctx *ctx, const struct hci_inquiry_result *res)
+{
+    char addr[18], *name = NULL;
+
+    if (!ctx->refresh)
+        name = get_device_name(&ctx->di.bdaddr, &res->bdaddr);
+
+    if (!name && name_queue_add(&ctx->names, &res->bdaddr,
+                res->pscan_rep_mode, res->clock_offset) == 0)
+        return;
+
+    ba2str(&res->bdaddr, addr);
+    printf("\t%s\t%s\n", addr, name ? name : "n/a");
+    fflush(stdout);
+
+    free(name);
+}
+
+static int scan_result(const struct hci_inquiry_result *res, void *user_data)
+{
+    struct scan_ctx *ctx = user_data;
+    inquiry_info info;
+
+    if (!res || scan_seen(ctx, &res->bdaddr)) {
+        name_queue_poll(&ctx->names, ctx->dd);
+        return signal_received;
+    }
+
+    if (!ctx->extcls && !ctx->extinf && !ctx->extoui) {
+        scan_name(ctx, res);
+        name_queue_poll(&ctx->names, ctx->dd);
+        return signal_received;
+    }
+
+    memset(&info, 0, sizeof(info));
+    bacpy(&info.bdaddr, &res->bdaddr);
+    info.pscan_rep_mode = res->pscan_rep_mode;
+    info.pscan_period_mode = res->pscan_period_mode;
+    memcpy(info.dev_class, res->dev_class, 3);
+    info.clock_offset = res->clock_offset;
+
+    scan_device(ctx, &info);
+    fflush(stdout);
+
+    return signal_received;
+}
+
+static void cmd_scan(int dev_id, int argc, char **argv)
+{
+    uint8_t lap[3] = { 0x33, 0x8b, 0x9e };
+    int num_rsp, length;
+    struct scan_ctx ctx;
+    struct sigaction sa;
+    int l, opt, idd;
 
     length  = 8;	/* ~10 seconds */
     num_rsp = 0;
-    flags   = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.names.tail = &ctx.names.reqs;
+    ctx.names.limit = 4;
+    ctx.names.timeout = 10000;
 
     for_each_opt(opt, scan_options, NULL) {
         switch (opt) {
@@ -597,29 +1161,46 @@ static void cmd_scan(int dev_id, int argc, char **argv)
             break;
 
         case 'f':
-            flags |= IREQ_CACHE_FLUSH;
+            /* Responses come straight from the controller, not the
+             * kernel's inquiry cache, so there is nothing to flush */
             break;
 
         case 'r':
-            refresh = 1;
+            ctx.refresh = 1;
             break;
 
         case 'C':
-            extcls = 1;
+            ctx.extcls = 1;
             break;
 
         case 'I':
-            extinf = 1;
+            ctx.extinf = 1;
             break;
 
         case 'O':
-            extoui = 1;
+            ctx.extoui = 1;
             break;
 
         case 'A':
-            extcls = 1;
-            extinf = 1;
-            extoui = 1;
+            ctx.extcls = 1;
+            ctx.extinf = 1;
+            ctx.extoui = 1;
+            break;
+
+        case 'N':
+            ctx.names.limit = atoi(optarg);
+            if (ctx.names.limit < 1) {
+                printf("Invalid number of names %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'T':
+            ctx.names.timeout = atoi(optarg);
+            if (ctx.names.timeout < 1) {
+                printf("Invalid name timeout %s\n", optarg);
+                exit(1);
+            }
             break;
 
         default:
@@ -637,181 +1218,62 @@ static void cmd_scan(int dev_id, int argc, char **argv)
         }
     }
 
-    if (hci_devinfo(dev_id, &di) < 0) {
+    if (hci_devinfo(dev_id, &ctx.di) < 0) {
         perror("Can't get device info");
         exit(1);
     }
 
-    printf("Scanning ...\n");
-    num_rsp = hci_inquiry(dev_id, length, num_rsp, lap, &info, flags);
-    if (num_rsp < 0) {
-        perror("Inquiry failed");
+    /*
+     * Responses queue up on their own socket while names and versions
+     * are requested on the other, whose filter changes with every
+     * request.
+     */
+    idd = hci_open_dev(dev_id);
+    ctx.dd = open_dev(dev_id);
+    if (idd < 0 || ctx.dd < 0) {
+        perror("HCI device open failed");
         exit(1);
     }
 
-    dd = hci_open_dev(dev_id);
-    if (dd < 0) {
-        perror("HCI device open failed");
-        free(info);
+    ctx.names.chan = hci_cmd_chan_new(ctx.dd);
+    if (!ctx.names.chan) {
+        perror("Can't attach command channel");
         exit(1);
     }
 
-    if (extcls || extinf || extoui)
-        printf("\n");
+    /* Interrupts the inquiry, then the name requests still pending */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
 
-    for (i = 0; i < num_rsp; i++) {
-        uint16_t handle = 0;
-
-        if (!refresh) {
-            memset(name, 0, sizeof(name));
-            tmp = get_device_name(&di.bdaddr, &(info+i)->bdaddr);
-            if (tmp) {
-                strncpy(name, tmp, 249);
-                free(tmp);
-                nc = 1;
-            } else
-                nc = 0;
-        } else
-            nc = 0;
+    printf("Scanning ...\n");
 
-        if (!extcls && !extinf && !extoui) {
-            ba2str(&(info+i)->bdaddr, addr);
+    if (ctx.extcls || ctx.extinf || ctx.extoui)
+        printf("\n");
 
-            if (nc) {
-                printf("\t%s\t%s\n", addr, name);
-                continue;
-            }
+    fflush(stdout);
 
-            if (hci_read_remote_name_with_clock_offset(dd,
-                    &(info+i)->bdaddr,
-                    (info+i)->pscan_rep_mode,
-                    (info+i)->clock_offset | 0x8000,
-                    sizeof(name), name, 100000) < 0)
-                strcpy(name, "n/a");
+    ctx.names.inquiring = 1;
 
-            for (n = 0; n < 248 && name[n]; n++) {
-                if ((unsigned char) name[i] < 32 || name[i] == 127)
-                    name[i] = '.';
-            }
+    if (hci_inquiry_stream(idd, length, num_rsp, lap, scan_result,
+                                &ctx) < 0) {
+        perror("Inquiry failed");
+        exit(1);
+    }
 
-            name[248] = '\0';
+    ctx.names.inquiring = 0;
 
-            printf("\t%s\t%s\n", addr, name);
-            continue;
-        }
+    name_queue_resolve(&ctx.names, ctx.dd);
+    name_queue_store(&ctx.names, &ctx.di.bdaddr);
+    name_queue_free(&ctx.names);
+    hci_cmd_chan_free(ctx.names.chan);
 
-        ba2str(&(info+i)->bdaddr, addr);
-        printf("BD Address:\t%s [mode %d, clkoffset 0x%4.4x]\n", addr,
-            (info+i)->pscan_rep_mode, btohs((info+i)->clock_offset));
-
-        if (extoui) {
-            ba2oui(&(info+i)->bdaddr, oui);
-            comp = ouitocomp(oui);
-            if (comp) {
-                printf("OUI company:\t%s (%s)\n", comp, oui);
-                free(comp);
-            }
-        }
+    free(ctx.seen);
 
-        cc = 0;
-
-        if (extinf) {
-            cr = malloc(sizeof(*cr) + sizeof(struct hci_conn_info));
-            if (cr) {
-                bacpy(&cr->bdaddr, &(info+i)->bdaddr);
-                cr->type = ACL_LINK;
-                if (ioctl(dd, HCIGETCONNINFO, (unsigned long) cr) < 0) {
-                    handle = 0;
-                    cc = 1;
-                } else {
-                    handle = htobs(cr->conn_info->handle);
-                    cc = 0;
-                }
-                free(cr);
-            }
-
-            if (cc) {
-                if (hci_create_connection(dd, &(info+i)->bdaddr,
-                        htobs(di.pkt_type & ACL_PTYPE_MASK),
-                        (info+i)->clock_offset | 0x8000,
-                        0x01, &handle, 25000) < 0) {
-                    handle = 0;
-                    cc = 0;
-                }
-            }
-        }
-
-        if (handle > 0 || !nc) {
-            if (hci_read_remote_name_with_clock_offset(dd,
-                    &(info+i)->bdaddr,
-                    (info+i)->pscan_rep_mode,
-                    (info+i)->clock_offset | 0x8000,
-                    sizeof(name), name, 100000) < 0) {
-                if (!nc)
-                    strcpy(name, "n/a");
-            } else {
-                for (n = 0; n < 248 && name[n]; n++) {
-                    if ((unsigned char) name[i] < 32 || name[i] == 127)
-                        name[i] = '.';
-                }
-
-                name[248] = '\0';
-                nc = 0;
-            }
-        }
-
-        if (strlen(name) > 0)
-            printf("Device name:\t%s%s\n", name, nc ? " [cached]" : "");
-
-        if (extcls) {
-            memcpy(cls, (info+i)->dev_class, 3);
-            printf("Device class:\t");
-            if ((cls[1] & 0x1f) > sizeof(major_classes) / sizeof(char *))
-                printf("Invalid");
-            else
-                printf("%s, %s", major_classes[cls[1] & 0x1f],
-                    get_minor_device_name(cls[1] & 0x1f, cls[0] >> 2));
-            printf(" (0x%2.2x%2.2x%2.2x)\n", cls[2], cls[1], cls[0]);
-        }
-
-        if (extinf && handle > 0) {
-            if (hci_read_remote_version(dd, handle, &version, 20000) == 0) {
-                char *ver = lmp_vertostr(version.lmp_ver);
-                printf("Manufacturer:\t%s (%d)\n",
-                    bt_compidtostr(version.manufacturer),
-                    version.manufacturer);
-                printf("LMP version:\t%s (0x%x) [subver 0x%x]\n",
-                    ver ? ver : "n/a",
-                    version.lmp_ver, version.lmp_subver);
-                if (ver)
-                    bt_free(ver);
-            }
-
-            if (hci_read_remote_features(dd, handle, features, 20000) == 0) {
-                char *tmp = lmp_featurestostr(features, "\t\t", 63);
-                printf("LMP features:\t0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x"
-                    " 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x\n",
-                    features[0], features[1],
-                    features[2], features[3],
-                    features[4], features[5],
-                    features[6], features[7]);
-                printf("%s\n", tmp);
-                bt_free(tmp);
-            }
-
-            if (cc) {
-                usleep(10000);
-                hci_disconnect(dd, handle, HCI_OE_USER_ENDED_CONNECTION, 10000);
-            }
-        }
-
-        printf("\n");
-    }
-
-    bt_free(info);
-
-    hci_close_dev(dd);
-}
+    hci_close_dev(idd);
+    hci_close_dev(ctx.dd);
+}
 
 /* Remote name */
 
@@ -849,7 +1311,7 @@ static void cmd_name(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -912,7 +1374,7 @@ static void cmd_info(int dev_id, int argc, char **argv)
 
     printf("Requesting information ...\n");
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1005,22 +1467,55 @@ static void cmd_info(int dev_id, int argc, char **argv)
 
 static struct option spinq_options[] = {
     { "help",	0, 0, 'h' },
+    { "watch",	0, 0, 'w' },
     { 0, 0, 0, 0 }
 };
 
 static const char *spinq_help =
     "Usage:\n"
-    "\tspinq\n";
+    "\tspinq [--watch]\n"
+    "\n"
+    "\t--watch: print responses as they arrive and exit periodic\n"
+    "\t         inquiry on Ctrl-C\n";
+
+static void sigint_handler(int sig);
+
+static int spinq_result(const struct hci_inquiry_result *res, void *user_data)
+{
+    unsigned int *periods = user_data;
+    char addr[18];
+
+    if (!res) {
+        printf("Inquiry period %u complete\n", ++(*periods));
+        fflush(stdout);
+        return signal_received;
+    }
+
+    ba2str(&res->bdaddr, addr);
+    printf("\t%s\tclass 0x%2.2x%2.2x%2.2x", addr, res->dev_class[2],
+                    res->dev_class[1], res->dev_class[0]);
+
+    if (res->rssi != HCI_INQUIRY_NO_RSSI)
+        printf("\trssi %d", res->rssi);
+
+    printf("\n");
+    fflush(stdout);
+
+    return signal_received;
+}
 
 static void cmd_spinq(int dev_id, int argc, char **argv)
 {
     uint8_t lap[3] = { 0x33, 0x8b, 0x9e };
     struct hci_request rq;
     periodic_inquiry_cp cp;
-    int opt, dd;
+    int opt, dd, watch = 0;
 
     for_each_opt(opt, spinq_options, NULL) {
         switch (opt) {
+        case 'w':
+            watch = 1;
+            break;
         default:
             printf("%s", spinq_help);
             return;
@@ -1031,12 +1526,34 @@ static void cmd_spinq(int dev_id, int argc, char **argv)
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Device open failed");
         exit(EXIT_FAILURE);
     }
 
+    if (watch) {
+        unsigned int periods = 0;
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_flags = SA_NOCLDSTOP;
+        sa.sa_handler = sigint_handler;
+        sigaction(SIGINT, &sa, NULL);
+
+        printf("Periodic inquiry, press Ctrl-C to stop\n");
+        fflush(stdout);
+
+        if (hci_periodic_inquiry_stream(dd, 16, 10, 8, 0, lap,
+                        spinq_result, &periods) < 0) {
+            perror("Periodic inquiry failed");
+            exit(EXIT_FAILURE);
+        }
+
+        hci_close_dev(dd);
+        return;
+    }
+
     memset(&cp, 0, sizeof(cp));
     memcpy(cp.lap, lap, 3);
     cp.max_period = htobs(16);
@@ -1085,7 +1602,7 @@ static void cmd_epinq(int dev_id, int argc, char **argv)
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Device open failed");
         exit(EXIT_FAILURE);
@@ -1145,7 +1662,7 @@ static void cmd_cmd(int dev_id, int argc, char **argv)
     for (i = 2, len = 0; i < argc && len < (int) sizeof(buf); i++, len++)
         *ptr++ = (uint8_t) strtol(argv[i], NULL, 16);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Device open failed");
         exit(EXIT_FAILURE);
@@ -1267,7 +1784,7 @@ static void cmd_cc(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1318,7 +1835,7 @@ static void cmd_dc(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1393,7 +1910,7 @@ static void cmd_sr(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1444,7 +1961,7 @@ static void cmd_rssi(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1512,7 +2029,7 @@ static void cmd_lq(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1582,7 +2099,7 @@ static void cmd_tpl(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1652,7 +2169,7 @@ static void cmd_afh(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1733,7 +2250,7 @@ static void cmd_cpt(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1811,7 +2328,7 @@ static void cmd_lp(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1904,7 +2421,7 @@ static void cmd_lst(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -1988,7 +2505,7 @@ static void cmd_auth(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -2054,7 +2571,7 @@ static void cmd_enc(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -2121,7 +2638,7 @@ static void cmd_key(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -2187,7 +2704,7 @@ static void cmd_clkoff(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -2263,7 +2780,7 @@ static void cmd_clock(int dev_id, int argc, char **argv)
         }
     }
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("HCI device open failed");
         exit(1);
@@ -2306,61 +2823,303 @@ static void cmd_clock(int dev_id, int argc, char **argv)
     hci_close_dev(dd);
 }
 
-static int read_flags(uint8_t *flags, const uint8_t *data, size_t size)
+/*
+ * Advertising data is at most 31 bytes, so every list below is sized
+ * for the largest number of entries that can fit in a single report.
+ */
+#define AD_MAX_UUID16   15
+#define AD_MAX_UUID32   7
+#define AD_MAX_UUID128  1
+
+struct ad_record {
+    uint8_t flags;
+    int has_flags;
+    char name[HCI_MAX_EIR_LENGTH + 1];
+    uint8_t name_type;
+    uint16_t uuid16[AD_MAX_UUID16];
+    int num_uuid16;
+    uint32_t uuid32[AD_MAX_UUID32];
+    int num_uuid32;
+    uint8_t uuid128[AD_MAX_UUID128][16];
+    int num_uuid128;
+    int8_t tx_power;
+    int has_tx_power;
+    uint16_t mfg_id;
+    const uint8_t *mfg_data;
+    uint8_t mfg_len;
+    int has_mfg;
+    const uint8_t *svc_data;
+    uint8_t svc_data_len;
+};
+
+/*
+ * Filters applied while the advertising data is parsed. A 16 or 32-bit
+ * UUID, or a 128-bit one built on the Bluetooth Base UUID, is kept as
+ * short_uuid so it matches whatever width the advertiser used.
+ */
+struct ad_filter {
+    uint8_t procedure;
+    int uuid_set;
+    int uuid_is_short;
+    uint32_t short_uuid;
+    uint8_t uuid128[16];
+    int mfg_set;
+    uint16_t mfg_id;
+    uint8_t mfg_prefix[HCI_MAX_EIR_LENGTH];
+    size_t mfg_prefix_len;
+    const char *name_prefix;
+    size_t name_prefix_len;
+};
+
+/* Bluetooth Base UUID, little endian, without the leading 32 bits */
+static const uint8_t base_uuid_le[12] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00
+};
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int parse_filter_uuid(struct ad_filter *f, const char *str)
+{
+    uint8_t be[16];
+    int i, n = 0, hi = -1;
+
+    if (!strncasecmp(str, "0x", 2))
+        str += 2;
+
+    if (strlen(str) <= 8) {
+        char *end;
+
+        f->short_uuid = strtoul(str, &end, 16);
+        if (*str == '\0' || *end != '\0')
+            return -EINVAL;
+
+        f->uuid_set = 1;
+        f->uuid_is_short = 1;
+        return 0;
+    }
+
+    for (; *str; str++) {
+        int v;
+
+        if (*str == '-')
+            continue;
+
+        v = hex_nibble(*str);
+        if (v < 0 || n == 16)
+            return -EINVAL;
+
+        if (hi < 0) {
+            hi = v;
+            continue;
+        }
+
+        be[n++] = (hi << 4) | v;
+        hi = -1;
+    }
+
+    if (n != 16 || hi >= 0)
+        return -EINVAL;
+
+    for (i = 0; i < 16; i++)
+        f->uuid128[i] = be[15 - i];
+
+    f->uuid_set = 1;
+
+    if (!memcmp(f->uuid128, base_uuid_le, sizeof(base_uuid_le))) {
+        f->uuid_is_short = 1;
+        f->short_uuid = f->uuid128[12] | f->uuid128[13] << 8 |
+                        f->uuid128[14] << 16 | (uint32_t) f->uuid128[15] << 24;
+    }
+
+    return 0;
+}
+
+static int parse_filter_mfg(struct ad_filter *f, const char *str)
 {
-    size_t offset;
+    char *end;
+    int hi;
 
-    if (!flags || !data)
+    f->mfg_id = strtoul(str, &end, 0);
+    if (end == str || (*end != '\0' && *end != ':'))
         return -EINVAL;
 
-    offset = 0;
+    f->mfg_set = 1;
+    f->mfg_prefix_len = 0;
+
+    if (*end == '\0')
+        return 0;
+
+    /* Optional payload prefix in hex, following the company ID */
+    for (str = end + 1; *str; str += 2) {
+        hi = hex_nibble(str[0]);
+        if (hi < 0 || hex_nibble(str[1]) < 0 ||
+                f->mfg_prefix_len == sizeof(f->mfg_prefix))
+            return -EINVAL;
+
+        f->mfg_prefix[f->mfg_prefix_len++] = hi << 4 | hex_nibble(str[1]);
+    }
+
+    return 0;
+}
+
+static int ad_match_uuid128(const struct ad_filter *f, const uint8_t *u)
+{
+    if (!f->uuid_is_short)
+        return !memcmp(u, f->uuid128, 16);
+
+    return !memcmp(u, base_uuid_le, sizeof(base_uuid_le)) &&
+        (u[12] | u[13] << 8 | u[14] << 16 | (uint32_t) u[15] << 24) ==
+                                                        f->short_uuid;
+}
+
+/*
+ * Parse all AD structures of a report in a single pass. Filters are
+ * evaluated as fields go by, and a report is rejected as soon as one of
+ * them can no longer match. Returns 1 if the report passes.
+ */
+static int parse_ad(const uint8_t *data, uint8_t size,
+                    const struct ad_filter *f, struct ad_record *rec)
+{
+    int uuid_ok = !f || !f->uuid_set;
+    int mfg_ok = !f || !f->mfg_set;
+    int name_ok = !f || !f->name_prefix;
+    size_t offset = 0;
+
+    rec->has_flags = 0;
+    rec->name[0] = '\0';
+    rec->name_type = 0;
+    rec->num_uuid16 = rec->num_uuid32 = rec->num_uuid128 = 0;
+    rec->has_tx_power = 0;
+    rec->has_mfg = 0;
+    rec->svc_data = NULL;
+    rec->svc_data_len = 0;
+
     while (offset < size) {
         uint8_t len = data[offset];
-        uint8_t type;
+        const uint8_t *val;
+        uint8_t vlen, type;
+        int i;
 
         /* Check if it is the end of the significant part */
         if (len == 0)
             break;
 
-        if (len + offset > size)
+        if (offset + 1 + len > size)
             break;
 
         type = data[offset + 1];
+        val = &data[offset + 2];
+        vlen = len - 1;
+        offset += 1 + len;
 
-        if (type == FLAGS_AD_TYPE) {
-            *flags = data[offset + 2];
-            return 0;
+        switch (type) {
+        case EIR_FLAGS:
+            if (vlen < 1)
+                break;
+            rec->flags = val[0];
+            rec->has_flags = 1;
+            break;
+        case EIR_UUID16_SOME:
+        case EIR_UUID16_ALL:
+            for (i = 0; i + 2 <= vlen &&
+                        rec->num_uuid16 < AD_MAX_UUID16; i += 2) {
+                uint16_t u = bt_get_le16(&val[i]);
+
+                rec->uuid16[rec->num_uuid16++] = u;
+                if (!uuid_ok && f->uuid_is_short && u == f->short_uuid)
+                    uuid_ok = 1;
+            }
+            break;
+        case EIR_UUID32_SOME:
+        case EIR_UUID32_ALL:
+            for (i = 0; i + 4 <= vlen &&
+                        rec->num_uuid32 < AD_MAX_UUID32; i += 4) {
+                uint32_t u = bt_get_le32(&val[i]);
+
+                rec->uuid32[rec->num_uuid32++] = u;
+                if (!uuid_ok && f->uuid_is_short && u == f->short_uuid)
+                    uuid_ok = 1;
+            }
+            break;
+        case EIR_UUID128_SOME:
+        case EIR_UUID128_ALL:
+            for (i = 0; i + 16 <= vlen &&
+                        rec->num_uuid128 < AD_MAX_UUID128; i += 16) {
+                memcpy(rec->uuid128[rec->num_uuid128++], &val[i], 16);
+                if (!uuid_ok && ad_match_uuid128(f, &val[i]))
+                    uuid_ok = 1;
+            }
+            break;
+        case EIR_NAME_SHORT:
+        case EIR_NAME_COMPLETE:
+            /* A complete name wins over a shortened one */
+            if (rec->name_type == EIR_NAME_COMPLETE)
+                break;
+            if (vlen > sizeof(rec->name) - 1)
+                vlen = sizeof(rec->name) - 1;
+            memcpy(rec->name, val, vlen);
+            rec->name[vlen] = '\0';
+            rec->name_type = type;
+            if (!name_ok && vlen >= f->name_prefix_len &&
+                    !memcmp(val, f->name_prefix, f->name_prefix_len))
+                name_ok = 1;
+            break;
+        case EIR_TX_POWER:
+            if (vlen < 1)
+                break;
+            rec->tx_power = (int8_t) val[0];
+            rec->has_tx_power = 1;
+            break;
+        case EIR_SVC_DATA16:
+        case EIR_SVC_DATA32:
+        case EIR_SVC_DATA128:
+            rec->svc_data = val;
+            rec->svc_data_len = vlen;
+            break;
+        case EIR_MANUFACTURER:
+            if (vlen < 2)
+                break;
+            rec->mfg_id = bt_get_le16(val);
+            rec->mfg_data = &val[2];
+            rec->mfg_len = vlen - 2;
+            rec->has_mfg = 1;
+            if (mfg_ok)
+                break;
+            /* Only one manufacturer field is expected, decide now */
+            if (rec->mfg_id != f->mfg_id || rec->mfg_len <
+                        f->mfg_prefix_len || memcmp(rec->mfg_data,
+                        f->mfg_prefix, f->mfg_prefix_len))
+                return 0;
+            mfg_ok = 1;
+            break;
         }
-
-        offset += 1 + len;
     }
 
-    return -ENOENT;
-}
-
-static int check_report_filter(uint8_t procedure, le_advertising_info *info)
-{
-    uint8_t flags;
+    if (!uuid_ok || !mfg_ok || !name_ok)
+        return 0;
 
     /* If no discovery procedure is set, all reports are treat as valid */
-    if (procedure == 0)
+    if (!f || f->procedure == 0)
         return 1;
 
-    /* Read flags AD type value from the advertising report if it exists */
-    if (read_flags(&flags, info->data, info->length))
+    if (!rec->has_flags)
         return 0;
 
-    switch (procedure) {
+    switch (f->procedure) {
     case 'l': /* Limited Discovery Procedure */
-        if (flags & FLAGS_LIMITED_MODE_BIT)
-            return 1;
-        break;
+        return !!(rec->flags & FLAGS_LIMITED_MODE_BIT);
     case 'g': /* General Discovery Procedure */
-        if (flags & (FLAGS_LIMITED_MODE_BIT | FLAGS_GENERAL_MODE_BIT))
-            return 1;
-        break;
-    default:
-        fprintf(stderr, "Unknown discovery procedure\n");
+        return !!(rec->flags & (FLAGS_LIMITED_MODE_BIT |
+                                FLAGS_GENERAL_MODE_BIT));
     }
 
     return 0;
@@ -2371,506 +3130,3455 @@ static void sigint_handler(int sig)
     signal_received = sig;
 }
 
-static void eir_parse_name(uint8_t *eir, size_t eir_len,
-                        char *buf, size_t buf_len)
+/* An LE Advertising Report event carries at most 0x19 reports */
+#define LE_MAX_REPORTS 0x19
+
+struct report_stats {
+    unsigned long hci_events;
+    unsigned long syscalls;
+    uint64_t elapsed;
+    unsigned long events;
+    unsigned long reports;
+    unsigned long truncated;
+    unsigned long per_event[LE_MAX_REPORTS + 1];
+};
+
+static void print_report_stats(const struct report_stats *st)
 {
-    size_t offset;
+    double secs = st->elapsed / 1000.0;
+    int i;
 
-    offset = 0;
-    while (offset < eir_len) {
-        uint8_t field_len = eir[0];
-        size_t name_len;
+    if (st->hci_events && secs > 0)
+        fprintf(stderr, "%lu HCI events in %lu reads over %.1f s "
+                "(%.0f events/s, %.0f reads/s)\n", st->hci_events,
+                st->syscalls, secs, st->hci_events / secs,
+                st->syscalls / secs);
 
-        /* Check for the end of EIR */
-        if (field_len == 0)
-            break;
+    if (st->events == 0)
+        return;
 
-        if (offset + field_len > eir_len)
-            goto failed;
+    fprintf(stderr, "%lu advertising events, %lu reports "
+            "(%.2f reports/event, %lu truncated)\n", st->events,
+            st->reports, (double) st->reports / st->events, st->truncated);
 
-        switch (eir[1]) {
-        case EIR_NAME_SHORT:
-        case EIR_NAME_COMPLETE:
-            name_len = field_len - 1;
-            if (name_len > buf_len)
-                goto failed;
+    fprintf(stderr, "Reports per event:");
+    for (i = 1; i <= LE_MAX_REPORTS; i++)
+        if (st->per_event[i])
+            fprintf(stderr, " %d:%lu", i, st->per_event[i]);
+    fprintf(stderr, "\n");
+}
 
-            memcpy(buf, &eir[2], name_len);
-            return;
-        }
+static uint64_t now_us(void)
+{
+    struct timespec ts;
 
-        offset += field_len + 1;
-        eir += field_len + 1;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-failed:
-    snprintf(buf, buf_len, "(unknown)");
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static int print_advertising_devices(int dd, uint8_t filter_type, int count,
-                                     uint8_t time)
+static uint64_t now_ms(void)
 {
-    unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-    struct hci_filter nf, of;
-    struct sigaction sa;
-    socklen_t olen;
-    int len;
-    int c = 0;
+    return now_us() / 1000;
+}
 
-    olen = sizeof(of);
-    if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-        printf("Could not get socket options\n");
-        return -1;
-    }
+/*
+ * Scan output. Reports are formatted straight into one large buffer that
+ * is written out when the next report would not fit or when the oldest
+ * buffered report is older than the flush interval, so a slow consumer
+ * costs one write() per buffer instead of one per report.
+ */
+enum {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_BINARY,
+};
+
+/* Longest formatted report: 255 bytes of AD as hex plus an escaped name */
+#define OUTPUT_RECORD_MAX 4096
+
+struct scan_output {
+    int fd;
+    int format;
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+    unsigned int flush_interval;
+    uint64_t first;
+    int failed;
+    struct lescan_ring *ring;
+};
+
+struct scan_report {
+    uint64_t timestamp;
+    const bdaddr_t *bdaddr;
+    uint8_t bdaddr_type;
+    uint8_t evt_type;
+    int8_t rssi;
+    const uint8_t *data;
+    uint8_t data_len;
+    const char *name;
+    const bdaddr_t *identity;
+    uint8_t identity_type;
+    uint32_t packets;
+    int8_t rssi_min;
+    int8_t rssi_avg;
+    int8_t rssi_max;
+};
+
+static int output_open(struct scan_output *out, int format,
+                       const char *path, size_t size,
+                       unsigned int flush_interval)
+{
+    memset(out, 0, sizeof(*out));
+
+    out->fd = STDOUT_FILENO;
+    out->format = format;
+    out->flush_interval = flush_interval;
+    out->size = MAX(size, OUTPUT_RECORD_MAX);
+
+    if (path) {
+        struct sockaddr_un addr;
 
-    hci_filter_clear(&nf);
-    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        out->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (out->fd < 0)
+            return -1;
+
+        if (connect(out->fd, (struct sockaddr *) &addr,
+                                    sizeof(addr)) < 0) {
+            close(out->fd);
+            return -1;
+        }
+
+        /* A consumer going away shows up as a write error instead */
+        signal(SIGPIPE, SIG_IGN);
+    }
 
-    if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-        printf("Could not set socket options\n");
+    out->buf = malloc(out->size);
+    if (!out->buf) {
+        if (out->fd != STDOUT_FILENO)
+            close(out->fd);
         return -1;
     }
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_flags = SA_NOCLDSTOP;
-    sa.sa_handler = sigint_handler;
-    sigaction(SIGINT, &sa, NULL);
+    /* Anything printed through stdio so far goes first */
+    fflush(stdout);
 
-    if ( time > 0 ) {
-        memset(&sa, 0, sizeof(sa));
-        sa.sa_flags = SA_NOCLDSTOP;
-        sa.sa_handler = sigint_handler;
-        sigaction(SIGALRM, &sa, NULL);
-        alarm(time);
-    }
+    return 0;
+}
 
-    while (count == -1 || c < count) {
-        evt_le_meta_event *meta;
-        le_advertising_info *info;
-        char addr[18];
+static int output_flush(struct scan_output *out)
+{
+    size_t off = 0;
 
-        c++;
-        while ((len = read(dd, buf, sizeof(buf))) < 0) {
-            if (errno == EINTR && (signal_received == SIGINT || 
-                                   signal_received == SIGALRM)) {
-                len = 0;
-                goto done;
-            }
+    while (off < out->len && !out->failed) {
+        ssize_t n = write(out->fd, out->buf + off, out->len - off);
 
-            if (errno == EAGAIN || errno == EINTR)
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
                 continue;
-            goto done;
+
+            perror("Could not write scan output");
+            out->failed = 1;
+            break;
         }
 
-        ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-        len -= (1 + HCI_EVENT_HDR_SIZE);
+        off += n;
+    }
 
-        meta = (void *) ptr;
+    out->len = 0;
 
-        if (meta->subevent != 0x02)
-            goto done;
+    return out->failed ? -1 : 0;
+}
 
-        /* Ignoring multiple reports */
-        info = (le_advertising_info *) (meta->data + 1);
-        if (check_report_filter(filter_type, info)) {
-            char name[30];
+static void output_close(struct scan_output *out)
+{
+    output_flush(out);
 
-            memset(name, 0, sizeof(name));
+    if (out->fd != STDOUT_FILENO)
+        close(out->fd);
 
-            ba2str(&info->bdaddr, addr);
-            eir_parse_name(info->data, info->length,
-                            name, sizeof(name) - 1);
+    lescan_ring_close(out->ring);
 
-            printf("%s %s\n", addr, name);
-        }
-    }
+    free(out->buf);
+}
 
-done:
-    setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+/* Milliseconds until buffered output is due, -1 if nothing is buffered */
+static int output_timeout(struct scan_output *out)
+{
+    uint64_t now;
 
-    if (len < 0)
+    if (out->len == 0)
         return -1;
 
-    return 0;
+    now = now_ms();
+    if (now - out->first >= out->flush_interval)
+        return 0;
+
+    return out->first + out->flush_interval - now;
 }
 
-static struct option lescan_options[] = {
-    { "help",	0, 0, 'h' },
-    { "privacy",	0, 0, 'p' },
-    { "passive",	0, 0, 'P' },
-    { "whitelist",	0, 0, 'w' },
-    { "discovery",	1, 0, 'd' },
-    { "duplicates",	0, 0, 'D' },
-    { "count",      1, 0, 'c' },
-    { "time",       1, 0, 't' },
-    { 0, 0, 0, 0 }
-};
+static size_t format_text(const struct scan_report *r, char *buf,
+                          size_t size)
+{
+    char addr[18];
+    size_t n;
 
-static const char *lescan_help =
-    "Usage:\n"
-    "\tlescan [--privacy] enable privacy\n"
-    "\tlescan [--passive] set scan type passive (default active)\n"
-    "\tlescan [--whitelist] scan for address in the whitelist only\n"
-    "\tlescan [--discovery=g|l] enable general or limited discovery"
-        "procedure\n"
-    "\tlescan [--duplicates] don't filter duplicates\n"
-    "\tlescan [--time=<value>] how long to scan\n"
-    "\tlescam [--count=<value>] how many results to show\n";
+    ba2str(r->bdaddr, addr);
 
-static void cmd_lescan(int dev_id, int argc, char **argv)
+    /* Reports flushed from the duplicate cache have no name column */
+    if (r->data)
+        n = snprintf(buf, size, "%s %s", addr,
+                     r->name ? r->name : "(unknown)");
+    else
+        n = snprintf(buf, size, "%s", addr);
+
+    if (r->packets)
+        n += snprintf(buf + n, size - n, " rssi %d/%d/%d packets %u",
+                      r->rssi_min, r->rssi_avg, r->rssi_max, r->packets);
+
+    if (r->identity) {
+        ba2str(r->identity, addr);
+        n += snprintf(buf + n, size - n, " id %s", addr);
+    }
+
+    n += snprintf(buf + n, size - n, "\n");
+
+    return n;
+}
+
+static size_t format_json(const struct scan_report *r, char *buf,
+                          size_t size)
 {
-    int err, opt, dd;
-    uint8_t own_type = 0x00;
-    uint8_t scan_type = 0x01;
-    uint8_t filter_type = 0;
-    uint8_t filter_policy = 0x00;
-    uint16_t interval = htobs(0x0010);
-    uint16_t window = htobs(0x0010);
-    uint8_t filter_dup = 1;
-    int count = -1;
-    uint8_t time = -1;
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *c;
+    char addr[18];
+    size_t n;
+    int i;
 
-    for_each_opt(opt, lescan_options, NULL) {
-        switch (opt) {
-        case 'p':
-            own_type = 0x01; /* Random */
+    ba2str(r->bdaddr, addr);
+
+    n = snprintf(buf, size, "{\"ts\":%llu.%06llu,\"addr\":\"%s\","
+                 "\"addr_type\":\"%s\",\"rssi\":%d",
+                 (unsigned long long) (r->timestamp / 1000000),
+                 (unsigned long long) (r->timestamp % 1000000), addr,
+                 r->bdaddr_type == LE_RANDOM_ADDRESS ? "random" : "public",
+                 r->rssi);
+
+    if (r->evt_type != LESCAN_EVT_UNKNOWN)
+        n += snprintf(buf + n, size - n, ",\"evt_type\":%u", r->evt_type);
+
+    if (r->packets)
+        n += snprintf(buf + n, size - n, ",\"packets\":%u,"
+                      "\"rssi_min\":%d,\"rssi_avg\":%d,\"rssi_max\":%d",
+                      r->packets, r->rssi_min, r->rssi_avg, r->rssi_max);
+
+    if (r->identity) {
+        ba2str(r->identity, addr);
+        n += snprintf(buf + n, size - n, ",\"identity\":\"%s\","
+                      "\"identity_type\":\"%s\"", addr,
+                      r->identity_type == LE_RANDOM_ADDRESS ?
+                                                "random" : "public");
+    }
+
+    if (r->name) {
+        n += snprintf(buf + n, size - n, ",\"name\":\"");
+
+        for (c = (const unsigned char *) r->name; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                buf[n++] = '\\';
+                buf[n++] = *c;
+            } else if (*c < 0x20) {
+                n += snprintf(buf + n, size - n, "\\u%04x", *c);
+            } else
+                buf[n++] = *c;
+        }
+
+        buf[n++] = '"';
+    }
+
+    if (r->data) {
+        n += snprintf(buf + n, size - n, ",\"data\":\"");
+
+        for (i = 0; i < r->data_len; i++) {
+            buf[n++] = hex[r->data[i] >> 4];
+            buf[n++] = hex[r->data[i] & 0x0f];
+        }
+
+        buf[n++] = '"';
+    }
+
+    n += snprintf(buf + n, size - n, "}\n");
+
+    return n;
+}
+
+static size_t format_binary(const struct scan_report *r, uint8_t *buf)
+{
+    struct lescan_record *rec = (void *) buf;
+    size_t n = LESCAN_RECORD_SIZE + r->data_len;
+
+    bt_put_le16(n, &rec->len);
+    rec->evt_type = r->evt_type;
+    rec->bdaddr_type = r->bdaddr_type;
+    bt_put_le64(r->timestamp, &rec->timestamp);
+    bacpy(&rec->bdaddr, r->bdaddr);
+    rec->rssi = r->rssi;
+
+    if (r->packets) {
+        rec->rssi_min = r->rssi_min;
+        rec->rssi_avg = r->rssi_avg;
+        rec->rssi_max = r->rssi_max;
+        bt_put_le16(MIN(r->packets, 0xffff), &rec->packets);
+    } else {
+        rec->rssi_min = rec->rssi_avg = rec->rssi_max = r->rssi;
+        bt_put_le16(1, &rec->packets);
+    }
+
+    rec->data_len = r->data_len;
+    if (r->data_len)
+        memcpy(rec->data, r->data, r->data_len);
+
+    return n;
+}
+
+static void output_report(struct scan_output *out,
+                          const struct scan_report *r)
+{
+    uint8_t *buf;
+    size_t n;
+
+    if (out->ring) {
+        uint8_t rec[LESCAN_RECORD_MAX];
+
+        format_binary(r, rec);
+        lescan_ring_publish(out->ring, (struct lescan_record *) rec);
+    }
+
+    if (out->failed)
+        return;
+
+    if (out->size - out->len < OUTPUT_RECORD_MAX &&
+                                    output_flush(out) < 0)
+        return;
+
+    buf = out->buf + out->len;
+
+    switch (out->format) {
+    case OUTPUT_JSON:
+        n = format_json(r, (char *) buf, OUTPUT_RECORD_MAX);
+        break;
+    case OUTPUT_BINARY:
+        n = format_binary(r, buf);
+        break;
+    default:
+        n = format_text(r, (char *) buf, OUTPUT_RECORD_MAX);
+        break;
+    }
+
+    if (out->len == 0)
+        out->first = now_ms();
+
+    out->len += n;
+
+    if (output_timeout(out) == 0)
+        output_flush(out);
+}
+
+/*
+ * Userspace duplicate suppression for lescan.
+ *
+ * Devices are keyed by address, address type and a hash of the
+ * advertising payload. Slots form an open addressing table with linear
+ * probing that index into a fixed pool of entries; the pool is kept in
+ * LRU order so the least recently heard device is evicted when full.
+ * Between two reports of the same key only RSSI statistics are kept.
+ */
+struct adv_entry {
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+    uint32_t payload_hash;
+    uint64_t last_report;
+    uint32_t packets;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    int32_t rssi_sum;
+    int slot;
+    int prev;
+    int next;
+};
+
+struct adv_cache {
+    struct adv_entry *pool;
+    int *slots;
+    unsigned int size;
+    unsigned int mask;
+    unsigned int used;
+    int lru_head;
+    int lru_tail;
+    unsigned int interval;
+    unsigned long evictions;
+};
+
+static uint32_t adv_payload_hash(const uint8_t *data, uint8_t len)
+{
+    uint32_t hash = 2166136261u;
+    uint8_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static unsigned int adv_key_hash(const bdaddr_t *ba, uint8_t type,
+                                 uint32_t payload_hash)
+{
+    uint32_t hash = payload_hash ^ type;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        hash ^= ba->b[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int adv_cache_init(struct adv_cache *cache, unsigned int size,
+                          unsigned int interval)
+{
+    unsigned int nslots = 2;
+
+    /* Keep the table at most half full */
+    while (nslots < size * 2)
+        nslots <<= 1;
+
+    memset(cache, 0, sizeof(*cache));
+
+    cache->pool = calloc(size, sizeof(*cache->pool));
+    cache->slots = malloc(nslots * sizeof(*cache->slots));
+    if (!cache->pool || !cache->slots) {
+        free(cache->pool);
+        free(cache->slots);
+        return -ENOMEM;
+    }
+
+    memset(cache->slots, 0xff, nslots * sizeof(*cache->slots));
+
+    cache->size = size;
+    cache->mask = nslots - 1;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    cache->interval = interval;
+
+    return 0;
+}
+
+static void adv_cache_free(struct adv_cache *cache)
+{
+    free(cache->pool);
+    free(cache->slots);
+}
+
+static void adv_lru_unlink(struct adv_cache *cache, int idx)
+{
+    struct adv_entry *e = &cache->pool[idx];
+
+    if (e->prev >= 0)
+        cache->pool[e->prev].next = e->next;
+    else
+        cache->lru_head = e->next;
+
+    if (e->next >= 0)
+        cache->pool[e->next].prev = e->prev;
+    else
+        cache->lru_tail = e->prev;
+}
+
+static void adv_lru_push(struct adv_cache *cache, int idx)
+{
+    struct adv_entry *e = &cache->pool[idx];
+
+    e->prev = -1;
+    e->next = cache->lru_head;
+
+    if (cache->lru_head >= 0)
+        cache->pool[cache->lru_head].prev = idx;
+    else
+        cache->lru_tail = idx;
+
+    cache->lru_head = idx;
+}
+
+/* Remove a slot and shift following entries back to close the gap */
+static void adv_slot_remove(struct adv_cache *cache, unsigned int slot)
+{
+    unsigned int next = slot, home;
+    int idx;
+
+    cache->slots[slot] = -1;
+
+    while (1) {
+        next = (next + 1) & cache->mask;
+        idx = cache->slots[next];
+        if (idx < 0)
+            return;
+
+        home = adv_key_hash(&cache->pool[idx].bdaddr,
+                            cache->pool[idx].bdaddr_type,
+                            cache->pool[idx].payload_hash) & cache->mask;
+
+        /* Entry may move to slot only if slot lies on its probe path */
+        if (((next - home) & cache->mask) >= ((next - slot) & cache->mask)) {
+            cache->slots[slot] = idx;
+            cache->pool[idx].slot = slot;
+            cache->slots[next] = -1;
+            slot = next;
+        }
+    }
+}
+
+static void adv_entry_add_rssi(struct adv_entry *e, int8_t rssi)
+{
+    if (e->packets == 0 || rssi < e->rssi_min)
+        e->rssi_min = rssi;
+
+    if (e->packets == 0 || rssi > e->rssi_max)
+        e->rssi_max = rssi;
+
+    e->rssi_sum += rssi;
+    e->packets++;
+}
+
+static void adv_entry_report(struct adv_entry *e, struct scan_report *r)
+{
+    r->packets = e->packets;
+    r->rssi_min = e->rssi_min;
+    r->rssi_avg = e->rssi_sum / (int32_t) e->packets;
+    r->rssi_max = e->rssi_max;
+
+    e->packets = 0;
+    e->rssi_sum = 0;
+}
+
+/* Report whatever was heard since the device's last report */
+static void adv_entry_flush(struct adv_entry *e, struct scan_output *out)
+{
+    struct scan_report r;
+
+    if (e->packets == 0)
+        return;
+
+    memset(&r, 0, sizeof(r));
+    r.timestamp = now_us();
+    r.bdaddr = &e->bdaddr;
+    r.bdaddr_type = e->bdaddr_type;
+    r.evt_type = LESCAN_EVT_UNKNOWN;
+    adv_entry_report(e, &r);
+    r.rssi = r.rssi_avg;
+
+    output_report(out, &r);
+}
+
+static struct adv_entry *adv_cache_lookup(struct adv_cache *cache,
+                                          struct scan_output *out,
+                                          le_advertising_info *info,
+                                          int *is_new)
+{
+    uint32_t payload_hash = adv_payload_hash(info->data, info->length);
+    unsigned int slot;
+    struct adv_entry *e;
+    int idx;
+
+    slot = adv_key_hash(&info->bdaddr, info->bdaddr_type,
+                        payload_hash) & cache->mask;
+
+    for (; (idx = cache->slots[slot]) >= 0;
+                        slot = (slot + 1) & cache->mask) {
+        e = &cache->pool[idx];
+
+        if (e->payload_hash == payload_hash &&
+                e->bdaddr_type == info->bdaddr_type &&
+                !bacmp(&e->bdaddr, &info->bdaddr)) {
+            adv_lru_unlink(cache, idx);
+            adv_lru_push(cache, idx);
+            *is_new = 0;
+            return e;
+        }
+    }
+
+    if (cache->used < cache->size) {
+        idx = cache->used++;
+    } else {
+        /* Evict the least recently heard device, keeping its stats */
+        idx = cache->lru_tail;
+        adv_entry_flush(&cache->pool[idx], out);
+        adv_lru_unlink(cache, idx);
+        adv_slot_remove(cache, cache->pool[idx].slot);
+        cache->evictions++;
+
+        /* Removal may have shifted our free slot */
+        slot = adv_key_hash(&info->bdaddr, info->bdaddr_type,
+                            payload_hash) & cache->mask;
+        while (cache->slots[slot] >= 0)
+            slot = (slot + 1) & cache->mask;
+    }
+
+    e = &cache->pool[idx];
+    memset(e, 0, sizeof(*e));
+    bacpy(&e->bdaddr, &info->bdaddr);
+    e->bdaddr_type = info->bdaddr_type;
+    e->payload_hash = payload_hash;
+    e->slot = slot;
+
+    cache->slots[slot] = idx;
+    adv_lru_push(cache, idx);
+
+    *is_new = 1;
+    return e;
+}
+
+static void adv_cache_flush(struct adv_cache *cache, struct scan_output *out)
+{
+    int idx;
+
+    for (idx = cache->lru_head; idx >= 0; idx = cache->pool[idx].next)
+        adv_entry_flush(&cache->pool[idx], out);
+
+    if (cache->evictions)
+        fprintf(stderr, "%lu devices evicted from the duplicate cache\n",
+                cache->evictions);
+}
+
+/*
+ * IRK file: one "<identity address> <IRK> [public|random]" line per
+ * device, the IRK as 32 hex digits most significant byte first.
+ */
+struct irk_load {
+    struct rpa_resolver *resolver;
+    int bad;
+};
+
+static void load_irk(char *key, char *value, void *user_data)
+{
+    struct irk_load *load = user_data;
+    uint8_t type = LE_PUBLIC_ADDRESS;
+    uint8_t irk[16];
+    bdaddr_t ba;
+    int i;
+
+    if (bachk(key) < 0 || strlen(value) < 32) {
+        load->bad++;
+        return;
+    }
+
+    for (i = 0; i < 16; i++) {
+        int hi = hex_nibble(value[i * 2]);
+        int lo = hex_nibble(value[i * 2 + 1]);
+
+        if (hi < 0 || lo < 0) {
+            load->bad++;
+            return;
+        }
+
+        irk[i] = hi << 4 | lo;
+    }
+
+    if (value[32] == ' ' && !strncasecmp(value + 33, "random", 6))
+        type = LE_RANDOM_ADDRESS;
+
+    str2ba(key, &ba);
+
+    if (rpa_resolver_add(load->resolver, irk, &ba, type) < 0)
+        load->bad++;
+}
+
+static struct rpa_resolver *load_irks(const char *path)
+{
+    struct irk_load load;
+    int err;
+
+    load.resolver = rpa_resolver_new(1024);
+    load.bad = 0;
+
+    if (!load.resolver)
+        return NULL;
+
+    err = textfile_foreach(path, load_irk, &load);
+    if (err < 0) {
+        rpa_resolver_free(load.resolver);
+        errno = -err;
+        return NULL;
+    }
+
+    if (load.bad)
+        fprintf(stderr, "Skipped %d invalid IRK entries\n", load.bad);
+
+    return load.resolver;
+}
+
+static void print_rpa_stats(struct rpa_resolver *resolver)
+{
+    struct rpa_stats st;
+
+    rpa_resolver_get_stats(resolver, &st);
+
+    fprintf(stderr, "%u IRKs: %lu private addresses, %lu cache hits, "
+            "%lu resolved, %lu AES blocks (%s)\n",
+            rpa_resolver_count(resolver), st.lookups, st.cache_hits,
+            st.resolved, st.blocks, rpa_aes_impl());
+}
+
+/* Returns 1 if the report passed the filters, even if it wasn't shown */
+static int print_advertising_report(const struct ad_filter *filter,
+                                     struct adv_cache *cache,
+                                     struct rpa_resolver *resolver,
+                                     struct scan_output *out,
+                                     le_advertising_info *info)
+{
+    struct scan_report r;
+    struct ad_record rec;
+
+    if (!parse_ad(info->data, info->length, filter, &rec))
+        return 0;
+
+    memset(&r, 0, sizeof(r));
+    r.timestamp = now_us();
+    r.bdaddr = &info->bdaddr;
+    r.bdaddr_type = info->bdaddr_type;
+    r.evt_type = info->evt_type;
+    r.rssi = info->data[info->length];
+    r.data = info->data;
+    r.data_len = info->length;
+    r.name = rec.name_type ? rec.name : NULL;
+
+    if (resolver && info->bdaddr_type == LE_RANDOM_ADDRESS &&
+                                        bdaddr_is_rpa(&info->bdaddr)) {
+        int idx = rpa_resolve(resolver, &info->bdaddr);
+
+        r.identity = rpa_resolver_identity(resolver, idx,
+                                           &r.identity_type);
+    }
+
+    if (cache) {
+        uint64_t now = r.timestamp / 1000;
+        struct adv_entry *e;
+        int is_new;
+
+        e = adv_cache_lookup(cache, out, info, &is_new);
+        adv_entry_add_rssi(e, r.rssi);
+
+        if (!is_new && now - e->last_report < cache->interval)
+            return 1;
+
+        e->last_report = now;
+        adv_entry_report(e, &r);
+    }
+
+    output_report(out, &r);
+
+    return 1;
+}
+
+/*
+ * Scan duty cycle. A cycle is a list of phases, each with its own scan
+ * type and filter policy, run for a fixed time and then repeated. For
+ * every phase the scheduler keeps how much radio time it got and how
+ * many devices it heard, and how many of those no earlier phase had
+ * found, so the cost of a phase can be weighed against what it yields.
+ */
+#define SCAN_MAX_PHASES 16
+
+struct scan_phase {
+    uint8_t scan_type;
+    uint8_t filter_policy;
+    unsigned int duration;
+    uint64_t time;
+    unsigned long reports;
+    unsigned long devices;
+    unsigned long new_devices;
+};
+
+struct seen_device {
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+    uint8_t used;
+    uint16_t phases;
+};
+
+struct scan_cycle {
+    struct scan_phase phase[SCAN_MAX_PHASES];
+    int num;
+    int cur;
+    uint64_t phase_start;
+    uint16_t interval;
+    uint16_t window;
+    uint8_t own_type;
+    uint8_t filter_dup;
+    struct seen_device *seen;
+    unsigned int seen_size;
+    unsigned int seen_used;
+};
+
+/* Parses "<active|passive>[+wl]:<ms>[,...]" */
+static int parse_scan_cycle(struct scan_cycle *cycle, const char *spec)
+{
+    char *str, *tok, *save = NULL;
+    int err = 0;
+
+    memset(cycle, 0, sizeof(*cycle));
+
+    str = strdup(spec);
+    if (!str)
+        return -1;
+
+    for (tok = strtok_r(str, ",", &save); tok;
+                            tok = strtok_r(NULL, ",", &save)) {
+        struct scan_phase *phase;
+        char *dur, *end;
+        long ms;
+
+        if (cycle->num == SCAN_MAX_PHASES) {
+            err = -1;
+            break;
+        }
+
+        phase = &cycle->phase[cycle->num];
+
+        dur = strchr(tok, ':');
+        if (!dur) {
+            err = -1;
+            break;
+        }
+        *dur++ = '\0';
+
+        ms = strtol(dur, &end, 10);
+        if (*end != '\0' || ms <= 0) {
+            err = -1;
+            break;
+        }
+
+        phase->duration = ms;
+
+        if (!strncmp(tok, "active", 6)) {
+            phase->scan_type = 0x01;
+            tok += 6;
+        } else if (!strncmp(tok, "passive", 7)) {
+            phase->scan_type = 0x00;
+            tok += 7;
+        } else {
+            err = -1;
+            break;
+        }
+
+        if (!strcmp(tok, "+wl"))
+            phase->filter_policy = 0x01;
+        else if (*tok != '\0') {
+            err = -1;
+            break;
+        }
+
+        cycle->num++;
+    }
+
+    free(str);
+
+    if (cycle->num == 0)
+        err = -1;
+
+    return err;
+}
+
+static uint32_t seen_hash(const bdaddr_t *ba, uint8_t type)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        h = (h ^ ba->b[i]) * 16777619u;
+
+    return (h ^ type) * 16777619u;
+}
+
+static struct seen_device *seen_slot(struct seen_device *tbl,
+                                     unsigned int size,
+                                     const bdaddr_t *ba, uint8_t type)
+{
+    unsigned int i = seen_hash(ba, type) & (size - 1);
+
+    while (tbl[i].used && (tbl[i].bdaddr_type != type ||
+                                bacmp(&tbl[i].bdaddr, ba)))
+        i = (i + 1) & (size - 1);
+
+    return &tbl[i];
+}
+
+static struct seen_device *seen_lookup(struct scan_cycle *cycle,
+                                       const bdaddr_t *ba, uint8_t type)
+{
+    struct seen_device *d;
+
+    /* Keep the table at most half full */
+    if (cycle->seen_used * 2 >= cycle->seen_size) {
+        unsigned int size = cycle->seen_size ? cycle->seen_size * 2 : 256;
+        struct seen_device *tbl;
+        unsigned int i;
+
+        tbl = calloc(size, sizeof(*tbl));
+        if (!tbl)
+            return NULL;
+
+        for (i = 0; i < cycle->seen_size; i++)
+            if (cycle->seen[i].used)
+                *seen_slot(tbl, size, &cycle->seen[i].bdaddr,
+                           cycle->seen[i].bdaddr_type) = cycle->seen[i];
+
+        free(cycle->seen);
+        cycle->seen = tbl;
+        cycle->seen_size = size;
+    }
+
+    d = seen_slot(cycle->seen, cycle->seen_size, ba, type);
+    if (!d->used) {
+        bacpy(&d->bdaddr, ba);
+        d->bdaddr_type = type;
+        d->used = 1;
+        cycle->seen_used++;
+        cycle->phase[cycle->cur].new_devices++;
+    }
+
+    return d;
+}
+
+static void scan_cycle_report(struct scan_cycle *cycle,
+                              const le_advertising_info *info)
+{
+    struct scan_phase *phase = &cycle->phase[cycle->cur];
+    struct seen_device *d;
+
+    phase->reports++;
+
+    d = seen_lookup(cycle, &info->bdaddr, info->bdaddr_type);
+    if (d && !(d->phases & (1 << cycle->cur))) {
+        d->phases |= 1 << cycle->cur;
+        phase->devices++;
+    }
+}
+
+static int scan_cycle_apply(int dd, struct scan_cycle *cycle)
+{
+    struct scan_phase *phase = &cycle->phase[cycle->cur];
+
+    if (hci_le_set_scan_parameters(dd, phase->scan_type, cycle->interval,
+                                   cycle->window, cycle->own_type,
+                                   phase->filter_policy, 1000) < 0)
+        return -1;
+
+    if (hci_le_set_scan_enable(dd, 0x01, cycle->filter_dup, 1000) < 0)
+        return -1;
+
+    cycle->phase_start = now_ms();
+
+    return 0;
+}
+
+/* Milliseconds left in the current phase, -1 without a cycle */
+static int scan_cycle_timeout(struct scan_cycle *cycle)
+{
+    uint64_t now, end;
+
+    if (!cycle || cycle->num < 2)
+        return -1;
+
+    now = now_ms();
+    end = cycle->phase_start + cycle->phase[cycle->cur].duration;
+
+    return now >= end ? 0 : (int) (end - now);
+}
+
+static int scan_cycle_next(int dd, struct scan_cycle *cycle)
+{
+    cycle->phase[cycle->cur].time += now_ms() - cycle->phase_start;
+    cycle->cur = (cycle->cur + 1) % cycle->num;
+
+    if (hci_le_set_scan_enable(dd, 0x00, cycle->filter_dup, 1000) < 0)
+        return -1;
+
+    return scan_cycle_apply(dd, cycle);
+}
+
+static void scan_cycle_finish(struct scan_cycle *cycle)
+{
+    int i;
+
+    cycle->phase[cycle->cur].time += now_ms() - cycle->phase_start;
+
+    fprintf(stderr, "Phase  Mode        Time(s)  Reports  Devices      New"
+            "    New/s\n");
+
+    for (i = 0; i < cycle->num; i++) {
+        struct scan_phase *phase = &cycle->phase[i];
+        double secs = phase->time / 1000.0;
+
+        fprintf(stderr, "%5d  %-7s%-3s  %8.1f %8lu %8lu %8lu %8.2f\n", i,
+                phase->scan_type ? "active" : "passive",
+                phase->filter_policy ? " wl" : "", secs, phase->reports,
+                phase->devices, phase->new_devices,
+                secs > 0 ? phase->new_devices / secs : 0.0);
+    }
+
+    free(cycle->seen);
+    cycle->seen = NULL;
+}
+
+/*
+ * Batched event reception. recvmmsg() hands over every event already
+ * queued on the socket in one system call, which matters once a busy
+ * channel delivers thousands of advertising events per second. It is
+ * called through syscall() since not every C library wraps it, and the
+ * batch shrinks to a single read() on kernels without it.
+ */
+#ifndef MSG_WAITFORONE
+#define MSG_WAITFORONE 0x10000
+#endif
+
+#define EVENT_BATCH_SIZE 32
+
+struct event_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+struct event_batch {
+    unsigned char buf[EVENT_BATCH_SIZE][HCI_MAX_EVENT_SIZE];
+    struct iovec iov[EVENT_BATCH_SIZE];
+    struct event_mmsghdr msg[EVENT_BATCH_SIZE];
+    int len[EVENT_BATCH_SIZE];
+    int mmsg;
+};
+
+static void event_batch_init(struct event_batch *b)
+{
+    int i;
+
+    memset(b->msg, 0, sizeof(b->msg));
+
+    for (i = 0; i < EVENT_BATCH_SIZE; i++) {
+        b->iov[i].iov_base = b->buf[i];
+        b->iov[i].iov_len = HCI_MAX_EVENT_SIZE;
+        b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+#ifdef __NR_recvmmsg
+    b->mmsg = 1;
+#else
+    b->mmsg = 0;
+#endif
+}
+
+/* Blocks until at least one event arrives, returns how many did */
+static int event_batch_recv(int dd, struct event_batch *b)
+{
+    int i, n;
+
+#ifdef __NR_recvmmsg
+    if (b->mmsg) {
+        n = syscall(__NR_recvmmsg, dd, b->msg, EVENT_BATCH_SIZE,
+                    MSG_WAITFORONE, NULL);
+        if (n >= 0) {
+            for (i = 0; i < n; i++)
+                b->len[i] = b->msg[i].msg_len;
+            return n;
+        }
+
+        if (errno != ENOSYS)
+            return -1;
+
+        b->mmsg = 0;
+    }
+#endif
+
+    b->len[0] = read(dd, b->buf[0], HCI_MAX_EVENT_SIZE);
+    if (b->len[0] < 0)
+        return -1;
+
+    return 1;
+}
+
+/* Milliseconds until the scan loop has something to do besides reading */
+static int scan_timeout(struct scan_output *out, struct scan_cycle *cycle)
+{
+    int a = output_timeout(out);
+    int b = scan_cycle_timeout(cycle);
+
+    if (a < 0 || (b >= 0 && b < a))
+        return b;
+
+    return a;
+}
+
+struct adv_scan {
+    const struct ad_filter *filter;
+    struct adv_cache *cache;
+    struct rpa_resolver *resolver;
+    struct scan_output *out;
+    struct scan_cycle *cycle;
+    struct report_stats st;
+    int count;
+    int c;
+};
+
+static void adv_scan_event(struct adv_scan *s, unsigned char *buf, int len)
+{
+    unsigned char *ptr, *end = buf + len;
+    evt_le_meta_event *meta;
+    le_advertising_info *info;
+    uint8_t num_reports, i;
+
+    ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+
+    if (ptr + EVT_LE_META_EVENT_SIZE + 1 > end)
+        return;
+
+    meta = (void *) ptr;
+
+    if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+        return;
+
+    num_reports = meta->data[0];
+    ptr = meta->data + 1;
+
+    s->st.events++;
+    if (num_reports <= LE_MAX_REPORTS)
+        s->st.per_event[num_reports]++;
+
+    for (i = 0; i < num_reports && (s->count == -1 || s->c < s->count); i++) {
+        info = (le_advertising_info *) ptr;
+
+        /* Each report is followed by a one byte RSSI */
+        if (ptr + LE_ADVERTISING_INFO_SIZE > end ||
+                ptr + LE_ADVERTISING_INFO_SIZE + info->length + 1 > end) {
+            s->st.truncated++;
+            break;
+        }
+
+        ptr += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+
+        s->st.reports++;
+        s->c++;
+
+        if (print_advertising_report(s->filter, s->cache, s->resolver,
+                                     s->out, info) && s->cycle)
+            scan_cycle_report(s->cycle, info);
+    }
+}
+
+/* Handle the queued reports, returns -1 once count reports were seen */
+static int adv_scan_drain(struct adv_scan *s, struct hci_cmd_chan *chan,
+                                                unsigned int sub)
+{
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+    int len;
+
+    while (s->count == -1 || s->c < s->count) {
+        len = hci_cmd_chan_sub_read(chan, sub, buf, sizeof(buf));
+        if (len < 0)
+            return 0;
+
+        adv_scan_event(s, buf, len);
+    }
+
+    return -1;
+}
+
+/*
+ * Reports reach the scan through a subscriber queue of the command
+ * channel, which owns the socket. The loop still does the reading, in
+ * batches, and passes every event on to the channel. Reports that arrive
+ * while a scan phase change waits for its commands are queued instead of
+ * filtered out.
+ */
+#define ADV_QUEUE_LEN 256
+
+static int print_advertising_devices(int dd, const struct ad_filter *filter,
+                                     int count, uint8_t time,
+                                     struct adv_cache *cache,
+                                     struct rpa_resolver *resolver,
+                                     struct scan_output *out,
+                                     struct scan_cycle *cycle)
+{
+    struct event_batch batch;
+    struct hci_cmd_chan *chan;
+    struct hci_sub_stats ss;
+    struct adv_scan s;
+    struct sigaction sa;
+    unsigned int sub;
+    uint64_t start;
+    int len, num, j;
+
+    memset(&s, 0, sizeof(s));
+    s.filter = filter;
+    s.cache = cache;
+    s.resolver = resolver;
+    s.out = out;
+    s.cycle = cycle;
+    s.count = count;
+
+    event_batch_init(&batch);
+
+    chan = hci_cmd_chan_new(dd);
+    if (!chan) {
+        printf("Could not attach command channel\n");
+        return -1;
+    }
+
+    sub = hci_cmd_chan_subscribe(chan, EVT_LE_META_EVENT,
+                    EVT_LE_ADVERTISING_REPORT, HCI_SUB_ANY,
+                    ADV_QUEUE_LEN, NULL, NULL);
+    if (!sub) {
+        printf("Could not subscribe to advertising reports\n");
+        hci_cmd_chan_free(chan);
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+
+    if ( time > 0 ) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_flags = SA_NOCLDSTOP;
+        sa.sa_handler = sigint_handler;
+        sigaction(SIGALRM, &sa, NULL);
+        alarm(time);
+    }
+
+    start = now_ms();
+
+    while ((count == -1 || s.c < count) && !out->failed) {
+        struct pollfd p;
+        int timeout;
+
+        if (adv_scan_drain(&s, chan, sub) < 0)
+            break;
+
+        /*
+         * Don't let buffered reports go stale while the air is quiet, and
+         * move on to the next scan phase when the current one is over.
+         */
+        while ((timeout = scan_timeout(out, cycle)) >= 0) {
+            p.fd = dd;
+            p.events = POLLIN;
+
+            if (timeout > 0) {
+                int n = poll(&p, 1, timeout);
+
+                if (n < 0 && errno == EINTR &&
+                        (signal_received == SIGINT ||
+                         signal_received == SIGALRM)) {
+                    len = 0;
+                    goto done;
+                }
+
+                if (n != 0)
+                    break;
+            }
+
+            if (output_timeout(out) == 0)
+                output_flush(out);
+
+            if (scan_cycle_timeout(cycle) == 0) {
+                if (scan_cycle_next(dd, cycle) < 0) {
+                    len = -1;
+                    goto done;
+                }
+
+                /* Reports that came in while the commands ran */
+                if (adv_scan_drain(&s, chan, sub) < 0) {
+                    len = 0;
+                    goto done;
+                }
+            }
+        }
+
+        while ((num = event_batch_recv(dd, &batch)) < 0) {
+            s.st.syscalls++;
+
+            if (errno == EINTR && (signal_received == SIGINT || 
+                                   signal_received == SIGALRM)) {
+                len = 0;
+                goto done;
+            }
+
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+
+            len = -1;
+            goto done;
+        }
+
+        s.st.syscalls++;
+        s.st.hci_events += num;
+
+        for (j = 0; j < num; j++)
+            hci_cmd_chan_input(chan, batch.buf[j], batch.len[j]);
+    }
+
+    len = 0;
+
+done:
+    s.st.elapsed = now_ms() - start;
+
+    if (hci_cmd_chan_sub_get_stats(chan, sub, &ss) == 0 && ss.dropped)
+        fprintf(stderr, "%lu advertising events dropped, queue of %d "
+                "full\n", ss.dropped, ADV_QUEUE_LEN);
+
+    hci_cmd_chan_free(chan);
+
+    if (cache)
+        adv_cache_flush(cache, out);
+
+    output_flush(out);
+
+    print_report_stats(&s.st);
+
+    if (cycle)
+        scan_cycle_finish(cycle);
+
+    if (resolver)
+        print_rpa_stats(resolver);
+
+    if (len < 0)
+        return -1;
+
+    return 0;
+}
+
+static struct option lescan_options[] = {
+    { "help",	0, 0, 'h' },
+    { "privacy",	0, 0, 'p' },
+    { "passive",	0, 0, 'P' },
+    { "whitelist",	0, 0, 'w' },
+    { "discovery",	1, 0, 'd' },
+    { "duplicates",	0, 0, 'D' },
+    { "count",      1, 0, 'c' },
+    { "time",       1, 0, 't' },
+    { "dedup",      0, 0, 'u' },
+    { "report-interval", 1, 0, 'r' },
+    { "cache-size", 1, 0, 'z' },
+    { "filter-uuid", 1, 0, 'U' },
+    { "filter-mfg", 1, 0, 'M' },
+    { "filter-name-prefix", 1, 0, 'N' },
+    { "format",     1, 0, 'f' },
+    { "output-socket", 1, 0, 'o' },
+    { "buffer-size", 1, 0, 'b' },
+    { "flush-interval", 1, 0, 'F' },
+    { "ring",       1, 0, 'R' },
+    { "ring-slots", 1, 0, 'S' },
+    { "interval",   1, 0, 'i' },
+    { "window",     1, 0, 'W' },
+    { "cycle",      1, 0, 'C' },
+    { "irks",       1, 0, 'I' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lescan_help =
+    "Usage:\n"
+    "\tlescan [--privacy] enable privacy\n"
+    "\tlescan [--passive] set scan type passive (default active)\n"
+    "\tlescan [--whitelist] scan for address in the whitelist only\n"
+    "\tlescan [--discovery=g|l] enable general or limited discovery"
+        "procedure\n"
+    "\tlescan [--duplicates] don't filter duplicates\n"
+    "\tlescan [--time=<value>] how long to scan\n"
+    "\tlescam [--count=<value>] how many results to show\n"
+    "\tlescan [--dedup] suppress duplicates in userspace, report RSSI\n"
+    "\tlescan [--report-interval=<ms>] re-report a device at most this often"
+        " (default 1000, implies --dedup)\n"
+    "\tlescan [--cache-size=<value>] devices tracked by --dedup"
+        " (default 1024)\n"
+    "\tlescan [--filter-uuid=<uuid>] only show devices advertising a"
+        " service\n"
+    "\tlescan [--filter-mfg=<company id>[:<hex prefix>]] only show"
+        " matching manufacturer data\n"
+    "\tlescan [--filter-name-prefix=<prefix>] only show devices whose"
+        " name starts with prefix\n"
+    "\tlescan [--format=text|json|binary] output format (default text)\n"
+    "\tlescan [--output-socket=<path>] stream binary records to a unix"
+        " socket\n"
+    "\tlescan [--buffer-size=<bytes>] output buffer size"
+        " (default 65536)\n"
+    "\tlescan [--flush-interval=<ms>] longest time output stays buffered"
+        " (default 0 for text, 100 otherwise)\n"
+    "\tlescan [--ring=<file>] also publish binary records to a shared"
+        " memory ring\n"
+    "\tlescan [--ring-slots=<value>] records kept in the ring"
+        " (default 4096)\n"
+    "\tlescan [--interval=<ms>] scan interval (default 10)\n"
+    "\tlescan [--window=<ms>] scan window (default the interval)\n"
+    "\tlescan [--cycle=<active|passive>[+wl]:<ms>,...] repeat scan phases"
+        " and report what each one found\n"
+    "\tlescan [--irks=<file>] resolve private addresses with these IRKs\n";
+
+/* Scan timing is given in milliseconds and sent in 0.625 ms units */
+static int parse_scan_time(const char *str, uint16_t *units)
+{
+    char *end;
+    double ms;
+
+    ms = strtod(str, &end);
+    if (*end != '\0' || ms < 2.5 || ms > 10240)
+        return -1;
+
+    *units = ms / 0.625 + 0.5;
+
+    return 0;
+}
+
+static void cmd_lescan(int dev_id, int argc, char **argv)
+{
+    int err, opt, dd;
+    uint8_t own_type = 0x00;
+    uint8_t scan_type = 0x01;
+    struct ad_filter filter;
+    uint8_t filter_policy = 0x00;
+    uint16_t interval = 0x0010;
+    uint16_t window = 0;
+    int interval_set = 0;
+    uint8_t filter_dup = 1;
+    int count = -1;
+    uint8_t time = -1;
+    struct adv_cache cache;
+    int dedup = 0;
+    unsigned int report_interval = 1000;
+    unsigned int cache_size = 1024;
+    struct scan_output out;
+    int format = OUTPUT_TEXT;
+    const char *socket_path = NULL;
+    size_t buffer_size = 65536;
+    int flush_interval = -1;
+    const char *ring_path = NULL;
+    unsigned int ring_slots = 4096;
+    struct scan_cycle cycle;
+    int use_cycle = 0;
+    struct rpa_resolver *resolver = NULL;
+
+    memset(&filter, 0, sizeof(filter));
+
+    for_each_opt(opt, lescan_options, NULL) {
+        switch (opt) {
+        case 'p':
+            own_type = 0x01; /* Random */
+            break;
+        case 'P':
+            scan_type = 0x00; /* Passive */
+            break;
+        case 'w':
+            filter_policy = 0x01; /* Whitelist */
+            break;
+        case 'd':
+            filter.procedure = optarg[0];
+            if (filter.procedure != 'g' && filter.procedure != 'l') {
+                fprintf(stderr, "Unknown discovery procedure\n");
+                exit(1);
+            }
+
+            if (!interval_set)
+                interval = 0x0012;
+            break;
+        case 'D':
+            filter_dup = 0x00;
+            break;
+        case 'c':
+            count = atoi(optarg);
+            continue;
+        case 't':
+            time = atoi(optarg);
+            continue;
+        case 'u':
+            dedup = 1;
+            break;
+        case 'r':
+            dedup = 1;
+            report_interval = atoi(optarg);
+            break;
+        case 'z':
+            cache_size = atoi(optarg);
+            if (cache_size == 0) {
+                fprintf(stderr, "Invalid cache size\n");
+                exit(1);
+            }
+            break;
+        case 'U':
+            if (parse_filter_uuid(&filter, optarg) < 0) {
+                fprintf(stderr, "Invalid UUID: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            if (parse_filter_mfg(&filter, optarg) < 0) {
+                fprintf(stderr, "Invalid manufacturer filter: %s\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            filter.name_prefix = optarg;
+            filter.name_prefix_len = strlen(optarg);
+            break;
+        case 'f':
+            if (!strcasecmp(optarg, "text"))
+                format = OUTPUT_TEXT;
+            else if (!strcasecmp(optarg, "json"))
+                format = OUTPUT_JSON;
+            else if (!strcasecmp(optarg, "binary"))
+                format = OUTPUT_BINARY;
+            else {
+                fprintf(stderr, "Unknown output format\n");
+                exit(1);
+            }
+            break;
+        case 'o':
+            socket_path = optarg;
+            break;
+        case 'b':
+            buffer_size = atoi(optarg);
+            break;
+        case 'F':
+            flush_interval = atoi(optarg);
+            break;
+        case 'R':
+            ring_path = optarg;
+            break;
+        case 'S':
+            ring_slots = atoi(optarg);
+            break;
+        case 'i':
+            if (parse_scan_time(optarg, &interval) < 0) {
+                fprintf(stderr, "Invalid scan interval\n");
+                exit(1);
+            }
+            interval_set = 1;
+            break;
+        case 'W':
+            if (parse_scan_time(optarg, &window) < 0) {
+                fprintf(stderr, "Invalid scan window\n");
+                exit(1);
+            }
+            break;
+        case 'C':
+            if (parse_scan_cycle(&cycle, optarg) < 0) {
+                fprintf(stderr, "Invalid scan cycle: %s\n", optarg);
+                exit(1);
+            }
+            use_cycle = 1;
+            break;
+        case 'I':
+            resolver = load_irks(optarg);
+            if (!resolver) {
+                perror("Could not load IRKs");
+                exit(1);
+            }
+            break;
+        default:
+            printf("%s", lescan_help);
+            return;
+        }
+    }
+    helper_arg(0, 1, &argc, &argv, lescan_help);
+
+    if (dedup) {
+        /* Every packet is needed for the RSSI statistics */
+        filter_dup = 0x00;
+
+        if (adv_cache_init(&cache, cache_size, report_interval) < 0) {
+            perror("Could not allocate duplicate cache");
+            exit(1);
+        }
+    }
+
+    if (window == 0)
+        window = interval;
+    else if (window > interval) {
+        fprintf(stderr, "Scan window longer than the interval\n");
+        exit(1);
+    }
+
+    /* The socket carries length prefixed records, nothing else */
+    if (socket_path)
+        format = OUTPUT_BINARY;
+
+    if (flush_interval < 0)
+        flush_interval = format == OUTPUT_TEXT ? 0 : 100;
+
+    if (output_open(&out, format, socket_path, buffer_size,
+                                    flush_interval) < 0) {
+        perror("Could not open scan output");
+        exit(1);
+    }
+
+    if (ring_path) {
+        out.ring = lescan_ring_create(ring_path, ring_slots);
+        if (!out.ring) {
+            perror("Could not create ring");
+            exit(1);
+        }
+    }
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    if (use_cycle) {
+        /* The phases decide scan type and filter policy */
+        cycle.interval = htobs(interval);
+        cycle.window = htobs(window);
+        cycle.own_type = own_type;
+        cycle.filter_dup = filter_dup;
+
+        err = scan_cycle_apply(dd, &cycle);
+        if (err < 0) {
+            perror("Could not start scan cycle");
+            hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000);
+            exit(1);
+        }
+    } else {
+        err = hci_le_set_scan_parameters(dd, scan_type, htobs(interval),
+                            htobs(window), own_type, filter_policy, 1000);
+        if (err < 0) {
+            perror("Set scan parameters failed");
+            err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000);
+            if (err < 0) {
+                perror("Disable scan failed");
+                exit(2);
+            }
+            exit(1);
+        }
+
+        err = hci_le_set_scan_enable(dd, 0x01, filter_dup, 1000);
+        if (err < 0) {
+            perror("Enable scan failed");
+            exit(1);
+        }
+    }
+
+    /* Keep binary and JSON on stdout free of anything else */
+    if (format == OUTPUT_TEXT || socket_path)
+        printf("LE Scan ...\n");
+    else
+        fprintf(stderr, "LE Scan ...\n");
+
+    /* Reports bypass stdio, so the banner has to go out first */
+    fflush(stdout);
+
+    err = print_advertising_devices(dd, &filter, count, time,
+                                    dedup ? &cache : NULL, resolver, &out,
+                                    use_cycle ? &cycle : NULL);
+    if (err < 0) {
+        perror("Could not receive advertising events");
+        exit(1);
+    }
+
+    output_close(&out);
+
+    err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000);
+    if (err < 0) {
+        perror("Disable scan failed");
+        exit(1);
+    }
+
+    if (dedup)
+        adv_cache_free(&cache);
+
+    rpa_resolver_free(resolver);
+
+    hci_close_dev(dd);
+}
+
+static struct option rpabench_options[] = {
+    { "help",	0, 0, 'h' },
+    { "irks",	1, 0, 'i' },
+    { "time",	1, 0, 't' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *rpabench_help =
+    "Usage:\n"
+    "\trpabench [--irks=<max IRKs>] [--time=<ms per measurement>]\n";
+
+static void random_bytes(uint8_t *buf, int len)
+{
+    while (len-- > 0)
+        *buf++ = rand();
+}
+
+/*
+ * Lookups per second of resolve over addrs, in rounds over all of them
+ * until at least min_us have passed: a fixed count would be over before
+ * the clock could tell with few IRKs, or take minutes with many.
+ */
+static double rpa_rate(struct rpa_resolver *resolver, const bdaddr_t *addrs,
+                       int num, uint64_t min_us, int cached)
+{
+    uint64_t start = now_us(), elapsed, lookups = 0;
+    int i;
+
+    do {
+        for (i = 0; i < num; i++) {
+            if (cached)
+                rpa_resolve(resolver, &addrs[i]);
+            else
+                rpa_resolver_match(resolver, &addrs[i]);
+        }
+
+        lookups += num;
+        elapsed = now_us() - start;
+    } while (elapsed < min_us);
+
+    return lookups * 1e6 / elapsed;
+}
+
+/*
+ * Resolution throughput against the number of IRKs: addresses that match
+ * no IRK (every key is tried), addresses of the last IRK added (the worst
+ * case for a match) and the same addresses again through the cache.
+ */
+static void cmd_rpabench(int dev_id, int argc, char **argv)
+{
+    static const uint8_t irk[16] = {
+        0xec, 0x02, 0x34, 0xa3, 0x57, 0xc8, 0xad, 0x05,
+        0x34, 0x10, 0x10, 0xa6, 0x0a, 0x39, 0x7d, 0x9b,
+    };
+    static const uint8_t prand[3] = { 0x70, 0x81, 0x94 };
+    bdaddr_t miss[64], hit[64], rpa;
+    int max_irks = 4096, ms = 200;
+    int opt, n, i;
+    char addr[18];
+
+    for_each_opt(opt, rpabench_options, NULL) {
+        switch (opt) {
+        case 'i':
+            max_irks = atoi(optarg);
+            break;
+        case 't':
+            ms = atoi(optarg);
+            break;
+        default:
+            printf("%s", rpabench_help);
+            return;
+        }
+    }
+    helper_arg(0, 0, &argc, &argv, rpabench_help);
+
+    if (ms <= 0) {
+        printf("%s", rpabench_help);
+        return;
+    }
+
+    /* Sample data from the Core specification, Vol 3 Part H, D.7 */
+    rpa_generate(irk, prand, &rpa);
+    ba2str(&rpa, addr);
+    if (strcmp(addr, "70:81:94:0D:FB:AA")) {
+        fprintf(stderr, "ah() self test failed: %s\n", addr);
+        exit(1);
+    }
+
+    printf("AES: %s\n", rpa_aes_impl());
+    printf("%8s %12s %12s %12s\n", "IRKs", "no match/s", "last IRK/s",
+           "cached/s");
+
+    for (n = 1; n <= max_irks; n *= 4) {
+        struct rpa_resolver *resolver;
+        uint8_t key[16], r[3];
+        bdaddr_t id;
+
+        resolver = rpa_resolver_new(1024);
+        if (!resolver) {
+            perror("Could not allocate resolver");
+            exit(1);
+        }
+
+        for (i = 0; i < n; i++) {
+            random_bytes(key, sizeof(key));
+            random_bytes(id.b, sizeof(id.b));
+
+            if (rpa_resolver_add(resolver, key, &id,
+                                 LE_PUBLIC_ADDRESS) < 0) {
+                perror("Could not add IRK");
+                exit(1);
+            }
+        }
+
+        for (i = 0; i < 64; i++) {
+            random_bytes(r, sizeof(r));
+            rpa_generate(key, r, &hit[i]);
+
+            /* A random hash matches some IRK with odds n / 2^24 */
+            miss[i] = hit[i];
+            miss[i].b[0] ^= 0x5a;
+        }
+
+        printf("%8d %12.0f", n, rpa_rate(resolver, miss, 64, ms * 1000, 0));
+        printf(" %12.0f", rpa_rate(resolver, hit, 64, ms * 1000, 0));
+
+        /* Warm the cache so only hits are timed */
+        for (i = 0; i < 64; i++)
+            rpa_resolve(resolver, &hit[i]);
+
+        printf(" %12.0f\n", rpa_rate(resolver, hit, 64, ms * 1000, 1));
+
+        rpa_resolver_free(resolver);
+    }
+}
+
+static struct option lecc_options[] = {
+    { "help",	0, 0, 'h' },
+    { "random",	0, 0, 'r' },
+    { "whitelist",	0, 0, 'w' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lecc_help =
+    "Usage:\n"
+    "\tlecc [--random] <bdaddr>\n"
+    "\tlecc --whitelist\n";
+
+static void cmd_lecc(int dev_id, int argc, char **argv)
+{
+    int err, opt, dd;
+    bdaddr_t bdaddr;
+    uint16_t interval, latency, max_ce_length, max_interval, min_ce_length;
+    uint16_t min_interval, supervision_timeout, window, handle;
+    uint8_t initiator_filter, own_bdaddr_type, peer_bdaddr_type;
+
+    peer_bdaddr_type = LE_PUBLIC_ADDRESS;
+    initiator_filter = 0; /* Use peer address */
+
+    for_each_opt(opt, lecc_options, NULL) {
+        switch (opt) {
+        case 'r':
+            peer_bdaddr_type = LE_RANDOM_ADDRESS;
+            break;
+        case 'w':
+            initiator_filter = 0x01; /* Use white list */
+            break;
+        default:
+            printf("%s", lecc_help);
+            return;
+        }
+    }
+    helper_arg(0, 1, &argc, &argv, lecc_help);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    memset(&bdaddr, 0, sizeof(bdaddr_t));
+    if (argv[0])
+        str2ba(argv[0], &bdaddr);
+
+    interval = htobs(0x0004);
+    window = htobs(0x0004);
+    own_bdaddr_type = 0x00;
+    min_interval = htobs(0x000F);
+    max_interval = htobs(0x000F);
+    latency = htobs(0x0000);
+    supervision_timeout = htobs(0x0C80);
+    min_ce_length = htobs(0x0001);
+    max_ce_length = htobs(0x0001);
+
+    err = hci_le_create_conn(dd, interval, window, initiator_filter,
+            peer_bdaddr_type, bdaddr, own_bdaddr_type, min_interval,
+            max_interval, latency, supervision_timeout,
+            min_ce_length, max_ce_length, &handle, 25000);
+    if (err < 0) {
+        perror("Could not create connection");
+        exit(1);
+    }
+
+    printf("Connection handle %d\n", handle);
+
+    hci_close_dev(dd);
+}
+
+/*
+ * lewlsync keeps the set it loaded last in a state file (see below). Any
+ * other change to the white list makes that file stale, so drop it and
+ * let the next lewlsync start from a cleared list.
+ */
+static int wl_state_name(int dev_id, char *filename)
+{
+    char addr[18];
+    bdaddr_t local;
+
+    if (hci_devba(dev_id, &local) < 0)
+        return -1;
+
+    ba2str(&local, addr);
+    create_name(filename, PATH_MAX, STORAGEDIR, addr, "lewhitelist");
+
+    return 0;
+}
+
+static void wl_state_forget(int dev_id)
+{
+    char filename[PATH_MAX + 1];
+
+    if (wl_state_name(dev_id, filename) < 0)
+        return;
+
+    if (unlink(filename) < 0 && errno != ENOENT)
+        fprintf(stderr, "Can't remove %s: %s (%d)\n", filename,
+                            strerror(errno), errno);
+}
+
+static struct option lewladd_options[] = {
+    { "help",	0, 0, 'h' },
+    { "random",	0, 0, 'r' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lewladd_help =
+    "Usage:\n"
+    "\tlewladd [--random] <bdaddr>\n";
+
+static void cmd_lewladd(int dev_id, int argc, char **argv)
+{
+    int err, opt, dd;
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type = LE_PUBLIC_ADDRESS;
+
+    for_each_opt(opt, lewladd_options, NULL) {
+        switch (opt) {
+        case 'r':
+            bdaddr_type = LE_RANDOM_ADDRESS;
+            break;
+        default:
+            printf("%s", lewladd_help);
+            return;
+        }
+    }
+
+    helper_arg(1, 1, &argc, &argv, lewladd_help);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    str2ba(argv[0], &bdaddr);
+
+    err = hci_le_add_white_list(dd, &bdaddr, bdaddr_type, 1000);
+    hci_close_dev(dd);
+
+    /* Even a command that timed out may have reached the controller */
+    wl_state_forget(dev_id);
+
+    if (err < 0) {
+        err = -errno;
+        fprintf(stderr, "Can't add to white list: %s(%d)\n",
+                            strerror(-err), -err);
+        exit(1);
+    }
+}
+
+static struct option lewlrm_options[] = {
+    { "help",	0, 0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lewlrm_help =
+    "Usage:\n"
+    "\tlewlrm <bdaddr>\n";
+
+static void cmd_lewlrm(int dev_id, int argc, char **argv)
+{
+    int err, opt, dd;
+    bdaddr_t bdaddr;
+
+    for_each_opt(opt, lewlrm_options, NULL) {
+        switch (opt) {
+        default:
+            printf("%s", lewlrm_help);
+            return;
+        }
+    }
+
+    helper_arg(1, 1, &argc, &argv, lewlrm_help);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    str2ba(argv[0], &bdaddr);
+
+    err = hci_le_rm_white_list(dd, &bdaddr, LE_PUBLIC_ADDRESS, 1000);
+    hci_close_dev(dd);
+
+    /* Even a command that timed out may have reached the controller */
+    wl_state_forget(dev_id);
+
+    if (err < 0) {
+        err = errno;
+        fprintf(stderr, "Can't remove from white list: %s(%d)\n",
+                            strerror(err), err);
+        exit(1);
+    }
+}
+
+static struct option lewlsz_options[] = {
+    { "help",	0, 0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lewlsz_help =
+    "Usage:\n"
+    "\tlewlsz\n";
+
+static void cmd_lewlsz(int dev_id, int argc, char **argv)
+{
+    int err, dd, opt;
+    uint8_t size;
+
+    for_each_opt(opt, lewlsz_options, NULL) {
+        switch (opt) {
+        default:
+            printf("%s", lewlsz_help);
+            return;
+        }
+    }
+
+    helper_arg(0, 0, &argc, &argv, lewlsz_help);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    err = hci_le_read_white_list_size(dd, &size, 1000);
+    hci_close_dev(dd);
+
+    if (err < 0) {
+        err = -errno;
+        fprintf(stderr, "Can't read white list size: %s(%d)\n",
+                            strerror(-err), -err);
+        exit(1);
+    }
+
+    printf("White list size: %d\n", size);
+}
+
+static struct option lewlclr_options[] = {
+    { "help",	0, 0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lewlclr_help =
+    "Usage:\n"
+    "\tlewlclr\n";
+
+static void cmd_lewlclr(int dev_id, int argc, char **argv)
+{
+    int err, dd, opt;
+
+    for_each_opt(opt, lewlclr_options, NULL) {
+        switch (opt) {
+        default:
+            printf("%s", lewlclr_help);
+            return;
+        }
+    }
+
+    helper_arg(0, 0, &argc, &argv, lewlclr_help);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    err = hci_le_clear_white_list(dd, 1000);
+    hci_close_dev(dd);
+
+    /* Even a command that timed out may have reached the controller */
+    wl_state_forget(dev_id);
+
+    if (err < 0) {
+        err = -errno;
+        fprintf(stderr, "Can't clear white list: %s(%d)\n",
+                            strerror(-err), -err);
+        exit(1);
+    }
+}
+
+/*
+ * White list synchronization. The set applied last is kept next to the
+ * adapter's other state so that a new list only costs the difference.
+ * The controller forgets its white list on reset, --full (or a missing
+ * state file) starts over from an empty list.
+ */
+struct wl_entry {
+    bdaddr_t bdaddr;
+    uint8_t type;
+    uint8_t status;
+};
+
+struct wl_set {
+    struct wl_entry *entries;
+    int count;
+    int size;
+};
+
+static int wl_entry_cmp(const void *a, const void *b)
+{
+    const struct wl_entry *ea = a, *eb = b;
+
+    if (ea->type != eb->type)
+        return ea->type - eb->type;
+
+    return bacmp(&ea->bdaddr, &eb->bdaddr);
+}
+
+static int wl_set_add(struct wl_set *set, const bdaddr_t *bdaddr,
+                            uint8_t type)
+{
+    if (set->count == set->size) {
+        int size = set->size ? set->size * 2 : 64;
+        struct wl_entry *entries;
+
+        entries = realloc(set->entries, size * sizeof(*entries));
+        if (!entries)
+            return -1;
+
+        set->entries = entries;
+        set->size = size;
+    }
+
+    bacpy(&set->entries[set->count].bdaddr, bdaddr);
+    set->entries[set->count].type = type;
+    set->entries[set->count].status = 0;
+    set->count++;
+
+    return 0;
+}
+
+/* Sort and drop duplicates */
+static void wl_set_sort(struct wl_set *set)
+{
+    int i, n = 0;
+
+    qsort(set->entries, set->count, sizeof(*set->entries), wl_entry_cmp);
+
+    for (i = 0; i < set->count; i++) {
+        if (n > 0 && !wl_entry_cmp(&set->entries[n - 1], &set->entries[i]))
+            continue;
+        set->entries[n++] = set->entries[i];
+    }
+
+    set->count = n;
+}
+
+/* One "<bdaddr> [public|random]" per line, # starts a comment */
+static int wl_set_load(struct wl_set *set, const char *path, int *bad)
+{
+    char line[128];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *addr, *type, *save;
+        uint8_t bdaddr_type = LE_PUBLIC_ADDRESS;
+        bdaddr_t bdaddr;
+
+        addr = strtok_r(line, " \t\r\n", &save);
+        if (!addr || *addr == '#')
+            continue;
+
+        type = strtok_r(NULL, " \t\r\n", &save);
+        if (type && !strcasecmp(type, "random"))
+            bdaddr_type = LE_RANDOM_ADDRESS;
+        else if (type && strcasecmp(type, "public") && *type != '#') {
+            (*bad)++;
+            continue;
+        }
+
+        if (bachk(addr) < 0) {
+            (*bad)++;
+            continue;
+        }
+
+        str2ba(addr, &bdaddr);
+
+        if (wl_set_add(set, &bdaddr, bdaddr_type) < 0) {
+            fclose(f);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    fclose(f);
+
+    wl_set_sort(set);
+
+    return 0;
+}
+
+static int wl_set_save(struct wl_set *set, const char *path)
+{
+    char addr[18];
+    FILE *f;
+    int i;
+
+    if (create_file(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0)
+        return -1;
+
+    f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    for (i = 0; i < set->count; i++) {
+        ba2str(&set->entries[i].bdaddr, addr);
+        fprintf(f, "%s %s\n", addr,
+            set->entries[i].type == LE_RANDOM_ADDRESS ?
+                            "random" : "public");
+    }
+
+    return fclose(f);
+}
+
+static void wl_request(struct hci_request *rq, struct wl_entry *e,
+                    uint16_t ocf, void *cp)
+{
+    le_add_device_to_white_list_cp *add = cp;
+
+    /* Add and remove take the same parameters */
+    memset(add, 0, sizeof(*add));
+    add->bdaddr_type = e->type;
+    bacpy(&add->bdaddr, &e->bdaddr);
+
+    memset(rq, 0, sizeof(*rq));
+    rq->ogf = OGF_LE_CTL;
+    rq->ocf = ocf;
+    rq->cparam = cp;
+    rq->clen = LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE;
+    rq->rparam = &e->status;
+    rq->rlen = 1;
+}
+
+static int wl_print_failures(const char *what, struct wl_entry **list,
+                        struct hci_request *rqs, int num)
+{
+    char addr[18];
+    int i, failed = 0;
+
+    for (i = 0; i < num; i++) {
+        if (rqs[i].rlen >= 1 && !list[i]->status)
+            continue;
+
+        failed++;
+        ba2str(&list[i]->bdaddr, addr);
+
+        if (rqs[i].rlen < 1)
+            fprintf(stderr, "Can't %s %s: no reply\n", what, addr);
+        else
+            fprintf(stderr, "Can't %s %s: status 0x%02x\n", what, addr,
+                                list[i]->status);
+    }
+
+    return failed;
+}
+
+static struct option lewlsync_options[] = {
+    { "help",	0, 0, 'h' },
+    { "full",	0, 0, 'f' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lewlsync_help =
+    "Usage:\n"
+    "\tlewlsync [--full] <file>\n"
+    "\n"
+    "\tfile: one \"<bdaddr> [public|random]\" line per device\n"
+    "\t--full: clear the white list instead of applying the difference\n"
+    "\t        to the set loaded last, e.g. after a controller reset\n";
+
+static void cmd_lewlsync(int dev_id, int argc, char **argv)
+{
+    struct wl_set want = { NULL, 0, 0 }, have = { NULL, 0, 0 };
+    struct wl_set result = { NULL, 0, 0 };
+    struct wl_entry **list;
+    struct hci_request *rqs;
+    le_add_device_to_white_list_cp *cps;
+    struct hci_cmd_chan *chan;
+    struct hci_cmd_chan_stats st;
+    char filename[PATH_MAX + 1];
+    int i, j, err, opt, dd, bad = 0, full = 0;
+    int num_rm = 0, num_add = 0, num, failed_rm, failed_add;
+    uint64_t start, elapsed;
+    uint8_t size;
+
+    for_each_opt(opt, lewlsync_options, NULL) {
+        switch (opt) {
+        case 'f':
+            full = 1;
             break;
-        case 'P':
-            scan_type = 0x00; /* Passive */
+        default:
+            printf("%s", lewlsync_help);
+            return;
+        }
+    }
+
+    helper_arg(1, 1, &argc, &argv, lewlsync_help);
+
+    if (wl_set_load(&want, argv[0], &bad) < 0) {
+        fprintf(stderr, "Can't read %s: %s (%d)\n", argv[0],
+                            strerror(errno), errno);
+        exit(1);
+    }
+
+    if (bad)
+        fprintf(stderr, "Skipped %d invalid entries\n", bad);
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    if (wl_state_name(dev_id, filename) < 0) {
+        perror("Could not get device address");
+        exit(1);
+    }
+
+    if (!full && wl_set_load(&have, filename, &bad) < 0)
+        full = 1;
+
+    dd = open_dev(dev_id);
+    if (dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    start = now_us();
+
+    err = hci_le_read_white_list_size(dd, &size, 1000);
+    if (err < 0) {
+        err = errno;
+        fprintf(stderr, "Can't read white list size: %s(%d)\n",
+                            strerror(err), err);
+        exit(1);
+    }
+
+    if (want.count > size) {
+        fprintf(stderr, "%d devices don't fit a white list of %d\n",
+                            want.count, size);
+        exit(1);
+    }
+
+    if (full) {
+        have.count = 0;
+
+        err = hci_le_clear_white_list(dd, 1000);
+        if (err < 0) {
+            err = errno;
+            fprintf(stderr, "Can't clear white list: %s(%d)\n",
+                            strerror(err), err);
+            exit(1);
+        }
+    }
+
+    num = want.count + have.count;
+    list = calloc(num ? num : 1, sizeof(*list));
+    rqs = calloc(num ? num : 1, sizeof(*rqs));
+    cps = calloc(num ? num : 1, sizeof(*cps));
+    if (!list || !rqs || !cps) {
+        perror("Can't allocate requests");
+        exit(1);
+    }
+
+    /* Both sets are sorted: removals first so that additions fit */
+    for (i = 0, j = 0; i < have.count; i++) {
+        while (j < want.count &&
+                wl_entry_cmp(&want.entries[j], &have.entries[i]) < 0)
+            j++;
+
+        if (j < want.count &&
+                !wl_entry_cmp(&want.entries[j], &have.entries[i]))
+            continue;
+
+        list[num_rm] = &have.entries[i];
+        wl_request(&rqs[num_rm], list[num_rm],
+                OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST, &cps[num_rm]);
+        num_rm++;
+    }
+
+    for (i = 0, j = 0; i < want.count; i++) {
+        int k = num_rm + num_add;
+
+        while (j < have.count &&
+                wl_entry_cmp(&have.entries[j], &want.entries[i]) < 0)
+            j++;
+
+        if (j < have.count &&
+                !wl_entry_cmp(&have.entries[j], &want.entries[i]))
+            continue;
+
+        list[k] = &want.entries[i];
+        wl_request(&rqs[k], list[k], OCF_LE_ADD_DEVICE_TO_WHITE_LIST,
+                                &cps[k]);
+        num_add++;
+    }
+
+    chan = hci_cmd_chan_new(dd);
+    if (!chan) {
+        perror("Can't attach command channel");
+        exit(1);
+    }
+
+    /* Removals must complete before additions may need their room */
+    if (num_rm)
+        hci_cmd_chan_send_batch(chan, rqs, num_rm, 5000);
+
+    if (num_add)
+        hci_cmd_chan_send_batch(chan, rqs + num_rm, num_add, 5000);
+
+    elapsed = now_us() - start;
+
+    hci_cmd_chan_get_stats(chan, &st);
+    hci_cmd_chan_free(chan);
+    hci_close_dev(dd);
+
+    failed_rm = wl_print_failures("remove", list, rqs, num_rm);
+    failed_add = wl_print_failures("add", list + num_rm, rqs + num_rm,
+                                num_add);
+
+    /* Record what the controller holds now, failures included */
+    for (i = 0; i < num_rm; i++)
+        if (rqs[i].rlen < 1 || list[i]->status)
+            wl_set_add(&result, &list[i]->bdaddr, list[i]->type);
+
+    for (i = 0; i < want.count; i++) {
+        struct wl_entry *e = &want.entries[i];
+
+        for (j = num_rm; j < num_rm + num_add; j++)
+            if (list[j] == e)
+                break;
+
+        if (j < num_rm + num_add && (rqs[j].rlen < 1 || e->status))
+            continue;
+
+        wl_set_add(&result, &e->bdaddr, e->type);
+    }
+
+    wl_set_sort(&result);
+
+    if (wl_set_save(&result, filename) < 0)
+        fprintf(stderr, "Can't save %s: %s (%d)\n", filename,
+                            strerror(errno), errno);
+
+    printf("White list: %d of %d entries, %d added, %d removed, "
+            "%d unchanged, %d failed%s\n", result.count, size,
+            num_add - failed_add, num_rm - failed_rm,
+            want.count - num_add, failed_add + failed_rm,
+            full ? " (cleared first)" : "");
+    printf("%lu commands in %llu.%03llu ms, up to %lu in flight\n",
+            st.commands + 1 + full,
+            (unsigned long long) elapsed / 1000,
+            (unsigned long long) elapsed % 1000, st.max_inflight);
+
+    free(list);
+    free(rqs);
+    free(cps);
+    free(want.entries);
+    free(have.entries);
+    free(result.entries);
+
+    if (failed_add || failed_rm)
+        exit(1);
+}
+
+/*
+ * Multi-peer connection orchestrator. All targets go into the white list
+ * and a single LE Create Connection with the white list initiator filter
+ * lets the controller connect whichever target advertises first. Every
+ * completion re-arms the next connect right away, so one pending command
+ * serves all targets that are still missing.
+ */
+struct conn_target {
+    bdaddr_t bdaddr;
+    uint8_t type;
+    int connected;
+    uint16_t handle;
+    uint64_t since;
+    unsigned int drops;
+};
+
+struct conn_samples {
+    uint64_t *us;
+    int count;
+    int size;
+};
+
+struct conn_orch {
+    struct hci_cmd_chan *chan;
+    le_create_connection_cp cp;
+    struct conn_target *targets;
+    int num_targets;
+    int num_connected;
+    unsigned int create_id;
+    uint64_t rearm_at;
+    int stopping;
+    unsigned long attempts;
+    unsigned long failures;
+    unsigned long drops;
+    struct conn_samples initial;
+    struct conn_samples reconnect;
+};
+
+static void conn_samples_add(struct conn_samples *s, uint64_t us)
+{
+    if (s->count == s->size) {
+        int size = s->size ? s->size * 2 : 64;
+        uint64_t *p = realloc(s->us, size * sizeof(*p));
+
+        if (!p)
+            return;
+
+        s->us = p;
+        s->size = size;
+    }
+
+    s->us[s->count++] = us;
+}
+
+static int conn_samples_cmp(const void *a, const void *b)
+{
+    uint64_t ua = *(const uint64_t *) a, ub = *(const uint64_t *) b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+static double conn_samples_pct(struct conn_samples *s, int pct)
+{
+    int i = (s->count * pct + 99) / 100 - 1;
+
+    if (i < 0)
+        i = 0;
+
+    return s->us[i] / 1000.0;
+}
+
+static void conn_samples_print(const char *what, struct conn_samples *s)
+{
+    if (!s->count) {
+        printf("%s: none\n", what);
+        return;
+    }
+
+    qsort(s->us, s->count, sizeof(*s->us), conn_samples_cmp);
+
+    printf("%s: %d, time to connect p50 %.1f p90 %.1f p99 %.1f "
+            "max %.1f ms\n", what, s->count, conn_samples_pct(s, 50),
+            conn_samples_pct(s, 90), conn_samples_pct(s, 99),
+            s->us[s->count - 1] / 1000.0);
+}
+
+static struct conn_target *conn_find_addr(struct conn_orch *o,
+                    const bdaddr_t *bdaddr, uint8_t type)
+{
+    int i;
+
+    for (i = 0; i < o->num_targets; i++)
+        if (o->targets[i].type == type &&
+                !bacmp(&o->targets[i].bdaddr, bdaddr))
+            return &o->targets[i];
+
+    return NULL;
+}
+
+static struct conn_target *conn_find_handle(struct conn_orch *o,
+                                uint16_t handle)
+{
+    int i;
+
+    for (i = 0; i < o->num_targets; i++)
+        if (o->targets[i].connected && o->targets[i].handle == handle)
+            return &o->targets[i];
+
+    return NULL;
+}
+
+static void conn_arm(struct conn_orch *o);
+
+static void conn_complete(int err, void *rparam, int rlen, void *user_data)
+{
+    struct conn_orch *o = user_data;
+    evt_le_connection_complete *evt = rparam;
+    struct conn_target *t;
+    uint64_t now = now_us();
+    char addr[18];
+
+    o->create_id = 0;
+
+    if (err || rlen < EVT_LE_CONN_COMPLETE_SIZE || evt->status) {
+        /* Rejected outright: back off instead of spinning */
+        if (err)
+            o->rearm_at = now + 100000;
+
+        if (err || evt->status != HCI_NO_CONNECTION)
+            o->failures++;
+
+        conn_arm(o);
+        return;
+    }
+
+    ba2str(&evt->peer_bdaddr, addr);
+
+    t = conn_find_addr(o, &evt->peer_bdaddr, evt->peer_bdaddr_type);
+    if (!t) {
+        printf("Connected %s, handle %d: not a target\n", addr,
+                            btohs(evt->handle));
+        conn_arm(o);
+        return;
+    }
+
+    if (!t->connected) {
+        conn_samples_add(t->drops ? &o->reconnect : &o->initial,
+                                now - t->since);
+        o->num_connected++;
+    }
+
+    t->connected = 1;
+    t->handle = btohs(evt->handle);
+
+    printf("Connected %s, handle %d, in %.1f ms (%d/%d)\n", addr,
+            t->handle, (now - t->since) / 1000.0, o->num_connected,
+            o->num_targets);
+    fflush(stdout);
+
+    conn_arm(o);
+}
+
+static void conn_arm(struct conn_orch *o)
+{
+    if (o->stopping || o->create_id ||
+            o->num_connected == o->num_targets || now_us() < o->rearm_at)
+        return;
+
+    o->create_id = hci_cmd_chan_submit(o->chan, OGF_LE_CTL,
+                    OCF_LE_CREATE_CONN, EVT_LE_CONN_COMPLETE,
+                    &o->cp, LE_CREATE_CONN_CP_SIZE,
+                    conn_complete, o);
+    if (o->create_id)
+        o->attempts++;
+}
+
+static void conn_event(uint8_t evt, void *data, int len, void *user_data)
+{
+    struct conn_orch *o = user_data;
+    evt_disconn_complete *dc = data;
+    struct conn_target *t;
+    char addr[18];
+
+    if (evt != EVT_DISCONN_COMPLETE || len < EVT_DISCONN_COMPLETE_SIZE ||
+                                dc->status)
+        return;
+
+    t = conn_find_handle(o, btohs(dc->handle));
+    if (!t)
+        return;
+
+    t->connected = 0;
+    t->since = now_us();
+    t->drops++;
+    o->drops++;
+    o->num_connected--;
+
+    ba2str(&t->bdaddr, addr);
+    printf("Disconnected %s, handle %d, reason 0x%02x (%d/%d)\n", addr,
+            t->handle, dc->reason, o->num_connected, o->num_targets);
+    fflush(stdout);
+
+    conn_arm(o);
+}
+
+static struct option lemulti_options[] = {
+    { "help",	0, 0, 'h' },
+    { "interval",	1, 0, 'i' },
+    { "window",	1, 0, 'w' },
+    { "min-interval",	1, 0, 'm' },
+    { "max-interval",	1, 0, 'M' },
+    { "latency",	1, 0, 'l' },
+    { "timeout",	1, 0, 't' },
+    { "duration",	1, 0, 'd' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *lemulti_help =
+    "Usage:\n"
+    "\tlemulti [--interval i] [--window w] [--min-interval c]\n"
+    "\t        [--max-interval C] [--latency l] [--timeout t]\n"
+    "\t        [--duration d] <file>\n"
+    "\n"
+    "\tKeeps every device listed in file connected, reconnecting as\n"
+    "\tlinks drop, until interrupted or for d seconds. file takes the\n"
+    "\tlewlsync format. i and w are the scan interval and window in ms\n"
+    "\t(60 and 60), c and C the connection interval in ms (30 and 50),\n"
+    "\tl the slave latency (0) and t the supervision timeout in ms\n"
+    "\t(4000).\n";
+
+static void cmd_lemulti(int dev_id, int argc, char **argv)
+{
+    struct wl_set set = { NULL, 0, 0 };
+    struct conn_orch o;
+    char filename[PATH_MAX + 1];
+    struct hci_request *rqs;
+    le_add_device_to_white_list_cp *cps;
+    struct sigaction sa;
+    uint16_t interval = 0x0060, window = 0x0060;
+    double min_ms = 30, max_ms = 50, to_ms = 4000;
+    int i, opt, dd, bad = 0, latency = 0, duration = 0;
+    uint64_t start, end = 0;
+    uint8_t size;
+
+    for_each_opt(opt, lemulti_options, NULL) {
+        switch (opt) {
+        case 'i':
+            if (parse_scan_time(optarg, &interval) < 0) {
+                fprintf(stderr, "Invalid scan interval %s\n", optarg);
+                exit(1);
+            }
             break;
         case 'w':
-            filter_policy = 0x01; /* Whitelist */
-            break;
-        case 'd':
-            filter_type = optarg[0];
-            if (filter_type != 'g' && filter_type != 'l') {
-                fprintf(stderr, "Unknown discovery procedure\n");
+            if (parse_scan_time(optarg, &window) < 0) {
+                fprintf(stderr, "Invalid scan window %s\n", optarg);
                 exit(1);
             }
-
-            interval = htobs(0x0012);
-            window = htobs(0x0012);
             break;
-        case 'D':
-            filter_dup = 0x00;
+        case 'm':
+            min_ms = atof(optarg);
+            break;
+        case 'M':
+            max_ms = atof(optarg);
+            break;
+        case 'l':
+            latency = atoi(optarg);
             break;
-        case 'c':
-            count = atoi(optarg);
-            continue;
         case 't':
-            time = atoi(optarg);
-            continue;
+            to_ms = atof(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
         default:
-            printf("%s", lescan_help);
+            printf("%s", lemulti_help);
             return;
         }
     }
-    helper_arg(0, 1, &argc, &argv, lescan_help);
+
+    helper_arg(1, 1, &argc, &argv, lemulti_help);
+
+    if (window > interval) {
+        fprintf(stderr, "Scan window can't exceed the interval\n");
+        exit(1);
+    }
+
+    if (min_ms < 7.5 || max_ms > 4000 || min_ms > max_ms ||
+            latency < 0 || latency > 499 || to_ms < 100 || to_ms > 32000) {
+        fprintf(stderr, "Invalid connection parameters\n");
+        exit(1);
+    }
+
+    if (wl_set_load(&set, argv[0], &bad) < 0 || !set.count) {
+        fprintf(stderr, "Can't read targets from %s\n", argv[0]);
+        exit(1);
+    }
+
+    if (bad)
+        fprintf(stderr, "Skipped %d invalid entries\n", bad);
 
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Could not open device");
         exit(1);
     }
 
-    err = hci_le_set_scan_parameters(dd, scan_type, interval, window,
-                        own_type, filter_policy, 1000);
-    if (err < 0) {
-        perror("Set scan parameters failed");
-        err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000);
-        if (err < 0) {
-            perror("Disable scan failed");
-            exit(2);
-        }
+    if (hci_le_read_white_list_size(dd, &size, 1000) < 0) {
+        perror("Can't read white list size");
         exit(1);
     }
 
-    err = hci_le_set_scan_enable(dd, 0x01, filter_dup, 1000);
-    if (err < 0) {
-        perror("Enable scan failed");
+    if (set.count > size) {
+        fprintf(stderr, "%d devices don't fit a white list of %d\n",
+                            set.count, size);
         exit(1);
     }
 
-    printf("LE Scan ...\n");
+    memset(&o, 0, sizeof(o));
+    o.num_targets = set.count;
+    o.targets = calloc(set.count, sizeof(*o.targets));
+    rqs = calloc(set.count, sizeof(*rqs));
+    cps = calloc(set.count, sizeof(*cps));
+    if (!o.targets || !rqs || !cps) {
+        perror("Can't allocate targets");
+        exit(1);
+    }
 
-    err = print_advertising_devices(dd, filter_type, count, time);
-    if (err < 0) {
-        perror("Could not receive advertising events");
+    o.chan = hci_cmd_chan_new(dd);
+    if (!o.chan) {
+        perror("Can't attach command channel");
         exit(1);
     }
 
-    err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000);
-    if (err < 0) {
-        perror("Disable scan failed");
+    /* The list lewlsync applied last is gone from here on */
+    wl_state_forget(dev_id);
+
+    if (hci_le_clear_white_list(dd, 1000) < 0) {
+        perror("Can't clear white list");
+        exit(1);
+    }
+
+    for (i = 0; i < set.count; i++) {
+        wl_request(&rqs[i], &set.entries[i],
+                OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &cps[i]);
+        bacpy(&o.targets[i].bdaddr, &set.entries[i].bdaddr);
+        o.targets[i].type = set.entries[i].type;
+    }
+
+    hci_cmd_chan_send_batch(o.chan, rqs, set.count, 5000);
+
+    for (i = 0; i < set.count; i++) {
+        char addr[18];
+
+        if (rqs[i].rlen >= 1 && !set.entries[i].status)
+            continue;
+
+        ba2str(&set.entries[i].bdaddr, addr);
+        fprintf(stderr, "Can't add %s to the white list\n", addr);
         exit(1);
     }
 
+    /* The controller holds exactly the targets: lewlsync can go on */
+    if (wl_state_name(dev_id, filename) == 0 &&
+                        wl_set_save(&set, filename) < 0)
+        fprintf(stderr, "Can't save %s: %s (%d)\n", filename,
+                            strerror(errno), errno);
+
+    o.cp.interval = htobs(interval);
+    o.cp.window = htobs(window);
+    o.cp.initiator_filter = 0x01;
+    o.cp.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+    o.cp.min_interval = htobs((uint16_t) (min_ms / 1.25 + 0.5));
+    o.cp.max_interval = htobs((uint16_t) (max_ms / 1.25 + 0.5));
+    o.cp.latency = htobs(latency);
+    o.cp.supervision_timeout = htobs((uint16_t) (to_ms / 10 + 0.5));
+    o.cp.min_ce_length = htobs(0x0001);
+    o.cp.max_ce_length = htobs(0x0001);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+
+    start = now_us();
+    if (duration)
+        end = start + duration * 1000000ULL;
+
+    for (i = 0; i < o.num_targets; i++)
+        o.targets[i].since = start;
+
+    hci_cmd_chan_set_event_func(o.chan, conn_event, &o);
+
+    printf("Connecting %d devices, press Ctrl-C to stop\n", o.num_targets);
+    fflush(stdout);
+
+    conn_arm(&o);
+
+    while (!signal_received) {
+        struct pollfd p;
+        int left = 100;
+        uint64_t now = now_us();
+
+        if (end) {
+            if (now >= end)
+                break;
+            if ((end - now) / 1000 < (uint64_t) left)
+                left = (end - now) / 1000 + 1;
+        }
+
+        p.fd = dd;
+        p.events = POLLIN;
+
+        if (poll(&p, 1, left) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (hci_cmd_chan_process(o.chan) < 0) {
+            perror("Read failed");
+            break;
+        }
+
+        /* Picks up a connect postponed after a rejection */
+        conn_arm(&o);
+    }
+
+    o.stopping = 1;
+
+    /* Stop the pending connect, its completion reports the cancel */
+    if (o.create_id) {
+        unsigned int id = o.create_id;
+
+        hci_cmd_chan_submit(o.chan, OGF_LE_CTL, OCF_LE_CREATE_CONN_CANCEL,
+                        0, NULL, 0, NULL, NULL);
+
+        if (hci_cmd_chan_wait(o.chan, id, 2000) < 0)
+            hci_cmd_chan_cancel(o.chan, id);
+    }
+
+    hci_cmd_chan_free(o.chan);
     hci_close_dev(dd);
+
+    printf("%d of %d devices connected after %.1f s, %lu connects, "
+            "%lu failed, %lu links dropped\n", o.num_connected,
+            o.num_targets, (now_us() - start) / 1e6, o.attempts,
+            o.failures, o.drops);
+    conn_samples_print("Initial connections", &o.initial);
+    conn_samples_print("Reconnections", &o.reconnect);
+
+    free(o.initial.us);
+    free(o.reconnect.us);
+    free(o.targets);
+    free(rqs);
+    free(cps);
+    free(set.entries);
 }
 
-static struct option lecc_options[] = {
-    { "help",	0, 0, 'h' },
-    { "random",	0, 0, 'r' },
-    { "whitelist",	0, 0, 'w' },
-    { 0, 0, 0, 0 }
+/*
+ * Link metrics sampler. Connections are listed once, afterwards the
+ * connection and disconnection events keep the table current. Every
+ * round queues Read RSSI, Read Link Quality and Read Transmit Power
+ * Level for all links on the command channel, so a round costs about
+ * one round trip per few links instead of one process per sample.
+ */
+#define LINKMON_MAX_LINKS 32
+#define LINKMON_MAX_WINDOW 64
+
+enum {
+    METRIC_RSSI,
+    METRIC_LQ,
+    METRIC_TPL,
+    METRIC_MAX,
 };
 
-static const char *lecc_help =
-    "Usage:\n"
-    "\tlecc [--random] <bdaddr>\n"
-    "\tlecc --whitelist\n";
+static const char *metric_names[METRIC_MAX] = { "rssi", "lq", "tpl" };
 
-static void cmd_lecc(int dev_id, int argc, char **argv)
-{
-    int err, opt, dd;
+struct metric_window {
+    int16_t samples[LINKMON_MAX_WINDOW];
+    int count;
+    int pos;
+    int sum;
+};
+
+struct link_mon {
+    int used;
+    uint16_t handle;
+    uint8_t type;
     bdaddr_t bdaddr;
-    uint16_t interval, latency, max_ce_length, max_interval, min_ce_length;
-    uint16_t min_interval, supervision_timeout, window, handle;
-    uint8_t initiator_filter, own_bdaddr_type, peer_bdaddr_type;
+    unsigned int ids[METRIC_MAX];
+    int pending;
+    int unsupported;
+    int valid;
+    int value[METRIC_MAX];
+    struct metric_window win[METRIC_MAX];
+    unsigned long rounds;
+    unsigned long skipped;
+};
 
-    peer_bdaddr_type = LE_PUBLIC_ADDRESS;
-    initiator_filter = 0; /* Use peer address */
+struct link_monitor {
+    struct hci_cmd_chan *chan;
+    struct link_mon links[LINKMON_MAX_LINKS];
+    int window;
+    int json;
+    uint64_t start;
+};
 
-    for_each_opt(opt, lecc_options, NULL) {
-        switch (opt) {
-        case 'r':
-            peer_bdaddr_type = LE_RANDOM_ADDRESS;
-            break;
-        case 'w':
-            initiator_filter = 0x01; /* Use white list */
-            break;
-        default:
-            printf("%s", lecc_help);
-            return;
-        }
+static struct link_monitor *link_monitor;
+
+static void metric_add(struct metric_window *w, int window, int v)
+{
+    if (w->count == window)
+        w->sum -= w->samples[w->pos];
+    else
+        w->count++;
+
+    w->samples[w->pos] = v;
+    w->sum += v;
+    w->pos = (w->pos + 1) % window;
+}
+
+static void metric_range(struct metric_window *w, int *min, int *max)
+{
+    int i;
+
+    *min = INT_MAX;
+    *max = INT_MIN;
+
+    for (i = 0; i < w->count; i++) {
+        if (w->samples[i] < *min)
+            *min = w->samples[i];
+        if (w->samples[i] > *max)
+            *max = w->samples[i];
     }
-    helper_arg(0, 1, &argc, &argv, lecc_help);
+}
 
-    if (dev_id < 0)
-        dev_id = hci_get_route(NULL);
+static struct link_mon *link_find(struct link_monitor *m, uint16_t handle)
+{
+    int i;
 
-    dd = hci_open_dev(dev_id);
-    if (dd < 0) {
-        perror("Could not open device");
-        exit(1);
+    for (i = 0; i < LINKMON_MAX_LINKS; i++)
+        if (m->links[i].used && m->links[i].handle == handle)
+            return &m->links[i];
+
+    return NULL;
+}
+
+static void link_print(struct link_monitor *m, struct link_mon *l,
+                            const char *state)
+{
+    uint64_t t = (now_us() - m->start) / 1000;
+    char addr[18];
+    int i;
+
+    ba2str(&l->bdaddr, addr);
+
+    if (m->json)
+        printf("{\"t\":%llu,\"addr\":\"%s\",\"handle\":%d,\"type\":\"%s\"",
+                (unsigned long long) t, addr, l->handle,
+                type2str(l->type));
+    else
+        printf("%llu %s %d %s", (unsigned long long) t, addr, l->handle,
+                            type2str(l->type));
+
+    if (state) {
+        printf(m->json ? ",\"state\":\"%s\"}\n" : " %s\n", state);
+        return;
     }
 
-    memset(&bdaddr, 0, sizeof(bdaddr_t));
-    if (argv[0])
-        str2ba(argv[0], &bdaddr);
+    for (i = 0; i < METRIC_MAX; i++) {
+        struct metric_window *w = &l->win[i];
+        int min, max;
 
-    interval = htobs(0x0004);
-    window = htobs(0x0004);
-    own_bdaddr_type = 0x00;
-    min_interval = htobs(0x000F);
-    max_interval = htobs(0x000F);
-    latency = htobs(0x0000);
-    supervision_timeout = htobs(0x0C80);
-    min_ce_length = htobs(0x0001);
-    max_ce_length = htobs(0x0001);
+        if (!(l->valid & (1 << i)))
+            continue;
 
-    err = hci_le_create_conn(dd, interval, window, initiator_filter,
-            peer_bdaddr_type, bdaddr, own_bdaddr_type, min_interval,
-            max_interval, latency, supervision_timeout,
-            min_ce_length, max_ce_length, &handle, 25000);
-    if (err < 0) {
-        perror("Could not create connection");
-        exit(1);
+        metric_range(w, &min, &max);
+
+        if (m->json)
+            printf(",\"%s\":%d,\"%s_avg\":%.1f,\"%s_min\":%d,"
+                    "\"%s_max\":%d", metric_names[i], l->value[i],
+                    metric_names[i], (double) w->sum / w->count,
+                    metric_names[i], min, metric_names[i], max);
+        else
+            printf(" %s %d %.1f/%d/%d", metric_names[i], l->value[i],
+                    (double) w->sum / w->count, min, max);
     }
 
-    printf("Connection handle %d\n", handle);
+    printf(m->json ? "}\n" : "\n");
+}
 
-    hci_close_dev(dd);
+static void link_sample(struct link_mon *l, int metric, int err,
+                        void *rparam, int rlen)
+{
+    struct link_monitor *m = link_monitor;
+    /* RSSI, link quality and power level replies share this layout */
+    read_rssi_rp *rp = rparam;
+
+    l->ids[metric] = 0;
+    l->pending--;
+
+    if (!err && rlen >= READ_RSSI_RP_SIZE && !rp->status) {
+        /* Link quality is the only unsigned one */
+        if (metric == METRIC_LQ)
+            l->value[metric] = (uint8_t) rp->rssi;
+        else
+            l->value[metric] = rp->rssi;
+
+        l->valid |= 1 << metric;
+        metric_add(&l->win[metric], m->window, l->value[metric]);
+    } else if (!err) {
+        /* Not available on this link, e.g. link quality on LE */
+        l->unsupported |= 1 << metric;
+    }
+
+    if (!err && l->pending == 0 && l->valid)
+        link_print(m, l, NULL);
 }
 
-static struct option lewladd_options[] = {
-    { "help",	0, 0, 'h' },
-    { "random",	0, 0, 'r' },
-    { 0, 0, 0, 0 }
-};
+static void link_rssi(int err, void *rparam, int rlen, void *user_data)
+{
+    link_sample(user_data, METRIC_RSSI, err, rparam, rlen);
+}
 
-static const char *lewladd_help =
-    "Usage:\n"
-    "\tlewladd [--random] <bdaddr>\n";
+static void link_lq(int err, void *rparam, int rlen, void *user_data)
+{
+    link_sample(user_data, METRIC_LQ, err, rparam, rlen);
+}
 
-static void cmd_lewladd(int dev_id, int argc, char **argv)
+static void link_tpl(int err, void *rparam, int rlen, void *user_data)
 {
-    int err, opt, dd;
-    bdaddr_t bdaddr;
-    uint8_t bdaddr_type = LE_PUBLIC_ADDRESS;
+    link_sample(user_data, METRIC_TPL, err, rparam, rlen);
+}
 
-    for_each_opt(opt, lewladd_options, NULL) {
-        switch (opt) {
-        case 'r':
-            bdaddr_type = LE_RANDOM_ADDRESS;
-            break;
-        default:
-            printf("%s", lewladd_help);
-            return;
-        }
+static void link_round(struct link_monitor *m, struct link_mon *l)
+{
+    read_transmit_power_level_cp tpl;
+    uint16_t handle = htobs(l->handle);
+
+    /* Slower than the rate allows: skip rather than queue up */
+    if (l->pending) {
+        l->skipped++;
+        return;
     }
 
-    helper_arg(1, 1, &argc, &argv, lewladd_help);
+    l->rounds++;
 
-    if (dev_id < 0)
-        dev_id = hci_get_route(NULL);
+    if (!(l->unsupported & (1 << METRIC_RSSI))) {
+        l->ids[METRIC_RSSI] = hci_cmd_chan_submit(m->chan,
+                    OGF_STATUS_PARAM, OCF_READ_RSSI, 0,
+                    &handle, 2, link_rssi, l);
+        if (l->ids[METRIC_RSSI])
+            l->pending++;
+    }
+
+    if (!(l->unsupported & (1 << METRIC_LQ))) {
+        l->ids[METRIC_LQ] = hci_cmd_chan_submit(m->chan,
+                    OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY, 0,
+                    &handle, 2, link_lq, l);
+        if (l->ids[METRIC_LQ])
+            l->pending++;
+    }
+
+    if (!(l->unsupported & (1 << METRIC_TPL))) {
+        tpl.handle = handle;
+        tpl.type = 0; /* Current level */
+        l->ids[METRIC_TPL] = hci_cmd_chan_submit(m->chan,
+                    OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL, 0,
+                    &tpl, READ_TRANSMIT_POWER_LEVEL_CP_SIZE,
+                    link_tpl, l);
+        if (l->ids[METRIC_TPL])
+            l->pending++;
+    }
+}
+
+static struct link_mon *link_add(struct link_monitor *m, uint16_t handle,
+                    uint8_t type, const bdaddr_t *bdaddr)
+{
+    struct link_mon *l;
+    int i;
+
+    l = link_find(m, handle);
+    if (l)
+        return l;
+
+    for (i = 0; i < LINKMON_MAX_LINKS; i++) {
+        if (m->links[i].used)
+            continue;
+
+        l = &m->links[i];
+        memset(l, 0, sizeof(*l));
+        l->used = 1;
+        l->handle = handle;
+        l->type = type;
+        bacpy(&l->bdaddr, bdaddr);
+
+        return l;
+    }
+
+    return NULL;
+}
+
+static void link_event(uint8_t evt, void *data, int len, void *user_data)
+{
+    struct link_monitor *m = user_data;
+    struct link_mon *l;
+    int i;
+
+    switch (evt) {
+    case EVT_CONN_COMPLETE: {
+        evt_conn_complete *cc = data;
+
+        /* EVT_CONN_COMPLETE_SIZE overstates the event's length */
+        if (len < (int) sizeof(*cc) || cc->status ||
+                        cc->link_type != ACL_LINK)
+            return;
+
+        l = link_add(m, btohs(cc->handle), ACL_LINK, &cc->bdaddr);
+        break;
+    }
+    case EVT_LE_META_EVENT: {
+        evt_le_meta_event *me = data;
+        evt_le_connection_complete *cc = (void *) me->data;
 
-    dd = hci_open_dev(dev_id);
-    if (dd < 0) {
-        perror("Could not open device");
-        exit(1);
+        if (len < 1 + EVT_LE_CONN_COMPLETE_SIZE ||
+                me->subevent != EVT_LE_CONN_COMPLETE || cc->status)
+            return;
+
+        l = link_add(m, btohs(cc->handle), LE_LINK, &cc->peer_bdaddr);
+        break;
     }
+    case EVT_DISCONN_COMPLETE: {
+        evt_disconn_complete *dc = data;
 
-    str2ba(argv[0], &bdaddr);
+        if (len < EVT_DISCONN_COMPLETE_SIZE || dc->status)
+            return;
 
-    err = hci_le_add_white_list(dd, &bdaddr, bdaddr_type, 1000);
-    hci_close_dev(dd);
+        l = link_find(m, btohs(dc->handle));
+        if (!l)
+            return;
 
-    if (err < 0) {
-        err = -errno;
-        fprintf(stderr, "Can't add to white list: %s(%d)\n",
-                            strerror(-err), -err);
-        exit(1);
+        for (i = 0; i < METRIC_MAX; i++)
+            if (l->ids[i])
+                hci_cmd_chan_cancel(m->chan, l->ids[i]);
+
+        link_print(m, l, "disconnected");
+        l->used = 0;
+        return;
+    }
+    default:
+        return;
     }
+
+    if (l)
+        link_print(m, l, "connected");
 }
 
-static struct option lewlrm_options[] = {
+static struct option linkmon_options[] = {
     { "help",	0, 0, 'h' },
+    { "rate",	1, 0, 'r' },
+    { "window",	1, 0, 'w' },
+    { "format",	1, 0, 'f' },
+    { "duration",	1, 0, 'd' },
     { 0, 0, 0, 0 }
 };
 
-static const char *lewlrm_help =
+static const char *linkmon_help =
     "Usage:\n"
-    "\tlewlrm <bdaddr>\n";
-
-static void cmd_lewlrm(int dev_id, int argc, char **argv)
+    "\tlinkmon [--rate r] [--window n] [--format text|json]\n"
+    "\t        [--duration d]\n"
+    "\n"
+    "\tSamples RSSI, link quality and transmit power level of every\n"
+    "\tconnection r times a second (1). Each record carries the\n"
+    "\tlatest value and the average/min/max of the last n samples (16).\n";
+
+static void cmd_linkmon(int dev_id, int argc, char **argv)
 {
-    int err, opt, dd;
-    bdaddr_t bdaddr;
+    struct link_monitor m;
+    struct hci_conn_list_req *cl;
+    struct hci_conn_info *ci;
+    struct hci_cmd_chan_stats st;
+    struct sigaction sa;
+    double rate = 1;
+    uint64_t period, next, end = 0;
+    unsigned long rounds = 0, skipped = 0;
+    int i, opt, dd, duration = 0;
 
-    for_each_opt(opt, lewlrm_options, NULL) {
+    memset(&m, 0, sizeof(m));
+    m.window = 16;
+
+    for_each_opt(opt, linkmon_options, NULL) {
         switch (opt) {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'w':
+            m.window = atoi(optarg);
+            break;
+        case 'f':
+            if (!strcasecmp(optarg, "json"))
+                m.json = 1;
+            else if (strcasecmp(optarg, "text")) {
+                fprintf(stderr, "Unknown format %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
         default:
-            printf("%s", lewlrm_help);
+            printf("%s", linkmon_help);
             return;
         }
     }
 
-    helper_arg(1, 1, &argc, &argv, lewlrm_help);
+    helper_arg(0, 0, &argc, &argv, linkmon_help);
+
+    if (rate <= 0 || rate > 1000 || m.window < 1 ||
+                        m.window > LINKMON_MAX_WINDOW) {
+        printf("%s", linkmon_help);
+        exit(1);
+    }
 
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Could not open device");
         exit(1);
     }
 
-    str2ba(argv[0], &bdaddr);
+    m.chan = hci_cmd_chan_new(dd);
+    if (!m.chan) {
+        perror("Can't attach command channel");
+        exit(1);
+    }
 
-    err = hci_le_rm_white_list(dd, &bdaddr, LE_PUBLIC_ADDRESS, 1000);
-    hci_close_dev(dd);
+    /* The only listing, events take over from here */
+    cl = malloc(LINKMON_MAX_LINKS * sizeof(*ci) + sizeof(*cl));
+    if (!cl) {
+        perror("Can't allocate memory");
+        exit(1);
+    }
 
-    if (err < 0) {
-        err = errno;
-        fprintf(stderr, "Can't remove from white list: %s(%d)\n",
-                            strerror(err), err);
+    cl->dev_id = dev_id;
+    cl->conn_num = LINKMON_MAX_LINKS;
+
+    if (ioctl(dd, HCIGETCONNLIST, (void *) cl) < 0) {
+        perror("Can't get connection list");
         exit(1);
     }
-}
 
-static struct option lewlsz_options[] = {
-    { "help",	0, 0, 'h' },
-    { 0, 0, 0, 0 }
-};
+    m.start = now_us();
+    link_monitor = &m;
 
-static const char *lewlsz_help =
-    "Usage:\n"
-    "\tlewlsz\n";
+    for (i = 0, ci = cl->conn_info; i < cl->conn_num; i++, ci++) {
+        struct link_mon *l;
 
-static void cmd_lewlsz(int dev_id, int argc, char **argv)
-{
-    int err, dd, opt;
-    uint8_t size;
+        if (ci->type != ACL_LINK && ci->type != LE_LINK)
+            continue;
 
-    for_each_opt(opt, lewlsz_options, NULL) {
-        switch (opt) {
-        default:
-            printf("%s", lewlsz_help);
-            return;
-        }
+        l = link_add(&m, ci->handle, ci->type, &ci->bdaddr);
+        if (l)
+            link_print(&m, l, "connected");
     }
 
-    helper_arg(0, 0, &argc, &argv, lewlsz_help);
-
-    if (dev_id < 0)
-        dev_id = hci_get_route(NULL);
+    free(cl);
 
-    dd = hci_open_dev(dev_id);
-    if (dd < 0) {
-        perror("Could not open device");
-        exit(1);
-    }
+    hci_cmd_chan_set_event_func(m.chan, link_event, &m);
 
-    err = hci_le_read_white_list_size(dd, &size, 1000);
-    hci_close_dev(dd);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
 
-    if (err < 0) {
-        err = -errno;
-        fprintf(stderr, "Can't read white list size: %s(%d)\n",
-                            strerror(-err), -err);
-        exit(1);
-    }
+    period = 1000000 / rate;
+    next = m.start;
+    if (duration)
+        end = m.start + duration * 1000000ULL;
 
-    printf("White list size: %d\n", size);
-}
+    while (!signal_received) {
+        uint64_t now = now_us();
+        struct pollfd p;
+        int left;
 
-static struct option lewlclr_options[] = {
-    { "help",	0, 0, 'h' },
-    { 0, 0, 0, 0 }
-};
+        if (end && now >= end)
+            break;
 
-static const char *lewlclr_help =
-    "Usage:\n"
-    "\tlewlclr\n";
+        if (now >= next) {
+            for (i = 0; i < LINKMON_MAX_LINKS; i++)
+                if (m.links[i].used)
+                    link_round(&m, &m.links[i]);
 
-static void cmd_lewlclr(int dev_id, int argc, char **argv)
-{
-    int err, dd, opt;
+            fflush(stdout);
 
-    for_each_opt(opt, lewlclr_options, NULL) {
-        switch (opt) {
-        default:
-            printf("%s", lewlclr_help);
-            return;
+            /* Don't burst to catch up after a stall */
+            next += period;
+            if (next < now)
+                next = now + period;
         }
-    }
 
-    helper_arg(0, 0, &argc, &argv, lewlclr_help);
+        now = now_us();
+        left = next > now ? (next - now + 999) / 1000 : 0;
+        if (end && end < next)
+            left = end > now ? (end - now + 999) / 1000 : 0;
 
-    if (dev_id < 0)
-        dev_id = hci_get_route(NULL);
+        p.fd = dd;
+        p.events = POLLIN;
 
-    dd = hci_open_dev(dev_id);
-    if (dd < 0) {
-        perror("Could not open device");
-        exit(1);
+        if (poll(&p, 1, left) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (hci_cmd_chan_process(m.chan) < 0) {
+            perror("Read failed");
+            break;
+        }
     }
 
-    err = hci_le_clear_white_list(dd, 1000);
+    for (i = 0; i < LINKMON_MAX_LINKS; i++) {
+        rounds += m.links[i].rounds;
+        skipped += m.links[i].skipped;
+    }
+
+    hci_cmd_chan_get_stats(m.chan, &st);
+    hci_cmd_chan_free(m.chan);
     hci_close_dev(dd);
 
-    if (err < 0) {
-        err = -errno;
-        fprintf(stderr, "Can't clear white list: %s(%d)\n",
-                            strerror(-err), -err);
-        exit(1);
-    }
+    link_monitor = NULL;
+
+    fprintf(stderr, "%lu link samples, %lu skipped, %lu commands, "
+            "up to %lu in flight\n", rounds, skipped, st.commands,
+            st.max_inflight);
 }
 
 static struct option ledc_options[] = {
@@ -2900,7 +6608,7 @@ static void cmd_ledc(int dev_id, int argc, char **argv)
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         perror("Could not open device");
         exit(1);
@@ -2988,7 +6696,7 @@ static void cmd_lecup(int dev_id, int argc, char **argv)
     if (dev_id < 0)
         dev_id = hci_get_route(NULL);
 
-    dd = hci_open_dev(dev_id);
+    dd = open_dev(dev_id);
     if (dd < 0) {
         fprintf(stderr, "HCI device open failed\n");
         exit(1);
@@ -3004,6 +6712,8 @@ static void cmd_lecup(int dev_id, int argc, char **argv)
     hci_close_dev(dd);
 }
 
+static void cmd_batch(int dev_id, int argc, char **argv);
+
 static struct {
     char *cmd;
     void (*func)(int dev_id, int argc, char **argv);
@@ -3025,6 +6735,7 @@ static struct {
     { "rssi",     cmd_rssi,    "Display connection RSSI"              },
     { "lq",       cmd_lq,      "Display link quality"                 },
     { "tpl",      cmd_tpl,     "Display transmit power level"         },
+    { "linkmon",  cmd_linkmon, "Monitor RSSI, link quality and TX power" },
     { "afh",      cmd_afh,     "Display AFH channel map"              },
     { "lp",       cmd_lp,      "Set/display link policy settings"     },
     { "lst",      cmd_lst,     "Set/display link supervision timeout" },
@@ -3038,12 +6749,27 @@ static struct {
     { "lewlrm",   cmd_lewlrm,  "Remove device from LE White List"     },
     { "lewlsz",   cmd_lewlsz,  "Read size of LE White List"           },
     { "lewlclr",  cmd_lewlclr, "Clear LE White list"                  },
+    { "lewlsync", cmd_lewlsync, "Synchronize LE White List with a file" },
     { "lecc",     cmd_lecc,    "Create a LE Connection"               },
+    { "lemulti",  cmd_lemulti, "Keep several LE devices connected"    },
     { "ledc",     cmd_ledc,    "Disconnect a LE Connection"           },
     { "lecup",    cmd_lecup,   "LE Connection Update"                 },
+    { "rpabench", cmd_rpabench, "Benchmark private address resolution" },
+    { "batch",    cmd_batch,   "Run commands from a file on one device" },
     { NULL, NULL, 0 }
 };
 
+static int find_command(const char *name)
+{
+    int i;
+
+    for (i = 0; command[i].cmd; i++)
+        if (!strncmp(command[i].cmd, name, strlen(command[i].cmd)))
+            return i;
+
+    return -1;
+}
+
 static void usage(void)
 {
     int i;
@@ -3063,6 +6789,226 @@ static void usage(void)
         "\thcitool <command> --help\n" );
 }
 
+#define BATCH_MAX_ARGS 64
+
+/* Split a script line on blanks, "..." keeps blanks inside an argument */
+static int batch_split(char *line, char **argv)
+{
+    int argc = 0;
+    char *p = line;
+
+    while (*p) {
+        while (isspace((unsigned char) *p))
+            p++;
+
+        if (!*p || *p == '#')
+            break;
+
+        if (argc == BATCH_MAX_ARGS - 1)
+            return -1;
+
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            while (*p && *p != '"')
+                p++;
+        } else {
+            argv[argc++] = p;
+            while (*p && !isspace((unsigned char) *p))
+                p++;
+        }
+
+        if (*p)
+            *p++ = '\0';
+    }
+
+    argv[argc] = NULL;
+
+    return argc;
+}
+
+/* Throw away events a previous command left on the shared socket */
+static void batch_drain(int dd)
+{
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+
+    while (recv(dd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+static int batch_run(FILE *script, int dev_id, int argc, char **argv)
+{
+    int i, status;
+    pid_t pid;
+
+    i = find_command(argv[0]);
+    if (i < 0) {
+        fprintf(stderr, "Unknown command - \"%s\"\n", argv[0]);
+        return 1;
+    }
+
+    if (command[i].func == cmd_batch) {
+        fprintf(stderr, "batch can't be nested\n");
+        return 1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /*
+     * Commands exit() on errors, so each runs in a child of its own.
+     * The child inherits the open device and the resolved route, which
+     * is what made running them as separate processes slow.
+     */
+    pid = fork();
+    if (pid < 0) {
+        perror("Can't fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        /*
+         * exit() would seek the shared script descriptor back to what
+         * this copy of the stream has consumed, rewinding the parent.
+         */
+        close(fileno(script));
+
+        optind = 0;
+        command[i].func(dev_id, argc, argv);
+        exit(0);
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Can't wait for command");
+            return 1;
+        }
+    }
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+
+    return WEXITSTATUS(status);
+}
+
+static struct option batch_options[] = {
+    { "help",	0, 0, 'h' },
+    { "keep-going",	0, 0, 'k' },
+    { "quiet",	0, 0, 'q' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *batch_help =
+    "Usage:\n"
+    "\tbatch [--keep-going] [--quiet] [file]\n"
+    "\n"
+    "\tRuns one hcitool command per line of file, or of stdin, on a\n"
+    "\tdevice opened once. # starts a comment. Stops at the first\n"
+    "\tfailing command unless --keep-going is given.\n";
+
+static void cmd_batch(int dev_id, int argc, char **argv)
+{
+    char line[1024], *args[BATCH_MAX_ARGS];
+    uint64_t start, setup, t, lat, total = 0, lat_min = 0, lat_max = 0;
+    int opt, n, ret, lineno = 0, count = 0, failed = 0;
+    int keep_going = 0, quiet = 0;
+    FILE *f = stdin;
+
+    for_each_opt(opt, batch_options, NULL) {
+        switch (opt) {
+        case 'k':
+            keep_going = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            printf("%s", batch_help);
+            return;
+        }
+    }
+
+    helper_arg(0, 1, &argc, &argv, batch_help);
+
+    if (argc > 0 && strcmp(argv[0], "-")) {
+        f = fopen(argv[0], "r");
+        if (!f) {
+            perror("Can't open script");
+            exit(1);
+        }
+    }
+
+    start = now_us();
+
+    if (dev_id < 0)
+        dev_id = hci_get_route(NULL);
+
+    if (dev_id < 0) {
+        perror("Device is not available");
+        exit(1);
+    }
+
+    batch_dd = hci_open_dev(dev_id);
+    if (batch_dd < 0) {
+        perror("Could not open device");
+        exit(1);
+    }
+
+    batch_dev_id = dev_id;
+    setup = now_us() - start;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        n = batch_split(line, args);
+        if (n < 0) {
+            fprintf(stderr, "Line %d: too many arguments\n", lineno);
+            ret = 1;
+        } else if (n == 0) {
+            continue;
+        } else {
+            batch_drain(batch_dd);
+
+            t = now_us();
+            ret = batch_run(f, dev_id, n, args);
+            lat = now_us() - t;
+
+            if (count == 0 || lat < lat_min)
+                lat_min = lat;
+            if (lat > lat_max)
+                lat_max = lat;
+
+            total += lat;
+            count++;
+
+            if (!quiet)
+                fprintf(stderr, "Line %d: %s: exit %d, %llu.%03llu ms\n",
+                        lineno, args[0], ret,
+                        (unsigned long long) lat / 1000,
+                        (unsigned long long) lat % 1000);
+        }
+
+        if (ret) {
+            failed++;
+            if (!keep_going)
+                break;
+        }
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    hci_close_dev(batch_dd);
+    batch_dd = -1;
+
+    fprintf(stderr, "%d commands, %d failed, %.3f ms total "
+            "(%.3f/%.3f/%.3f ms min/avg/max), %.3f ms to open hci%d\n",
+            count, failed, total / 1000.0, lat_min / 1000.0,
+            count ? total / 1000.0 / count : 0, lat_max / 1000.0,
+            setup / 1000.0, dev_id);
+
+    if (failed)
+        exit(1);
+}
+
 static struct option main_options[] = {
     { "help",	0, 0, 'h' },
     { "device",	1, 0, 'i' },
@@ -3105,19 +7051,13 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    for (i = 0; command[i].cmd; i++) {
-        if (strncmp(command[i].cmd,
-                argv[0], strlen(command[i].cmd)))
-            continue;
-
-        command[i].func(dev_id, argc, argv);
-        break;
-    }
-
-    if (command[i].cmd == 0) {
+    i = find_command(argv[0]);
+    if (i < 0) {
         fprintf(stderr, "Unknown command - \"%s\"\n", *argv);
         exit(1);
     }
 
+    command[i].func(dev_id, argc, argv);
+
     return 0;
 }
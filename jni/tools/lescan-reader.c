@@ -0,0 +1,280 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Example consumer of the ring published by "hcitool lescan --ring".
+ * With -b it instead measures the ring itself: a child process publishes
+ * synthetic records as fast as it can while this process reads them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lescan.h"
+
+static volatile sig_atomic_t __io_canceled = 0;
+
+static void sig_term(int sig)
+{
+	__io_canceled = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_record(uint64_t seq, const struct lescan_record *rec)
+{
+	uint64_t ts = bt_get_le64(&rec->timestamp);
+	char addr[18];
+	int i;
+
+	ba2str(&rec->bdaddr, addr);
+
+	printf("%llu %llu.%06llu %s %s evt %u rssi %d packets %u ",
+			(unsigned long long) seq,
+			(unsigned long long) ts / 1000000,
+			(unsigned long long) ts % 1000000, addr,
+			rec->bdaddr_type ? "random" : "public", rec->evt_type,
+			rec->rssi, bt_get_le16(&rec->packets));
+
+	for (i = 0; i < rec->data_len; i++)
+		printf("%02x", rec->data[i]);
+
+	printf("\n");
+}
+
+/* Returns 1 when *ring was replaced by a newly attached one */
+static int follow(struct lescan_ring **ring, const char *path)
+{
+	if (*ring && lescan_ring_replaced(*ring, path)) {
+		fprintf(stderr, "Ring replaced, re-attaching\n");
+		lescan_ring_close(*ring);
+		*ring = NULL;
+	}
+
+	/* Attaching fails until the new publisher has set the ring up */
+	if (!*ring) {
+		*ring = lescan_ring_attach(path);
+		return *ring != NULL;
+	}
+
+	return 0;
+}
+
+static int do_read(const char *path)
+{
+	uint8_t buf[LESCAN_RECORD_MAX];
+	struct lescan_record *rec = (void *) buf;
+	struct lescan_ring *ring;
+	uint64_t seq, lost = 0, reported = 0;
+
+	ring = lescan_ring_attach(path);
+	if (!ring) {
+		perror("Can't attach to ring");
+		return 1;
+	}
+
+	/* Start with the records published from now on */
+	seq = lescan_ring_head(ring);
+
+	while (!__io_canceled) {
+		if (!ring || !lescan_ring_read(ring, &seq, rec, &lost)) {
+			fflush(stdout);
+			usleep(10000);
+
+			/* A new ring starts over from its first record */
+			if (follow(&ring, path))
+				seq = lost = reported = 0;
+			continue;
+		}
+
+		if (lost != reported) {
+			fprintf(stderr, "Overrun, %llu records lost\n",
+				(unsigned long long) (lost - reported));
+			reported = lost;
+		}
+
+		print_record(seq - 1, rec);
+	}
+
+	lescan_ring_close(ring);
+
+	return 0;
+}
+
+static void publish(struct lescan_ring *ring, unsigned long count)
+{
+	uint8_t buf[LESCAN_RECORD_SIZE + 31];
+	struct lescan_record *rec = (void *) buf;
+	unsigned long i;
+
+	memset(buf, 0, sizeof(buf));
+	rec->len = htobs(sizeof(buf));
+	rec->data_len = 31;
+
+	for (i = 0; i < count; i++) {
+		bt_put_le64(i, &rec->timestamp);
+		rec->rssi = -(int8_t) (i % 100);
+		lescan_ring_publish(ring, rec);
+	}
+}
+
+static int do_bench(const char *path, unsigned int slots,
+						unsigned long count)
+{
+	uint8_t buf[LESCAN_RECORD_MAX];
+	struct lescan_record *rec = (void *) buf;
+	struct lescan_ring *ring, *reader;
+	uint64_t seq = 0, lost = 0, read = 0, torn = 0;
+	double start, elapsed;
+	pid_t pid;
+
+	ring = lescan_ring_create(path, slots);
+	if (!ring) {
+		perror("Can't create ring");
+		return 1;
+	}
+
+	reader = lescan_ring_attach(path);
+	if (!reader) {
+		perror("Can't attach to ring");
+		lescan_ring_close(ring);
+		return 1;
+	}
+
+	start = now();
+
+	pid = fork();
+	if (pid < 0) {
+		perror("Can't fork publisher");
+		return 1;
+	}
+
+	if (pid == 0) {
+		publish(ring, count);
+		_exit(0);
+	}
+
+	while (seq < count) {
+		if (!lescan_ring_read(reader, &seq, rec, &lost)) {
+			if (waitpid(pid, NULL, WNOHANG) == pid &&
+					lescan_ring_head(reader) == seq)
+				break;
+
+			sched_yield();
+			continue;
+		}
+
+		/* The timestamp carries the sequence number */
+		if (bt_get_le64(&rec->timestamp) != seq - 1)
+			torn++;
+
+		read++;
+	}
+
+	elapsed = now() - start;
+
+	waitpid(pid, NULL, 0);
+
+	/* Only what got through counts: the publisher never waits */
+	printf("%lu records through %u slots in %.3f s\n", count,
+						slots, elapsed);
+	printf("%.0f records/s read, %llu read, %llu lost (%.2f%%), "
+			"%llu inconsistent\n", read / elapsed,
+			(unsigned long long) read, (unsigned long long) lost,
+			count ? 100.0 * lost / count : 0.0,
+			(unsigned long long) torn);
+
+	lescan_ring_close(reader);
+	lescan_ring_close(ring);
+	unlink(path);
+
+	return torn ? 1 : 0;
+}
+
+static void usage(void)
+{
+	printf("lescan-reader - read the lescan shared memory ring\n"
+		"Usage:\n"
+		"\tlescan-reader <ring file>\n"
+		"\tlescan-reader -b [-n count] [-s slots] <scratch file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	unsigned long count = 10000000;
+	unsigned int slots = 4096;
+	int bench = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bn:s:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			slots = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if (bench)
+		return do_bench(argv[optind], slots, count);
+
+	return do_read(argv[optind]);
+}
@@ -0,0 +1,299 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The ring file is a header followed by a power of two number of fixed
+ * size slots. Record n lives in slot n % slots, and the slot's sequence
+ * word holds n + 1 once the record is complete (0 while it is being
+ * written). head counts the records published so far.
+ *
+ * Readers never write to the file. A read copies the slot and checks the
+ * sequence word before and after the copy, so a record overwritten under
+ * the reader is detected and reported as lost rather than returned torn.
+ * Restarting the publisher replaces the file. Readers notice by the file
+ * they attached to no longer being the one at the path, and re-attach.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lescan.h"
+
+#define RING_MAGIC	0x5253454c	/* "LESR" */
+#define RING_VERSION	1
+
+struct ring_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t slots;
+	uint32_t reserved;
+	volatile uint64_t head;
+	uint8_t pad[40];
+} __attribute__ ((packed));
+
+struct ring_slot {
+	volatile uint64_t seq;
+	uint8_t record[LESCAN_RECORD_MAX];
+} __attribute__ ((packed));
+
+struct lescan_ring {
+	struct ring_header *hdr;
+	uint8_t *slots;
+	size_t size;
+	uint32_t mask;
+	dev_t dev;
+	ino_t ino;
+};
+
+static struct ring_slot *ring_slot(struct lescan_ring *ring, uint64_t seq)
+{
+	return (struct ring_slot *) (ring->slots +
+			(seq & ring->mask) * ring->hdr->slot_size);
+}
+
+static struct lescan_ring *ring_map(int fd, size_t size, int prot)
+{
+	struct lescan_ring *ring;
+	void *map;
+
+	map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring) {
+		munmap(map, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ring->hdr = map;
+	ring->slots = (uint8_t *) map + sizeof(struct ring_header);
+	ring->size = size;
+	ring->dev = 0;
+	ring->ino = 0;
+
+	return ring;
+}
+
+struct lescan_ring *lescan_ring_create(const char *path, unsigned int slots)
+{
+	struct lescan_ring *ring;
+	unsigned int n;
+	size_t size;
+	int fd;
+
+	if (slots == 0 || slots > 0x100000) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (n = 1; n < slots; n <<= 1);
+
+	size = sizeof(struct ring_header) + n * sizeof(struct ring_slot);
+
+	/* A new file, so readers of a previous run keep a valid mapping */
+	unlink(path);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	ring = ring_map(fd, size, PROT_READ | PROT_WRITE);
+	close(fd);
+
+	if (!ring)
+		return NULL;
+
+	ring->mask = n - 1;
+
+	ring->hdr->version = RING_VERSION;
+	ring->hdr->slot_size = sizeof(struct ring_slot);
+	ring->hdr->slots = n;
+	ring->hdr->head = 0;
+
+	/* Attaching readers check the magic last written */
+	__sync_synchronize();
+	ring->hdr->magic = RING_MAGIC;
+
+	return ring;
+}
+
+struct lescan_ring *lescan_ring_attach(const char *path)
+{
+	struct lescan_ring *ring;
+	struct ring_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = ring_map(fd, st.st_size, PROT_READ);
+	close(fd);
+
+	if (!ring)
+		return NULL;
+
+	hdr = ring->hdr;
+
+	if (hdr->magic != RING_MAGIC || hdr->version != RING_VERSION ||
+			hdr->slot_size < sizeof(struct ring_slot) ||
+			hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) ||
+			sizeof(*hdr) + (size_t) hdr->slots * hdr->slot_size >
+								ring->size) {
+		lescan_ring_close(ring);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring->mask = hdr->slots - 1;
+	ring->dev = st.st_dev;
+	ring->ino = st.st_ino;
+
+	return ring;
+}
+
+void lescan_ring_close(struct lescan_ring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->hdr, ring->size);
+	free(ring);
+}
+
+void lescan_ring_publish(struct lescan_ring *ring,
+					const struct lescan_record *rec)
+{
+	uint64_t seq = ring->hdr->head;
+	struct ring_slot *slot = ring_slot(ring, seq);
+	size_t len = bt_get_le16(&rec->len);
+
+	if (len > LESCAN_RECORD_MAX)
+		len = LESCAN_RECORD_MAX;
+
+	slot->seq = 0;
+	__sync_synchronize();
+
+	memcpy(slot->record, rec, len);
+
+	__sync_synchronize();
+	slot->seq = seq + 1;
+	ring->hdr->head = seq + 1;
+}
+
+uint64_t lescan_ring_head(struct lescan_ring *ring)
+{
+	uint64_t head = ring->hdr->head;
+
+	__sync_synchronize();
+
+	return head;
+}
+
+/*
+ * Copy record *seq into rec, which must hold LESCAN_RECORD_MAX bytes.
+ * Returns 1 and advances *seq when a record was copied, 0 when the reader
+ * has caught up with the publisher. Records overwritten before they could
+ * be read are skipped and added to *lost.
+ */
+int lescan_ring_read(struct lescan_ring *ring, uint64_t *seq,
+				struct lescan_record *rec, uint64_t *lost)
+{
+	uint32_t slots = ring->mask + 1;
+
+	while (1) {
+		uint64_t head = lescan_ring_head(ring);
+		struct ring_slot *slot;
+		uint64_t before, after;
+		size_t len;
+
+		if (*seq >= head)
+			return 0;
+
+		if (head - *seq > slots) {
+			*lost += head - slots - *seq;
+			*seq = head - slots;
+		}
+
+		slot = ring_slot(ring, *seq);
+
+		before = slot->seq;
+		__sync_synchronize();
+
+		if (before == *seq + 1) {
+			memcpy(rec, slot->record, LESCAN_RECORD_MAX);
+			__sync_synchronize();
+			after = slot->seq;
+
+			len = bt_get_le16(&rec->len);
+
+			if (after == before && len >= LESCAN_RECORD_SIZE &&
+						len <= LESCAN_RECORD_MAX) {
+				(*seq)++;
+				return 1;
+			}
+		}
+
+		/* Overwritten under us: at least this record is gone */
+		(*lost)++;
+		(*seq)++;
+	}
+}
+
+/*
+ * Returns 1 once path names another file than the one attached, as when
+ * the publisher has restarted. The old mapping stays readable, but no
+ * longer receives records.
+ */
+int lescan_ring_replaced(struct lescan_ring *ring, const char *path)
+{
+	struct stat st;
+
+	/* Not there again yet */
+	if (stat(path, &st) < 0)
+		return 0;
+
+	return st.st_dev != ring->dev || st.st_ino != ring->ino;
+}
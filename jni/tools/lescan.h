@@ -0,0 +1,78 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __LESCAN_H
+#define __LESCAN_H
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+
+/*
+ * Binary record written by "hcitool lescan --format=binary", one per
+ * advertising report. All fields are little endian. len is the size of
+ * the whole record including the header, so a stream of records can be
+ * split without knowing the layout of newer versions.
+ *
+ * Without --dedup every record describes a single packet: packets is 1
+ * and the RSSI statistics equal rssi. Records flushed from the duplicate
+ * cache when the scan ends carry statistics but no AD data.
+ */
+struct lescan_record {
+	uint16_t	len;
+	uint8_t		evt_type;
+	uint8_t		bdaddr_type;
+	uint64_t	timestamp;	/* CLOCK_MONOTONIC, microseconds */
+	bdaddr_t	bdaddr;
+	int8_t		rssi;
+	int8_t		rssi_min;
+	int8_t		rssi_avg;
+	int8_t		rssi_max;
+	uint16_t	packets;
+	uint8_t		data_len;
+	uint8_t		data[0];
+} __attribute__ ((packed));
+#define LESCAN_RECORD_SIZE 25
+
+#define LESCAN_EVT_UNKNOWN 0xff
+
+/* Largest record: the header plus a full 255 byte AD payload */
+#define LESCAN_RECORD_MAX (LESCAN_RECORD_SIZE + 255)
+
+/*
+ * Shared memory ring of lescan records, one publisher and any number of
+ * readers. Each reader keeps its own position and learns how many
+ * records it lost when the publisher laps it.
+ */
+struct lescan_ring;
+
+struct lescan_ring *lescan_ring_create(const char *path, unsigned int slots);
+struct lescan_ring *lescan_ring_attach(const char *path);
+void lescan_ring_close(struct lescan_ring *ring);
+
+void lescan_ring_publish(struct lescan_ring *ring,
+					const struct lescan_record *rec);
+
+uint64_t lescan_ring_head(struct lescan_ring *ring);
+int lescan_ring_read(struct lescan_ring *ring, uint64_t *seq,
+				struct lescan_record *rec, uint64_t *lost);
+int lescan_ring_replaced(struct lescan_ring *ring, const char *path);
+
+#endif /* __LESCAN_H */
@@ -0,0 +1,178 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Compiles the IEEE OUI text file into the index ouitocomp() searches.
+ * With -b it instead compares lookups per second through the index and
+ * through the text file, using the compiled in default paths.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "oui.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Same pseudo random OUIs on every run, mostly unlisted ones */
+static void bench_oui(unsigned long i, char *oui)
+{
+	unsigned long val = (i * 2654435761UL) & 0xffffff;
+
+	sprintf(oui, "%2.2lX-%2.2lX-%2.2lX", val >> 16, (val >> 8) & 0xff,
+								val & 0xff);
+}
+
+static unsigned long bench(const char *what, char *(*lookup)(const char *),
+				unsigned long count, double limit)
+{
+	unsigned long i, found = 0;
+	double start, elapsed;
+	char oui[9];
+
+	start = now();
+
+	for (i = 0; i < count; i++) {
+		char *comp;
+
+		bench_oui(i, oui);
+
+		comp = lookup(oui);
+		if (comp) {
+			found++;
+			free(comp);
+		}
+
+		if ((i & 63) == 63 && now() - start > limit) {
+			i++;
+			break;
+		}
+	}
+
+	elapsed = now() - start;
+
+	printf("%-6s %lu lookups in %.3f s, %.0f lookups/s, %lu found\n",
+				what, i, elapsed, i / elapsed, found);
+
+	return i;
+}
+
+/* Both paths have to agree wherever the text was searched */
+static int compare(unsigned long count)
+{
+	unsigned long i, diff = 0;
+	char oui[9];
+
+	for (i = 0; i < count; i++) {
+		char *a, *b;
+
+		bench_oui(i, oui);
+
+		a = oui_index_lookup(oui);
+		b = oui_text_lookup(oui);
+
+		if ((a == NULL) != (b == NULL) || (a && strcmp(a, b))) {
+			fprintf(stderr, "%s: index \"%s\", text \"%s\"\n", oui,
+						a ? a : "", b ? b : "");
+			diff++;
+		}
+
+		free(a);
+		free(b);
+	}
+
+	return diff ? 1 : 0;
+}
+
+static int do_bench(unsigned long count)
+{
+	unsigned long done;
+
+	/* Mapped up front, so the timing covers lookups only */
+	if (oui_index_open() < 0) {
+		fprintf(stderr, "No index or out of date, run ouiindex\n");
+		return 1;
+	}
+
+	if (bench("index", oui_index_lookup, count, 10) == 0)
+		return 1;
+
+	done = bench("text", oui_text_lookup, count, 2);
+
+	return compare(done);
+}
+
+static void usage(void)
+{
+	printf("ouiindex - compile the OUI vendor database\n"
+		"Usage:\n"
+		"\touiindex [text file [index file]]\n"
+		"\touiindex -b [-n count]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = 1000000;
+	int bench = 0;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "bn:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (bench)
+		return do_bench(count);
+
+	n = oui_index_build(optind < argc ? argv[optind] : NULL,
+				optind + 1 < argc ? argv[optind + 1] : NULL);
+	if (n < 0) {
+		perror("Can't build OUI index");
+		return 1;
+	}
+
+	printf("%d OUIs indexed\n", n);
+
+	return 0;
+}
@@ -0,0 +1,500 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Resolvable private address resolution.
+ *
+ * An RPA is prand (upper 24 bits) followed by ah(IRK, prand) (lower 24
+ * bits), where ah() is AES-128 of the zero padded prand truncated to 24
+ * bits. Resolving an address means computing ah() under every known IRK
+ * until one matches, so the key schedules are expanded once when an IRK
+ * is added and every lookup encrypts the same block under all of them.
+ * With AES instructions available at compile time (x86 AES-NI or the
+ * ARMv8 crypto extension) several keys are processed in parallel.
+ *
+ * There is no runtime dispatch: the ABIs this tree is built for
+ * (armeabi, armeabi-v7a and mips, see Application.mk) have neither, so
+ * the shipped code is always the table based software AES below. The
+ * instruction paths only build for a compiler that targets them, as a
+ * host build with -maes, and rpa_aes_impl() tells which one was built.
+ *
+ * Results, including failures, are remembered in a four way set
+ * associative cache keyed by address: a device keeps its RPA for many
+ * minutes while it advertises many times a second.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__AES__) && defined(__SSE2__)
+#include <wmmintrin.h>
+#define RPA_AESNI
+#elif defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define RPA_ARMV8
+#endif
+
+#include "rpa.h"
+
+#define CACHE_EMPTY	-2
+#define CACHE_NOMATCH	-1
+#define CACHE_WAYS	4
+
+struct rpa_key {
+	uint8_t rk[176];
+	bdaddr_t identity;
+	uint8_t type;
+} __attribute__ ((aligned (16)));
+
+struct rpa_cache_entry {
+	bdaddr_t rpa;
+	int idx;
+};
+
+struct rpa_resolver {
+	struct rpa_key *keys;
+	unsigned int num;
+	unsigned int size;
+	struct rpa_cache_entry *cache;
+	unsigned int cache_mask;
+	struct rpa_stats stats;
+};
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static void aes_expand_key(const uint8_t key[16], uint8_t rk[176])
+{
+	uint8_t rcon = 0x01;
+	int i;
+
+	memcpy(rk, key, 16);
+
+	for (i = 16; i < 176; i += 4) {
+		uint8_t t[4];
+
+		memcpy(t, &rk[i - 4], 4);
+
+		if (i % 16 == 0) {
+			uint8_t b = t[0];
+
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[b];
+
+			rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+		}
+
+		rk[i] = rk[i - 16] ^ t[0];
+		rk[i + 1] = rk[i - 15] ^ t[1];
+		rk[i + 2] = rk[i - 14] ^ t[2];
+		rk[i + 3] = rk[i - 13] ^ t[3];
+	}
+}
+
+#if !defined(RPA_AESNI) && !defined(RPA_ARMV8)
+static uint32_t te0[256];
+static int te_ready;
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void aes_init_tables(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		uint8_t s = sbox[i];
+		uint8_t s2 = (s << 1) ^ ((s & 0x80) ? 0x1b : 0);
+
+		te0[i] = (uint32_t) s2 << 24 | (uint32_t) s << 16 |
+				(uint32_t) s << 8 | (uint8_t) (s2 ^ s);
+	}
+
+	te_ready = 1;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+				(uint32_t) p[2] << 8 | p[3];
+}
+
+static void put_be32(uint32_t v, uint8_t *p)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define TE(a, b, c, d) (te0[(a) >> 24] ^ ROTR(te0[((b) >> 16) & 0xff], 8) ^ \
+			ROTR(te0[((c) >> 8) & 0xff], 16) ^ ROTR(te0[(d) & 0xff], 24))
+
+#define SB(a, b, c, d) ((uint32_t) sbox[(a) >> 24] << 24 | \
+			(uint32_t) sbox[((b) >> 16) & 0xff] << 16 | \
+			(uint32_t) sbox[((c) >> 8) & 0xff] << 8 | \
+			sbox[(d) & 0xff])
+
+static void aes_encrypt(const uint8_t rk[176], const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+	int r;
+
+	s0 = get_be32(in) ^ get_be32(rk);
+	s1 = get_be32(in + 4) ^ get_be32(rk + 4);
+	s2 = get_be32(in + 8) ^ get_be32(rk + 8);
+	s3 = get_be32(in + 12) ^ get_be32(rk + 12);
+
+	for (r = 1; r < 10; r++) {
+		const uint8_t *k = rk + r * 16;
+
+		t0 = TE(s0, s1, s2, s3) ^ get_be32(k);
+		t1 = TE(s1, s2, s3, s0) ^ get_be32(k + 4);
+		t2 = TE(s2, s3, s0, s1) ^ get_be32(k + 8);
+		t3 = TE(s3, s0, s1, s2) ^ get_be32(k + 12);
+
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+
+	put_be32(SB(s0, s1, s2, s3) ^ get_be32(rk + 160), out);
+	put_be32(SB(s1, s2, s3, s0) ^ get_be32(rk + 164), out + 4);
+	put_be32(SB(s2, s3, s0, s1) ^ get_be32(rk + 168), out + 8);
+	put_be32(SB(s3, s0, s1, s2) ^ get_be32(rk + 172), out + 12);
+}
+#endif
+
+#ifdef RPA_AESNI
+#define RPA_LANES 4
+
+static void aes_encrypt_lanes(const struct rpa_key *keys, int n,
+					const uint8_t in[16], uint8_t out[][16])
+{
+	__m128i p = _mm_loadu_si128((const __m128i *) in);
+	__m128i s[RPA_LANES];
+	int i, r;
+
+	for (i = 0; i < n; i++)
+		s[i] = _mm_xor_si128(p,
+			_mm_load_si128((const __m128i *) keys[i].rk));
+
+	for (r = 1; r < 10; r++)
+		for (i = 0; i < n; i++)
+			s[i] = _mm_aesenc_si128(s[i], _mm_load_si128(
+				(const __m128i *) (keys[i].rk + r * 16)));
+
+	for (i = 0; i < n; i++)
+		_mm_storeu_si128((__m128i *) out[i],
+			_mm_aesenclast_si128(s[i], _mm_load_si128(
+				(const __m128i *) (keys[i].rk + 160))));
+}
+
+const char *rpa_aes_impl(void)
+{
+	return "AES-NI";
+}
+#elif defined(RPA_ARMV8)
+#define RPA_LANES 4
+
+static void aes_encrypt_lanes(const struct rpa_key *keys, int n,
+					const uint8_t in[16], uint8_t out[][16])
+{
+	uint8x16_t p = vld1q_u8(in);
+	uint8x16_t s[RPA_LANES];
+	int i, r;
+
+	for (i = 0; i < n; i++)
+		s[i] = p;
+
+	for (r = 0; r < 9; r++)
+		for (i = 0; i < n; i++)
+			s[i] = vaesmcq_u8(vaeseq_u8(s[i],
+					vld1q_u8(keys[i].rk + r * 16)));
+
+	for (i = 0; i < n; i++) {
+		s[i] = vaeseq_u8(s[i], vld1q_u8(keys[i].rk + 144));
+		vst1q_u8(out[i], veorq_u8(s[i], vld1q_u8(keys[i].rk + 160)));
+	}
+}
+
+const char *rpa_aes_impl(void)
+{
+	return "ARMv8 crypto";
+}
+#else
+#define RPA_LANES 1
+
+static void aes_encrypt_lanes(const struct rpa_key *keys, int n,
+					const uint8_t in[16], uint8_t out[][16])
+{
+	if (!te_ready)
+		aes_init_tables();
+
+	aes_encrypt(keys[0].rk, in, out[0]);
+}
+
+const char *rpa_aes_impl(void)
+{
+	return "software";
+}
+#endif
+
+/*
+ * ah() on MSB first AES blocks: the plaintext is 13 zero bytes followed
+ * by prand, and the hash is the last three bytes of the ciphertext.
+ */
+static void rpa_block(const bdaddr_t *rpa, uint8_t block[16])
+{
+	memset(block, 0, 13);
+	block[13] = rpa->b[5];
+	block[14] = rpa->b[4];
+	block[15] = rpa->b[3];
+}
+
+static int rpa_hash_matches(const bdaddr_t *rpa, const uint8_t out[16])
+{
+	return out[13] == rpa->b[2] && out[14] == rpa->b[1] &&
+							out[15] == rpa->b[0];
+}
+
+void rpa_generate(const uint8_t irk[16], const uint8_t prand[3],
+							bdaddr_t *rpa)
+{
+	struct rpa_key key;
+	uint8_t block[16], out[1][16];
+
+	aes_expand_key(irk, key.rk);
+
+	rpa->b[5] = (prand[0] & 0x3f) | 0x40;
+	rpa->b[4] = prand[1];
+	rpa->b[3] = prand[2];
+
+	rpa_block(rpa, block);
+	aes_encrypt_lanes(&key, 1, block, out);
+
+	rpa->b[2] = out[0][13];
+	rpa->b[1] = out[0][14];
+	rpa->b[0] = out[0][15];
+}
+
+struct rpa_resolver *rpa_resolver_new(unsigned int cache_size)
+{
+	struct rpa_resolver *res;
+	unsigned int n, i;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return NULL;
+
+	for (n = CACHE_WAYS; n < cache_size; n <<= 1);
+
+	res->cache = malloc(n * sizeof(*res->cache));
+	if (!res->cache) {
+		free(res);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		res->cache[i].idx = CACHE_EMPTY;
+
+	res->cache_mask = n / CACHE_WAYS - 1;
+
+	return res;
+}
+
+void rpa_resolver_free(struct rpa_resolver *res)
+{
+	if (!res)
+		return;
+
+	free(res->keys);
+	free(res->cache);
+	free(res);
+}
+
+int rpa_resolver_add(struct rpa_resolver *res, const uint8_t irk[16],
+				const bdaddr_t *identity, uint8_t type)
+{
+	unsigned int i;
+
+	if (res->num == res->size) {
+		unsigned int size = res->size ? res->size * 2 : 64;
+		struct rpa_key *keys;
+
+		/* Aligned for the AES instructions' round key loads */
+		if (posix_memalign((void **) &keys, 16,
+						size * sizeof(*keys)) != 0)
+			return -ENOMEM;
+
+		if (res->num)
+			memcpy(keys, res->keys, res->num * sizeof(*keys));
+
+		free(res->keys);
+		res->keys = keys;
+		res->size = size;
+	}
+
+	aes_expand_key(irk, res->keys[res->num].rk);
+	bacpy(&res->keys[res->num].identity, identity);
+	res->keys[res->num].type = type;
+	res->num++;
+
+	/* Addresses that matched nothing may match the new key */
+	for (i = 0; i < (res->cache_mask + 1) * CACHE_WAYS; i++)
+		if (res->cache[i].idx == CACHE_NOMATCH)
+			res->cache[i].idx = CACHE_EMPTY;
+
+	return 0;
+}
+
+unsigned int rpa_resolver_count(struct rpa_resolver *res)
+{
+	return res->num;
+}
+
+/* Tries every IRK, bypassing the cache. Returns the IRK index or -1 */
+int rpa_resolver_match(struct rpa_resolver *res, const bdaddr_t *rpa)
+{
+	uint8_t block[16], out[RPA_LANES][16];
+	unsigned int i;
+	int j, n;
+
+	if (!bdaddr_is_rpa(rpa))
+		return -1;
+
+	rpa_block(rpa, block);
+
+	for (i = 0; i < res->num; i += n) {
+		n = MIN(RPA_LANES, res->num - i);
+
+		aes_encrypt_lanes(&res->keys[i], n, block, out);
+		res->stats.blocks += n;
+
+		for (j = 0; j < n; j++)
+			if (rpa_hash_matches(rpa, out[j]))
+				return i + j;
+	}
+
+	return -1;
+}
+
+static struct rpa_cache_entry *cache_bucket(struct rpa_resolver *res,
+							const bdaddr_t *ba)
+{
+	uint32_t h = ba->b[0] | ba->b[1] << 8 | ba->b[2] << 16;
+
+	/* The low half of an RPA is a hash already */
+	h = (h ^ (h >> 11) ^ ba->b[3] << 5) & res->cache_mask;
+
+	return &res->cache[h * CACHE_WAYS];
+}
+
+int rpa_resolve(struct rpa_resolver *res, const bdaddr_t *rpa)
+{
+	struct rpa_cache_entry *bucket;
+	int i, idx;
+
+	res->stats.lookups++;
+
+	bucket = cache_bucket(res, rpa);
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (bucket[i].idx == CACHE_EMPTY || bacmp(&bucket[i].rpa, rpa))
+			continue;
+
+		res->stats.cache_hits++;
+		idx = bucket[i].idx;
+		goto done;
+	}
+
+	idx = rpa_resolver_match(res, rpa);
+
+	/* The newest entry goes first, the oldest falls out */
+	memmove(&bucket[1], &bucket[0], (CACHE_WAYS - 1) * sizeof(*bucket));
+	bacpy(&bucket[0].rpa, rpa);
+	bucket[0].idx = idx < 0 ? CACHE_NOMATCH : idx;
+
+done:
+	if (idx >= 0)
+		res->stats.resolved++;
+
+	return idx;
+}
+
+const bdaddr_t *rpa_resolver_identity(struct rpa_resolver *res, int idx,
+							uint8_t *type)
+{
+	if (idx < 0 || (unsigned int) idx >= res->num)
+		return NULL;
+
+	if (type)
+		*type = res->keys[idx].type;
+
+	return &res->keys[idx].identity;
+}
+
+void rpa_resolver_get_stats(struct rpa_resolver *res,
+						struct rpa_stats *stats)
+{
+	*stats = res->stats;
+}
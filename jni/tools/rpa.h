@@ -0,0 +1,62 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __RPA_H
+#define __RPA_H
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+
+/* Two most significant bits 01: resolvable private address */
+static inline int bdaddr_is_rpa(const bdaddr_t *ba)
+{
+	return (ba->b[5] & 0xc0) == 0x40;
+}
+
+struct rpa_stats {
+	unsigned long lookups;
+	unsigned long cache_hits;
+	unsigned long resolved;
+	unsigned long blocks;
+};
+
+struct rpa_resolver;
+
+struct rpa_resolver *rpa_resolver_new(unsigned int cache_size);
+void rpa_resolver_free(struct rpa_resolver *res);
+
+/* IRKs are given most significant byte first, as they are displayed */
+int rpa_resolver_add(struct rpa_resolver *res, const uint8_t irk[16],
+				const bdaddr_t *identity, uint8_t type);
+unsigned int rpa_resolver_count(struct rpa_resolver *res);
+
+int rpa_resolve(struct rpa_resolver *res, const bdaddr_t *rpa);
+int rpa_resolver_match(struct rpa_resolver *res, const bdaddr_t *rpa);
+const bdaddr_t *rpa_resolver_identity(struct rpa_resolver *res, int idx,
+							uint8_t *type);
+void rpa_resolver_get_stats(struct rpa_resolver *res,
+						struct rpa_stats *stats);
+
+void rpa_generate(const uint8_t irk[16], const uint8_t prand[3],
+							bdaddr_t *rpa);
+const char *rpa_aes_impl(void);
+
+#endif /* __RPA_H */